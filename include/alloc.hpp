@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef> // std::size_t
+
+// Pages counted for defragmentation, page_used aliases pages this many apart
+constexpr std::size_t ALLOC_PAGE_SIZE = 4096;
+constexpr std::size_t ALLOC_PAGES = 1 << 20;
+
+/*
+    The global operator new and delete are replaced to keep track of the heap
+    memory in use, as reported by malloc_usable_size. This covers everything
+    allocated through the C++ allocators: keys, values, hash table buckets and
+    connection buffers.
+
+    Once track_pages is called, the bytes of the allocations starting in each
+    page are counted too. Active defragmentation uses that to tell sparse pages
+    from dense ones, the allocator does not say.
+*/
+
+// Bytes currently allocated through operator new
+std::size_t used_memory();
+// Number of successful operator new calls so far, never decreases
+std::size_t allocations();
+// Resident set size of the process, 0 if it cannot be read
+std::size_t rss_memory();
+
+// Start counting the bytes allocated in each page, for page_used. There is no
+// going back, a page would lose count of what was allocated meanwhile.
+void track_pages();
+// Bytes of the allocations starting in the page of ptr, 0 unless tracking
+std::size_t page_used(const void *ptr);
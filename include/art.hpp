@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>     // std::size_t
+#include <memory>      // std::unique_ptr
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+struct ArtNode;
+
+/*
+    An adaptive radix tree of keys, kept in byte order. Inner nodes branch on
+    one byte and grow from 4 to 16, 48 and 256 children as they fill, then
+    shrink back. Each one holds the bytes its children have in common, so a
+    chain of single children takes one node, and the key ending at it if any.
+    A node with 16 children is searched with SSE2.
+
+    Lookups take O(k) for a key of k bytes, whatever the number of keys. The
+    prefix and range queries take that plus the keys they return.
+*/
+class ArtTree {
+  public:
+    ArtTree();
+    ArtTree(const ArtTree &) = delete;
+    ArtTree(ArtTree &&other) noexcept;
+
+    ArtTree &operator=(const ArtTree &) = delete;
+    ArtTree &operator=(ArtTree &&other) noexcept;
+
+    ~ArtTree();
+
+    // Return false if key was already there, or was not
+    bool insert(std::string_view key);
+    bool remove(std::string_view key);
+    bool contains(std::string_view key) const;
+
+    // The keys starting with prefix in order, at most limit of them if not 0
+    std::vector<std::string> with_prefix(std::string_view prefix,
+                                         std::size_t limit) const;
+    // The keys from start to end, both included, in order, at most limit if not 0
+    std::vector<std::string> range(std::string_view start, std::string_view end,
+                                   std::size_t limit) const;
+
+    std::size_t size() const;
+    void clear();
+
+  private:
+    std::unique_ptr<ArtNode> root;
+    std::size_t count = 0;
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint8_t, std::uint64_t
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+enum class BitOp : std::uint8_t { AND, OR, XOR, NOT };
+
+// Bitmaps are plain strings, bit 0 is the most significant bit of the first byte
+
+std::uint64_t popcount(const std::uint8_t *p, std::size_t n);
+
+// Index of the first bit equal to bit, -1 if there is none
+std::int64_t bitpos(const std::uint8_t *p, std::size_t n, bool bit);
+
+// Combine srcs into dst of n bytes, sources shorter than n are padded with zeros
+void bitop(BitOp op, std::uint8_t *dst, std::size_t n,
+           const std::vector<std::string_view> &srcs);
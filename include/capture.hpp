@@ -0,0 +1,60 @@
+#pragma once
+
+#include "connection.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint32_t, std::uint64_t
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+// Starts every capture file
+constexpr std::string_view CAPTURE_MAGIC = "MRCAP001";
+// The writer thread wakes up at least this often to write what was captured
+constexpr std::uint64_t CAPTURE_FLUSH_MS = 100;
+// Records waiting for the writer beyond this are dropped, the event loop never
+// waits for the disk
+constexpr std::size_t CAPTURE_MAX_PENDING = 16UL << 20;
+
+// One request as do_request saw it. time_us counts from the first request of
+// the capture, conn numbers the connections from 1 in the order of their first
+// captured request.
+struct CaptureRecord {
+    std::uint64_t time_us = 0;
+    std::uint32_t conn = 0;
+    std::vector<std::string> args;
+};
+
+/*
+    Capture of the client requests, for replay against another build. The
+    requests of the clients are recorded once parsed, with the time they ran
+    at and the connection they came on. The replication stream and requests
+    refused before they run, e.g. for their number of arguments, are left out.
+
+    The file is CAPTURE_MAGIC then the records, each as LEB128 varints: the
+    microseconds since the previous record, the connection, the number of
+    arguments, then the length and bytes of each argument. The event loop
+    appends the encoded records to a buffer that a writer thread flushes to the
+    file.
+*/
+namespace Capture {
+// Start capturing to the file at path, which is truncated. Returns an error
+// message if already capturing or the file cannot be created.
+std::optional<std::string> start(const std::string &path);
+// Write what is left and close the file
+void stop();
+bool enabled();
+// Record the request of conn, which is about to run
+void record(Connection &conn);
+
+// The capture section of INFO
+std::string info();
+
+// Append a record, delta_us after the previous one
+void encode(std::string &out, std::uint64_t delta_us, std::uint32_t conn,
+            const std::vector<std::string_view> &args);
+// Decode the record at the start of in and consume it, record.time_us goes
+// forward by its delta. Returns false if in does not start with a whole record.
+bool decode(std::string_view &in, CaptureRecord &record);
+} // namespace Capture
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "connection.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint16_t
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+// Keys handed out by one CLUSTER DUMPKEYS at most
+constexpr std::size_t CLUSTER_DUMP_MAX = 1000;
+
+// A server of the cluster, as its clients reach it
+struct ClusterNode {
+    std::string host;
+    std::uint16_t port = 0;
+};
+
+// The slots from start to end, both included, are served by node
+struct SlotRange {
+    std::uint16_t start = 0;
+    std::uint16_t end = 0;
+    ClusterNode node;
+};
+
+/*
+    Cluster mode. The keyspace is split into CLUSTER_SLOTS hash slots, see
+    key_slot, each served by one node. Every node holds the whole slot map,
+    set on each of them with CLUSTER SETRANGE and CLUSTER SETSLOT; there is no
+    gossip between the nodes. A request for keys of a slot served elsewhere is
+    answered with MOVED slot host:port and the client retries there. The keys
+    of a request must share a slot.
+
+    A slot moves a batch of keys at a time from its node, where it is
+    MIGRATING, to another, where it is IMPORTING, driven by a client so that
+    neither event loop ever waits for the other node. CLUSTER DUMPKEYS returns
+    the requests that recreate some keys of the slot, the client sends them to
+    the target, then CLUSTER DELKEYS deletes them here. Meanwhile these keys
+    can be read but not written, TRYAGAIN, and a request for keys that already
+    left is answered with ASK slot host:port: the client sends ASKING then the
+    request to the target. Once the slot is empty, CLUSTER SETSLOT slot NODE
+    makes the target its node on every node.
+
+    The keys of each slot are kept in byte order, so a batch is the first keys
+    of the slot not moving yet.
+*/
+namespace Cluster {
+// Serve the slots assigned to the node at host:port, none at first
+void enable(const std::string &host, std::uint16_t port);
+// Serve every key again and forget the slot map
+void disable();
+bool enabled();
+
+// The error to reply instead of running the request of conn when its keys are
+// not served here. asking is true right after ASKING.
+std::optional<std::string> redirect(const Connection &conn, bool asking);
+// The slot is moving from this node, or to it
+bool migrating(std::uint16_t slot);
+bool importing(std::uint16_t slot);
+
+// The slot map in slot order, unassigned slots left out
+std::vector<SlotRange> ranges();
+// Serve the slots from start to end on node, ending their migrations
+void assign(std::uint16_t start, std::uint16_t end, const ClusterNode &node);
+// Start moving a slot served here to node, or one served elsewhere here.
+// Returns an error message if the slot is not served where it should be.
+std::optional<std::string> migrate(std::uint16_t slot, const ClusterNode &node);
+std::optional<std::string> import(std::uint16_t slot, const ClusterNode &node);
+// Forget the migration of the slot, the keys that moved stay on the target
+void stabilize(std::uint16_t slot);
+
+std::size_t count_keys(std::uint16_t slot);
+// Up to count keys of a MIGRATING slot that are not moving yet, in order. They
+// are moving from now on.
+std::vector<std::string> take_keys(std::uint16_t slot, std::size_t count);
+// The keys take_keys would hand out, without moving them
+std::vector<std::string> next_keys(std::uint16_t slot, std::size_t count);
+// The key was handed out by take_keys and not deleted since
+bool moving(std::string_view key);
+
+// The cluster section of INFO
+std::string info();
+} // namespace Cluster
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "cluster.hpp"
+
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::int64_t, std::uint16_t
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+// Redirects followed for one request before giving up
+constexpr int CLUSTER_CLIENT_MAX_REDIRECTS = 16;
+// Wait before sending a request refused with TRYAGAIN again
+constexpr int CLUSTER_CLIENT_RETRY_MS = 10;
+// Requests in flight to each node in a pipeline, so that neither side blocks
+// writing while the other one does too
+constexpr std::size_t CLUSTER_CLIENT_PIPELINE_DEPTH = 128;
+
+// A reply of the native protocol. type is the ObjType byte, str holds strings and
+// errors, num integers and elems arrays.
+struct Reply {
+    char type = '_';
+    std::string str;
+    std::int64_t num = 0;
+    std::vector<Reply> elems;
+};
+
+// Decode the reply at the start of in and consume it, returns false if in does
+// not start with a whole reply
+bool parse_reply(std::string_view &in, Reply &reply);
+
+/*
+    A client of a cluster, see Cluster. It caches the slot map, loaded from
+    any node with CLUSTER SLOTS, and sends each request straight to the node
+    serving its keys. MOVED updates the map and ASK sends ASKING then the
+    request to the node named, TRYAGAIN waits a little, so requests go on while
+    slots move. Connections to the nodes are opened on first use and blocking.
+
+    Failures to reach a node come back as error replies starting with ERR.
+*/
+class ClusterClient {
+  public:
+    // seed is any node of the cluster
+    ClusterClient(const std::string &host, std::uint16_t port);
+    ClusterClient(const ClusterClient &) = delete;
+    ClusterClient &operator=(const ClusterClient &) = delete;
+    ~ClusterClient();
+
+    // Load the slot map from the first known node that answers
+    bool refresh();
+    Reply run(const std::vector<std::string_view> &args);
+    // The requests sent to their nodes pipelined, the replies in the same order
+    std::vector<Reply> pipeline(const std::vector<std::vector<std::string_view>> &reqs);
+    // Move the keys of slot from its node to target, batch keys at a time, then
+    // make target serve it on every known node. Returns an error message if a
+    // step fails, the slot is left migrating and the moved keys on target.
+    std::optional<std::string> migrate_slot(std::uint16_t slot, const ClusterNode &target,
+                                            std::size_t batch);
+
+  private:
+    struct Node {
+        ClusterNode addr;
+        int fd = -1;
+    };
+
+    std::uint16_t node_id(const ClusterNode &addr);
+    // Follow a MOVED, ASK or TRYAGAIN reply to a request sent to id. Returns
+    // false for any other reply, the final one.
+    bool follow(const Reply &reply, std::uint16_t &id, bool &asking);
+    // The node serving the keys of the request, the first one for other requests
+    std::uint16_t route(const std::vector<std::string_view> &args) const;
+    // Send bytes holding count requests to node and read their replies
+    bool send(std::uint16_t id, const std::vector<std::byte> &bytes);
+    bool receive(std::uint16_t id, std::size_t count, std::vector<Reply> &replies);
+    Reply call(std::uint16_t id, const std::vector<std::string_view> &args);
+    void disconnect(std::uint16_t id);
+
+    std::vector<Node> nodes;
+    // The node id of each slot, UINT16_MAX if unknown
+    std::vector<std::uint16_t> slots;
+};
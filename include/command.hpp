@@ -8,4 +8,46 @@ void do_unknown(std::unique_ptr<Connection> &conn);
 void do_get(std::unique_ptr<Connection> &conn);
 void do_set(std::unique_ptr<Connection> &conn);
 void do_del(std::unique_ptr<Connection> &conn);
-void do_keys(std::unique_ptr<Connection> &conn);
\ No newline at end of file
+void do_keys(std::unique_ptr<Connection> &conn);
+// Need the ordered-index option
+void do_scanprefix(std::unique_ptr<Connection> &conn);
+void do_keysrange(std::unique_ptr<Connection> &conn);
+void do_sadd(std::unique_ptr<Connection> &conn);
+void do_srem(std::unique_ptr<Connection> &conn);
+void do_sismember(std::unique_ptr<Connection> &conn);
+void do_scard(std::unique_ptr<Connection> &conn);
+void do_sinter(std::unique_ptr<Connection> &conn);
+void do_sunion(std::unique_ptr<Connection> &conn);
+void do_sdiff(std::unique_ptr<Connection> &conn);
+void do_incr(std::unique_ptr<Connection> &conn);
+void do_decr(std::unique_ptr<Connection> &conn);
+void do_incrby(std::unique_ptr<Connection> &conn);
+void do_decrby(std::unique_ptr<Connection> &conn);
+void do_pfadd(std::unique_ptr<Connection> &conn);
+void do_pfcount(std::unique_ptr<Connection> &conn);
+void do_pfmerge(std::unique_ptr<Connection> &conn);
+void do_setbit(std::unique_ptr<Connection> &conn);
+void do_getbit(std::unique_ptr<Connection> &conn);
+void do_bitcount(std::unique_ptr<Connection> &conn);
+void do_bitpos(std::unique_ptr<Connection> &conn);
+void do_bitop(std::unique_ptr<Connection> &conn);
+void do_mget(std::unique_ptr<Connection> &conn);
+void do_mset(std::unique_ptr<Connection> &conn);
+void do_ping(std::unique_ptr<Connection> &conn);
+void do_hello(std::unique_ptr<Connection> &conn);
+void do_hotkeys(std::unique_ptr<Connection> &conn);
+void do_info(std::unique_ptr<Connection> &conn);
+void do_debug(std::unique_ptr<Connection> &conn);
+void do_latency(std::unique_ptr<Connection> &conn);
+void do_replicaof(std::unique_ptr<Connection> &conn);
+void do_psync(std::unique_ptr<Connection> &conn);
+void do_fullresync(std::unique_ptr<Connection> &conn);
+void do_continue(std::unique_ptr<Connection> &conn);
+void do_restore(std::unique_ptr<Connection> &conn);
+void do_subscribe(std::unique_ptr<Connection> &conn);
+void do_unsubscribe(std::unique_ptr<Connection> &conn);
+void do_psubscribe(std::unique_ptr<Connection> &conn);
+void do_punsubscribe(std::unique_ptr<Connection> &conn);
+void do_publish(std::unique_ptr<Connection> &conn);
+void do_cluster(std::unique_ptr<Connection> &conn);
+void do_asking(std::unique_ptr<Connection> &conn);
\ No newline at end of file
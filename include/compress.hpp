@@ -0,0 +1,43 @@
+#pragma once
+
+#include "hashtable.hpp"
+
+#include <cstddef>     // std::size_t
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+
+// LZF, the format of liblzf. Back references reach LZF_MAX_OFF bytes back and
+// copy up to LZF_MAX_MATCH bytes.
+constexpr std::size_t LZF_MAX_OFF = 1 << 13;
+constexpr std::size_t LZF_MAX_MATCH = (1 << 8) + (1 << 3);
+// A string is kept compressed only if that saves at least 1/COMPRESS_MIN_GAIN
+constexpr std::size_t COMPRESS_MIN_GAIN = 8;
+
+// Compress in to out, returns the compressed size or 0 if it does not fit in
+// out_len bytes
+std::size_t lzf_compress(const char *in, std::size_t in_len, char *out,
+                         std::size_t out_len);
+// Returns false unless in decompresses to exactly out_len bytes
+bool lzf_decompress(const char *in, std::size_t in_len, char *out, std::size_t out_len);
+
+/*
+    Transparent compression of large strings. SET and MSET store a string of at
+    least the minimum size as a PackedStr when it compresses well. Commands that
+    read it decompress it on each access, GET and MGET straight into the reply.
+    Commands that modify it turn it back into a plain string.
+*/
+namespace Compress {
+// 0 turns compression off
+void set_min_size(std::size_t size);
+std::size_t min_size();
+
+// str compressed, nullopt if it is too small or compresses badly
+std::optional<PackedStr> pack(std::string_view str);
+// Decompress value into its len bytes at out
+void unpack(const PackedStr &value, char *out);
+std::string unpack(const PackedStr &value);
+
+// The compression section of INFO
+std::string info();
+} // namespace Compress
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "evict.hpp"
+#include "utils.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint8_t, std::uint16_t, std::uint32_t
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+
+enum class LoopBackend : std::uint8_t { EPOLL, IO_URING };
+
+// Clients whose unsent output is over these are disconnected, 0 disables a limit
+struct OutputLimit {
+    std::size_t hard = 0; // Bytes, disconnect at once
+    std::size_t soft = 0; // Bytes, disconnect after soft_seconds above it
+    std::uint64_t soft_seconds = 0;
+};
+
+/*
+    Server settings, read from a config file of "name value" lines and from
+    --name value flags. The names follow Redis where it has the same setting.
+*/
+struct Config {
+    // Listeners, port 0 disables TCP and an empty unixsocket disables Unix
+    std::string bind = "0.0.0.0";
+    std::uint16_t port = PORT;
+    std::string unixsocket;
+    std::uint32_t unixsocketperm = 0; // 0 keeps the permissions from the umask
+    int tcp_backlog = 511;
+
+    // Set on the listeners, accepted sockets inherit them
+    bool tcp_nodelay = true;
+    bool reuseport = false;
+    int busy_poll = 0; // Microseconds, 0 is off
+    int sndbuf = 0;    // Bytes, 0 keeps the kernel default
+    int rcvbuf = 0;
+
+    LoopBackend io_backend = LoopBackend::EPOLL;
+    int events_per_wait = 128;
+    // Requests handled per connection before the loop moves on to the others
+    int request_budget = 64;
+
+    // Clients
+    std::uint32_t timeout = 0; // Seconds idle before a client is closed, 0 is off
+    OutputLimit output_limit;
+    // Bytes, longer request arguments are a protocol error
+    std::size_t proto_max_bulk_len = PROTO_MAX_BULK_LEN;
+
+    std::size_t maxmemory = 0;
+    EvictPolicy maxmemory_policy = EvictPolicy::NOEVICTION;
+
+    // Every request is logged at debug, the default keeps the request path quiet
+    Logger::Level loglevel = Logger::Level::INFO;
+    // One in this many reads is traced for DEBUG TRACE DUMP, 0 is off
+    std::uint32_t trace_sample_rate = 0;
+    // Milliseconds, events at least this slow are kept for LATENCY, 0 is off
+    std::uint32_t latency_monitor_threshold = 0;
+    // Milliseconds, the stack is logged when a loop iteration runs longer, 0 is off
+    std::uint32_t watchdog_period = 0;
+
+    // Replication, an empty replicaof_host makes this server a primary
+    std::string replicaof_host;
+    std::uint16_t replicaof_port = 0;
+    std::size_t repl_backlog_size = 1UL << 20; // Bytes, the default of Redis
+
+    // Tiered storage, an empty tier_dir keeps every value in memory
+    std::string tier_dir;
+    std::uint32_t tier_idle_seconds = 3600; // Strings idle this long are spilled
+    std::size_t tier_io_threads = 2;
+
+    // Bytes, strings at least this long are stored compressed, 0 is off
+    std::size_t compress_min_size = 0;
+
+    // Active defragmentation, once the RSS is over the used memory by
+    // active_defrag_threshold percent and by active_defrag_ignore_bytes
+    bool activedefrag = false;
+    std::uint32_t active_defrag_threshold = 10;
+    std::size_t active_defrag_ignore_bytes = 100UL << 20;
+    std::uint32_t active_defrag_cpu = 25; // Percent of the time spent at most
+
+    // Keep the keys ordered as well, for SCANPREFIX and KEYSRANGE
+    bool ordered_index = false;
+
+    // Capture the client requests to this file, see Capture. Empty is off.
+    std::string capture_file;
+
+    // Serve only the hash slots assigned to this node, see Cluster. Clients are
+    // sent to the other nodes at cluster_announce_host and their port.
+    bool cluster_enabled = false;
+    std::string cluster_announce_host = "127.0.0.1";
+};
+
+// Returns an error message if the name or the value is invalid
+std::optional<std::string> set_option(Config &config, std::string_view name,
+                                      std::string_view value);
+// Lines of "name value", blank lines and lines starting with # are skipped
+std::optional<std::string> load_config(Config &config, const std::string &path);
+// server [config-file] [--name value]..., flags override the file
+std::optional<std::string> parse_args(Config &config, int argc, char **argv);
+
+// Bytes with an optional unit, k and kb are 1000 and 1024 like in Redis
+std::optional<std::size_t> to_memory(std::string_view str);
@@ -1,29 +1,119 @@
 #pragma once
 
+#include "config.hpp"
+#include "hashtable.hpp"
 #include "utils.hpp"
 
 #include <cstddef>     // std::byte, std::size_t
-#include <cstdint>     // std::uint8_t
+#include <cstdint>     // std::int64_t, std::uint8_t, std::uint64_t
 #include <memory>      // std::unique_ptr
 #include <string_view> // std::string_view
 #include <vector>      // std::vector
 
-enum class Cmd : std::uint8_t { GET, SET, DEL, KEYS, NONE };
+#include <sys/uio.h> // iovec
 
-enum class ReqStatus : std::uint8_t { OK, ERR, AGAIN };
+enum class Cmd : std::uint8_t {
+    GET,
+    SET,
+    DEL,
+    KEYS,
+    SCANPREFIX,
+    KEYSRANGE,
+    SADD,
+    SREM,
+    SISMEMBER,
+    SCARD,
+    SINTER,
+    SUNION,
+    SDIFF,
+    INCR,
+    DECR,
+    INCRBY,
+    DECRBY,
+    PFADD,
+    PFCOUNT,
+    PFMERGE,
+    SETBIT,
+    GETBIT,
+    BITCOUNT,
+    BITPOS,
+    BITOP,
+    MGET,
+    MSET,
+    PING,
+    HELLO,
+    HOTKEYS,
+    INFO,
+    DEBUG,
+    LATENCY,
+    REPLICAOF,
+    // Sent between a primary and its replicas, see Replication
+    PSYNC,
+    FULLRESYNC,
+    CONTINUE,
+    RESTORE,
+    SUBSCRIBE,
+    UNSUBSCRIBE,
+    PSUBSCRIBE,
+    PUNSUBSCRIBE,
+    PUBLISH,
+    // Cluster mode, see Cluster
+    CLUSTER,
+    ASKING,
+    NONE
+};
+
+// BLOCKED: the request waits for spilled values to be read, see Tier
+enum class ReqStatus : std::uint8_t { OK, ERR, AGAIN, BLOCKED };
 enum class ConnState : std::uint8_t { REQUEST, RESPONSE, END };
-enum class ObjType : std::uint8_t { NIL = '_', INT = ':', STR = '$', ARR = '*' };
+// REPLICA: on a primary, a replica that sent PSYNC. PRIMARY: on a replica, the
+// connection to its primary, its requests are the replication stream.
+enum class Link : std::uint8_t { CLIENT, REPLICA, PRIMARY };
+// Detected from the first request, see is_resp
+enum class Proto : std::uint8_t { UNKNOWN, NATIVE, RESP2, RESP3 };
+enum class ObjType : std::uint8_t {
+    NIL = '_',
+    ERR = '-',
+    INT = ':',
+    STR = '$',
+    ARR = '*'
+};
+
+// Most requests have few arguments, reserved up front so they never reallocate
+constexpr std::size_t REQ_ARGS_INIT = 8;
 
+// One per connection, reused for every request
 struct Request {
     // A view of Connection::rbuf
     std::vector<std::string_view> args;
     Cmd cmd = Cmd::NONE;
 };
 
+// A stored value sent in place, right after wbuf[pos - 1]
+struct WbufRef {
+    std::size_t pos = 0;
+    SharedStr value;
+};
+
 struct Connection {
     int fd = -1;
     // Current state of the connection
     ConnState state = ConnState::REQUEST;
+    Proto proto = Proto::UNKNOWN;
+    // The requests read by the last read are traced, see Trace::sample
+    bool traced = false;
+    Link link = Link::CLIENT;
+    // Replicas: the replication stream is in wbuf up to this offset
+    std::uint64_t repl_offset = 0;
+    // Sent ASKING, the next request may be for a slot being imported, see Cluster
+    bool asking = false;
+    // Numbers the connection in the capture file once it sent a request, see
+    // Capture
+    std::uint32_t capture_id = 0;
+    // Channels and patterns subscribed to, see PubSub
+    std::uint32_t subscriptions = 0;
+    // Spilled values being read for the current request, see Tier
+    std::uint32_t io_pending = 0;
     // Reading
     std::size_t rbuf_size = 0;   // Size of the piped requests in rbuf
     std::size_t rbuf_pos = 0;    // Current position in rbuf
@@ -32,13 +122,26 @@ struct Connection {
     std::size_t wbuf_size = 0;   // Size of the piped responses in wbuf
     std::size_t wbuf_pos = 0;    // Current position in wbuf
     std::vector<std::byte> wbuf; // [wbuf_pos, wbuf_size) are the responses to be sent
+    // Values interleaved with wbuf, sorted by pos. They keep the values alive
+    // until sent even if the keys are overwritten or deleted meanwhile.
+    std::vector<WbufRef> wrefs;
+    std::size_t wref_idx = 0;   // First value not fully sent
+    std::size_t wref_pos = 0;   // Bytes of wrefs[wref_idx] sent
+    std::size_t wref_bytes = 0; // Bytes of the values not sent yet
 
     std::unique_ptr<Request> req;
 
-    Connection(int fd) : fd{fd} {
-        rbuf.resize(IOBUF_LEN);
-        wbuf.resize(IOBUF_LEN);
+    // Seconds on the event loop's clock
+    std::uint64_t last_active = 0;      // Last request or write, for the idle timeout
+    std::uint64_t soft_limit_since = 0; // Output above the soft limit since, 0 if not
+
+    // rbuf and wbuf are empty until needed, see acquire_rbuf
+    Connection(int fd) : fd{fd}, req{std::make_unique<Request>()} {
+        req->args.reserve(REQ_ARGS_INIT);
     }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+    ~Connection();
 };
 
 constexpr std::string_view to_string(Cmd cmd) {
@@ -51,14 +154,405 @@ constexpr std::string_view to_string(Cmd cmd) {
         return "DEL";
     case Cmd::KEYS:
         return "KEYS";
+    case Cmd::SCANPREFIX:
+        return "SCANPREFIX";
+    case Cmd::KEYSRANGE:
+        return "KEYSRANGE";
+    case Cmd::SADD:
+        return "SADD";
+    case Cmd::SREM:
+        return "SREM";
+    case Cmd::SISMEMBER:
+        return "SISMEMBER";
+    case Cmd::SCARD:
+        return "SCARD";
+    case Cmd::SINTER:
+        return "SINTER";
+    case Cmd::SUNION:
+        return "SUNION";
+    case Cmd::SDIFF:
+        return "SDIFF";
+    case Cmd::INCR:
+        return "INCR";
+    case Cmd::DECR:
+        return "DECR";
+    case Cmd::INCRBY:
+        return "INCRBY";
+    case Cmd::DECRBY:
+        return "DECRBY";
+    case Cmd::PFADD:
+        return "PFADD";
+    case Cmd::PFCOUNT:
+        return "PFCOUNT";
+    case Cmd::PFMERGE:
+        return "PFMERGE";
+    case Cmd::SETBIT:
+        return "SETBIT";
+    case Cmd::GETBIT:
+        return "GETBIT";
+    case Cmd::BITCOUNT:
+        return "BITCOUNT";
+    case Cmd::BITPOS:
+        return "BITPOS";
+    case Cmd::BITOP:
+        return "BITOP";
+    case Cmd::MGET:
+        return "MGET";
+    case Cmd::MSET:
+        return "MSET";
+    case Cmd::PING:
+        return "PING";
+    case Cmd::HELLO:
+        return "HELLO";
+    case Cmd::HOTKEYS:
+        return "HOTKEYS";
+    case Cmd::INFO:
+        return "INFO";
+    case Cmd::DEBUG:
+        return "DEBUG";
+    case Cmd::LATENCY:
+        return "LATENCY";
+    case Cmd::REPLICAOF:
+        return "REPLICAOF";
+    case Cmd::PSYNC:
+        return "PSYNC";
+    case Cmd::FULLRESYNC:
+        return "FULLRESYNC";
+    case Cmd::CONTINUE:
+        return "CONTINUE";
+    case Cmd::RESTORE:
+        return "RESTORE";
+    case Cmd::SUBSCRIBE:
+        return "SUBSCRIBE";
+    case Cmd::UNSUBSCRIBE:
+        return "UNSUBSCRIBE";
+    case Cmd::PSUBSCRIBE:
+        return "PSUBSCRIBE";
+    case Cmd::PUNSUBSCRIBE:
+        return "PUNSUBSCRIBE";
+    case Cmd::PUBLISH:
+        return "PUBLISH";
+    case Cmd::CLUSTER:
+        return "CLUSTER";
+    case Cmd::ASKING:
+        return "ASKING";
     case Cmd::NONE:
         return "NONE";
     }
 }
 
+// Number of arguments including the command, negative means at least -N
+constexpr int arity(Cmd cmd) {
+    switch (cmd) {
+    case Cmd::GET:
+    case Cmd::SCARD:
+    case Cmd::INCR:
+    case Cmd::DECR:
+        return 2;
+    case Cmd::SET:
+    case Cmd::SISMEMBER:
+    case Cmd::INCRBY:
+    case Cmd::DECRBY:
+    case Cmd::GETBIT:
+    case Cmd::REPLICAOF:
+    case Cmd::PSYNC:
+    case Cmd::FULLRESYNC:
+    case Cmd::PUBLISH:
+        return 3;
+    case Cmd::SETBIT:
+        return 4;
+    case Cmd::KEYS:
+    case Cmd::ASKING:
+        return 1;
+    case Cmd::SADD:
+    case Cmd::SREM:
+    case Cmd::KEYSRANGE:
+        return -3;
+    case Cmd::DEL:
+    case Cmd::SINTER:
+    case Cmd::SUNION:
+    case Cmd::SDIFF:
+    case Cmd::PFADD:
+    case Cmd::PFCOUNT:
+    case Cmd::PFMERGE:
+    case Cmd::BITCOUNT:
+    case Cmd::MGET:
+    case Cmd::DEBUG:
+    case Cmd::LATENCY:
+    case Cmd::SUBSCRIBE:
+    case Cmd::PSUBSCRIBE:
+    case Cmd::SCANPREFIX:
+    case Cmd::CLUSTER:
+    case Cmd::CONTINUE:
+        return -2;
+    case Cmd::BITPOS:
+        return -3;
+    case Cmd::BITOP:
+    case Cmd::RESTORE:
+        return -4;
+    case Cmd::MSET:
+        return -3;
+    case Cmd::PING:
+    case Cmd::HELLO:
+    case Cmd::HOTKEYS:
+    case Cmd::INFO:
+    case Cmd::UNSUBSCRIBE:
+    case Cmd::PUNSUBSCRIBE:
+    case Cmd::NONE:
+        return -1;
+    }
+}
+
+// Commands that may allocate, refused while over maxmemory
+constexpr bool grows_memory(Cmd cmd) {
+    switch (cmd) {
+    case Cmd::SET:
+    case Cmd::SADD:
+    case Cmd::INCR:
+    case Cmd::DECR:
+    case Cmd::INCRBY:
+    case Cmd::DECRBY:
+    case Cmd::PFADD:
+    case Cmd::PFMERGE:
+    case Cmd::SETBIT:
+    case Cmd::BITOP:
+    case Cmd::MSET:
+        return true;
+    case Cmd::GET:
+    case Cmd::DEL:
+    case Cmd::KEYS:
+    case Cmd::SCANPREFIX:
+    case Cmd::KEYSRANGE:
+    case Cmd::SREM:
+    case Cmd::SISMEMBER:
+    case Cmd::SCARD:
+    case Cmd::SINTER:
+    case Cmd::SUNION:
+    case Cmd::SDIFF:
+    case Cmd::PFCOUNT:
+    case Cmd::GETBIT:
+    case Cmd::BITCOUNT:
+    case Cmd::BITPOS:
+    case Cmd::MGET:
+    case Cmd::PING:
+    case Cmd::HELLO:
+    case Cmd::HOTKEYS:
+    case Cmd::INFO:
+    case Cmd::DEBUG:
+    case Cmd::LATENCY:
+    case Cmd::REPLICAOF:
+    case Cmd::PSYNC:
+    case Cmd::FULLRESYNC:
+    case Cmd::CONTINUE:
+    case Cmd::RESTORE: // Replicas ignore maxmemory
+    case Cmd::SUBSCRIBE:
+    case Cmd::UNSUBSCRIBE:
+    case Cmd::PSUBSCRIBE:
+    case Cmd::PUNSUBSCRIBE:
+    case Cmd::PUBLISH:
+    case Cmd::CLUSTER:
+    case Cmd::ASKING:
+    case Cmd::NONE:
+        return false;
+    }
+}
+
+// Commands that change the keyspace, sent to the replicas and refused by them
+constexpr bool is_write(Cmd cmd) {
+    switch (cmd) {
+    case Cmd::SET:
+    case Cmd::DEL:
+    case Cmd::SADD:
+    case Cmd::SREM:
+    case Cmd::INCR:
+    case Cmd::DECR:
+    case Cmd::INCRBY:
+    case Cmd::DECRBY:
+    case Cmd::PFADD:
+    case Cmd::PFMERGE:
+    case Cmd::SETBIT:
+    case Cmd::BITOP:
+    case Cmd::MSET:
+        return true;
+    case Cmd::GET:
+    case Cmd::KEYS:
+    case Cmd::SCANPREFIX:
+    case Cmd::KEYSRANGE:
+    case Cmd::SISMEMBER:
+    case Cmd::SCARD:
+    case Cmd::SINTER:
+    case Cmd::SUNION:
+    case Cmd::SDIFF:
+    case Cmd::PFCOUNT:
+    case Cmd::GETBIT:
+    case Cmd::BITCOUNT:
+    case Cmd::BITPOS:
+    case Cmd::MGET:
+    case Cmd::PING:
+    case Cmd::HELLO:
+    case Cmd::HOTKEYS:
+    case Cmd::INFO:
+    case Cmd::DEBUG:
+    case Cmd::LATENCY:
+    case Cmd::REPLICAOF:
+    case Cmd::PSYNC:
+    case Cmd::FULLRESYNC:
+    case Cmd::CONTINUE:
+    case Cmd::RESTORE: // Fed by do_restore once applied
+    case Cmd::SUBSCRIBE:
+    case Cmd::UNSUBSCRIBE:
+    case Cmd::PSUBSCRIBE:
+    case Cmd::PUNSUBSCRIBE:
+    case Cmd::PUBLISH: // Only reaches the subscribers of this server
+    case Cmd::CLUSTER: // DELKEYS feeds the keys it deletes
+    case Cmd::ASKING:
+    case Cmd::NONE:
+        return false;
+    }
+}
+
+// The arguments holding keys, from first to last every step. A negative last
+// counts from the end, first is 0 for commands without keys.
+struct KeySpec {
+    int first = 0;
+    int last = 0;
+    int step = 1;
+};
+
+constexpr KeySpec key_spec(Cmd cmd) {
+    switch (cmd) {
+    case Cmd::GET:
+    case Cmd::SET:
+    case Cmd::SADD:
+    case Cmd::SREM:
+    case Cmd::SISMEMBER:
+    case Cmd::SCARD:
+    case Cmd::INCR:
+    case Cmd::DECR:
+    case Cmd::INCRBY:
+    case Cmd::DECRBY:
+    case Cmd::PFADD:
+    case Cmd::SETBIT:
+    case Cmd::GETBIT:
+    case Cmd::BITCOUNT:
+    case Cmd::BITPOS:
+    case Cmd::RESTORE:
+        return {1, 1, 1};
+    case Cmd::DEL:
+    case Cmd::SINTER:
+    case Cmd::SUNION:
+    case Cmd::SDIFF:
+    case Cmd::PFCOUNT:
+    case Cmd::PFMERGE:
+    case Cmd::MGET:
+        return {1, -1, 1};
+    case Cmd::MSET:
+        return {1, -1, 2};
+    case Cmd::BITOP:
+        return {2, -1, 1};
+    case Cmd::KEYS:
+    case Cmd::SCANPREFIX:
+    case Cmd::KEYSRANGE:
+    case Cmd::PING:
+    case Cmd::HELLO:
+    case Cmd::HOTKEYS:
+    case Cmd::INFO:
+    case Cmd::DEBUG:
+    case Cmd::LATENCY:
+    case Cmd::REPLICAOF:
+    case Cmd::PSYNC:
+    case Cmd::FULLRESYNC:
+    case Cmd::CONTINUE:
+    case Cmd::SUBSCRIBE:
+    case Cmd::UNSUBSCRIBE:
+    case Cmd::PSUBSCRIBE:
+    case Cmd::PUNSUBSCRIBE:
+    case Cmd::PUBLISH:
+    case Cmd::CLUSTER:
+    case Cmd::ASKING:
+    case Cmd::NONE:
+        return {};
+    }
+}
+
+/*
+    rbuf and wbuf are IOBUF_LEN buffers taken from a pool shared by all the
+    connections, and given back once they hold nothing. An idle connection holds
+    no buffer, so memory follows the active clients rather than all of them.
+    rbuf grows for a request that doesn't fit, its arguments are up to
+    proto_max_bulk_len bytes.
+*/
+// Make sure rbuf has room to read into
+void acquire_rbuf(std::unique_ptr<Connection> &conn);
+// Give rbuf back to the pool unless it holds part of a request
+void release_rbuf(std::unique_ptr<Connection> &conn);
+// Make room in rbuf for the n bytes of a request from rbuf_pos, the handled
+// requests before it are dropped before the next read
+void reserve_rbuf(std::unique_ptr<Connection> &conn, std::size_t n);
+
+void set_proto_max_bulk_len(std::size_t bytes);
+std::size_t proto_max_bulk_len();
+// Bytes of the wbufs of all the connections, replicas included. maxmemory leaves
+// them out, see free_memory.
+std::size_t output_buffer_memory();
+
+// Returns true if the unsent output is over the hard limit, or has been over the
+// soft limit for soft_seconds. now is in seconds.
+bool over_output_limit(std::unique_ptr<Connection> &conn, const OutputLimit &limit,
+                       std::uint64_t now);
+// Whether the idle timeout closes conn. Replication links and Pub/Sub
+// subscribers are never idle, only quiet.
+bool may_time_out(const Connection &conn);
+
 ReqStatus do_request(std::unique_ptr<Connection> &conn);
+// Reply "ERR Protocol error: msg", the connection is closed once it is sent.
+// Returns ReqStatus::ERR.
+ReqStatus protocol_error(std::unique_ptr<Connection> &conn, std::string_view msg);
+// Handle one request from rbuf, returns false once there is nothing more to do
+bool try_one_request(std::unique_ptr<Connection> &conn);
 
-void add_reply(std::unique_ptr<Connection> &conn, const std::vector<std::byte> &msg,
+void add_reply(std::unique_ptr<Connection> &conn, std::string_view msg,
                ObjType type = ObjType::STR);
-void add_reply_raw(std::unique_ptr<Connection> &conn, const std::vector<std::byte> &msg,
-                   ObjType type = ObjType::STR);
\ No newline at end of file
+void add_reply_raw(std::unique_ptr<Connection> &conn, std::string_view msg,
+                   ObjType type = ObjType::STR);
+void add_reply_err(std::unique_ptr<Connection> &conn, std::string_view msg);
+// A simple string like OK, a plain string reply in the native protocol
+void add_reply_status(std::unique_ptr<Connection> &conn, std::string_view msg);
+// Values of at least WBUF_REF_MIN bytes are referenced instead of copied
+void add_reply_str(std::unique_ptr<Connection> &conn, const SharedStr &value);
+void add_reply_raw_str(std::unique_ptr<Connection> &conn, const SharedStr &value);
+// A len bytes string reply whose bytes the caller writes to the returned space,
+// valid until the next reply is added
+char *add_reply_space(std::unique_ptr<Connection> &conn, std::size_t len);
+char *add_reply_raw_space(std::unique_ptr<Connection> &conn, std::size_t len);
+void add_reply_int(std::unique_ptr<Connection> &conn, std::int64_t value);
+void add_reply_raw_int(std::unique_ptr<Connection> &conn, std::int64_t value);
+
+// Reserve the headers of an array reply, returns the position to pass to end_arr
+std::size_t begin_arr(std::unique_ptr<Connection> &conn);
+// Fill in the headers once all nelems elements are added with add_reply_raw*
+void end_arr(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t nelems);
+// A request sent by this server, to a replica or to its primary
+void add_request(std::unique_ptr<Connection> &conn,
+                 const std::vector<std::string_view> &args);
+// Bytes already encoded, the replication stream
+void add_raw(std::unique_ptr<Connection> &conn, const std::byte *data, std::size_t n);
+// Header of an array of nelems elements nested in an array reply
+void add_arr_header(std::unique_ptr<Connection> &conn, std::size_t nelems);
+// Like end_arr for npairs keys and values, a map in RESP3 and a flat array otherwise
+void end_map(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t npairs);
+// Like end_arr for an out of band message, a push in RESP3 and an array otherwise
+void end_push(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t nelems);
+// A complete reply shared by several connections, queued without a copy
+void add_shared(Connection &conn, const SharedStr &reply);
+
+// Returns true if some of the responses are not sent yet
+bool wbuf_pending(const std::unique_ptr<Connection> &conn);
+// Bytes of the responses not sent yet, values included
+std::size_t wbuf_pending_bytes(const std::unique_ptr<Connection> &conn);
+// Point up to n iovecs at the responses not sent yet, returns the number used
+std::size_t wbuf_iov(const std::unique_ptr<Connection> &conn, iovec *iov, std::size_t n);
+// Drop the output not sent yet
+void wbuf_discard(std::unique_ptr<Connection> &conn);
+// Mark n bytes as sent, the buffers are reset once everything is
+void wbuf_consume(std::unique_ptr<Connection> &conn, std::size_t n);
@@ -0,0 +1,14 @@
+#pragma once
+
+// Runtime CPU feature detection for the SIMD kernels. Every kernel has a scalar
+// fallback, so the binaries stay portable across x86-64 machines.
+namespace Cpu {
+// Baseline on x86-64, only false once the SIMD paths are turned off
+bool has_sse2();
+bool has_sse42();
+bool has_avx2();
+bool has_popcnt();
+
+// Force the scalar code paths, e.g. to compare them against the SIMD ones
+void set_simd_enabled(bool enabled);
+} // namespace Cpu
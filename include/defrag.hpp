@@ -0,0 +1,50 @@
+#pragma once
+
+#include "alloc.hpp"
+
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint32_t, std::uint64_t
+#include <string>  // std::string
+
+// A cycle runs every DEFRAG_CYCLE_MS while defragmenting, otherwise the
+// fragmentation is measured every DEFRAG_CHECK_MS
+constexpr std::uint64_t DEFRAG_CYCLE_MS = 100;
+constexpr std::uint64_t DEFRAG_CHECK_MS = 1000;
+// Buckets relocated between looks at the clock
+constexpr std::size_t DEFRAG_BUCKETS = 16;
+// Allocations in pages used less than this are moved, bigger ones never are
+constexpr std::size_t DEFRAG_SPARSE_BYTES = ALLOC_PAGE_SIZE / 2;
+constexpr std::size_t DEFRAG_MAX_ALLOC = ALLOC_PAGE_SIZE / 4;
+
+/*
+    Active defragmentation. After enough churn the heap is full of pages holding
+    a few live allocations each, and the RSS is far above the used memory. Once
+    the gap reaches the threshold, each cycle walks some buckets of the
+    keyspace and moves the nodes, keys and strings that sit in sparse pages.
+
+    glibc does not say where an allocation will land, so a copy is made first
+    and kept only if its page holds more than the page of the original, see
+    page_used. The allocations given up on are freed at the end of the cycle,
+    freeing them right away would get them back on the next try. Once a pass
+    over the keyspace is done malloc_trim returns the emptied pages to the
+    system.
+
+    Strings still referenced by a reply stay where they are, as do sets and
+    HyperLogLogs.
+*/
+namespace Defrag {
+// Defragment once the RSS is over the used memory by threshold percent and by
+// ignore_bytes, spending up to cpu_percent of the time on it
+void enable(std::uint32_t threshold, std::size_t ignore_bytes, std::uint32_t cpu_percent);
+bool enabled();
+// In a pass over the keyspace, cycles then run every DEFRAG_CYCLE_MS
+bool running();
+// Measure the fragmentation or go on with the pass, called once per loop
+// iteration
+void cycle();
+// Make a whole pass now
+void run_pass();
+
+// The active defrag fields of the memory section of INFO
+std::string info();
+} // namespace Defrag
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "config.hpp"
+#include "listener.hpp"
+
+#include <memory> // std::unique_ptr
+#include <vector> // std::vector
+
+class EventLoop {
+  public:
+    EventLoop() = default;
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+    virtual ~EventLoop() = default;
+
+    // Serve the clients accepted on listeners, only returns on fatal errors
+    virtual int run(const std::vector<Listener> &listeners) = 0;
+};
+
+std::unique_ptr<EventLoop> make_epoll_loop(const Config &config);
+// Returns nullptr if the kernel lacks the io_uring features we rely on
+std::unique_ptr<EventLoop> make_uring_loop(const Config &config);
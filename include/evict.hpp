@@ -0,0 +1,66 @@
+#pragma once
+
+#include "hashtable.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint8_t, std::uint32_t, std::uint64_t
+#include <optional>    // std::optional
+#include <string_view> // std::string_view
+
+enum class EvictPolicy : std::uint8_t {
+    NOEVICTION,
+    ALLKEYS_LRU,
+    ALLKEYS_LFU,
+    ALLKEYS_RANDOM,
+    // Only keys with a TTL are candidates. Keys cannot expire yet, so these
+    // never find anything to evict and behave like NOEVICTION.
+    VOLATILE_LRU,
+    VOLATILE_LFU,
+    VOLATILE_RANDOM,
+    VOLATILE_TTL
+};
+
+// Keys sampled per eviction round and the best candidates kept across rounds
+constexpr std::size_t EVICT_SAMPLES = 5;
+constexpr std::size_t EVICT_POOL_SIZE = 16;
+// free_memory gives the loop back after EVICT_BUDGET_US, checked every
+// EVICT_CHECK_ROUNDS rounds, and gives up after EVICT_STALL_KEYS evicted keys in
+// a row that freed nothing
+constexpr std::uint64_t EVICT_BUDGET_US = 1000;
+constexpr std::size_t EVICT_CHECK_ROUNDS = 16;
+constexpr std::size_t EVICT_STALL_KEYS = 64;
+
+// LRU: HashNode::lru is a clock in seconds wrapping at 24 bits, about 194 days.
+// Every policy but LFU keeps it, the tier files need it too, see Tier.
+constexpr std::uint32_t LRU_CLOCK_MAX = (1U << 24) - 1;
+
+// LFU: HashNode::lru is 16 bits of minutes since the last decay then an 8 bit
+// logarithmic access counter, halving its odds to grow every LFU_LOG_FACTOR hits
+constexpr std::uint8_t LFU_INIT_VAL = 5;
+constexpr std::uint32_t LFU_LOG_FACTOR = 10;
+constexpr std::uint32_t LFU_DECAY_MINUTES = 1;
+
+std::optional<EvictPolicy> to_evict_policy(std::string_view name);
+std::string_view to_string(EvictPolicy policy);
+
+// 0 bytes means unlimited
+void set_maxmemory(std::size_t bytes, EvictPolicy policy);
+std::size_t maxmemory();
+// The used memory maxmemory applies to. The output buffers of the clients and
+// replicas and the replication backlog are left out, evicting keys would not
+// shrink them.
+std::size_t maxmemory_used();
+EvictPolicy maxmemory_policy();
+
+std::uint32_t lru_clock();
+// Record an access to node for the LRU or LFU policies, created if it is a new key
+void touch_key(HashNode *node, bool created);
+// The LFU counter of node after decay
+std::uint8_t lfu_counter(const HashNode *node);
+// Seconds since node was last accessed, whole minutes under the LFU policies
+std::uint64_t idle_seconds(const HashNode *node);
+
+// Evict keys of ht until the used memory is within maxmemory, or for
+// EVICT_BUDGET_US; each write carries on from there. Returns false if it cannot
+// get there: nothing is left to evict or evicting frees nothing.
+bool free_memory(HashTable &ht);
@@ -1,10 +1,20 @@
 #pragma once
 
-#include <array>      // std::array
-#include <cstdint>    // std::uint64_t
-#include <functional> // std::function
-#include <string>     // std::string, std::hash<std::string>
-
+#include "hyperloglog.hpp"
+#include "set.hpp"
+
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint32_t, std::uint64_t
+#include <functional>  // std::function
+#include <memory>      // std::shared_ptr, std::make_shared, std::unique_ptr
+#include <string>      // std::string
+#include <string_view> // std::string_view, std::hash<std::string_view>
+#include <utility>     // std::exchange
+#include <variant>     // std::variant
+#include <vector>      // std::vector
+
+class ArtTree;
 class HashTable;
 extern HashTable map;
 
@@ -15,10 +25,50 @@ constexpr std::size_t HT_MASK(std::int8_t exp) {
     return exp == -1 ? 0 : HT_SIZE(exp) - 1;
 }
 
+// Reference counted so a reply can send a string without copying it while the
+// key is overwritten or deleted. Shared strings are immutable, writers copy them
+// first if use_count() > 1.
+using SharedStr = std::shared_ptr<std::string>;
+
+inline SharedStr make_str(std::string_view str) {
+    return std::make_shared<std::string>(str);
+}
+
+// A string that was moved to the tier files, see Tier. pos locates the bytes
+// of the value there. Each record has a single owner, it is dead once that is
+// destroyed; a moved-from SpilledStr has len 0.
+struct SpilledStr {
+    std::uint64_t pos = 0;
+    std::uint32_t len = 0;
+
+    SpilledStr(std::uint64_t pos, std::uint32_t len) : pos{pos}, len{len} {}
+    SpilledStr(const SpilledStr &) = delete;
+    SpilledStr(SpilledStr &&other) noexcept
+        : pos{other.pos}, len{std::exchange(other.len, 0)} {}
+
+    SpilledStr &operator=(const SpilledStr &) = delete;
+    SpilledStr &operator=(SpilledStr &&other) noexcept;
+
+    ~SpilledStr();
+};
+
+// A string of len bytes stored LZF compressed in data, see Compress
+struct PackedStr {
+    std::string data;
+    std::size_t len = 0;
+};
+
+// Strings that hold a canonical 64-bit integer are stored as std::int64_t.
+// Commands never see a SpilledStr, its value is read back before they run.
+using Value =
+    std::variant<SharedStr, std::int64_t, Set, HyperLogLog, SpilledStr, PackedStr>;
+
 struct HashNode {
     std::string key;
-    std::string value;
+    Value value;
     HashNode *next = nullptr;
+    // 24 bits of access info for eviction, see touch_key
+    std::uint32_t lru = 0;
 };
 
 struct HTState {
@@ -29,8 +79,10 @@ struct HTState {
 
 class HashTable {
   public:
-    using KeyCompare = std::function<bool(const std::string &, const std::string &)>;
-    using Hash = std::function<std::size_t(const std::string &)>;
+    using KeyCompare = std::function<bool(std::string_view, std::string_view)>;
+    using Hash = std::function<std::size_t(std::string_view)>;
+    // Told of each key added to the table, added is true, or removed from it
+    using KeyHook = std::function<void(std::string_view key, bool added)>;
 
     HashTable();
     HashTable(const HashTable &) = delete;
@@ -41,21 +93,48 @@ class HashTable {
 
     ~HashTable();
 
-    void set(std::string key, std::string value);
-    HashNode *get(const std::string &key);
-    bool remove(const std::string &key);
+    // Returns the node holding key
+    HashNode *set(std::string key, Value value);
+    HashNode *get(std::string_view key);
+    // Same as get for the count keys keys[0], keys[stride], ..., out[i] is the node
+    // of the i-th. All the buckets are prefetched before any chain is walked, so
+    // the cache misses overlap.
+    void get_many(const std::string_view *keys, std::size_t count, std::size_t stride,
+                  std::vector<HashNode *> &out);
+    bool remove(std::string_view key);
     std::vector<std::string> keys();
+    // Call fn on every node, fn must not change the table
+    void for_each(const std::function<void(const HashNode &)> &fn) const;
+    // Store up to count nodes from random buckets in out, returns the number stored.
+    // Nodes may repeat and are not uniformly distributed, good enough for eviction.
+    std::size_t sample(HashNode **out, std::size_t count);
+    // Visit count buckets of both tables from cursor, fn returns the node to keep
+    // in the chain in place of its argument, a copy it made or the node itself.
+    // Returns the cursor to go on from, 0 once the last bucket was visited. Nodes
+    // moved by rehashing between calls may be missed or visited twice.
+    std::size_t relocate(std::size_t cursor, std::size_t count,
+                         const std::function<HashNode *(HashNode *)> &fn);
 
     bool is_empty() const;
     HTState state(std::size_t htidx) const;
     std::size_t size() const;
     std::size_t buckets() const;
 
+    // Keep the keys in an ArtTree as well, for the ordered queries. Only set once,
+    // before the first key.
+    void enable_index();
+    // nullptr if not enabled
+    const ArtTree *index() const;
+
+    void set_key_hook(KeyHook hook);
     void set_cmp(KeyCompare cmp);
     void set_hash(Hash fn);
     void force_rehash();
+    // Remove every key
+    void clear();
 
   private:
+    HashNode *find(std::size_t hash, std::string_view key) const;
     void reset(std::size_t htidx);
     void clear(std::size_t htidx);
     bool is_rehashing() const;
@@ -73,6 +152,9 @@ class HashTable {
     std::array<std::int8_t, 2> size_exp{};
 
     std::int64_t rehash_idx = -1;
-    Hash hash_fn = std::hash<std::string>{};
-    KeyCompare cmp = std::equal_to<std::string>{};
+    Hash hash_fn = std::hash<std::string_view>{};
+    KeyCompare cmp = std::equal_to<std::string_view>{};
+    std::unique_ptr<ArtTree> ordered;
+    KeyHook key_hook;
+    std::vector<std::size_t> hashes; // Scratch of get_many, reused between calls
 };
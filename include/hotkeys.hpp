@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint8_t, std::uint32_t, std::uint64_t
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+// Count-min sketch of HOTKEYS_DEPTH rows of HOTKEYS_WIDTH counters, 16 KiB
+constexpr std::size_t HOTKEYS_DEPTH = 4;
+constexpr std::size_t HOTKEYS_WIDTH = 1024;
+// Hottest keys kept, and the bytes of each key kept, longer keys are truncated
+constexpr std::size_t HOTKEYS_TOP = 32;
+constexpr std::size_t HOTKEYS_KEY_MAX = 128;
+// All the counts are halved every this many accesses, so old traffic fades out
+constexpr std::uint32_t HOTKEYS_DECAY_PERIOD = 1U << 20;
+// do_request counts the keys of one request in HOTKEYS_SAMPLE, chosen at random.
+// HOTKEYS and INFO scale the counts back up.
+constexpr std::uint32_t HOTKEYS_SAMPLE = 8;
+// Keys listed by HOTKEYS and INFO when no count is given
+constexpr std::size_t HOTKEYS_DEFAULT = 10;
+
+struct HotKey {
+    std::string key;
+    std::uint32_t count = 0;
+};
+
+/*
+    Finds the most accessed keys in a fixed amount of memory, whatever the size
+    of the keyspace. A count-min sketch estimates how often each key was seen,
+    never less than it was. The keys whose estimate beats the coldest of the top
+    ones replace it in a min-heap of HOTKEYS_TOP entries.
+
+    Adding a key is one hash and HOTKEYS_DEPTH counters, the heap is only looked
+    at for keys hotter than its minimum. Nothing is allocated after construction.
+*/
+class HotKeys {
+  public:
+    // Count an access to key, returns its estimated count
+    std::uint32_t add(std::string_view key);
+    std::uint32_t estimate(std::string_view key) const;
+    // Up to n of the hottest keys, hottest first
+    std::vector<HotKey> top(std::size_t n) const;
+    // Accesses counted since the start
+    std::uint64_t accesses() const { return total; }
+    void clear();
+
+  private:
+    struct Entry {
+        std::uint32_t count = 0;
+        std::uint8_t slot = 0; // Index in keys and key_lens
+    };
+
+    void offer(std::uint64_t hash, std::string_view key, std::uint32_t count);
+    void swap_entries(std::size_t i, std::size_t j);
+    void sift_down(std::size_t i);
+    void decay();
+
+    std::array<std::array<std::uint32_t, HOTKEYS_WIDTH>, HOTKEYS_DEPTH> rows{};
+    // Min-heap on count, heap[0] is the coldest of the top keys. The hashes are
+    // apart so looking a key up only reads them.
+    std::array<Entry, HOTKEYS_TOP> heap{};
+    std::array<std::uint64_t, HOTKEYS_TOP> heap_hashes{};
+    std::size_t heap_size = 0;
+    std::array<std::array<char, HOTKEYS_KEY_MAX>, HOTKEYS_TOP> keys{};
+    std::array<std::uint8_t, HOTKEYS_TOP> key_lens{};
+    std::uint32_t since_decay = 0;
+    std::uint64_t total = 0;
+};
+
+// Fed with the keys of every command by do_request
+extern HotKeys hotkeys;
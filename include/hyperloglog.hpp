@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>       // std::array
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::int64_t, std::uint8_t, std::uint32_t, std::uint64_t
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+constexpr std::size_t HLL_P = 14;
+constexpr std::size_t HLL_REGISTERS = 1 << HLL_P;
+constexpr std::size_t HLL_BITS = 6;
+constexpr std::size_t HLL_DENSE_BYTES = HLL_REGISTERS * HLL_BITS / 8;
+// Sparse counters holding more registers than this are converted to dense
+constexpr std::size_t HLL_SPARSE_MAX = 750;
+
+// Registers unpacked to one byte each, used to merge and count several counters
+using HLLRegisters = std::array<std::uint8_t, HLL_REGISTERS>;
+
+/*
+    A HyperLogLog cardinality estimator with 16384 6-bit registers.
+
+    Small counters are sparse, a sorted list of the non-zero registers. Once it
+    grows past HLL_SPARSE_MAX it becomes dense, all the registers packed into
+    12 KiB. The dense merge and estimation use AVX2 when available.
+*/
+class HyperLogLog {
+  public:
+    // Returns true if any register changed
+    bool add(std::string_view element);
+    std::uint64_t count();
+
+    // Take the maximum of each register in regs and ours
+    void merge_into(HLLRegisters &regs) const;
+    // Replace our registers with regs, the counter becomes dense
+    void assign(const HLLRegisters &regs);
+
+    bool is_sparse() const;
+    std::size_t bytes() const;
+
+    static std::uint64_t estimate(const HLLRegisters &regs);
+
+  private:
+    bool set_max(std::size_t idx, std::uint8_t value);
+    void to_dense();
+
+    // Sorted by register index, each entry is index << 8 | value
+    std::vector<std::uint32_t> sparse;
+    std::vector<std::uint8_t> dense; // Empty while sparse
+    std::int64_t cached = -1;        // Last count, -1 if stale
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef> // std::byte, std::size_t
+#include <cstdint> // std::int16_t, std::int32_t, std::int64_t, std::uint8_t
+#include <vector>  // std::vector
+
+// Width in bytes of every element in an IntSet
+enum class IntSetEnc : std::uint8_t { INT16 = 2, INT32 = 4, INT64 = 8 };
+
+/*
+    A sorted array of unique integers packed with the smallest width that can hold
+    all of them. Adding a value that does not fit upgrades the whole array to the
+    next width, the array is never downgraded.
+*/
+class IntSet {
+  public:
+    bool add(std::int64_t value);
+    // Add a batch of values with a single merge pass, returns the number added
+    std::size_t add(std::vector<std::int64_t> values);
+    bool remove(std::int64_t value);
+    bool contains(std::int64_t value) const;
+
+    std::int64_t at(std::size_t idx) const;
+    std::vector<std::int64_t> values() const;
+
+    std::size_t size() const;
+    std::size_t bytes() const;
+    IntSetEnc encoding() const;
+
+    // Append the sorted intersection of a and b to out
+    static void intersect(const IntSet &a, const IntSet &b,
+                          std::vector<std::int64_t> &out);
+
+  private:
+    // Call fn with a typed pointer to the elements
+    template <typename Fn>
+    decltype(auto) visit(Fn &&fn) const;
+
+    bool search(std::int64_t value, std::size_t &pos) const;
+    void set_at(std::size_t idx, std::int64_t value);
+    void upgrade(IntSetEnc new_enc);
+
+    std::vector<std::byte> data;
+    std::size_t len = 0;
+    IntSetEnc enc = IntSetEnc::INT16;
+};
+
+template <typename Fn>
+decltype(auto) IntSet::visit(Fn &&fn) const {
+    switch (enc) {
+    case IntSetEnc::INT16:
+        return fn(reinterpret_cast<const std::int16_t *>(data.data()));
+    case IntSetEnc::INT32:
+        return fn(reinterpret_cast<const std::int32_t *>(data.data()));
+    case IntSetEnc::INT64:
+        break;
+    }
+    return fn(reinterpret_cast<const std::int64_t *>(data.data()));
+}
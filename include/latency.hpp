@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint8_t, std::uint32_t, std::uint64_t
+#include <optional>    // std::optional
+#include <string_view> // std::string_view
+#include <utility>     // std::pair
+#include <vector>      // std::vector
+
+// Samples kept per event, samples of the same second are merged into the worst
+constexpr std::size_t LATENCY_HISTORY_LEN = 160;
+
+enum class LatencyEvent : std::uint8_t {
+    COMMAND,      // A whole command, replies included
+    EVENT_LOOP,   // An event loop iteration, waiting for events excluded
+    REHASH,       // Allocating and freeing the tables of the keyspace
+    EXPIRE_CYCLE, // Closing the idle clients
+    EVICTION,     // Evicting keys down to maxmemory
+    FREE          // Removing a key and freeing its value
+};
+constexpr std::size_t LATENCY_EVENTS = 6;
+
+struct LatencySample {
+    std::int64_t time = 0; // Unix seconds
+    std::uint32_t ms = 0;
+};
+
+struct LatencyStats {
+    LatencyEvent event = LatencyEvent::COMMAND;
+    std::int64_t time = 0; // Of the latest sample
+    std::uint32_t latest = 0;
+    std::uint32_t max = 0; // Since the last reset
+};
+
+std::optional<LatencyEvent> to_latency_event(std::string_view name);
+std::string_view to_string(LatencyEvent event);
+
+/*
+    Latency monitor, the events that take at least the threshold are sampled
+    for LATENCY LATEST and LATENCY HISTORY. With the monitor off a span costs a
+    load and a branch, the clock is only read while it is on.
+
+    The watchdog is a thread that signals the event loop thread once an
+    iteration runs past its period, the handler writes the stack of the loop
+    thread to stderr, once per stall.
+*/
+namespace Latency {
+// 0 turns the monitor off
+void set_threshold(std::uint32_t ms);
+std::uint32_t threshold();
+// Only set_threshold writes it, it is here so enabled() is inlined
+extern std::uint32_t threshold_ms;
+inline bool enabled() { return threshold_ms != 0; }
+
+// Monotonic microseconds
+std::uint64_t now_us();
+// Sampled if us reaches the threshold
+void add_sample(LatencyEvent event, std::uint64_t us);
+
+// The events with samples, in the order of LatencyEvent
+std::vector<LatencyStats> latest();
+// Oldest first
+std::vector<LatencySample> history(LatencyEvent event);
+// Returns true if the event had samples
+bool reset(LatencyEvent event);
+
+// Around each event loop iteration, samples EVENT_LOOP and feeds the watchdog
+void begin_iteration();
+void end_iteration();
+
+// Watch the calling thread, it has to be the one running the event loop.
+// Returns false if the watchdog could not be started.
+bool start_watchdog(std::uint32_t period_ms);
+} // namespace Latency
+
+// Samples event from construction to destruction if the monitor is on
+class LatencySpan {
+  public:
+    explicit LatencySpan(LatencyEvent event)
+        : event{event}, start{Latency::enabled() ? Latency::now_us() : 0} {}
+    LatencySpan(const LatencySpan &) = delete;
+    LatencySpan &operator=(const LatencySpan &) = delete;
+
+    ~LatencySpan() {
+        if (start != 0) {
+            Latency::add_sample(event, Latency::now_us() - start);
+        }
+    }
+
+  private:
+    LatencyEvent event;
+    std::uint64_t start;
+};
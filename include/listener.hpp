@@ -0,0 +1,14 @@
+#pragma once
+
+#include "config.hpp"
+
+#include <vector> // std::vector
+
+struct Listener {
+    int fd = -1;
+    bool is_unix = false;
+};
+
+// Open the TCP and Unix listeners enabled in config, non-blocking and with the
+// socket options set. Returns an empty vector on failure.
+std::vector<Listener> open_listeners(const Config &config);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "connection.hpp"
+
+#include <cstddef>     // std::size_t
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+/*
+    Publish/subscribe. Subscribers are indexed by channel, and patterns by their
+    literal prefix, see glob_prefix, so PUBLISH only matches the patterns whose
+    prefix starts the channel instead of all of them.
+
+    A message is encoded once per protocol in use into a SharedStr, which the
+    output of every subscriber references, see add_shared. Fanning out to 10k
+    subscribers costs 10k reference counts rather than 10k copies.
+
+    The index holds Connection pointers, the event loops call on_close before
+    freeing a connection with subscriptions.
+*/
+namespace PubSub {
+// Return false if conn was already subscribed or not subscribed
+bool subscribe(Connection &conn, std::string_view channel);
+bool unsubscribe(Connection &conn, std::string_view channel);
+bool psubscribe(Connection &conn, std::string_view pattern);
+bool punsubscribe(Connection &conn, std::string_view pattern);
+
+// What conn is subscribed to, for UNSUBSCRIBE and PUNSUBSCRIBE without arguments
+std::vector<std::string> channels(const Connection &conn);
+std::vector<std::string> patterns(const Connection &conn);
+
+// Queue message for the subscribers of channel, returns how many got it
+std::size_t publish(std::string_view channel, std::string_view message);
+// Move the fds of the subscribers that got messages since the last call to
+// fds, the event loop sends them their output
+void take_woken(std::vector<int> &fds);
+
+// Drop the subscriptions of conn, it is being closed
+void on_close(Connection &conn);
+
+// Channels and patterns with at least one subscriber, for INFO
+std::size_t num_channels();
+std::size_t num_patterns();
+} // namespace PubSub
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "connection.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint16_t, std::uint64_t
+#include <functional>  // std::function
+#include <memory>      // std::unique_ptr
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+// Bytes of the replication stream kept for replicas that reconnect
+constexpr std::size_t REPL_BACKLOG_SIZE = 1UL << 20;
+// Seconds between attempts to connect to the primary
+constexpr std::uint64_t REPL_RETRY_SECONDS = 1;
+// Bytes of a value, or of set members, sent per RESTORE of the snapshot. Each
+// RESTORE is a request, so it has to fit in IOBUF_LEN with the key.
+constexpr std::size_t REPL_CHUNK = 4096;
+// The snapshot is added to the output of a replica while less than this waits
+constexpr std::size_t REPL_SNAPSHOT_BUFFER = 256UL * 1024UL;
+
+/*
+    Primary-replica replication. A replica connects to its primary like any
+    client and sends PSYNC with the id of the stream it follows and the offset
+    it got to. Everything after that are requests from the primary:
+
+    - FULLRESYNC id offset, then the keyspace, when the replica is new or too
+      far behind
+    - CONTINUE id, when the backlog still has the stream from its offset
+
+    and then the write commands of the primary, encoded as they would be by
+    make_request, as they happen. The writes go to a circular backlog first,
+    the event loop copies what is new to each replica once per iteration.
+
+    The keyspace is not copied up front, the buckets of map are sent a few at
+    a time as the replica drains its output, each key as a DEL then RESTOREs.
+    The writes go on meanwhile: a key sent later replaces what they did to it,
+    the ones to keys already sent apply on top. BITOP and PFMERGE read other
+    keys, these are sent again first. Spilled values are read back before
+    their bucket is sent. CONTINUE id offset ends the snapshot, until then the
+    replica does not count the stream and cannot resume it.
+
+    Replicas are read only and leave eviction to their primary, which sends the
+    evicted keys as DELs. A replica does not serve replicas of its own.
+*/
+namespace Replication {
+void set_backlog_size(std::size_t bytes);
+
+// Called with each request of a dump
+using Emit = std::function<void(const std::vector<std::string_view> &args)>;
+// The RESTORE requests that recreate the key of node, for the snapshot and to
+// migrate keys between cluster nodes. The value must not be spilled, see
+// Tier::load_keys.
+void dump_key(const HashNode &node, const Emit &emit);
+// The backlog and the keys waiting for replicas being sent the snapshot,
+// maxmemory leaves them out
+std::size_t buffer_memory();
+
+// Primary
+
+// Append a write command to the stream, a no-op until a replica connects
+void feed(const std::vector<std::string_view> &args);
+// conn sent PSYNC replid offset, it becomes a replica
+void psync(std::unique_ptr<Connection> &conn, std::string_view replid,
+           std::string_view offset);
+// The fds of the replicas
+const std::vector<int> &replicas();
+// Called before a write runs, see BITOP and PFMERGE above
+void prepare_write(const Connection &conn);
+// Add the stream the replica is missing to its output, and more of the snapshot
+// if it drained it. Returns false if it fell out of the backlog, it has to be
+// closed.
+bool catch_up(std::unique_ptr<Connection> &conn);
+// More of the snapshot is due once the output of the replica drained
+bool sending_snapshot(const Connection &conn);
+
+// Replica
+
+bool is_replica();
+// False for a link replicate_from dropped, the loop closes it
+bool is_link(const Connection &conn);
+// Replicate host:port, an empty host makes this server a primary again
+void replicate_from(std::string host, std::uint16_t port);
+// A connecting socket to the primary when a new link is due, -1 otherwise
+int connect_primary(std::uint64_t now);
+// conn is the connection of the fd from connect_primary, queues its PSYNC
+void on_link(std::unique_ptr<Connection> &conn);
+// FULLRESYNC and CONTINUE from the primary, offset ends a snapshot
+void full_resync(std::string_view replid, std::uint64_t offset);
+bool resume(std::string_view replid, std::optional<std::uint64_t> offset);
+// The primary link handled a request of bytes bytes
+void applied(const std::unique_ptr<Connection> &conn, std::size_t bytes);
+
+// Either side, conn is being closed. now is in seconds.
+void on_close(const Connection &conn, std::uint64_t now);
+// The replication section of INFO
+std::string info();
+} // namespace Replication
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "connection.hpp"
+
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::int64_t
+#include <memory>      // std::unique_ptr
+#include <string_view> // std::string_view
+
+/*
+    RESP, the Redis protocol, so standard clients and benchmarks can talk to the
+    server. Requests are arrays of bulk strings:
+
+        *2\r\n$3\r\nGET\r\n$3\r\nkey\r\n
+
+    The type bytes of ObjType are the same as in RESP, replies only differ in
+    the framing. RESP3 is enabled per connection with HELLO 3.
+*/
+
+// Longest header line, a type byte, INT64_MIN and CRLF
+constexpr std::size_t RESP_HEADER_MAX = 1 + 20 + 2;
+
+// Returns true if buf, at least 4 bytes, starts a RESP request, "*" and a digit.
+// A native request can not, the last byte of its length is 0, see NATIVE_LEN_MAX.
+bool is_resp(const std::byte *buf);
+
+// Position of the first "\r\n" in p, n if there is none
+std::size_t find_crlf(const char *p, std::size_t n);
+
+// Parse the request at rbuf_pos into req->args, which view rbuf. rbuf_pos is only
+// moved past complete requests, like the native framing.
+ReqStatus parse_resp(std::unique_ptr<Connection> &conn);
+
+// Write "<type><n>\r\n" to p, returns its length, at most RESP_HEADER_MAX
+std::size_t write_resp_header(std::byte *p, char type, std::int64_t n);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "intset.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t
+#include <memory>      // std::unique_ptr
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+class HashTable;
+
+// Sets holding more integers than this are converted to a hash table
+constexpr std::size_t SET_MAX_INTSET_ENTRIES = 1UL << 22;
+
+/*
+    A set of strings. As long as every member is an integer the set is stored as
+    an IntSet, otherwise it falls back to a HashTable whose keys are the members.
+*/
+class Set {
+  public:
+    Set();
+    Set(const Set &) = delete;
+    Set(Set &&other) noexcept;
+
+    Set &operator=(const Set &) = delete;
+    Set &operator=(Set &&other) noexcept;
+
+    ~Set();
+
+    bool add(std::string_view member);
+    // Add a batch of members, returns the number added
+    std::size_t add(const std::vector<std::string_view> &members);
+    bool remove(std::string_view member);
+    bool contains(std::string_view member);
+    // Add every member of other
+    void merge(Set &other);
+
+    std::size_t size() const;
+    bool is_intset() const;
+    const IntSet &ints() const;
+    std::vector<std::string> members() const;
+
+  private:
+    void convert();
+
+    IntSet intset;
+    std::unique_ptr<HashTable> ht; // Only set after conversion
+};
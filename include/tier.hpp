@@ -0,0 +1,66 @@
+#pragma once
+
+#include "connection.hpp"
+#include "hashtable.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint32_t, std::uint64_t
+#include <memory>      // std::unique_ptr
+#include <string>      // std::string
+#include <vector>      // std::vector
+
+// Bytes of a segment file, a record never crosses two. Offsets within a segment
+// are 32 bits.
+constexpr std::uint64_t TIER_SEGMENT_SIZE = 64UL << 20;
+// Smaller strings cost less than the bookkeeping of spilling them
+constexpr std::size_t TIER_MIN_VALUE = 64;
+// Keys sampled every TIER_CYCLE_MS, more after a longer wait
+constexpr std::size_t TIER_SAMPLES = 64;
+constexpr std::uint64_t TIER_CYCLE_MS = 10;
+// Values on their way to the files, they stay in memory until written
+constexpr std::size_t TIER_MAX_WRITES = 256;
+// A full segment with less than this share of live bytes is compacted
+constexpr double TIER_COMPACT_RATIO = 0.5;
+
+/*
+    Tiered storage. Strings not accessed for idle seconds are moved out of
+    memory into append only segment files on a local disk, leaving a SpilledStr
+    with where their bytes are. A record is the key and value lengths as 32 bit
+    integers, the key, then the value. The files are unlinked as soon as they
+    are created, the data does not outlive the process.
+
+    The disk is only touched by a pool of I/O threads. A request that needs a
+    spilled value does not run: load_keys queues reads of its spilled keys and
+    the connection waits, with the request left in rbuf. Once the values are
+    back in memory, complete hands the connection back to the event loop, which
+    runs the request again. The loop polls event_fd to learn about finished
+    I/O.
+
+    Overwritten or deleted values leave dead records behind. The segment with
+    the most dead space is compacted by reading it back and writing its live
+    records to the current segment, and removed once nothing refers to it.
+*/
+namespace Tier {
+// Start spilling to files in dir with io_threads threads, returns false if the
+// first segment cannot be created
+bool open(const std::string &dir, std::uint32_t idle_seconds, std::size_t io_threads);
+bool enabled();
+// Readable when I/O finished, -1 if disabled
+int event_fd();
+
+// Queue reads of the spilled keys of the request of conn. Returns true if there
+// are any, conn->io_pending counts them and the request has to wait.
+bool load_keys(std::unique_ptr<Connection> &conn);
+// Same for other keys, the ones a request reads besides its arguments or the
+// ones of the replication snapshot
+bool load_keys(std::unique_ptr<Connection> &conn, const std::vector<std::string> &keys);
+// Apply the finished I/O, fds gets a connection once for each of its loads
+// that completed
+void complete(std::vector<int> &fds);
+// Spill a sample of the cold strings and compact, called once per loop
+// iteration. It does little more than look at the clock most of the time.
+void cycle();
+
+// The tier section of INFO
+std::string info();
+} // namespace Tier
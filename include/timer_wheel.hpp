@@ -0,0 +1,32 @@
+#pragma once
+
+#include <array>   // std::array
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint64_t
+#include <vector>  // std::vector
+
+// One slot per second
+constexpr std::size_t TIMER_WHEEL_SLOTS = 64;
+
+struct Timer {
+    int fd = -1;
+    std::uint64_t when = 0; // Seconds
+};
+
+/*
+    A hashed timing wheel with one slot per second. A timer lives in slot
+    when % TIMER_WHEEL_SLOTS, ones more than a turn away stay in their slot until
+    the wheel comes around to their second. Adding and expiring are O(1) per
+    timer. There is no cancel, the owner remembers which timer is current and
+    skips the others when they expire.
+*/
+class TimerWheel {
+  public:
+    void add(int fd, std::uint64_t when);
+    // Move the timers due by now to due
+    void expire(std::uint64_t now, std::vector<Timer> &due);
+
+  private:
+    std::array<std::vector<Timer>, TIMER_WHEEL_SLOTS> slots;
+    std::uint64_t next = 0; // Next second to expire, 0 before the first expire
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "connection.hpp"
+
+#include <x86intrin.h> // __rdtsc
+
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint8_t, std::uint32_t, std::uint64_t
+#include <string>  // std::string
+
+// Events kept per thread, the oldest are overwritten once it is full
+constexpr std::size_t TRACE_RING_SIZE = 1 << 16;
+
+enum class Phase : std::uint8_t { READ, FRAME, PARSE, EXEC, WRITE };
+
+/*
+    Sampled tracing of where the event loop spends its time. One in rate reads
+    marks the connection as traced, and the phases of its requests until the
+    next read are timestamped with rdtsc. The events go to a ring per thread,
+    which DEBUG TRACE DUMP turns into Chrome trace JSON for chrome://tracing or
+    Perfetto, one track per connection.
+*/
+namespace Trace {
+// Trace one in rate reads, 0 turns tracing off
+void set_rate(std::uint32_t rate);
+std::uint32_t rate();
+// Returns true if the connection reading now should be traced
+bool sample();
+
+inline std::uint64_t now() { return __rdtsc(); }
+void record(Phase phase, int fd, std::uint64_t start, Cmd cmd = Cmd::NONE);
+
+// The events of this thread as Chrome trace JSON, the ring is emptied
+std::string dump();
+} // namespace Trace
+
+// Records the phase from construction to destruction if the connection is traced
+class TraceSpan {
+  public:
+    TraceSpan(const Connection &conn, Phase phase, Cmd cmd = Cmd::NONE)
+        : traced{conn.traced}, phase{phase}, cmd{cmd}, fd{conn.fd},
+          start{conn.traced ? Trace::now() : 0} {}
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    // Nothing worth recording happened, e.g. no whole request was buffered yet
+    void discard() { traced = false; }
+
+    ~TraceSpan() {
+        if (traced) {
+            Trace::record(phase, fd, start, cmd);
+        }
+    }
+
+  private:
+    bool traced;
+    Phase phase;
+    Cmd cmd;
+    int fd;
+    std::uint64_t start;
+};
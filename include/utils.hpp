@@ -3,8 +3,9 @@
 #include "location.hpp"
 
 #include <cstddef>     // std::byte, std::size_t
-#include <cstdint>     // std::uint16_t
+#include <cstdint>     // std::uint16_t, std::uint64_t
 #include <cstdio>      // std::FILE
+#include <optional>    // std::optional
 #include <string_view> // std::string_view
 #include <vector>      // std::vector
 
@@ -26,11 +27,24 @@ constexpr const char *get_filename(const char *file) {
 void print_msg(const char *file, int line, const char *func, std::FILE *f,
                std::string_view msg);
 
+// Default port of the server and the client
 constexpr std::uint16_t PORT = 1234;
 constexpr std::size_t IOBUF_LEN = 8UL * 1024UL;
+// Free IOBUF_LEN buffers kept for reuse, the rest go back to the allocator
+constexpr std::size_t IOBUF_POOL_MAX = 1024;
 constexpr std::size_t CMD_LEN_BYTES = sizeof(std::uint32_t);
-constexpr std::size_t MAX_ARGS = 3;
-constexpr int MAX_EVENTS = 10;
+// Native requests stay below 16 MiB, so the last byte of their length is 0
+constexpr std::size_t NATIVE_LEN_MAX = (1UL << 24) - 1;
+// Longest argument of a request by default, the default of Redis
+constexpr std::size_t PROTO_MAX_BULK_LEN = 512UL << 20;
+// Replies with values this large reference the value instead of copying it
+constexpr std::size_t WBUF_REF_MIN = 1024;
+// Max number of iovecs handed to the kernel per write
+constexpr std::size_t WBUF_IOV_MAX = 64;
+// A connection stops handling requests while this much output waits for a slow reader
+constexpr std::size_t WBUF_HIGH_WATER = 256UL * 1024UL;
+// A connection stops reading while this much input waits for its output to be sent
+constexpr std::size_t RBUF_HIGH_WATER = 256UL * 1024UL;
 
 void set_nonblocking(int fd);
 
@@ -41,14 +55,41 @@ std::string_view to_view(const std::vector<std::byte> &buf, std::size_t n);
 std::string_view to_view(const std::vector<std::byte> &buf, std::size_t offset,
                          std::size_t n);
 std::vector<std::byte> to_bytes(std::string_view sv);
+// Only accepts the canonical form, so converting back yields the same string
+std::optional<std::int64_t> to_int64(std::string_view sv);
+
+// Fast non-cryptographic pseudo random numbers (xorshift64*)
+std::uint64_t fast_rand();
 
 std::vector<std::byte> make_request(const std::vector<std::string_view> &args);
 
+// Glob-style matching like Redis: * ? [abc] [^abc] [a-z] and \ escapes
+bool glob_match(std::string_view pattern, std::string_view str);
+// The part of pattern before its first special character, what every match starts with
+std::string_view glob_prefix(std::string_view pattern);
+
+// Keys are spread over this many hash slots in cluster mode, see Cluster
+constexpr std::size_t CLUSTER_SLOTS = 16384;
+
+// CRC16-CCITT (XMODEM), the hash of the cluster slots
+std::uint16_t crc16(std::string_view data);
+// The slot of key. Only the part between the first { and the next } is hashed
+// if not empty, so keys sharing that tag land on the same slot.
+std::uint16_t key_slot(std::string_view key);
+
 #define CURRENT_LOCATION Location::current()
-#define LOG_DEBUG(msg) Logger::debug((msg), CURRENT_LOCATION)
-#define LOG_INFO(msg) Logger::info((msg), CURRENT_LOCATION)
-#define LOG_WARNING(msg) Logger::warning((msg), CURRENT_LOCATION)
-#define LOG_ERROR(msg) Logger::error((msg), CURRENT_LOCATION)
+// msg is only evaluated if the level is enabled, so a disabled message costs no
+// formatting or allocation
+#define LOG_AT(level, msg)                                                             \
+    do {                                                                               \
+        if (Logger::enabled(level)) {                                                  \
+            Logger::log_write((level), (msg), CURRENT_LOCATION);                       \
+        }                                                                              \
+    } while (false)
+#define LOG_DEBUG(msg) LOG_AT(Logger::Level::DEBUG, msg)
+#define LOG_INFO(msg) LOG_AT(Logger::Level::INFO, msg)
+#define LOG_WARNING(msg) LOG_AT(Logger::Level::WARNING, msg)
+#define LOG_ERROR(msg) LOG_AT(Logger::Level::ERROR, msg)
 
 namespace Logger {
 enum class Level : std::uint8_t {
@@ -60,6 +101,7 @@ enum class Level : std::uint8_t {
 };
 
 void set_level(Level level);
+bool enabled(Level level);
 
 void log_write(Level level, const std::string &msg, const Location &loc);
 inline void debug(const std::string &msg, const Location &loc) {
@@ -0,0 +1,157 @@
+#include "alloc.hpp"
+
+#include <array>   // std::array
+#include <atomic>  // std::atomic
+#include <cstddef> // std::size_t
+#include <cstdint> // std::int32_t, std::uintptr_t
+#include <cstdio>  // std::fopen, std::fscanf, std::fclose
+#include <cstdlib> // std::malloc, std::aligned_alloc, std::free
+#include <new>     // std::bad_alloc, std::align_val_t, std::nothrow_t
+
+#include <malloc.h> // malloc_usable_size
+#include <unistd.h> // sysconf
+
+namespace {
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::atomic<std::size_t> used{0};
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::atomic<std::size_t> count{0};
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::atomic<bool> tracking{false};
+// Bytes per page, signed as the allocations made before tracking are freed too
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::array<std::atomic<std::int32_t>, ALLOC_PAGES> pages{};
+
+std::atomic<std::int32_t> &page_of(const void *ptr) {
+    return pages[reinterpret_cast<std::uintptr_t>(ptr) / ALLOC_PAGE_SIZE % ALLOC_PAGES];
+}
+
+void add_used(void *ptr) {
+    const std::size_t size = malloc_usable_size(ptr);
+    used.fetch_add(size, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    if (tracking.load(std::memory_order_relaxed)) {
+        const auto bytes = static_cast<std::int32_t>(size);
+        page_of(ptr).fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+void *counted_alloc(std::size_t size) noexcept {
+    void *ptr = std::malloc(size == 0 ? 1 : size); // NOLINT(cppcoreguidelines-no-malloc)
+    if (ptr != nullptr) {
+        add_used(ptr);
+    }
+    return ptr;
+}
+
+void *counted_alloc(std::size_t size, std::align_val_t align) noexcept {
+    const auto alignment = static_cast<std::size_t>(align);
+    // aligned_alloc wants a multiple of the alignment
+    const std::size_t rounded = (size + alignment - 1) / alignment * alignment;
+    void *ptr = std::aligned_alloc(alignment, rounded == 0 ? alignment : rounded);
+    if (ptr != nullptr) {
+        add_used(ptr);
+    }
+    return ptr;
+}
+
+void counted_free(void *ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    const std::size_t size = malloc_usable_size(ptr);
+    used.fetch_sub(size, std::memory_order_relaxed);
+    if (tracking.load(std::memory_order_relaxed)) {
+        const auto bytes = static_cast<std::int32_t>(size);
+        page_of(ptr).fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    std::free(ptr); // NOLINT(cppcoreguidelines-no-malloc)
+}
+
+template <typename... Args>
+void *throwing_alloc(std::size_t size, Args... args) {
+    void *ptr = counted_alloc(size, args...);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+} // namespace
+
+std::size_t used_memory() { return used.load(std::memory_order_relaxed); }
+std::size_t allocations() { return count.load(std::memory_order_relaxed); }
+
+std::size_t rss_memory() {
+    std::FILE *file = std::fopen("/proc/self/statm", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    std::size_t size = 0;
+    std::size_t resident = 0;
+    const int n = std::fscanf(file, "%zu %zu", &size, &resident);
+    std::fclose(file);
+    return n == 2 ? resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+void track_pages() { tracking.store(true, std::memory_order_relaxed); }
+
+std::size_t page_used(const void *ptr) {
+    const std::int32_t bytes = page_of(ptr).load(std::memory_order_relaxed);
+    return bytes > 0 ? static_cast<std::size_t>(bytes) : 0;
+}
+
+// NOLINTBEGIN(cert-dcl54-cpp, misc-new-delete-overloads)
+void *operator new(std::size_t size) { return throwing_alloc(size); }
+void *operator new[](std::size_t size) { return throwing_alloc(size); }
+void *operator new(std::size_t size, std::align_val_t align) {
+    return throwing_alloc(size, align);
+}
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return throwing_alloc(size, align);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t & /*tag*/) noexcept {
+    return counted_alloc(size);
+}
+void *operator new[](std::size_t size, const std::nothrow_t & /*tag*/) noexcept {
+    return counted_alloc(size);
+}
+void *operator new(std::size_t size, std::align_val_t align,
+                   const std::nothrow_t & /*tag*/) noexcept {
+    return counted_alloc(size, align);
+}
+void *operator new[](std::size_t size, std::align_val_t align,
+                     const std::nothrow_t & /*tag*/) noexcept {
+    return counted_alloc(size, align);
+}
+
+void operator delete(void *ptr) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr) noexcept { counted_free(ptr); }
+void operator delete(void *ptr, std::size_t /*size*/) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr, std::size_t /*size*/) noexcept { counted_free(ptr); }
+void operator delete(void *ptr, std::align_val_t /*align*/) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr, std::align_val_t /*align*/) noexcept {
+    counted_free(ptr);
+}
+void operator delete(void *ptr, std::size_t /*size*/, std::align_val_t /*align*/) noexcept {
+    counted_free(ptr);
+}
+void operator delete[](void *ptr, std::size_t /*size*/,
+                       std::align_val_t /*align*/) noexcept {
+    counted_free(ptr);
+}
+void operator delete(void *ptr, const std::nothrow_t & /*tag*/) noexcept {
+    counted_free(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t & /*tag*/) noexcept {
+    counted_free(ptr);
+}
+void operator delete(void *ptr, std::align_val_t /*align*/,
+                     const std::nothrow_t & /*tag*/) noexcept {
+    counted_free(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t /*align*/,
+                       const std::nothrow_t & /*tag*/) noexcept {
+    counted_free(ptr);
+}
+// NOLINTEND(cert-dcl54-cpp, misc-new-delete-overloads)
@@ -0,0 +1,634 @@
+#include "art.hpp"
+#include "cpu.hpp"
+
+#include <emmintrin.h> // SSE2 intrinsics
+
+#include <algorithm> // std::min
+#include <array>     // std::array
+#include <cstdint>   // std::uint8_t, std::uint16_t
+#include <memory>    // std::make_unique
+#include <utility>   // std::move, std::exchange
+
+enum class ArtType : std::uint8_t { LEAF, NODE4, NODE16, NODE48, NODE256 };
+
+struct ArtNode {
+    explicit ArtNode(ArtType type) : type{type} {}
+    ArtNode(const ArtNode &) = delete;
+    ArtNode(ArtNode &&) = delete;
+    ArtNode &operator=(const ArtNode &) = delete;
+    ArtNode &operator=(ArtNode &&) = delete;
+    virtual ~ArtNode() = default;
+
+    ArtType type;
+};
+
+namespace {
+using Child = std::unique_ptr<ArtNode>;
+
+struct Leaf : ArtNode {
+    explicit Leaf(std::string_view key) : ArtNode{ArtType::LEAF}, key{key} {}
+    std::string key;
+};
+
+struct Inner : ArtNode {
+    using ArtNode::ArtNode;
+    // Bytes shared by all the keys below, after the byte that led here
+    std::string prefix;
+    // The key that ends here
+    std::unique_ptr<Leaf> end;
+    std::uint16_t count = 0;
+};
+
+// Children ordered by their byte
+template <std::size_t N, ArtType T>
+struct SortedNode : Inner {
+    SortedNode() : Inner{T} {}
+    std::array<std::uint8_t, N> keys{};
+    std::array<Child, N> children;
+};
+using Node4 = SortedNode<4, ArtType::NODE4>;
+using Node16 = SortedNode<16, ArtType::NODE16>;
+
+struct Node48 : Inner {
+    Node48() : Inner{ArtType::NODE48} {}
+    // Slot of the child of each byte plus one, 0 for none
+    std::array<std::uint8_t, 256> index{};
+    std::array<Child, 48> children;
+};
+
+struct Node256 : Inner {
+    Node256() : Inner{ArtType::NODE256} {}
+    std::array<Child, 256> children;
+};
+
+// A node shrinks when it is down to this many children, fewer than the smaller
+// node holds so that one key going back and forth does not resize it each time
+constexpr std::uint16_t NODE16_MIN = 3;
+constexpr std::uint16_t NODE48_MIN = 12;
+constexpr std::uint16_t NODE256_MIN = 37;
+
+std::size_t common_len(std::string_view a, std::string_view b) {
+    const std::size_t n = std::min(a.size(), b.size());
+    std::size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+template <typename Node>
+int find_sorted(const Node &node, std::uint8_t byte) {
+    for (int i = 0; i < node.count; i++) {
+        if (node.keys[i] == byte) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int find16(const Node16 &node, std::uint8_t byte) {
+    if (!Cpu::has_sse2()) {
+        return find_sorted(node, byte);
+    }
+    const __m128i keys =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(node.keys.data()));
+    const __m128i hits = _mm_cmpeq_epi8(keys, _mm_set1_epi8(static_cast<char>(byte)));
+    const unsigned mask =
+        static_cast<unsigned>(_mm_movemask_epi8(hits)) & ((1U << node.count) - 1);
+    return mask != 0 ? __builtin_ctz(mask) : -1;
+}
+
+const Child *find_child(const Inner &node, std::uint8_t byte) {
+    switch (node.type) {
+    case ArtType::NODE4: {
+        const auto &n = static_cast<const Node4 &>(node);
+        const int i = find_sorted(n, byte);
+        return i >= 0 ? &n.children[i] : nullptr;
+    }
+    case ArtType::NODE16: {
+        const auto &n = static_cast<const Node16 &>(node);
+        const int i = find16(n, byte);
+        return i >= 0 ? &n.children[i] : nullptr;
+    }
+    case ArtType::NODE48: {
+        const auto &n = static_cast<const Node48 &>(node);
+        return n.index[byte] != 0 ? &n.children[n.index[byte] - 1] : nullptr;
+    }
+    case ArtType::NODE256: {
+        const auto &n = static_cast<const Node256 &>(node);
+        return n.children[byte] != nullptr ? &n.children[byte] : nullptr;
+    }
+    case ArtType::LEAF:
+        break;
+    }
+    return nullptr;
+}
+
+Child *find_child(Inner &node, std::uint8_t byte) {
+    return const_cast<Child *>(find_child(static_cast<const Inner &>(node), byte));
+}
+
+template <typename Node, typename Fn>
+bool for_each_sorted(const Node &node, Fn &fn) {
+    for (std::uint16_t i = 0; i < node.count; i++) {
+        if (!fn(node.keys[i], *node.children[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Call fn(byte, child) for each child in byte order until it returns false
+template <typename Fn>
+bool for_each_child(const Inner &node, Fn fn) {
+    switch (node.type) {
+    case ArtType::NODE4:
+        return for_each_sorted(static_cast<const Node4 &>(node), fn);
+    case ArtType::NODE16:
+        return for_each_sorted(static_cast<const Node16 &>(node), fn);
+    case ArtType::NODE48: {
+        const auto &n = static_cast<const Node48 &>(node);
+        for (std::size_t byte = 0; byte < n.index.size(); byte++) {
+            if (n.index[byte] != 0 && !fn(byte, *n.children[n.index[byte] - 1])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case ArtType::NODE256: {
+        const auto &n = static_cast<const Node256 &>(node);
+        for (std::size_t byte = 0; byte < n.children.size(); byte++) {
+            if (n.children[byte] != nullptr && !fn(byte, *n.children[byte])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case ArtType::LEAF:
+        break;
+    }
+    return true;
+}
+
+void move_header(Inner &to, Inner &from) {
+    to.prefix = std::move(from.prefix);
+    to.end = std::move(from.end);
+    to.count = from.count;
+}
+
+template <typename Node>
+void insert_sorted(Node &node, std::uint8_t byte, Child child) {
+    std::uint16_t i = node.count;
+    for (; i > 0 && node.keys[i - 1] > byte; i--) {
+        node.keys[i] = node.keys[i - 1];
+        node.children[i] = std::move(node.children[i - 1]);
+    }
+    node.keys[i] = byte;
+    node.children[i] = std::move(child);
+    node.count++;
+}
+
+template <typename Node>
+void erase_sorted(Node &node, int i) {
+    for (; i + 1 < node.count; i++) {
+        node.keys[i] = node.keys[i + 1];
+        node.children[i] = std::move(node.children[i + 1]);
+    }
+    node.children[i].reset();
+    node.count--;
+}
+
+// Add a child to the inner node of ref, replacing it with a bigger one if full
+void add_child(Child &ref, std::uint8_t byte, Child child) {
+    auto &node = static_cast<Inner &>(*ref);
+    switch (node.type) {
+    case ArtType::NODE4: {
+        auto &n = static_cast<Node4 &>(node);
+        if (n.count < n.keys.size()) {
+            insert_sorted(n, byte, std::move(child));
+            return;
+        }
+        auto grown = std::make_unique<Node16>();
+        move_header(*grown, n);
+        for (std::size_t i = 0; i < n.keys.size(); i++) {
+            grown->keys[i] = n.keys[i];
+            grown->children[i] = std::move(n.children[i]);
+        }
+        insert_sorted(*grown, byte, std::move(child));
+        ref = std::move(grown);
+        return;
+    }
+    case ArtType::NODE16: {
+        auto &n = static_cast<Node16 &>(node);
+        if (n.count < n.keys.size()) {
+            insert_sorted(n, byte, std::move(child));
+            return;
+        }
+        auto grown = std::make_unique<Node48>();
+        move_header(*grown, n);
+        for (std::size_t i = 0; i < n.keys.size(); i++) {
+            grown->index[n.keys[i]] = static_cast<std::uint8_t>(i + 1);
+            grown->children[i] = std::move(n.children[i]);
+        }
+        grown->index[byte] = static_cast<std::uint8_t>(n.keys.size() + 1);
+        grown->children[n.keys.size()] = std::move(child);
+        grown->count++;
+        ref = std::move(grown);
+        return;
+    }
+    case ArtType::NODE48: {
+        auto &n = static_cast<Node48 &>(node);
+        if (n.count < n.children.size()) {
+            // Removals leave holes
+            std::size_t slot = 0;
+            while (n.children[slot] != nullptr) {
+                slot++;
+            }
+            n.index[byte] = static_cast<std::uint8_t>(slot + 1);
+            n.children[slot] = std::move(child);
+            n.count++;
+            return;
+        }
+        auto grown = std::make_unique<Node256>();
+        move_header(*grown, n);
+        for (std::size_t b = 0; b < n.index.size(); b++) {
+            if (n.index[b] != 0) {
+                grown->children[b] = std::move(n.children[n.index[b] - 1]);
+            }
+        }
+        grown->children[byte] = std::move(child);
+        grown->count++;
+        ref = std::move(grown);
+        return;
+    }
+    case ArtType::NODE256: {
+        auto &n = static_cast<Node256 &>(node);
+        n.children[byte] = std::move(child);
+        n.count++;
+        return;
+    }
+    case ArtType::LEAF:
+        break;
+    }
+}
+
+// Remove a child of the inner node of ref, replacing it with a smaller one once
+// it holds few enough
+void remove_child(Child &ref, std::uint8_t byte) {
+    auto &node = static_cast<Inner &>(*ref);
+    switch (node.type) {
+    case ArtType::NODE4: {
+        auto &n = static_cast<Node4 &>(node);
+        erase_sorted(n, find_sorted(n, byte));
+        return;
+    }
+    case ArtType::NODE16: {
+        auto &n = static_cast<Node16 &>(node);
+        erase_sorted(n, find_sorted(n, byte));
+        if (n.count > NODE16_MIN) {
+            return;
+        }
+        auto shrunk = std::make_unique<Node4>();
+        move_header(*shrunk, n);
+        for (std::size_t i = 0; i < n.count; i++) {
+            shrunk->keys[i] = n.keys[i];
+            shrunk->children[i] = std::move(n.children[i]);
+        }
+        ref = std::move(shrunk);
+        return;
+    }
+    case ArtType::NODE48: {
+        auto &n = static_cast<Node48 &>(node);
+        n.children[n.index[byte] - 1].reset();
+        n.index[byte] = 0;
+        n.count--;
+        if (n.count > NODE48_MIN) {
+            return;
+        }
+        auto shrunk = std::make_unique<Node16>();
+        move_header(*shrunk, n);
+        std::size_t i = 0;
+        for (std::size_t b = 0; b < n.index.size(); b++) {
+            if (n.index[b] != 0) {
+                shrunk->keys[i] = static_cast<std::uint8_t>(b);
+                shrunk->children[i++] = std::move(n.children[n.index[b] - 1]);
+            }
+        }
+        ref = std::move(shrunk);
+        return;
+    }
+    case ArtType::NODE256: {
+        auto &n = static_cast<Node256 &>(node);
+        n.children[byte].reset();
+        n.count--;
+        if (n.count > NODE256_MIN) {
+            return;
+        }
+        auto shrunk = std::make_unique<Node48>();
+        move_header(*shrunk, n);
+        std::size_t slot = 0;
+        for (std::size_t b = 0; b < n.children.size(); b++) {
+            if (n.children[b] != nullptr) {
+                shrunk->index[b] = static_cast<std::uint8_t>(slot + 1);
+                shrunk->children[slot++] = std::move(n.children[b]);
+            }
+        }
+        ref = std::move(shrunk);
+        return;
+    }
+    case ArtType::LEAF:
+        break;
+    }
+}
+
+// Replace the inner node of ref by its key if it has no child left, or by its
+// only child if it has no key
+void collapse(Child &ref) {
+    auto &node = static_cast<Inner &>(*ref);
+    if (node.count == 0) {
+        ref = std::move(node.end);
+        return;
+    }
+    if (node.count > 1 || node.end != nullptr) {
+        return;
+    }
+
+    Child only;
+    for_each_child(node, [&](std::uint8_t byte, const ArtNode &child) {
+        only = std::move(*find_child(node, byte));
+        if (child.type != ArtType::LEAF) {
+            auto &inner = static_cast<Inner &>(*only);
+            inner.prefix = node.prefix + static_cast<char>(byte) + inner.prefix;
+        }
+        return false;
+    });
+    ref = std::move(only);
+}
+
+// Put leaf below node, which is at depth
+void place(Node4 &node, std::unique_ptr<Leaf> leaf, std::size_t depth) {
+    if (leaf->key.size() == depth) {
+        node.end = std::move(leaf);
+        return;
+    }
+    const auto byte = static_cast<std::uint8_t>(leaf->key[depth]);
+    insert_sorted(node, byte, std::move(leaf));
+}
+
+bool remove_from(Child &ref, std::string_view key, std::size_t depth) {
+    if (ref == nullptr) {
+        return false;
+    }
+    if (ref->type == ArtType::LEAF) {
+        if (static_cast<const Leaf &>(*ref).key != key) {
+            return false;
+        }
+        ref.reset();
+        return true;
+    }
+
+    auto &node = static_cast<Inner &>(*ref);
+    if (key.substr(depth, node.prefix.size()) != node.prefix) {
+        return false;
+    }
+    depth += node.prefix.size();
+    if (depth == key.size()) {
+        if (node.end == nullptr) {
+            return false;
+        }
+        node.end.reset();
+    } else {
+        const auto byte = static_cast<std::uint8_t>(key[depth]);
+        Child *child = find_child(node, byte);
+        if (child == nullptr || !remove_from(*child, key, depth + 1)) {
+            return false;
+        }
+        if (*child == nullptr) {
+            remove_child(ref, byte);
+        }
+    }
+    collapse(ref);
+    return true;
+}
+
+bool reached(std::size_t limit, const std::vector<std::string> &out) {
+    return limit != 0 && out.size() >= limit;
+}
+
+// Add every key below node to out, returns false once limit is reached
+bool collect(const ArtNode &node, std::size_t limit, std::vector<std::string> &out) {
+    if (node.type == ArtType::LEAF) {
+        out.push_back(static_cast<const Leaf &>(node).key);
+        return !reached(limit, out);
+    }
+    const auto &inner = static_cast<const Inner &>(node);
+    if (inner.end != nullptr && !collect(*inner.end, limit, out)) {
+        return false;
+    }
+    return for_each_child(inner, [&](std::uint8_t /*byte*/, const ArtNode &child) {
+        return collect(child, limit, out);
+    });
+}
+
+// Same as collect for the keys from start to end, path holds the bytes above
+// node. Subtrees whose path is out of the range are skipped, returns false
+// once past end or the limit.
+bool collect_range(const ArtNode &node, std::string &path, std::string_view start,
+                   std::string_view end, std::size_t limit,
+                   std::vector<std::string> &out) {
+    if (node.type == ArtType::LEAF) {
+        const std::string &key = static_cast<const Leaf &>(node).key;
+        if (key < start) {
+            return true;
+        }
+        if (key > end) {
+            return false;
+        }
+        out.push_back(key);
+        return !reached(limit, out);
+    }
+
+    const auto &inner = static_cast<const Inner &>(node);
+    const std::size_t mark = path.size();
+    path += inner.prefix;
+    bool more = true;
+    if (std::string_view(path) < start.substr(0, path.size())) {
+        // Every key below is before start
+    } else if (std::string_view(path) > end.substr(0, path.size())) {
+        more = false;
+    } else {
+        if (inner.end != nullptr) {
+            more = collect_range(*inner.end, path, start, end, limit, out);
+        }
+        if (more) {
+            more = for_each_child(inner, [&](std::uint8_t byte, const ArtNode &child) {
+                path.push_back(static_cast<char>(byte));
+                const bool go_on = collect_range(child, path, start, end, limit, out);
+                path.pop_back();
+                return go_on;
+            });
+        }
+    }
+    path.resize(mark);
+    return more;
+}
+} // namespace
+
+ArtTree::ArtTree() = default;
+ArtTree::ArtTree(ArtTree &&other) noexcept
+    : root{std::move(other.root)}, count{std::exchange(other.count, 0)} {}
+
+ArtTree &ArtTree::operator=(ArtTree &&other) noexcept {
+    root = std::move(other.root);
+    count = std::exchange(other.count, 0);
+    return *this;
+}
+
+ArtTree::~ArtTree() = default;
+
+bool ArtTree::insert(std::string_view key) {
+    Child *ref = &root;
+    std::size_t depth = 0;
+    while (true) {
+        if (*ref == nullptr) {
+            *ref = std::make_unique<Leaf>(key);
+            count++;
+            return true;
+        }
+
+        if ((*ref)->type == ArtType::LEAF) {
+            auto &leaf = static_cast<Leaf &>(**ref);
+            if (leaf.key == key) {
+                return false;
+            }
+            // A node for the bytes both keys share, with the two below
+            const std::size_t same =
+                common_len(std::string_view(leaf.key).substr(depth), key.substr(depth));
+            auto node = std::make_unique<Node4>();
+            node->prefix = key.substr(depth, same);
+            depth += same;
+            std::unique_ptr<Leaf> old(static_cast<Leaf *>(ref->release()));
+            place(*node, std::move(old), depth);
+            place(*node, std::make_unique<Leaf>(key), depth);
+            *ref = std::move(node);
+            count++;
+            return true;
+        }
+
+        auto &node = static_cast<Inner &>(**ref);
+        const std::size_t same = common_len(node.prefix, key.substr(depth));
+        if (same < node.prefix.size()) {
+            // The key leaves the prefix, split it there
+            auto parent = std::make_unique<Node4>();
+            parent->prefix = node.prefix.substr(0, same);
+            const auto byte = static_cast<std::uint8_t>(node.prefix[same]);
+            node.prefix.erase(0, same + 1);
+            insert_sorted(*parent, byte, std::move(*ref));
+            place(*parent, std::make_unique<Leaf>(key), depth + same);
+            *ref = std::move(parent);
+            count++;
+            return true;
+        }
+
+        depth += node.prefix.size();
+        if (depth == key.size()) {
+            if (node.end != nullptr) {
+                return false;
+            }
+            node.end = std::make_unique<Leaf>(key);
+            count++;
+            return true;
+        }
+
+        const auto byte = static_cast<std::uint8_t>(key[depth]);
+        Child *child = find_child(node, byte);
+        if (child == nullptr) {
+            add_child(*ref, byte, std::make_unique<Leaf>(key));
+            count++;
+            return true;
+        }
+        ref = child;
+        depth++;
+    }
+}
+
+bool ArtTree::remove(std::string_view key) {
+    if (!remove_from(root, key, 0)) {
+        return false;
+    }
+    count--;
+    return true;
+}
+
+bool ArtTree::contains(std::string_view key) const {
+    const ArtNode *node = root.get();
+    std::size_t depth = 0;
+    while (node != nullptr) {
+        if (node->type == ArtType::LEAF) {
+            return static_cast<const Leaf &>(*node).key == key;
+        }
+        const auto &inner = static_cast<const Inner &>(*node);
+        if (key.substr(depth, inner.prefix.size()) != inner.prefix) {
+            return false;
+        }
+        depth += inner.prefix.size();
+        if (depth == key.size()) {
+            return inner.end != nullptr;
+        }
+        const Child *child = find_child(inner, static_cast<std::uint8_t>(key[depth]));
+        node = child != nullptr ? child->get() : nullptr;
+        depth++;
+    }
+    return false;
+}
+
+std::vector<std::string> ArtTree::with_prefix(std::string_view prefix,
+                                              std::size_t limit) const {
+    std::vector<std::string> out;
+    const ArtNode *node = root.get();
+    std::size_t depth = 0;
+    while (node != nullptr) {
+        if (node->type == ArtType::LEAF) {
+            const std::string &key = static_cast<const Leaf &>(*node).key;
+            if (key.compare(0, prefix.size(), prefix) == 0) {
+                out.push_back(key);
+            }
+            break;
+        }
+
+        const auto &inner = static_cast<const Inner &>(*node);
+        const std::string_view rest = prefix.substr(depth);
+        const std::size_t n = std::min(rest.size(), inner.prefix.size());
+        if (rest.substr(0, n) != std::string_view(inner.prefix).substr(0, n)) {
+            break;
+        }
+        // The prefix ends within this node, everything below starts with it
+        if (rest.size() <= inner.prefix.size()) {
+            collect(*node, limit, out);
+            break;
+        }
+        depth += inner.prefix.size();
+        const Child *child =
+            find_child(inner, static_cast<std::uint8_t>(prefix[depth]));
+        node = child != nullptr ? child->get() : nullptr;
+        depth++;
+    }
+    return out;
+}
+
+std::vector<std::string> ArtTree::range(std::string_view start, std::string_view end,
+                                        std::size_t limit) const {
+    std::vector<std::string> out;
+    if (root != nullptr && start <= end) {
+        std::string path;
+        collect_range(*root, path, start, end, limit, out);
+    }
+    return out;
+}
+
+std::size_t ArtTree::size() const { return count; }
+
+void ArtTree::clear() {
+    root.reset();
+    count = 0;
+}
@@ -0,0 +1,202 @@
+#include "bitops.hpp"
+#include "cpu.hpp"
+
+#include <immintrin.h> // AVX2, POPCNT intrinsics
+
+#include <algorithm> // std::min
+#include <cstddef>   // std::size_t
+#include <cstdint>   // std::int64_t, std::uint8_t, std::uint32_t, std::uint64_t
+#include <cstring>   // std::memcpy, std::memset
+
+namespace {
+std::uint64_t popcount_scalar(const std::uint8_t *p, std::size_t n) {
+    std::uint64_t count = 0;
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, p + i, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    for (; i < n; i++) {
+        count += __builtin_popcount(p[i]);
+    }
+    return count;
+}
+
+__attribute__((target("popcnt"))) std::uint64_t popcount_hw(const std::uint8_t *p,
+                                                             std::size_t n) {
+    std::uint64_t count = 0;
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, p + i, sizeof(word));
+        count += _mm_popcnt_u64(word);
+    }
+    for (; i < n; i++) {
+        count += _mm_popcnt_u32(p[i]);
+    }
+    return count;
+}
+
+// Count the bits of each nibble with a shuffle lookup, then sum the bytes with sad
+__attribute__((target("avx2,popcnt"))) std::uint64_t popcount_avx2(const std::uint8_t *p,
+                                                                   std::size_t n) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3,
+                                            4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2,
+                                            3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        const __m256i lo = _mm256_and_si256(v, low_mask);
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                            _mm256_shuffle_epi8(lookup, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, zero));
+    }
+
+    std::uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_hw(p + i, n - i);
+}
+
+// Position of the first byte that is not skip, n if there is none
+std::size_t skip_bytes_scalar(const std::uint8_t *p, std::size_t n, std::uint8_t skip) {
+    std::size_t i = 0;
+    const std::uint64_t skip_word = skip * 0x0101010101010101ULL;
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, p + i, sizeof(word));
+        if (word != skip_word) {
+            break;
+        }
+    }
+    while (i < n && p[i] == skip) {
+        i++;
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) std::size_t
+skip_bytes_avx2(const std::uint8_t *p, std::size_t n, std::uint8_t skip) {
+    const __m256i skip_v = _mm256_set1_epi8(static_cast<char>(skip));
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        const auto same =
+            static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, skip_v)));
+        if (same != 0xFFFFFFFF) {
+            return i + __builtin_ctz(~same);
+        }
+    }
+    return i + skip_bytes_scalar(p + i, n - i, skip);
+}
+
+void apply_scalar(BitOp op, std::uint8_t *dst, const std::uint8_t *src, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        switch (op) {
+        case BitOp::AND:
+            dst[i] &= src[i];
+            break;
+        case BitOp::OR:
+            dst[i] |= src[i];
+            break;
+        case BitOp::XOR:
+            dst[i] ^= src[i];
+            break;
+        case BitOp::NOT:
+            dst[i] = ~src[i];
+            break;
+        }
+    }
+}
+
+__attribute__((target("avx2"))) void apply_avx2(BitOp op, std::uint8_t *dst,
+                                                const std::uint8_t *src, std::size_t n) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        auto *d = reinterpret_cast<__m256i *>(dst + i);
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        const __m256i v = _mm256_loadu_si256(d);
+        switch (op) {
+        case BitOp::AND:
+            _mm256_storeu_si256(d, _mm256_and_si256(v, s));
+            break;
+        case BitOp::OR:
+            _mm256_storeu_si256(d, _mm256_or_si256(v, s));
+            break;
+        case BitOp::XOR:
+            _mm256_storeu_si256(d, _mm256_xor_si256(v, s));
+            break;
+        case BitOp::NOT:
+            _mm256_storeu_si256(d, _mm256_xor_si256(s, ones));
+            break;
+        }
+    }
+    apply_scalar(op, dst + i, src + i, n - i);
+}
+
+void apply(BitOp op, std::uint8_t *dst, const std::uint8_t *src, std::size_t n) {
+    if (Cpu::has_avx2()) {
+        apply_avx2(op, dst, src, n);
+    } else {
+        apply_scalar(op, dst, src, n);
+    }
+}
+
+const std::uint8_t *bytes(std::string_view sv) {
+    return reinterpret_cast<const std::uint8_t *>(sv.data());
+}
+} // namespace
+
+std::uint64_t popcount(const std::uint8_t *p, std::size_t n) {
+    if (Cpu::has_avx2() && Cpu::has_popcnt()) {
+        return popcount_avx2(p, n);
+    }
+    if (Cpu::has_popcnt()) {
+        return popcount_hw(p, n);
+    }
+    return popcount_scalar(p, n);
+}
+
+std::int64_t bitpos(const std::uint8_t *p, std::size_t n, bool bit) {
+    const std::uint8_t skip = bit ? 0x00 : 0xFF;
+    const std::size_t i =
+        Cpu::has_avx2() ? skip_bytes_avx2(p, n, skip) : skip_bytes_scalar(p, n, skip);
+    if (i == n) {
+        return -1;
+    }
+
+    // Count the leading bits that differ from bit
+    const unsigned byte = bit ? p[i] : static_cast<std::uint8_t>(~p[i]);
+    const int lead = __builtin_clz(byte) - 24;
+    return static_cast<std::int64_t>(i * 8) + lead;
+}
+
+void bitop(BitOp op, std::uint8_t *dst, std::size_t n,
+           const std::vector<std::string_view> &srcs) {
+    std::memset(dst, 0, n);
+    if (srcs.empty()) {
+        return;
+    }
+
+    const std::string_view first = srcs[0];
+    if (op == BitOp::NOT) {
+        apply(op, dst, bytes(first), first.size());
+        return;
+    }
+
+    std::memcpy(dst, first.data(), first.size());
+    for (std::size_t k = 1; k < srcs.size(); k++) {
+        const std::size_t len = std::min(srcs[k].size(), n);
+        apply(op, dst, bytes(srcs[k]), len);
+        if (op == BitOp::AND) {
+            // AND with the zero padding
+            std::memset(dst + len, 0, n - len);
+        }
+    }
+}
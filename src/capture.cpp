@@ -0,0 +1,221 @@
+#include "capture.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <cerrno>             // errno
+#include <chrono>             // std::chrono
+#include <condition_variable> // std::condition_variable
+#include <cstdio>             // std::FILE, std::fopen, std::fwrite, std::fclose
+#include <cstring>            // std::strerror
+#include <mutex>              // std::mutex, std::lock_guard, std::unique_lock
+#include <thread>             // std::thread
+#include <utility>            // std::swap
+
+namespace {
+struct State {
+    bool enabled = false;
+    std::string path;
+    std::FILE *file = nullptr;
+    std::thread writer;
+
+    // Loop thread only
+    std::uint64_t start_us = 0;
+    std::uint64_t last_us = 0;
+    std::uint32_t conns = 0;
+    std::uint64_t records = 0;
+    std::uint64_t dropped = 0;
+    std::string encoded; // Reused for each record
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::string pending; // For the writer
+    bool stopping = false;
+    std::uint64_t written = 0;
+    bool failed = false;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+State state;
+
+std::uint64_t now_us() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+void put_varint(std::string &out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool get_varint(std::string_view &in, std::uint64_t &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        const auto byte = static_cast<unsigned char>(in[0]);
+        in.remove_prefix(1);
+        value |= std::uint64_t{byte & 0x7fU} << shift;
+        if ((byte & 0x80U) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void write_batch(std::string_view data) {
+    if (std::fwrite(data.data(), 1, data.size(), state.file) != data.size()) {
+        LOG_ERROR(fmt::format("Capture write failed: {}", std::strerror(errno)));
+        const std::lock_guard<std::mutex> lock{state.mutex};
+        state.failed = true;
+        return;
+    }
+    std::fflush(state.file);
+    const std::lock_guard<std::mutex> lock{state.mutex};
+    state.written += data.size();
+}
+
+// The writer thread, swaps the pending records out and writes them unlocked
+void work() {
+    std::string batch;
+    while (true) {
+        bool stopping = false;
+        {
+            std::unique_lock<std::mutex> lock{state.mutex};
+            state.wake.wait_for(lock, std::chrono::milliseconds(CAPTURE_FLUSH_MS),
+                                [] { return state.stopping; });
+            std::swap(batch, state.pending);
+            stopping = state.stopping;
+        }
+        if (!batch.empty()) {
+            write_batch(batch);
+            batch.clear();
+        }
+        if (stopping) {
+            return;
+        }
+    }
+}
+} // namespace
+
+namespace Capture {
+std::optional<std::string> start(const std::string &path) {
+    if (state.enabled) {
+        return fmt::format("already capturing to {}", state.path);
+    }
+    state.file = std::fopen(path.c_str(), "wb");
+    if (state.file == nullptr) {
+        return fmt::format("cannot create {}: {}", path, std::strerror(errno));
+    }
+
+    state.enabled = true;
+    state.path = path;
+    state.start_us = now_us();
+    state.last_us = 0;
+    state.conns = 0;
+    state.records = 0;
+    state.dropped = 0;
+    state.pending = CAPTURE_MAGIC;
+    state.stopping = false;
+    state.written = 0;
+    state.failed = false;
+    state.writer = std::thread{work};
+    LOG_INFO(fmt::format("Capturing requests to {}", path));
+    return std::nullopt;
+}
+
+void stop() {
+    if (!state.enabled) {
+        return;
+    }
+    {
+        const std::lock_guard<std::mutex> lock{state.mutex};
+        state.stopping = true;
+    }
+    state.wake.notify_one();
+    state.writer.join();
+    std::fclose(state.file);
+    state.file = nullptr;
+    state.enabled = false;
+    LOG_INFO(fmt::format("Captured {} requests to {}, {} dropped", state.records,
+                         state.path, state.dropped));
+}
+
+bool enabled() { return state.enabled; }
+
+void record(Connection &conn) {
+    if (!state.enabled || conn.link != Link::CLIENT) {
+        return;
+    }
+    if (conn.capture_id == 0) {
+        conn.capture_id = ++state.conns;
+    }
+
+    const std::uint64_t time = now_us() - state.start_us;
+    state.encoded.clear();
+    encode(state.encoded, time - state.last_us, conn.capture_id, conn.req->args);
+
+    const std::lock_guard<std::mutex> lock{state.mutex};
+    if (state.failed ||
+        state.pending.size() + state.encoded.size() > CAPTURE_MAX_PENDING) {
+        state.dropped++;
+        return;
+    }
+    // A dropped record keeps its time for the next one
+    state.last_us = time;
+    state.pending += state.encoded;
+    state.records++;
+}
+
+std::string info() {
+    std::uint64_t written = 0;
+    {
+        const std::lock_guard<std::mutex> lock{state.mutex};
+        written = state.written;
+    }
+    return fmt::format("capture_enabled:{}\r\ncapture_file:{}\r\ncapture_records:{}\r\n"
+                       "capture_dropped:{}\r\ncapture_connections:{}\r\n"
+                       "capture_written_bytes:{}\r\n",
+                       state.enabled ? 1 : 0, state.path, state.records, state.dropped,
+                       state.conns, written);
+}
+
+void encode(std::string &out, std::uint64_t delta_us, std::uint32_t conn,
+            const std::vector<std::string_view> &args) {
+    put_varint(out, delta_us);
+    put_varint(out, conn);
+    put_varint(out, args.size());
+    for (const auto arg : args) {
+        put_varint(out, arg.size());
+        out += arg;
+    }
+}
+
+bool decode(std::string_view &in, CaptureRecord &record) {
+    std::string_view rest = in;
+    std::uint64_t delta = 0;
+    std::uint64_t conn = 0;
+    std::uint64_t argc = 0;
+    if (!get_varint(rest, delta) || !get_varint(rest, conn) || !get_varint(rest, argc) ||
+        argc > rest.size()) {
+        return false;
+    }
+
+    record.args.resize(argc);
+    for (auto &arg : record.args) {
+        std::uint64_t len = 0;
+        if (!get_varint(rest, len) || len > rest.size()) {
+            return false;
+        }
+        arg.assign(rest.substr(0, len));
+        rest.remove_prefix(len);
+    }
+    record.time_us += delta;
+    record.conn = static_cast<std::uint32_t>(conn);
+    in = rest;
+    return true;
+}
+} // namespace Capture
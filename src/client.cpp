@@ -1,15 +1,23 @@
+#include "cluster_client.hpp"
 #include "utils.hpp"
 
 #include <fmt/core.h> // fmt::print
 
 #include <cerrno>      // errno
-#include <cstddef>     // std::byte, std::size_t
+#include <cstddef>     // std::byte, std::ptrdiff_t, std::size_t
+#include <cstdint>     // std::uint16_t, UINT16_MAX
 #include <cstring>     // std::strerror
+#include <iostream>    // std::cin
+#include <optional>    // std::optional, std::nullopt
+#include <sstream>     // std::istringstream
+#include <string>      // std::string, std::getline
 #include <string_view> // std::string_view
+#include <utility>     // std::move
 #include <vector>      // std::vector
 
-#include <netinet/in.h> // sockaddr_in, ntohs
+#include <netinet/in.h> // sockaddr_in, htons
 #include <sys/socket.h> // connect, socket
+#include <sys/un.h>     // sockaddr_un
 #include <unistd.h>     // close
 
 void print_obj(const std::byte **buf, std::size_t len, char type) {
@@ -21,11 +29,24 @@ void print_obj(const std::byte **buf, std::size_t len, char type) {
     if (type == ':') {
         long long value = 0;
         std::memcpy(&value, *buf, len);
+        // Sign extend
+        if (len < sizeof(value)) {
+            const unsigned shift = 8 * (sizeof(value) - len);
+            value = static_cast<long long>(static_cast<unsigned long long>(value) << shift) >>
+                    shift;
+        }
         fmt::print("(integer) {}\n", value);
         *buf += len;
         return;
     }
 
+    if (type == '-') {
+        std::string_view sv{reinterpret_cast<const char *>(*buf), len};
+        fmt::print("(error) {}\n", sv);
+        *buf += len;
+        return;
+    }
+
     if (type == '$') {
         std::string_view sv{reinterpret_cast<const char *>(*buf), len};
         fmt::print("\"{}\"\n", sv);
@@ -67,6 +88,68 @@ void print_response(const std::byte *buf, std::size_t len) {
     print_obj(&buf, len, type);
 }
 
+// Keys moved per round trip by -m
+constexpr std::size_t MIGRATE_BATCH = 100;
+
+void print_reply(const Reply &reply) {
+    switch (reply.type) {
+    case '*':
+        for (const auto &elem : reply.elems) {
+            print_reply(elem);
+        }
+        return;
+    case ':':
+        fmt::print("(integer) {}\n", reply.num);
+        return;
+    case '-':
+        fmt::print("(error) {}\n", reply.str);
+        return;
+    case '$':
+        fmt::print("\"{}\"\n", reply.str);
+        return;
+    default:
+        fmt::print("(nil)\n");
+    }
+}
+
+// Route through the cluster the node at port is part of. Without a command,
+// the commands on stdin, one per line, are sent as a pipeline.
+int run_cluster(std::uint16_t port, const std::vector<std::string_view> &args) {
+    ClusterClient cluster{"127.0.0.1", port};
+    if (!cluster.refresh()) {
+        LOG_ERROR("Cannot load the slot map");
+        return 1;
+    }
+    if (!args.empty()) {
+        print_reply(cluster.run(args));
+        return 0;
+    }
+
+    std::vector<std::string> words;
+    std::vector<std::size_t> ends;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::istringstream in{line};
+        for (std::string word; in >> word;) {
+            words.push_back(std::move(word));
+        }
+        ends.push_back(words.size());
+    }
+    std::vector<std::vector<std::string_view>> reqs;
+    std::size_t begin = 0;
+    for (const std::size_t end : ends) {
+        if (end > begin) {
+            reqs.emplace_back(words.begin() + static_cast<std::ptrdiff_t>(begin),
+                              words.begin() + static_cast<std::ptrdiff_t>(end));
+        }
+        begin = end;
+    }
+    for (const auto &reply : cluster.pipeline(reqs)) {
+        print_reply(reply);
+    }
+    return 0;
+}
+
 int send_req(int fd, const std::vector<std::byte> &buf) {
     return write_all(fd, buf, buf.size());
 }
@@ -90,28 +173,127 @@ int read_res(int fd) {
     return 0;
 }
 
-int main(int argc, char **argv) {
-    std::vector<std::string_view> args;
-
-    for (int i = 1; i < argc; i++) {
-        args.emplace_back(argv[i]);
-    }
-
-    auto req_buf = make_request(args);
-
+int connect_tcp(std::uint16_t port) {
     const int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd == -1) {
         LOG_ERROR(fmt::format("socket failed: {}", std::strerror(errno)));
-        return 1;
+        return -1;
     }
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(PORT);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
     if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
         LOG_ERROR(fmt::format("connect failed: {}", std::strerror(errno)));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_unix(std::string_view path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR(fmt::format("Unix socket path too long: {}", path));
+        return -1;
+    }
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        LOG_ERROR(fmt::format("socket failed: {}", std::strerror(errno)));
+        return -1;
+    }
+
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+        LOG_ERROR(fmt::format("connect failed: {}", std::strerror(errno)));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::optional<std::uint16_t> to_port(std::string_view value) {
+    const auto port = to_int64(value);
+    if (!port || *port <= 0 || *port > UINT16_MAX) {
+        LOG_ERROR(fmt::format("Invalid port: {}", value));
+        return std::nullopt;
+    }
+    return static_cast<std::uint16_t>(*port);
+}
+
+// client [-p port | -s unixsocket] command [arg]...
+// client [-p port] -c [command [arg]...]: routed through the cluster
+// client [-p port] -m slot host port: move a slot of the cluster to host:port
+int main(int argc, char **argv) {
+    std::uint16_t port = PORT;
+    std::string_view unixsocket;
+    bool cluster = false;
+    std::vector<std::string_view> migrate;
+
+    int i = 1;
+    for (; i < argc; i++) {
+        const std::string_view opt = argv[i];
+        if (opt == "-c") {
+            cluster = true;
+        } else if (opt == "-m" && i + 3 < argc) {
+            migrate.assign(argv + i + 1, argv + i + 4);
+            i += 3;
+        } else if (opt == "-p" && i + 1 < argc) {
+            const auto value = to_port(argv[++i]);
+            if (!value) {
+                return 1;
+            }
+            port = *value;
+        } else if (opt == "-s" && i + 1 < argc) {
+            unixsocket = argv[++i];
+        } else {
+            break;
+        }
+    }
+
+    std::vector<std::string_view> args;
+
+    for (; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    if ((cluster || !migrate.empty()) && !unixsocket.empty()) {
+        LOG_ERROR("A cluster is only reached over TCP");
+        return 1;
+    }
+    if (!migrate.empty()) {
+        const auto slot = to_int64(migrate[0]);
+        if (!slot || *slot < 0 || *slot >= static_cast<std::int64_t>(CLUSTER_SLOTS)) {
+            LOG_ERROR(fmt::format("Invalid slot: {}", migrate[0]));
+            return 1;
+        }
+        const auto target_port = to_port(migrate[2]);
+        if (!target_port) {
+            return 1;
+        }
+        ClusterClient client{"127.0.0.1", port};
+        const ClusterNode target{std::string(migrate[1]), *target_port};
+        const auto err =
+            client.migrate_slot(static_cast<std::uint16_t>(*slot), target, MIGRATE_BATCH);
+        if (err) {
+            LOG_ERROR(fmt::format("Cannot move slot {}: {}", *slot, *err));
+            return 1;
+        }
+        fmt::print("OK\n");
+        return 0;
+    }
+    if (cluster) {
+        return run_cluster(port, args);
+    }
+
+    auto req_buf = make_request(args);
+
+    const int fd = unixsocket.empty() ? connect_tcp(port) : connect_unix(unixsocket);
+    if (fd == -1) {
         return 1;
     }
 
@@ -0,0 +1,286 @@
+#include "cluster.hpp"
+#include "art.hpp"
+#include "hashtable.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>   // std::count_if
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint16_t, std::uint64_t, UINT16_MAX
+#include <functional>  // std::less
+#include <iterator>    // std::next
+#include <optional>    // std::optional, std::nullopt
+#include <set>         // std::set
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <utility>     // std::move
+#include <vector>      // std::vector
+
+namespace {
+// Node ids index State::nodes, this node is the first one
+constexpr std::uint16_t SELF = 0;
+constexpr std::uint16_t NO_NODE = UINT16_MAX;
+
+struct State {
+    bool enabled = false;
+    std::vector<ClusterNode> nodes;
+    // By slot, CLUSTER_SLOTS each once enabled
+    std::vector<std::uint16_t> owner;     // NO_NODE if not served
+    std::vector<std::uint16_t> migrating; // The target of a slot served here
+    std::vector<std::uint16_t> importing; // The node a slot comes from
+    std::vector<ArtTree> slot_keys;
+    // Keys handed out by take_keys, not deleted yet
+    std::set<std::string, std::less<>> moving;
+
+    std::uint64_t moved = 0;
+    std::uint64_t asked = 0;
+    std::uint64_t tryagain = 0;
+    std::uint64_t crossslot = 0;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+State state;
+
+std::uint16_t node_id(const ClusterNode &node) {
+    for (std::size_t i = 0; i < state.nodes.size(); i++) {
+        if (state.nodes[i].host == node.host && state.nodes[i].port == node.port) {
+            return static_cast<std::uint16_t>(i);
+        }
+    }
+    state.nodes.push_back(node);
+    return static_cast<std::uint16_t>(state.nodes.size() - 1);
+}
+
+std::string address(std::uint16_t id) {
+    return fmt::format("{}:{}", state.nodes[id].host, state.nodes[id].port);
+}
+
+// The moving keys of the slots from start to end stop moving
+void drop_moving(std::uint16_t start, std::uint16_t end) {
+    for (auto it = state.moving.begin(); it != state.moving.end();) {
+        const std::uint16_t slot = key_slot(*it);
+        it = slot >= start && slot <= end ? state.moving.erase(it) : std::next(it);
+    }
+}
+
+void on_key(std::string_view key, bool added) {
+    ArtTree &keys = state.slot_keys[key_slot(key)];
+    if (added) {
+        keys.insert(key);
+        return;
+    }
+    keys.remove(key);
+    if (const auto it = state.moving.find(key); it != state.moving.end()) {
+        state.moving.erase(it);
+    }
+}
+
+// The slot is served here and moving elsewhere. Keys still here are served
+// unless they are moving and the request writes, when all of them left the
+// request goes to the target.
+std::optional<std::string> while_migrating(const Connection &conn, int first, int last,
+                                           int step, std::uint16_t slot) {
+    const auto &args = conn.req->args;
+    int keys = 0;
+    int missing = 0;
+    bool busy = false;
+    for (int i = first; i <= last; i += step) {
+        keys++;
+        if (map.get(args[i]) == nullptr) {
+            missing++;
+        } else if (state.moving.find(args[i]) != state.moving.end()) {
+            busy = true;
+        }
+    }
+
+    if (missing == keys) {
+        state.asked++;
+        return fmt::format("ASK {} {}", slot, address(state.migrating[slot]));
+    }
+    if (missing > 0) {
+        state.tryagain++;
+        return "TRYAGAIN Multiple keys request during rehashing of slot";
+    }
+    if (busy && is_write(conn.req->cmd)) {
+        state.tryagain++;
+        return "TRYAGAIN Keys are moving to another node";
+    }
+    return std::nullopt;
+}
+} // namespace
+
+namespace Cluster {
+void enable(const std::string &host, std::uint16_t port) {
+    state.enabled = true;
+    state.nodes = {{host, port}};
+    state.owner.assign(CLUSTER_SLOTS, NO_NODE);
+    state.migrating.assign(CLUSTER_SLOTS, NO_NODE);
+    state.importing.assign(CLUSTER_SLOTS, NO_NODE);
+    state.slot_keys = std::vector<ArtTree>(CLUSTER_SLOTS);
+    state.moving.clear();
+
+    map.for_each([](const HashNode &node) { on_key(node.key, true); });
+    map.set_key_hook(on_key);
+    LOG_INFO(fmt::format("Cluster mode, this node is {}", address(SELF)));
+}
+
+void disable() {
+    map.set_key_hook(nullptr);
+    state = State{};
+}
+
+bool enabled() { return state.enabled; }
+
+std::optional<std::string> redirect(const Connection &conn, bool asking) {
+    const KeySpec spec = key_spec(conn.req->cmd);
+    // The replication stream and the replicas follow their primary
+    if (!state.enabled || spec.first == 0 || conn.link != Link::CLIENT) {
+        return std::nullopt;
+    }
+
+    const auto &args = conn.req->args;
+    const auto nargs = static_cast<int>(args.size());
+    const int last = spec.last < 0 ? nargs + spec.last : spec.last;
+    const std::uint16_t slot = key_slot(args[spec.first]);
+    for (int i = spec.first + spec.step; i <= last; i += spec.step) {
+        if (key_slot(args[i]) != slot) {
+            state.crossslot++;
+            return "CROSSSLOT Keys in request don't hash to the same slot";
+        }
+    }
+
+    const std::uint16_t owner = state.owner[slot];
+    if (owner == SELF) {
+        if (state.migrating[slot] == NO_NODE) {
+            return std::nullopt;
+        }
+        return while_migrating(conn, spec.first, last, spec.step, slot);
+    }
+    // Keys already moved here, or being moved by RESTORE
+    if (state.importing[slot] != NO_NODE && (asking || conn.req->cmd == Cmd::RESTORE)) {
+        return std::nullopt;
+    }
+    if (owner == NO_NODE) {
+        return "CLUSTERDOWN Hash slot not served";
+    }
+    state.moved++;
+    return fmt::format("MOVED {} {}", slot, address(owner));
+}
+
+bool migrating(std::uint16_t slot) {
+    return state.enabled && state.migrating[slot] != NO_NODE;
+}
+
+bool importing(std::uint16_t slot) {
+    return state.enabled && state.importing[slot] != NO_NODE;
+}
+
+std::vector<SlotRange> ranges() {
+    std::vector<SlotRange> out;
+    if (!state.enabled) {
+        return out;
+    }
+    for (std::size_t slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        const std::uint16_t owner = state.owner[slot];
+        if (owner == NO_NODE) {
+            continue;
+        }
+        const auto s = static_cast<std::uint16_t>(slot);
+        if (!out.empty() && out.back().end + 1 == s && state.owner[slot - 1] == owner) {
+            out.back().end = s;
+        } else {
+            out.push_back({s, s, state.nodes[owner]});
+        }
+    }
+    return out;
+}
+
+void assign(std::uint16_t start, std::uint16_t end, const ClusterNode &node) {
+    const std::uint16_t id = node_id(node);
+    for (std::size_t slot = start; slot <= end; slot++) {
+        state.owner[slot] = id;
+        state.migrating[slot] = NO_NODE;
+        state.importing[slot] = NO_NODE;
+    }
+    drop_moving(start, end);
+}
+
+std::optional<std::string> migrate(std::uint16_t slot, const ClusterNode &node) {
+    if (state.owner[slot] != SELF) {
+        return fmt::format("ERR I'm not the owner of hash slot {}", slot);
+    }
+    const std::uint16_t id = node_id(node);
+    if (id == SELF) {
+        return "ERR can't migrate a slot to this node";
+    }
+    state.migrating[slot] = id;
+    return std::nullopt;
+}
+
+std::optional<std::string> import(std::uint16_t slot, const ClusterNode &node) {
+    if (state.owner[slot] == SELF) {
+        return fmt::format("ERR I'm already the owner of hash slot {}", slot);
+    }
+    const std::uint16_t id = node_id(node);
+    if (id == SELF) {
+        return "ERR can't import a slot from this node";
+    }
+    state.importing[slot] = id;
+    return std::nullopt;
+}
+
+void stabilize(std::uint16_t slot) {
+    state.migrating[slot] = NO_NODE;
+    state.importing[slot] = NO_NODE;
+    drop_moving(slot, slot);
+}
+
+std::size_t count_keys(std::uint16_t slot) { return state.slot_keys[slot].size(); }
+
+std::vector<std::string> next_keys(std::uint16_t slot, std::size_t count) {
+    std::vector<std::string> out;
+    // Keys are taken in order and stay until deleted, so the moving keys of
+    // the slot come first
+    std::vector<std::string> keys =
+        state.slot_keys[slot].with_prefix({}, count + state.moving.size());
+    for (auto &key : keys) {
+        if (out.size() == count) {
+            break;
+        }
+        if (state.moving.find(key) == state.moving.end()) {
+            out.push_back(std::move(key));
+        }
+    }
+    return out;
+}
+
+std::vector<std::string> take_keys(std::uint16_t slot, std::size_t count) {
+    std::vector<std::string> out = next_keys(slot, count);
+    state.moving.insert(out.begin(), out.end());
+    return out;
+}
+
+bool moving(std::string_view key) { return state.moving.find(key) != state.moving.end(); }
+
+std::string info() {
+    if (!state.enabled) {
+        return "cluster_enabled:0\r\n";
+    }
+    const auto count = [](const std::vector<std::uint16_t> &slots, bool self) {
+        return std::count_if(slots.begin(), slots.end(), [self](std::uint16_t id) {
+            return self ? id == SELF : id != NO_NODE;
+        });
+    };
+    return fmt::format(
+        "cluster_enabled:1\r\ncluster_myself:{}\r\ncluster_known_nodes:{}\r\n"
+        "cluster_slots_assigned:{}\r\ncluster_slots_served:{}\r\n"
+        "cluster_slots_migrating:{}\r\ncluster_slots_importing:{}\r\n"
+        "cluster_keys_moving:{}\r\ncluster_moved:{}\r\ncluster_ask:{}\r\n"
+        "cluster_tryagain:{}\r\ncluster_crossslot:{}\r\n",
+        address(SELF), state.nodes.size(), count(state.owner, false),
+        count(state.owner, true), count(state.migrating, false),
+        count(state.importing, false), state.moving.size(), state.moved, state.asked,
+        state.tryagain, state.crossslot);
+}
+} // namespace Cluster
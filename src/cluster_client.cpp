@@ -0,0 +1,461 @@
+#include "cluster_client.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>   // std::fill, std::find, std::max, std::min
+#include <array>       // std::array
+#include <cerrno>      // errno
+#include <chrono>      // std::chrono
+#include <cstdint>     // std::int64_t, std::uint16_t, std::uint32_t, UINT16_MAX
+#include <cstring>     // std::memcpy, std::strerror
+#include <optional>    // std::optional, std::nullopt
+#include <string>      // std::string, std::to_string
+#include <thread>      // std::this_thread
+#include <utility>     // std::move
+
+#include <netdb.h>      // addrinfo, getaddrinfo, freeaddrinfo
+#include <sys/socket.h> // connect, socket
+#include <unistd.h>     // close
+
+namespace {
+constexpr std::uint16_t NO_NODE = UINT16_MAX;
+constexpr std::string_view UNREACHABLE = "ERR cannot reach ";
+
+// Commands without keys, sent to any node. BITOP has its destination second.
+constexpr std::array<std::string_view, 17> KEYLESS = {
+    "KEYS",        "SCANPREFIX", "KEYSRANGE",    "PING",    "HELLO",  "HOTKEYS",
+    "INFO",        "DEBUG",      "LATENCY",      "REPLICAOF", "SUBSCRIBE",
+    "UNSUBSCRIBE", "PSUBSCRIBE", "PUNSUBSCRIBE", "PUBLISH", "CLUSTER", "ASKING"};
+
+std::optional<std::string_view> routing_key(const std::vector<std::string_view> &args) {
+    if (args.size() < 2 ||
+        std::find(KEYLESS.begin(), KEYLESS.end(), args[0]) != KEYLESS.end()) {
+        return std::nullopt;
+    }
+    if (args[0] == "BITOP") {
+        return args.size() > 2 ? std::optional{args[2]} : std::nullopt;
+    }
+    return args[1];
+}
+
+std::string address(const ClusterNode &node) {
+    return fmt::format("{}:{}", node.host, node.port);
+}
+
+Reply unreachable(const ClusterNode &node) {
+    Reply reply;
+    reply.type = '-';
+    reply.str = std::string(UNREACHABLE) + address(node);
+    return reply;
+}
+
+// "MOVED slot host:port" or "ASK slot host:port"
+bool parse_redirect(std::string_view msg, std::uint16_t &slot, ClusterNode &node) {
+    const std::size_t space = msg.find(' ');
+    const std::size_t end = msg.find(' ', space + 1);
+    if (space == std::string_view::npos || end == std::string_view::npos) {
+        return false;
+    }
+    const std::string_view addr = msg.substr(end + 1);
+    const std::size_t colon = addr.rfind(':');
+    const auto num = to_int64(msg.substr(space + 1, end - space - 1));
+    if (colon == std::string_view::npos) {
+        return false;
+    }
+    const auto port = to_int64(addr.substr(colon + 1));
+    if (!num || *num < 0 ||
+        *num >= static_cast<std::int64_t>(CLUSTER_SLOTS) || !port || *port <= 0 ||
+        *port > UINT16_MAX) {
+        return false;
+    }
+    slot = static_cast<std::uint16_t>(*num);
+    node = {std::string(addr.substr(0, colon)), static_cast<std::uint16_t>(*port)};
+    return true;
+}
+
+bool starts_with(std::string_view str, std::string_view prefix) {
+    return str.substr(0, prefix.size()) == prefix;
+}
+
+// The request should be sent again, elsewhere or later
+bool retryable(const Reply &reply) {
+    return reply.type == '-' &&
+           (starts_with(reply.str, "MOVED ") || starts_with(reply.str, "ASK ") ||
+            starts_with(reply.str, "TRYAGAIN") || starts_with(reply.str, UNREACHABLE));
+}
+
+int connect_to(const ClusterNode &node) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs = nullptr;
+    const std::string port = std::to_string(node.port);
+    if (const int rv = getaddrinfo(node.host.c_str(), port.c_str(), &hints, &addrs);
+        rv != 0) {
+        LOG_ERROR(fmt::format("Cannot resolve {}: {}", node.host, gai_strerror(rv)));
+        return -1;
+    }
+
+    int fd = -1;
+    for (const addrinfo *addr = addrs; addr != nullptr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1) {
+        LOG_ERROR(fmt::format("Cannot connect to {}: {}", address(node),
+                              std::strerror(errno)));
+    }
+    return fd;
+}
+} // namespace
+
+bool parse_reply(std::string_view &in, Reply &reply) {
+    if (in.size() < 1 + CMD_LEN_BYTES) {
+        return false;
+    }
+    reply = Reply{};
+    reply.type = in[0];
+    std::uint32_t len = 0;
+    std::memcpy(&len, in.data() + 1, CMD_LEN_BYTES);
+    std::string_view rest = in.substr(1 + CMD_LEN_BYTES);
+    // len bytes for strings, an array takes more than a byte per element
+    if (len > rest.size()) {
+        return false;
+    }
+
+    if (reply.type == '*') {
+        reply.elems.resize(len);
+        for (auto &elem : reply.elems) {
+            if (!parse_reply(rest, elem)) {
+                return false;
+            }
+        }
+        in = rest;
+        return true;
+    }
+    if (reply.type == ':') {
+        // Little endian in as few bytes as needed, sign extended
+        if (len == 0 || len > sizeof(std::uint64_t)) {
+            return false;
+        }
+        std::uint64_t bits = 0;
+        std::memcpy(&bits, rest.data(), len);
+        const unsigned shift = 8 * (sizeof(bits) - len);
+        reply.num = static_cast<std::int64_t>(bits << shift) >> shift;
+    } else if (reply.type == '$' || reply.type == '-') {
+        reply.str = rest.substr(0, len);
+    }
+    rest.remove_prefix(len);
+    in = rest;
+    return true;
+}
+
+ClusterClient::ClusterClient(const std::string &host, std::uint16_t port)
+    : nodes{{{host, port}, -1}}, slots(CLUSTER_SLOTS, NO_NODE) {}
+
+ClusterClient::~ClusterClient() {
+    for (std::size_t id = 0; id < nodes.size(); id++) {
+        disconnect(static_cast<std::uint16_t>(id));
+    }
+}
+
+bool ClusterClient::refresh() {
+    // Nodes may be added while reading the map
+    for (std::size_t id = 0; id < nodes.size(); id++) {
+        const Reply reply = call(static_cast<std::uint16_t>(id), {"CLUSTER", "SLOTS"});
+        if (reply.type != '*') {
+            continue;
+        }
+        std::fill(slots.begin(), slots.end(), NO_NODE);
+        // start, end, host and port of each range
+        for (const auto &range : reply.elems) {
+            if (range.elems.size() != 4 || range.elems[0].num < 0 ||
+                range.elems[0].num > range.elems[1].num ||
+                range.elems[1].num >= static_cast<std::int64_t>(CLUSTER_SLOTS)) {
+                continue;
+            }
+            const std::uint16_t node = node_id(
+                {range.elems[2].str, static_cast<std::uint16_t>(range.elems[3].num)});
+            std::fill(slots.begin() + range.elems[0].num,
+                      slots.begin() + range.elems[1].num + 1, node);
+        }
+        return true;
+    }
+    return false;
+}
+
+Reply ClusterClient::run(const std::vector<std::string_view> &args) {
+    std::uint16_t id = route(args);
+    bool asking = false;
+    bool refreshed = false;
+    Reply reply;
+    for (int i = 0; i < CLUSTER_CLIENT_MAX_REDIRECTS; i++) {
+        if (asking && call(id, {"ASKING"}).type == '-') {
+            asking = false;
+        }
+        reply = call(id, args);
+        // The node may be gone, the others know where its slots went
+        if (reply.type == '-' && starts_with(reply.str, UNREACHABLE) && !refreshed) {
+            refreshed = true;
+            if (refresh()) {
+                id = route(args);
+                asking = false;
+                continue;
+            }
+        }
+        if (!follow(reply, id, asking)) {
+            break;
+        }
+    }
+    return reply;
+}
+
+std::vector<Reply> ClusterClient::pipeline(
+    const std::vector<std::vector<std::string_view>> &reqs) {
+    std::vector<Reply> replies(reqs.size());
+    std::vector<std::vector<std::size_t>> by_node(nodes.size());
+    for (std::size_t i = 0; i < reqs.size(); i++) {
+        by_node[route(reqs[i])].push_back(i);
+    }
+
+    // A chunk to every node, then their replies, until all were sent
+    std::vector<Reply> chunk_replies;
+    std::vector<bool> sent(by_node.size());
+    for (std::size_t start = 0;; start += CLUSTER_CLIENT_PIPELINE_DEPTH) {
+        bool any = false;
+        for (std::size_t id = 0; id < by_node.size(); id++) {
+            const auto &idxs = by_node[id];
+            const std::size_t end =
+                std::min(idxs.size(), start + CLUSTER_CLIENT_PIPELINE_DEPTH);
+            std::vector<std::byte> bytes;
+            for (std::size_t k = start; k < end; k++) {
+                const std::vector<std::byte> req = make_request(reqs[idxs[k]]);
+                bytes.insert(bytes.end(), req.begin(), req.end());
+            }
+            any = any || start < end;
+            sent[id] = start < end && send(static_cast<std::uint16_t>(id), bytes);
+        }
+        if (!any) {
+            break;
+        }
+
+        for (std::size_t id = 0; id < by_node.size(); id++) {
+            const auto &idxs = by_node[id];
+            const std::size_t end =
+                std::min(idxs.size(), start + CLUSTER_CLIENT_PIPELINE_DEPTH);
+            if (start >= end) {
+                continue;
+            }
+            chunk_replies.clear();
+            if (!sent[id] ||
+                !receive(static_cast<std::uint16_t>(id), end - start, chunk_replies)) {
+                disconnect(static_cast<std::uint16_t>(id));
+                chunk_replies.assign(end - start, unreachable(nodes[id].addr));
+            }
+            for (std::size_t k = start; k < end; k++) {
+                replies[idxs[k]] = std::move(chunk_replies[k - start]);
+            }
+        }
+    }
+
+    // Requests for slots that moved, in their order
+    for (std::size_t i = 0; i < reqs.size(); i++) {
+        if (retryable(replies[i])) {
+            replies[i] = run(reqs[i]);
+        }
+    }
+    return replies;
+}
+
+std::optional<std::string> ClusterClient::migrate_slot(std::uint16_t slot,
+                                                       const ClusterNode &target,
+                                                       std::size_t batch) {
+    if (!refresh()) {
+        return "cannot load the slot map";
+    }
+    const std::uint16_t source = slots[slot];
+    if (source == NO_NODE) {
+        return fmt::format("slot {} is not served", slot);
+    }
+    const std::uint16_t dest = node_id(target);
+    if (dest == source) {
+        return fmt::format("slot {} is already served by {}", slot, address(target));
+    }
+
+    const std::string slot_str = std::to_string(slot);
+    const std::string source_port = std::to_string(nodes[source].addr.port);
+    const std::string dest_port = std::to_string(target.port);
+    const std::string count = std::to_string(batch);
+    Reply reply = call(dest, {"CLUSTER", "SETSLOT", slot_str, "IMPORTING",
+                              nodes[source].addr.host, source_port});
+    if (reply.type != '-') {
+        reply = call(source, {"CLUSTER", "SETSLOT", slot_str, "MIGRATING", target.host,
+                              dest_port});
+    }
+    if (reply.type == '-') {
+        return reply.str;
+    }
+
+    // Each key then the requests that recreate it
+    std::size_t moved = 0;
+    std::vector<Reply> results;
+    while (true) {
+        reply = call(source, {"CLUSTER", "DUMPKEYS", slot_str, count});
+        if (reply.type != '*') {
+            return reply.type == '-' ? reply.str : "unexpected DUMPKEYS reply";
+        }
+        if (reply.elems.empty()) {
+            break;
+        }
+
+        std::vector<std::byte> bytes;
+        std::vector<std::string_view> keys{"CLUSTER", "DELKEYS"};
+        std::size_t nreqs = 0;
+        for (const auto &key : reply.elems) {
+            if (key.elems.empty()) {
+                return "unexpected DUMPKEYS reply";
+            }
+            keys.emplace_back(key.elems[0].str);
+            for (std::size_t i = 1; i < key.elems.size(); i++) {
+                const std::string &req = key.elems[i].str;
+                const auto *data = reinterpret_cast<const std::byte *>(req.data());
+                bytes.insert(bytes.end(), data, data + req.size());
+                nreqs++;
+            }
+        }
+        results.clear();
+        if (!send(dest, bytes) || !receive(dest, nreqs, results)) {
+            disconnect(dest);
+            return fmt::format("cannot reach {}", address(target));
+        }
+        for (const auto &result : results) {
+            if (result.type == '-') {
+                return fmt::format("{} refused a key: {}", address(target), result.str);
+            }
+        }
+
+        const Reply deleted = call(source, keys);
+        if (deleted.type == '-') {
+            return deleted.str;
+        }
+        moved += reply.elems.size();
+    }
+
+    // The target first, so that it serves the slot before the source redirects
+    std::vector<std::uint16_t> order{dest, source};
+    for (std::size_t id = 0; id < nodes.size(); id++) {
+        if (id != dest && id != source) {
+            order.push_back(static_cast<std::uint16_t>(id));
+        }
+    }
+    std::optional<std::string> err;
+    for (const std::uint16_t id : order) {
+        reply =
+            call(id, {"CLUSTER", "SETSLOT", slot_str, "NODE", target.host, dest_port});
+        if (reply.type == '-' && !err) {
+            err = fmt::format("{}: {}", address(nodes[id].addr), reply.str);
+        }
+    }
+    slots[slot] = dest;
+    LOG_INFO(fmt::format("Moved {} keys of slot {} to {}", moved, slot, address(target)));
+    return err;
+}
+
+std::uint16_t ClusterClient::node_id(const ClusterNode &addr) {
+    for (std::size_t id = 0; id < nodes.size(); id++) {
+        if (nodes[id].addr.host == addr.host && nodes[id].addr.port == addr.port) {
+            return static_cast<std::uint16_t>(id);
+        }
+    }
+    nodes.push_back({addr, -1});
+    return static_cast<std::uint16_t>(nodes.size() - 1);
+}
+
+bool ClusterClient::follow(const Reply &reply, std::uint16_t &id, bool &asking) {
+    if (reply.type != '-') {
+        return false;
+    }
+    std::uint16_t slot = 0;
+    ClusterNode node;
+    if (starts_with(reply.str, "MOVED ") && parse_redirect(reply.str, slot, node)) {
+        id = node_id(node);
+        slots[slot] = id;
+        asking = false;
+        return true;
+    }
+    if (starts_with(reply.str, "ASK ") && parse_redirect(reply.str, slot, node)) {
+        id = node_id(node);
+        asking = true;
+        return true;
+    }
+    if (starts_with(reply.str, "TRYAGAIN")) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_CLIENT_RETRY_MS));
+        return true;
+    }
+    return false;
+}
+
+std::uint16_t ClusterClient::route(const std::vector<std::string_view> &args) const {
+    const auto key = routing_key(args);
+    if (!key) {
+        return 0;
+    }
+    const std::uint16_t id = slots[key_slot(*key)];
+    return id == NO_NODE ? 0 : id;
+}
+
+bool ClusterClient::send(std::uint16_t id, const std::vector<std::byte> &bytes) {
+    Node &node = nodes[id];
+    if (node.fd == -1) {
+        node.fd = connect_to(node.addr);
+    }
+    return node.fd != -1 && write_all(node.fd, bytes, bytes.size()) == 0;
+}
+
+bool ClusterClient::receive(std::uint16_t id, std::size_t count,
+                            std::vector<Reply> &replies) {
+    std::vector<std::byte> buf(CMD_LEN_BYTES);
+    for (std::size_t i = 0; i < count; i++) {
+        std::uint32_t len = 0;
+        if (read_all(nodes[id].fd, buf, CMD_LEN_BYTES) != 0) {
+            return false;
+        }
+        std::memcpy(&len, buf.data(), CMD_LEN_BYTES);
+        buf.resize(std::max<std::size_t>(len, CMD_LEN_BYTES));
+        if (read_all(nodes[id].fd, buf, len) != 0) {
+            return false;
+        }
+        std::string_view in = to_view(buf, len);
+        Reply reply;
+        if (!parse_reply(in, reply)) {
+            return false;
+        }
+        replies.push_back(std::move(reply));
+    }
+    return true;
+}
+
+Reply ClusterClient::call(std::uint16_t id, const std::vector<std::string_view> &args) {
+    std::vector<Reply> replies;
+    if (!send(id, make_request(args)) || !receive(id, 1, replies)) {
+        disconnect(id);
+        return unreachable(nodes[id].addr);
+    }
+    return std::move(replies[0]);
+}
+
+void ClusterClient::disconnect(std::uint16_t id) {
+    if (nodes[id].fd != -1) {
+        close(nodes[id].fd);
+        nodes[id].fd = -1;
+    }
+}
@@ -1,62 +1,422 @@
 #include "command.hpp"
+#include "alloc.hpp"
+#include "art.hpp"
+#include "bitops.hpp"
+#include "capture.hpp"
+#include "cluster.hpp"
+#include "compress.hpp"
 #include "connection.hpp"
+#include "defrag.hpp"
+#include "evict.hpp"
 #include "hashtable.hpp"
+#include "hotkeys.hpp"
+#include "latency.hpp"
+#include "pubsub.hpp"
+#include "replication.hpp"
+#include "tier.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 #include <cstddef>
 #include <fmt/core.h> // fmt::format
 
-#include <cstring>     // std::memcpy
-#include <memory>      // std::unique_ptr
+#include <algorithm>   // std::sort, std::all_of, std::remove_if, std::max, std::min
+#include <array>       // std::array
+#include <charconv>    // std::to_chars
+#include <cstdint>     // std::int64_t, std::uint8_t, std::uint64_t
+#include <limits>      // std::numeric_limits
+#include <optional>    // std::optional, std::nullopt
+#include <memory>      // std::unique_ptr, std::make_shared
 #include <string>      // std::string
 #include <string_view> // std::string_view
+#include <utility>     // std::move
+#include <variant>     // std::get, std::get_if, std::holds_alternative
 #include <vector>
 
+namespace {
+constexpr std::string_view WRONGTYPE_ERR =
+    "WRONGTYPE Operation against a key holding the wrong kind of value";
+constexpr std::string_view NOT_INT_ERR = "ERR value is not an integer or out of range";
+constexpr std::string_view OVERFLOW_ERR = "ERR increment or decrement would overflow";
+constexpr std::string_view SYNTAX_ERR = "ERR syntax error";
+
+// Reported by HELLO
+constexpr std::string_view SERVER_NAME = "myredis";
+constexpr std::string_view SERVER_VERSION = "1.0.0";
+
+// Same limit as Redis, bitmaps up to 512 MiB
+constexpr std::int64_t BITMAP_MAX_BITS = 1LL << 32;
+
+// Long enough for INT64_MIN
+using IntBuf = std::array<char, 20>;
+
+// The nodes of the keys of MGET and MSET, kept between requests
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::vector<HashNode *> batch_nodes;
+
+std::string_view format_int(std::int64_t value, IntBuf &buf) {
+    const auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), value);
+    return {buf.data(), static_cast<std::size_t>(end - buf.data())};
+}
+
+// Look up key, counting it as an access for eviction
+HashNode *lookup_key(std::string_view key) {
+    HashNode *node = map.get(key);
+    if (node != nullptr) {
+        touch_key(node, false);
+    }
+    return node;
+}
+
+HashNode *set_key(std::string key, Value value) {
+    const std::size_t size = map.size();
+    HashNode *node = map.set(std::move(key), std::move(value));
+    touch_key(node, map.size() > size);
+    return node;
+}
+
+// Strings that hold a canonical integer are stored as one, large strings that
+// compress well are stored compressed
+Value to_value(std::string_view str) {
+    if (const auto num = to_int64(str)) {
+        return *num;
+    }
+    if (auto packed = Compress::pack(str)) {
+        return std::move(*packed);
+    }
+    return make_str(str);
+}
+
+// Room for a string value that is not stored as one
+struct StrBuf {
+    IntBuf num{};
+    std::string unpacked;
+};
+
+void incr_by(std::unique_ptr<Connection> &conn, std::int64_t by) {
+    const std::string_view key = conn->req->args[1];
+    HashNode *node = lookup_key(key);
+    if (node == nullptr) {
+        set_key(std::string(key), by);
+        add_reply_int(conn, by);
+        return;
+    }
+
+    // A string can hold an integer too once written by SETBIT or RESTORE
+    if (const auto *str = std::get_if<SharedStr>(&node->value)) {
+        if (const auto value = to_int64(**str)) {
+            node->value = *value;
+        }
+    }
+    auto *num = std::get_if<std::int64_t>(&node->value);
+    if (num == nullptr) {
+        const bool is_str = std::holds_alternative<SharedStr>(node->value) ||
+                            std::holds_alternative<PackedStr>(node->value);
+        add_reply_err(conn, is_str ? NOT_INT_ERR : WRONGTYPE_ERR);
+        return;
+    }
+
+    std::int64_t result = 0;
+    if (__builtin_add_overflow(*num, by, &result)) {
+        add_reply_err(conn, OVERFLOW_ERR);
+        return;
+    }
+    *num = result;
+
+    LOG_DEBUG(fmt::format("INCRBY Key: {}, Value: {}", key, result));
+
+    add_reply_int(conn, result);
+}
+
+// Returns false and replies with an error if key holds something other than a T
+template <typename T>
+bool lookup(std::unique_ptr<Connection> &conn, const std::string &key, T **value) {
+    HashNode *node = lookup_key(key);
+    *value = nullptr;
+    if (node == nullptr) {
+        return true;
+    }
+
+    *value = std::get_if<T>(&node->value);
+    if (*value == nullptr) {
+        add_reply_err(conn, WRONGTYPE_ERR);
+        return false;
+    }
+    return true;
+}
+
+// Returns the value of key, adding an empty T if it is missing
+template <typename T>
+T *lookup_or_add(std::unique_ptr<Connection> &conn, const std::string &key) {
+    T *value = nullptr;
+    if (!lookup(conn, key, &value)) {
+        return nullptr;
+    }
+    if (value == nullptr) {
+        value = &std::get<T>(set_key(key, T{})->value);
+    }
+    return value;
+}
+
+// Returns false and replies with an error if node holds something other than a string.
+// Integers are formatted into buf, compressed strings decompressed into it.
+bool str_value(std::unique_ptr<Connection> &conn, const HashNode *node,
+               std::string_view *value, StrBuf &buf) {
+    if (const auto *str = std::get_if<SharedStr>(&node->value)) {
+        *value = **str;
+    } else if (const auto *num = std::get_if<std::int64_t>(&node->value)) {
+        *value = format_int(*num, buf.num);
+    } else if (const auto *packed = std::get_if<PackedStr>(&node->value)) {
+        buf.unpacked = Compress::unpack(*packed);
+        *value = buf.unpacked;
+    } else {
+        add_reply_err(conn, WRONGTYPE_ERR);
+        return false;
+    }
+    return true;
+}
+
+// Same as str_value, a missing key is an empty string
+bool lookup_str(std::unique_ptr<Connection> &conn, const std::string &key,
+                std::string_view *value, StrBuf &buf) {
+    const HashNode *node = lookup_key(key);
+    *value = {};
+    return node == nullptr || str_value(conn, node, value, buf);
+}
+
+// Returns the string of key for modification, integers and compressed strings are
+// converted to strings. A string still referenced by a pending reply is copied first.
+std::string *lookup_or_add_str(std::unique_ptr<Connection> &conn, const std::string &key) {
+    HashNode *node = lookup_key(key);
+    if (node == nullptr) {
+        node = set_key(key, make_str({}));
+    }
+
+    if (const auto *num = std::get_if<std::int64_t>(&node->value)) {
+        IntBuf buf{};
+        node->value = make_str(format_int(*num, buf));
+    } else if (const auto *packed = std::get_if<PackedStr>(&node->value)) {
+        node->value = std::make_shared<std::string>(Compress::unpack(*packed));
+    }
+
+    auto *str = std::get_if<SharedStr>(&node->value);
+    if (str == nullptr) {
+        add_reply_err(conn, WRONGTYPE_ERR);
+        return nullptr;
+    }
+    if (str->use_count() > 1) {
+        *str = std::make_shared<std::string>(**str);
+    }
+    return str->get();
+}
+
+// [kind, name, subscriptions of conn], the reply for each channel or pattern. A nil
+// name for unsubscribing from everything while subscribed to nothing.
+void reply_subscription(std::unique_ptr<Connection> &conn, std::string_view kind,
+                        std::optional<std::string_view> name) {
+    const std::size_t pos = begin_arr(conn);
+    add_reply_raw(conn, kind);
+    if (name) {
+        add_reply_raw(conn, *name);
+    } else {
+        add_reply_raw(conn, {}, ObjType::NIL);
+    }
+    add_reply_raw_int(conn, conn->subscriptions);
+    end_push(conn, pos, 3);
+}
+
+// UNSUBSCRIBE and PUNSUBSCRIBE, from the arguments or from everything
+template <typename Unsubscribe>
+void unsubscribe_from(std::unique_ptr<Connection> &conn, std::string_view kind,
+                      std::vector<std::string> all, Unsubscribe unsubscribe) {
+    const auto &args = conn->req->args;
+    if (args.size() > 1) {
+        for (std::size_t i = 1; i < args.size(); i++) {
+            unsubscribe(*conn, args[i]);
+            reply_subscription(conn, kind, args[i]);
+        }
+        return;
+    }
+
+    if (all.empty()) {
+        reply_subscription(conn, kind, std::nullopt);
+    }
+    for (const auto &name : all) {
+        unsubscribe(*conn, name);
+        reply_subscription(conn, kind, name);
+    }
+}
+
+// Clamp the byte range [start, end] of a len bytes string, negative indexes count
+// from the end. Returns false if the range is empty.
+bool byte_range(std::size_t len, std::int64_t start, std::int64_t end, std::size_t *from,
+                std::size_t *to) {
+    const auto n = static_cast<std::int64_t>(len);
+    start = start < 0 ? std::max<std::int64_t>(start + n, 0) : start;
+    end = end < 0 ? end + n : std::min(end, n - 1);
+    if (start > end || start >= n) {
+        return false;
+    }
+    *from = static_cast<std::size_t>(start);
+    *to = static_cast<std::size_t>(end);
+    return true;
+}
+
+const std::uint8_t *to_bits(std::string_view sv) {
+    return reinterpret_cast<const std::uint8_t *>(sv.data());
+}
+
+// Look up all the sets in args[1..], missing keys are returned as nullptr
+bool lookup_sets(std::unique_ptr<Connection> &conn, std::vector<Set *> &sets) {
+    const auto &args = conn->req->args;
+    for (std::size_t i = 1; i < args.size(); i++) {
+        Set *set = nullptr;
+        if (!lookup(conn, std::string(args[i]), &set)) {
+            return false;
+        }
+        sets.push_back(set);
+    }
+    return true;
+}
+
+void reply_members(std::unique_ptr<Connection> &conn,
+                   const std::vector<std::string> &members) {
+    const std::size_t pos = begin_arr(conn);
+    for (const auto &member : members) {
+        add_reply_raw(conn, member);
+    }
+    end_arr(conn, pos, members.size());
+}
+
+// Parse the optional LIMIT n at args[pos], 0 for no limit
+bool parse_limit(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t *limit) {
+    const auto &args = conn->req->args;
+    *limit = 0;
+    if (args.size() == pos) {
+        return true;
+    }
+    if (args.size() != pos + 2 || args[pos] != "LIMIT") {
+        add_reply_err(conn, SYNTAX_ERR);
+        return false;
+    }
+    const auto n = to_int64(args[pos + 1]);
+    if (!n || *n < 0) {
+        add_reply_err(conn, NOT_INT_ERR);
+        return false;
+    }
+    *limit = static_cast<std::size_t>(*n);
+    return true;
+}
+
+// Replies with an error and returns false if arg is not a hash slot
+bool parse_slot(std::unique_ptr<Connection> &conn, std::string_view arg,
+                std::uint16_t *slot) {
+    const auto n = to_int64(arg);
+    if (!n || *n < 0 || *n >= static_cast<std::int64_t>(CLUSTER_SLOTS)) {
+        add_reply_err(conn, fmt::format("ERR Invalid or out of range slot '{}'", arg));
+        return false;
+    }
+    *slot = static_cast<std::uint16_t>(*n);
+    return true;
+}
+
+bool parse_node(std::unique_ptr<Connection> &conn, std::string_view host,
+                std::string_view port, ClusterNode *node) {
+    const auto n = to_int64(port);
+    if (!n || *n <= 0 || *n > UINT16_MAX) {
+        add_reply_err(conn, fmt::format("ERR Invalid port '{}'", port));
+        return false;
+    }
+    *node = {std::string(host), static_cast<std::uint16_t>(*n)};
+    return true;
+}
+
+const ArtTree *ordered_index(std::unique_ptr<Connection> &conn) {
+    const ArtTree *index = map.index();
+    if (index == nullptr) {
+        add_reply_err(conn, "ERR the ordered index is off, see the ordered-index option");
+    }
+    return index;
+}
+
+void reply_members(std::unique_ptr<Connection> &conn,
+                   const std::vector<std::int64_t> &members) {
+    const std::size_t pos = begin_arr(conn);
+    for (const auto member : members) {
+        IntBuf buf{};
+        add_reply_raw(conn, format_int(member, buf));
+    }
+    end_arr(conn, pos, members.size());
+}
+} // namespace
+
 void do_unknown(std::unique_ptr<Connection> &conn) {
-    static constexpr std::string_view msg = "Unknown command";
-    add_reply(conn, to_bytes(msg));
+    add_reply_err(conn, fmt::format("ERR unknown command '{}'", conn->req->args[0]));
     LOG_ERROR(fmt::format("Received unknown command {}", conn->req->args[0]));
 }
 
 void do_get(std::unique_ptr<Connection> &conn) {
-    const std::string key(conn->req->args[1]);
-    if (map.get(key) == nullptr) {
+    const std::string_view key = conn->req->args[1];
+    HashNode *node = lookup_key(key);
+    if (node == nullptr) {
         add_reply(conn, {}, ObjType::NIL);
         return;
     }
 
-    std::string_view value = map.get(key)->value;
+    if (const auto *str = std::get_if<SharedStr>(&node->value)) {
+        LOG_DEBUG(fmt::format("GET Key: {}, Value: {}", key, **str));
+        add_reply_str(conn, *str);
+        return;
+    }
+    if (const auto *packed = std::get_if<PackedStr>(&node->value)) {
+        LOG_DEBUG(fmt::format("GET Key: {}, compressed len: {}", key, packed->len));
+        Compress::unpack(*packed, add_reply_space(conn, packed->len));
+        return;
+    }
+
+    StrBuf buf;
+    std::string_view value;
+    if (!str_value(conn, node, &value, buf)) {
+        return;
+    }
 
-    LOG_INFO(fmt::format("GET Key: {}, Value: {}", key, value));
+    LOG_DEBUG(fmt::format("GET Key: {}, Value: {}", key, value));
 
-    add_reply(conn, to_bytes(value));
+    add_reply(conn, value);
 }
 
 void do_set(std::unique_ptr<Connection> &conn) {
-    const std::string key(conn->req->args[1]);
-    const std::string value(conn->req->args[2]);
+    const std::string_view key = conn->req->args[1];
+    const std::string_view value = conn->req->args[2];
 
-    map.set(key, value);
+    // Overwrite a string nobody else references in place, reusing its buffer,
+    // unless the new one is to be compressed
+    HashNode *node = lookup_key(key);
+    auto *str = node != nullptr ? std::get_if<SharedStr>(&node->value) : nullptr;
+    const bool packs = Compress::min_size() != 0 && value.size() >= Compress::min_size();
+    if (str != nullptr && str->use_count() == 1 && !packs && !to_int64(value)) {
+        (*str)->assign(value);
+    } else if (node != nullptr) {
+        node->value = to_value(value);
+    } else {
+        set_key(std::string(key), to_value(value));
+    }
 
-    LOG_INFO(fmt::format("SET Key: {}, Value: {}", key, value));
+    LOG_DEBUG(fmt::format("SET Key: {}, Value: {}", key, value));
 
-    add_reply(conn, to_bytes("OK"));
+    add_reply_status(conn, "OK");
 }
 
 void do_del(std::unique_ptr<Connection> &conn) {
-    const std::string key(conn->req->args[1]);
-    if (map.get(key) == nullptr) {
-        std::vector<std::byte> buf{std::byte(0)};
-        add_reply(conn, buf, ObjType::INT);
-        return;
+    const auto &args = conn->req->args;
+    std::int64_t removed = 0;
+    for (std::size_t i = 1; i < args.size(); i++) {
+        removed += map.remove(args[i]) ? 1 : 0;
     }
 
-    map.remove(key);
-
-    LOG_INFO(fmt::format("DEL Key: {}", key));
+    LOG_DEBUG(fmt::format("DEL Keys: {}, removed: {}", args.size() - 1, removed));
 
-    std::vector<std::byte> buf{std::byte(1)};
-    add_reply(conn, buf, ObjType::INT);
+    add_reply_int(conn, removed);
 }
 
 void do_keys(std::unique_ptr<Connection> &conn) {
@@ -67,28 +427,1090 @@ void do_keys(std::unique_ptr<Connection> &conn) {
 
     const std::vector<std::string> keys = map.keys();
 
-    LOG_INFO(fmt::format("KEYS: {}...", keys[0]));
+    LOG_DEBUG(fmt::format("KEYS: {}...", keys[0]));
+
+    reply_members(conn, keys);
+}
+
+void do_scanprefix(std::unique_ptr<Connection> &conn) {
+    const ArtTree *index = ordered_index(conn);
+    std::size_t limit = 0;
+    if (index == nullptr || !parse_limit(conn, 2, &limit)) {
+        return;
+    }
+    reply_members(conn, index->with_prefix(conn->req->args[1], limit));
+}
+
+void do_keysrange(std::unique_ptr<Connection> &conn) {
+    const ArtTree *index = ordered_index(conn);
+    std::size_t limit = 0;
+    if (index == nullptr || !parse_limit(conn, 3, &limit)) {
+        return;
+    }
+    const auto &args = conn->req->args;
+    reply_members(conn, index->range(args[1], args[2], limit));
+}
+
+void do_sadd(std::unique_ptr<Connection> &conn) {
+    const std::string key(conn->req->args[1]);
+    Set *set = lookup_or_add<Set>(conn, key);
+    if (set == nullptr) {
+        return;
+    }
+
+    const std::vector<std::string_view> members(conn->req->args.begin() + 2,
+                                                conn->req->args.end());
+    const std::size_t added = set->add(members);
+
+    LOG_DEBUG(fmt::format("SADD Key: {}, added: {}", key, added));
+
+    add_reply_int(conn, static_cast<std::int64_t>(added));
+}
+
+void do_srem(std::unique_ptr<Connection> &conn) {
+    const std::string key(conn->req->args[1]);
+    Set *set = nullptr;
+    if (!lookup(conn, key, &set)) {
+        return;
+    }
+
+    std::size_t removed = 0;
+    if (set != nullptr) {
+        for (std::size_t i = 2; i < conn->req->args.size(); i++) {
+            removed += set->remove(conn->req->args[i]) ? 1 : 0;
+        }
+        if (set->size() == 0) {
+            map.remove(key);
+        }
+    }
+
+    LOG_DEBUG(fmt::format("SREM Key: {}, removed: {}", key, removed));
+
+    add_reply_int(conn, static_cast<std::int64_t>(removed));
+}
+
+void do_sismember(std::unique_ptr<Connection> &conn) {
+    Set *set = nullptr;
+    if (!lookup(conn, std::string(conn->req->args[1]), &set)) {
+        return;
+    }
+
+    const bool found = set != nullptr && set->contains(conn->req->args[2]);
+    add_reply_int(conn, found ? 1 : 0);
+}
+
+void do_scard(std::unique_ptr<Connection> &conn) {
+    Set *set = nullptr;
+    if (!lookup(conn, std::string(conn->req->args[1]), &set)) {
+        return;
+    }
+
+    const std::size_t size = set == nullptr ? 0 : set->size();
+    add_reply_int(conn, static_cast<std::int64_t>(size));
+}
+
+void do_sinter(std::unique_ptr<Connection> &conn) {
+    std::vector<Set *> sets;
+    if (!lookup_sets(conn, sets)) {
+        return;
+    }
+
+    // The intersection with a missing key is empty
+    for (const Set *set : sets) {
+        if (set == nullptr) {
+            reply_members(conn, std::vector<std::string>{});
+            return;
+        }
+    }
+
+    // Start from the smallest set to keep the intermediate result small
+    std::sort(sets.begin(), sets.end(),
+              [](const Set *a, const Set *b) { return a->size() < b->size(); });
+
+    const bool all_ints = std::all_of(sets.begin(), sets.end(),
+                                      [](const Set *set) { return set->is_intset(); });
+
+    if (all_ints && sets.size() > 1) {
+        std::vector<std::int64_t> result;
+        IntSet::intersect(sets[0]->ints(), sets[1]->ints(), result);
+        for (std::size_t i = 2; i < sets.size(); i++) {
+            const IntSet &ints = sets[i]->ints();
+            result.erase(std::remove_if(result.begin(), result.end(),
+                                        [&](std::int64_t v) { return !ints.contains(v); }),
+                         result.end());
+        }
+
+        LOG_DEBUG(fmt::format("SINTER: {} sets, {} members", sets.size(), result.size()));
+
+        reply_members(conn, result);
+        return;
+    }
+
+    std::vector<std::string> result;
+    for (auto &member : sets[0]->members()) {
+        bool in_all = true;
+        for (std::size_t i = 1; i < sets.size() && in_all; i++) {
+            in_all = sets[i]->contains(member);
+        }
+        if (in_all) {
+            result.push_back(std::move(member));
+        }
+    }
+
+    LOG_DEBUG(fmt::format("SINTER: {} sets, {} members", sets.size(), result.size()));
+
+    reply_members(conn, result);
+}
+
+void do_sunion(std::unique_ptr<Connection> &conn) {
+    std::vector<Set *> sets;
+    if (!lookup_sets(conn, sets)) {
+        return;
+    }
+
+    Set result;
+    for (Set *set : sets) {
+        if (set != nullptr) {
+            result.merge(*set);
+        }
+    }
+
+    LOG_DEBUG(fmt::format("SUNION: {} sets, {} members", sets.size(), result.size()));
+
+    reply_members(conn, result.members());
+}
+
+void do_sdiff(std::unique_ptr<Connection> &conn) {
+    std::vector<Set *> sets;
+    if (!lookup_sets(conn, sets)) {
+        return;
+    }
+
+    std::vector<std::string> result;
+    if (sets[0] != nullptr) {
+        for (auto &member : sets[0]->members()) {
+            bool in_other = false;
+            for (std::size_t i = 1; i < sets.size() && !in_other; i++) {
+                in_other = sets[i] != nullptr && sets[i]->contains(member);
+            }
+            if (!in_other) {
+                result.push_back(std::move(member));
+            }
+        }
+    }
+
+    LOG_DEBUG(fmt::format("SDIFF: {} sets, {} members", sets.size(), result.size()));
+
+    reply_members(conn, result);
+}
 
-    auto *reserved = &conn->wbuf[conn->wbuf_size];
-    // Reserve space for the protocol header and the response header
-    conn->wbuf_size += CMD_LEN_BYTES + sizeof(ObjType) + CMD_LEN_BYTES;
+void do_incr(std::unique_ptr<Connection> &conn) { incr_by(conn, 1); }
+
+void do_decr(std::unique_ptr<Connection> &conn) { incr_by(conn, -1); }
+
+void do_incrby(std::unique_ptr<Connection> &conn) {
+    const auto by = to_int64(conn->req->args[2]);
+    if (!by) {
+        add_reply_err(conn, NOT_INT_ERR);
+        return;
+    }
+    incr_by(conn, *by);
+}
+
+void do_decrby(std::unique_ptr<Connection> &conn) {
+    const auto by = to_int64(conn->req->args[2]);
+    if (!by || *by == std::numeric_limits<std::int64_t>::min()) {
+        add_reply_err(conn, NOT_INT_ERR);
+        return;
+    }
+    incr_by(conn, -*by);
+}
+
+void do_pfadd(std::unique_ptr<Connection> &conn) {
+    const std::string key(conn->req->args[1]);
+    const bool created = map.get(key) == nullptr;
+    HyperLogLog *hll = lookup_or_add<HyperLogLog>(conn, key);
+    if (hll == nullptr) {
+        return;
+    }
 
+    bool changed = created;
+    for (std::size_t i = 2; i < conn->req->args.size(); i++) {
+        changed = hll->add(conn->req->args[i]) || changed;
+    }
+
+    LOG_DEBUG(fmt::format("PFADD Key: {}, changed: {}", key, changed));
+
+    add_reply_int(conn, changed ? 1 : 0);
+}
+
+void do_pfcount(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+
+    if (args.size() == 2) {
+        HyperLogLog *hll = nullptr;
+        if (!lookup(conn, std::string(args[1]), &hll)) {
+            return;
+        }
+        const std::uint64_t card = hll == nullptr ? 0 : hll->count();
+        add_reply_int(conn, static_cast<std::int64_t>(card));
+        return;
+    }
+
+    // The cardinality of the union
+    HLLRegisters regs{};
+    for (std::size_t i = 1; i < args.size(); i++) {
+        HyperLogLog *hll = nullptr;
+        if (!lookup(conn, std::string(args[i]), &hll)) {
+            return;
+        }
+        if (hll != nullptr) {
+            hll->merge_into(regs);
+        }
+    }
+
+    add_reply_int(conn, static_cast<std::int64_t>(HyperLogLog::estimate(regs)));
+}
+
+void do_pfmerge(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+
+    HLLRegisters regs{};
+    for (std::size_t i = 1; i < args.size(); i++) {
+        HyperLogLog *hll = nullptr;
+        if (!lookup(conn, std::string(args[i]), &hll)) {
+            return;
+        }
+        if (hll != nullptr) {
+            hll->merge_into(regs);
+        }
+    }
+
+    const std::string key(args[1]);
+    HyperLogLog *dest = lookup_or_add<HyperLogLog>(conn, key);
+    dest->assign(regs);
+
+    LOG_DEBUG(fmt::format("PFMERGE Key: {}, sources: {}", key, args.size() - 2));
+
+    add_reply_status(conn, "OK");
+}
+
+void do_setbit(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    const auto offset = to_int64(args[2]);
+    if (!offset || *offset < 0 || *offset >= BITMAP_MAX_BITS) {
+        add_reply_err(conn, "ERR bit offset is not an integer or out of range");
+        return;
+    }
+    if (args[3] != "0" && args[3] != "1") {
+        add_reply_err(conn, "ERR bit is not an integer or out of range");
+        return;
+    }
+
+    const std::string key(args[1]);
+    std::string *str = lookup_or_add_str(conn, key);
+    if (str == nullptr) {
+        return;
+    }
+
+    const auto byte = static_cast<std::size_t>(*offset >> 3);
+    if (byte >= str->size()) {
+        // Grow geometrically, setting increasing offsets must not copy every time
+        if (byte >= str->capacity()) {
+            str->reserve(std::max(byte + 1, 2 * str->capacity()));
+        }
+        str->resize(byte + 1);
+    }
+
+    const unsigned shift = 7 - (*offset & 7);
+    auto bits = static_cast<unsigned char>((*str)[byte]);
+    const unsigned old = (bits >> shift) & 1U;
+    bits = args[3] == "1" ? bits | (1U << shift) : bits & ~(1U << shift);
+    (*str)[byte] = static_cast<char>(bits);
+
+    LOG_DEBUG(fmt::format("SETBIT Key: {}, offset: {}", key, *offset));
+
+    add_reply_int(conn, old);
+}
+
+void do_getbit(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    const auto offset = to_int64(args[2]);
+    if (!offset || *offset < 0 || *offset >= BITMAP_MAX_BITS) {
+        add_reply_err(conn, "ERR bit offset is not an integer or out of range");
+        return;
+    }
+
+    StrBuf buf;
+    std::string_view value;
+    if (!lookup_str(conn, std::string(args[1]), &value, buf)) {
+        return;
+    }
+
+    const auto byte = static_cast<std::size_t>(*offset >> 3);
+    unsigned bit = 0;
+    if (byte < value.size()) {
+        bit = (static_cast<unsigned char>(value[byte]) >> (7 - (*offset & 7))) & 1U;
+    }
+    add_reply_int(conn, bit);
+}
+
+void do_bitcount(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (args.size() != 2 && args.size() != 4) {
+        add_reply_err(conn, SYNTAX_ERR);
+        return;
+    }
+
+    StrBuf buf;
+    std::string_view value;
+    if (!lookup_str(conn, std::string(args[1]), &value, buf)) {
+        return;
+    }
+
+    if (value.empty()) {
+        add_reply_int(conn, 0);
+        return;
+    }
+
+    std::size_t from = 0;
+    std::size_t to = value.size() - 1;
+    if (args.size() == 4) {
+        const auto start = to_int64(args[2]);
+        const auto end = to_int64(args[3]);
+        if (!start || !end) {
+            add_reply_err(conn, NOT_INT_ERR);
+            return;
+        }
+        if (!byte_range(value.size(), *start, *end, &from, &to)) {
+            add_reply_int(conn, 0);
+            return;
+        }
+    }
+
+    const std::uint64_t count = popcount(to_bits(value) + from, to - from + 1);
+    add_reply_int(conn, static_cast<std::int64_t>(count));
+}
+
+void do_bitpos(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (args.size() > 5) {
+        add_reply_err(conn, SYNTAX_ERR);
+        return;
+    }
+    if (args[2] != "0" && args[2] != "1") {
+        add_reply_err(conn, "ERR The bit argument must be 1 or 0.");
+        return;
+    }
+    const bool bit = args[2] == "1";
+
+    StrBuf buf;
+    std::string_view value;
+    if (!lookup_str(conn, std::string(args[1]), &value, buf)) {
+        return;
+    }
+
+    if (value.empty()) {
+        add_reply_int(conn, bit ? -1 : 0);
+        return;
+    }
+
+    std::int64_t start = 0;
+    std::int64_t end = -1;
+    for (std::size_t i = 3; i < args.size(); i++) {
+        const auto n = to_int64(args[i]);
+        if (!n) {
+            add_reply_err(conn, NOT_INT_ERR);
+            return;
+        }
+        (i == 3 ? start : end) = *n;
+    }
+
+    std::size_t from = 0;
+    std::size_t to = 0;
+    if (!byte_range(value.size(), start, end, &from, &to)) {
+        add_reply_int(conn, -1);
+        return;
+    }
+
+    std::int64_t pos = bitpos(to_bits(value) + from, to - from + 1, bit);
+    if (pos != -1) {
+        pos += static_cast<std::int64_t>(from * 8);
+    } else if (!bit && args.size() < 5) {
+        // Without an explicit end, the string is considered padded with zeros
+        pos = static_cast<std::int64_t>((to + 1) * 8);
+    }
+    add_reply_int(conn, pos);
+}
+
+void do_bitop(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+
+    BitOp op = BitOp::AND;
+    if (args[1] == "AND") {
+        op = BitOp::AND;
+    } else if (args[1] == "OR") {
+        op = BitOp::OR;
+    } else if (args[1] == "XOR") {
+        op = BitOp::XOR;
+    } else if (args[1] == "NOT") {
+        op = BitOp::NOT;
+    } else {
+        add_reply_err(conn, SYNTAX_ERR);
+        return;
+    }
+
+    const std::size_t nsrcs = args.size() - 3;
+    if (op == BitOp::NOT && nsrcs != 1) {
+        add_reply_err(conn, "ERR BITOP NOT must be called with a single source key.");
+        return;
+    }
+
+    // Sized up front, srcs may point into the buffers
+    std::vector<StrBuf> bufs(nsrcs);
+    std::vector<std::string_view> srcs(nsrcs);
     std::size_t len = 0;
-    for (const auto &key : keys) {
-        add_reply_raw(conn, to_bytes(key));
-        len += key.size();
-        LOG_DEBUG(fmt::format("key: {}, len: {}", key, len));
+    for (std::size_t i = 0; i < nsrcs; i++) {
+        if (!lookup_str(conn, std::string(args[i + 3]), &srcs[i], bufs[i])) {
+            return;
+        }
+        len = std::max(len, srcs[i].size());
+    }
+
+    std::string result(len, '\0');
+    bitop(op, reinterpret_cast<std::uint8_t *>(result.data()), len, srcs);
+
+    const std::string key(args[2]);
+    if (len == 0) {
+        map.remove(key);
+    } else {
+        set_key(key, std::make_shared<std::string>(std::move(result)));
+    }
+
+    LOG_DEBUG(fmt::format("BITOP {} Key: {}, len: {}", args[1], key, len));
+
+    add_reply_int(conn, static_cast<std::int64_t>(len));
+}
+
+void do_mget(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    map.get_many(args.data() + 1, args.size() - 1, 1, batch_nodes);
+
+    const std::size_t pos = begin_arr(conn);
+    for (HashNode *node : batch_nodes) {
+        if (node == nullptr) {
+            add_reply_raw(conn, {}, ObjType::NIL);
+            continue;
+        }
+
+        touch_key(node, false);
+        if (const auto *str = std::get_if<SharedStr>(&node->value)) {
+            add_reply_raw_str(conn, *str);
+        } else if (const auto *num = std::get_if<std::int64_t>(&node->value)) {
+            IntBuf buf{};
+            add_reply_raw(conn, format_int(*num, buf));
+        } else if (const auto *packed = std::get_if<PackedStr>(&node->value)) {
+            Compress::unpack(*packed, add_reply_raw_space(conn, packed->len));
+        } else {
+            // Not a string, same as a missing key
+            add_reply_raw(conn, {}, ObjType::NIL);
+        }
     }
+    end_arr(conn, pos, batch_nodes.size());
 
-    const ObjType type = ObjType::ARR;
-    const std::size_t nelems = keys.size();
-    len += (sizeof(ObjType) + CMD_LEN_BYTES) * (nelems + 1);
+    LOG_DEBUG(fmt::format("MGET Keys: {}", batch_nodes.size()));
+}
 
-    LOG_DEBUG(fmt::format("KEYS: len = {}, nelems = {}", len, nelems));
+void do_mset(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (args.size() % 2 == 0) {
+        add_reply_err(conn,
+                      fmt::format("ERR wrong number of arguments for '{}' command", args[0]));
+        return;
+    }
+
+    // The keys are every other argument
+    map.get_many(args.data() + 1, args.size() / 2, 2, batch_nodes);
+
+    for (std::size_t i = 0; i < batch_nodes.size(); i++) {
+        // Nodes do not move when the table grows, only removals invalidate them
+        if (batch_nodes[i] != nullptr) {
+            batch_nodes[i]->value = to_value(args[2 * i + 2]);
+            touch_key(batch_nodes[i], false);
+        } else {
+            set_key(std::string(args[2 * i + 1]), to_value(args[2 * i + 2]));
+        }
+    }
+
+    LOG_DEBUG(fmt::format("MSET Keys: {}", batch_nodes.size()));
+
+    add_reply_status(conn, "OK");
+}
+
+void do_ping(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (args.size() > 2) {
+        add_reply_err(conn,
+                      fmt::format("ERR wrong number of arguments for '{}' command", args[0]));
+        return;
+    }
+
+    // A subscribed RESP2 client can only make sense of arrays
+    if (conn->subscriptions > 0 && conn->proto != Proto::RESP3) {
+        const std::size_t pos = begin_arr(conn);
+        add_reply_raw(conn, "pong");
+        add_reply_raw(conn, args.size() == 2 ? args[1] : "");
+        end_arr(conn, pos, 2);
+        return;
+    }
+
+    if (args.size() == 2) {
+        add_reply(conn, args[1]);
+    } else {
+        add_reply_status(conn, "PONG");
+    }
+}
+
+void do_hello(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    // AUTH and SETNAME are not supported
+    if (args.size() > 2) {
+        add_reply_err(conn, SYNTAX_ERR);
+        return;
+    }
+
+    if (args.size() == 2) {
+        const auto version = to_int64(args[1]);
+        if (!version || (*version != 2 && *version != 3)) {
+            add_reply_err(conn, "NOPROTO unsupported protocol version");
+            return;
+        }
+        // The native protocol has its own framing and keeps it
+        if (conn->proto != Proto::NATIVE) {
+            conn->proto = *version == 3 ? Proto::RESP3 : Proto::RESP2;
+        }
+    }
+
+    const std::size_t pos = begin_arr(conn);
+    add_reply_raw(conn, "server");
+    add_reply_raw(conn, SERVER_NAME);
+    add_reply_raw(conn, "version");
+    add_reply_raw(conn, SERVER_VERSION);
+    add_reply_raw(conn, "proto");
+    add_reply_raw_int(conn, conn->proto == Proto::RESP3 ? 3 : 2);
+    add_reply_raw(conn, "id");
+    add_reply_raw_int(conn, conn->fd);
+    add_reply_raw(conn, "mode");
+    add_reply_raw(conn, "standalone");
+    add_reply_raw(conn, "role");
+    add_reply_raw(conn, Replication::is_replica() ? "replica" : "master");
+    end_map(conn, pos, 6);
+}
+
+void do_hotkeys(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (args.size() > 2) {
+        add_reply_err(conn,
+                      fmt::format("ERR wrong number of arguments for '{}' command", args[0]));
+        return;
+    }
+
+    std::size_t count = HOTKEYS_DEFAULT;
+    if (args.size() == 2) {
+        const auto n = to_int64(args[1]);
+        if (!n || *n <= 0) {
+            add_reply_err(conn, NOT_INT_ERR);
+            return;
+        }
+        count = static_cast<std::size_t>(*n);
+    }
+
+    const std::vector<HotKey> keys = hotkeys.top(count);
+    const std::size_t pos = begin_arr(conn);
+    for (const auto &[key, hits] : keys) {
+        add_reply_raw(conn, key);
+        add_reply_raw_int(conn, std::int64_t{hits} * HOTKEYS_SAMPLE);
+    }
+    end_map(conn, pos, keys.size());
+}
+
+void do_debug(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+
+    if (args.size() == 3 && args[1] == "TRACE" && args[2] == "DUMP") {
+        add_reply(conn, Trace::dump());
+        return;
+    }
+
+    if (args.size() == 4 && args[1] == "TRACE" && args[2] == "RATE") {
+        const auto rate = to_int64(args[3]);
+        if (!rate || *rate < 0 || *rate > UINT32_MAX) {
+            add_reply_err(conn, NOT_INT_ERR);
+            return;
+        }
+        Trace::set_rate(static_cast<std::uint32_t>(*rate));
+        add_reply_status(conn, "OK");
+        return;
+    }
 
-    // Protocol header
-    std::memcpy(reserved, &len, CMD_LEN_BYTES);
-    // Response header
-    std::memcpy(reserved + CMD_LEN_BYTES, &type, sizeof(ObjType));
-    std::memcpy(reserved + CMD_LEN_BYTES + sizeof(ObjType), &nelems, CMD_LEN_BYTES);
-}
\ No newline at end of file
+    if (args.size() == 4 && args[1] == "CAPTURE" && args[2] == "START") {
+        if (auto err = Capture::start(std::string(args[3]))) {
+            add_reply_err(conn, fmt::format("ERR {}", *err));
+            return;
+        }
+        add_reply_status(conn, "OK");
+        return;
+    }
+
+    if (args.size() == 3 && args[1] == "CAPTURE" && args[2] == "STOP") {
+        Capture::stop();
+        add_reply_status(conn, "OK");
+        return;
+    }
+
+    add_reply_err(conn, "ERR DEBUG supports TRACE DUMP, TRACE RATE <n>, CAPTURE START "
+                        "<file> and CAPTURE STOP");
+}
+
+void do_latency(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+
+    if (args.size() == 2 && args[1] == "LATEST") {
+        // event, time of the latest sample, latest ms, max ms for each event
+        const std::vector<LatencyStats> stats = Latency::latest();
+        const std::size_t pos = begin_arr(conn);
+        for (const LatencyStats &event : stats) {
+            add_arr_header(conn, 4);
+            add_reply_raw(conn, to_string(event.event));
+            add_reply_raw_int(conn, event.time);
+            add_reply_raw_int(conn, event.latest);
+            add_reply_raw_int(conn, event.max);
+        }
+        end_arr(conn, pos, stats.size());
+        return;
+    }
+
+    if (args.size() == 3 && args[1] == "HISTORY") {
+        const auto event = to_latency_event(args[2]);
+        if (!event) {
+            add_reply_err(conn, fmt::format("ERR unknown latency event '{}'", args[2]));
+            return;
+        }
+        const std::vector<LatencySample> samples = Latency::history(*event);
+        const std::size_t pos = begin_arr(conn);
+        for (const auto &[time, ms] : samples) {
+            add_arr_header(conn, 2);
+            add_reply_raw_int(conn, time);
+            add_reply_raw_int(conn, ms);
+        }
+        end_arr(conn, pos, samples.size());
+        return;
+    }
+
+    if (args[1] == "RESET") {
+        // All the events without names, returns how many had samples
+        std::int64_t reset = 0;
+        if (args.size() == 2) {
+            for (std::size_t i = 0; i < LATENCY_EVENTS; i++) {
+                reset += Latency::reset(static_cast<LatencyEvent>(i)) ? 1 : 0;
+            }
+        }
+        for (std::size_t i = 2; i < args.size(); i++) {
+            if (const auto event = to_latency_event(args[i])) {
+                reset += Latency::reset(*event) ? 1 : 0;
+            }
+        }
+        add_reply_int(conn, reset);
+        return;
+    }
+
+    add_reply_err(conn,
+                  "ERR LATENCY supports LATEST, HISTORY <event> and RESET [event ...]");
+}
+
+void do_info(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (args.size() > 2) {
+        add_reply_err(conn,
+                      fmt::format("ERR wrong number of arguments for '{}' command", args[0]));
+        return;
+    }
+
+    const std::string_view section = args.size() == 2 ? args[1] : "default";
+    const auto wanted = [section](std::string_view name) {
+        return section == "default" || section == "all" || section == name;
+    };
+
+    // Sections are separated by an empty line, like in Redis
+    std::string info;
+    const auto begin_section = [&info](std::string_view name) {
+        if (!info.empty()) {
+            info += "\r\n";
+        }
+        info += fmt::format("# {}\r\n", name);
+    };
+
+    if (wanted("server")) {
+        begin_section("Server");
+        info += fmt::format("server_name:{}\r\nversion:{}\r\n", SERVER_NAME,
+                            SERVER_VERSION);
+    }
+    if (wanted("memory")) {
+        begin_section("Memory");
+        info += fmt::format("used_memory:{}\r\nmaxmemory:{}\r\nmaxmemory_policy:{}\r\n",
+                            used_memory(), maxmemory(), to_string(maxmemory_policy()));
+        info += Defrag::info();
+    }
+    if (wanted("compression")) {
+        begin_section("Compression");
+        info += Compress::info();
+    }
+    if (wanted("tier")) {
+        begin_section("Tier");
+        info += Tier::info();
+    }
+    if (wanted("capture")) {
+        begin_section("Capture");
+        info += Capture::info();
+    }
+    if (wanted("cluster")) {
+        begin_section("Cluster");
+        info += Cluster::info();
+    }
+    if (wanted("keyspace")) {
+        begin_section("Keyspace");
+        info += fmt::format("keys:{}\r\n", map.size());
+    }
+    if (wanted("pubsub")) {
+        begin_section("Pubsub");
+        info += fmt::format("pubsub_channels:{}\r\npubsub_patterns:{}\r\n",
+                            PubSub::num_channels(), PubSub::num_patterns());
+    }
+    if (wanted("replication")) {
+        begin_section("Replication");
+        info += Replication::info();
+    }
+    if (wanted("hotkeys")) {
+        begin_section("Hotkeys");
+        info += fmt::format("hotkeys_sampled:{}\r\n", hotkeys.accesses());
+        const std::vector<HotKey> keys = hotkeys.top(HOTKEYS_DEFAULT);
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            info += fmt::format("hotkey{}:key={},count={}\r\n", i, keys[i].key,
+                                std::uint64_t{keys[i].count} * HOTKEYS_SAMPLE);
+        }
+    }
+
+    add_reply(conn, info);
+}
+
+void do_replicaof(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+
+    if (args[1] == "NO" && args[2] == "ONE") {
+        Replication::replicate_from({}, 0);
+        add_reply_status(conn, "OK");
+        return;
+    }
+
+    const auto port = to_int64(args[2]);
+    if (!port || *port <= 0 || *port > UINT16_MAX) {
+        add_reply_err(conn, "ERR invalid port");
+        return;
+    }
+    LOG_INFO(fmt::format("REPLICAOF {}:{}", args[1], *port));
+    Replication::replicate_from(std::string(args[1]), static_cast<std::uint16_t>(*port));
+    add_reply_status(conn, "OK");
+}
+
+void do_psync(std::unique_ptr<Connection> &conn) {
+    Replication::psync(conn, conn->req->args[1], conn->req->args[2]);
+}
+
+void do_fullresync(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    const auto offset = to_int64(args[2]);
+    if (conn->link != Link::PRIMARY || !offset || *offset < 0) {
+        add_reply_err(conn, "ERR FULLRESYNC is only sent by the primary");
+        return;
+    }
+    Replication::full_resync(args[1], static_cast<std::uint64_t>(*offset));
+}
+
+void do_continue(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    bool valid = conn->link == Link::PRIMARY && args.size() <= 3;
+    // The offset ends a snapshot
+    std::optional<std::uint64_t> offset;
+    if (valid && args.size() == 3) {
+        const auto num = to_int64(args[2]);
+        valid = num && *num >= 0;
+        offset = valid ? std::optional<std::uint64_t>{*num} : std::nullopt;
+    }
+    if (!valid || !Replication::resume(args[1], offset)) {
+        add_reply_err(conn, "ERR CONTINUE is only sent by the primary");
+        // A replica that kept a stream the primary does not have cannot go on
+        conn->state = ConnState::END;
+    }
+}
+
+void do_restore(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    // Clients move the keys of a slot to the node importing it, see Cluster
+    const bool importing =
+        conn->link == Link::CLIENT && Cluster::importing(key_slot(args[1]));
+    if (conn->link != Link::PRIMARY && !importing) {
+        add_reply_err(conn, "ERR RESTORE is only sent by the primary or to a cluster "
+                            "node importing the slot of the key");
+        return;
+    }
+
+    // Values bigger than REPL_CHUNK come in several RESTOREs, each one adds to the
+    // key. The replies only reach clients, the primary's are discarded.
+    const std::string key(args[1]);
+    const std::string_view type = args[2];
+    if (type == "str" && args.size() == 4) {
+        std::string *str = lookup_or_add_str(conn, key);
+        if (str == nullptr) {
+            return;
+        }
+        str->append(args[3]);
+    } else if (type == "int" && args.size() == 4) {
+        const auto num = to_int64(args[3]);
+        if (!num) {
+            add_reply_err(conn, NOT_INT_ERR);
+            return;
+        }
+        set_key(key, *num);
+    } else if (type == "packed" && args.size() == 5) {
+        // Kept compressed as on the primary, len is the size of the string
+        const auto len = to_int64(args[3]);
+        if (!len || *len < 0) {
+            add_reply_err(conn, SYNTAX_ERR);
+            return;
+        }
+        PackedStr *packed = lookup_or_add<PackedStr>(conn, key);
+        if (packed == nullptr) {
+            return;
+        }
+        packed->len = static_cast<std::size_t>(*len);
+        packed->data.append(args[4]);
+    } else if (type == "set") {
+        Set *set = lookup_or_add<Set>(conn, key);
+        if (set == nullptr) {
+            return;
+        }
+        set->add({args.begin() + 3, args.end()});
+    } else if (type == "hll" && args.size() == 5) {
+        // The registers from offset, one byte each
+        const auto offset = to_int64(args[3]);
+        if (!offset || *offset < 0 ||
+            static_cast<std::size_t>(*offset) + args[4].size() > HLL_REGISTERS) {
+            add_reply_err(conn, SYNTAX_ERR);
+            return;
+        }
+        HyperLogLog *hll = lookup_or_add<HyperLogLog>(conn, key);
+        if (hll == nullptr) {
+            return;
+        }
+        HLLRegisters regs{};
+        hll->merge_into(regs);
+        for (std::size_t i = 0; i < args[4].size(); i++) {
+            auto &reg = regs[*offset + i];
+            reg = std::max(reg, static_cast<std::uint8_t>(args[4][i]));
+        }
+        hll->assign(regs);
+    } else {
+        add_reply_err(conn, SYNTAX_ERR);
+        return;
+    }
+
+    // From the primary it is fed as it came, like any other write
+    if (importing) {
+        Replication::feed(args);
+    }
+    add_reply_status(conn, "OK");
+}
+
+void do_subscribe(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    for (std::size_t i = 1; i < args.size(); i++) {
+        PubSub::subscribe(*conn, args[i]);
+        reply_subscription(conn, "subscribe", args[i]);
+    }
+}
+
+void do_unsubscribe(std::unique_ptr<Connection> &conn) {
+    unsubscribe_from(conn, "unsubscribe", PubSub::channels(*conn), PubSub::unsubscribe);
+}
+
+void do_psubscribe(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    for (std::size_t i = 1; i < args.size(); i++) {
+        PubSub::psubscribe(*conn, args[i]);
+        reply_subscription(conn, "psubscribe", args[i]);
+    }
+}
+
+void do_punsubscribe(std::unique_ptr<Connection> &conn) {
+    unsubscribe_from(conn, "punsubscribe", PubSub::patterns(*conn), PubSub::punsubscribe);
+}
+
+void do_publish(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    const std::size_t receivers = PubSub::publish(args[1], args[2]);
+    add_reply_int(conn, static_cast<std::int64_t>(receivers));
+}
+
+void do_cluster(std::unique_ptr<Connection> &conn) {
+    const auto &args = conn->req->args;
+    if (!Cluster::enabled()) {
+        add_reply_err(conn, "ERR This instance has cluster support disabled");
+        return;
+    }
+
+    const std::string_view sub = args[1];
+    std::uint16_t slot = 0;
+    ClusterNode node;
+
+    if (args.size() == 3 && sub == "KEYSLOT") {
+        add_reply_int(conn, key_slot(args[2]));
+        return;
+    }
+
+    if (args.size() == 2 && sub == "SLOTS") {
+        // start, end, host and port of each range
+        const std::vector<SlotRange> ranges = Cluster::ranges();
+        const std::size_t pos = begin_arr(conn);
+        for (const SlotRange &range : ranges) {
+            add_arr_header(conn, 4);
+            add_reply_raw_int(conn, range.start);
+            add_reply_raw_int(conn, range.end);
+            add_reply_raw(conn, range.node.host);
+            add_reply_raw_int(conn, range.node.port);
+        }
+        end_arr(conn, pos, ranges.size());
+        return;
+    }
+
+    if (args.size() == 6 && sub == "SETRANGE") {
+        std::uint16_t end = 0;
+        if (!parse_slot(conn, args[2], &slot) || !parse_slot(conn, args[3], &end) ||
+            !parse_node(conn, args[4], args[5], &node)) {
+            return;
+        }
+        if (end < slot) {
+            add_reply_err(conn, SYNTAX_ERR);
+            return;
+        }
+        Cluster::assign(slot, end, node);
+        add_reply_status(conn, "OK");
+        return;
+    }
+
+    if ((args.size() == 4 || args.size() == 6) && sub == "SETSLOT") {
+        if (!parse_slot(conn, args[2], &slot)) {
+            return;
+        }
+        const std::string_view how = args[3];
+        if (args.size() == 4 && how == "STABLE") {
+            Cluster::stabilize(slot);
+            add_reply_status(conn, "OK");
+            return;
+        }
+        if (args.size() != 6 ||
+            (how != "MIGRATING" && how != "IMPORTING" && how != "NODE")) {
+            add_reply_err(conn, SYNTAX_ERR);
+            return;
+        }
+        if (!parse_node(conn, args[4], args[5], &node)) {
+            return;
+        }
+        std::optional<std::string> err;
+        if (how == "MIGRATING") {
+            err = Cluster::migrate(slot, node);
+        } else if (how == "IMPORTING") {
+            err = Cluster::import(slot, node);
+        } else {
+            Cluster::assign(slot, slot, node);
+        }
+        if (err) {
+            add_reply_err(conn, *err);
+            return;
+        }
+        add_reply_status(conn, "OK");
+        return;
+    }
+
+    if (args.size() == 3 && sub == "COUNTKEYSINSLOT") {
+        if (parse_slot(conn, args[2], &slot)) {
+            add_reply_int(conn, static_cast<std::int64_t>(Cluster::count_keys(slot)));
+        }
+        return;
+    }
+
+    if (args.size() == 4 && sub == "DUMPKEYS") {
+        // Each key then the requests that recreate it on the node importing the
+        // slot, encoded to be sent as they are
+        const auto count = to_int64(args[3]);
+        if (!parse_slot(conn, args[2], &slot)) {
+            return;
+        }
+        if (!count || *count <= 0 ||
+            *count > static_cast<std::int64_t>(CLUSTER_DUMP_MAX)) {
+            add_reply_err(conn, NOT_INT_ERR);
+            return;
+        }
+        if (!Cluster::migrating(slot)) {
+            add_reply_err(conn, fmt::format("ERR hash slot {} is not migrating", slot));
+            return;
+        }
+        // Spilled values are read back first, the request runs again then
+        const auto n = static_cast<std::size_t>(*count);
+        if (Tier::load_keys(conn, Cluster::next_keys(slot, n))) {
+            return;
+        }
+        const std::vector<std::string> keys = Cluster::take_keys(slot, n);
+        std::vector<std::string> requests;
+        const Replication::Emit emit = [&requests](const auto &request) {
+            const std::vector<std::byte> bytes = make_request(request);
+            requests.emplace_back(to_view(bytes, bytes.size()));
+        };
+        const std::size_t pos = begin_arr(conn);
+        for (const auto &key : keys) {
+            requests.clear();
+            // The key may be left over from an earlier attempt
+            emit({"ASKING"});
+            emit({"DEL", key});
+            Replication::dump_key(*map.get(key), emit);
+            add_arr_header(conn, 1 + requests.size());
+            add_reply_raw(conn, key);
+            for (const auto &req : requests) {
+                add_reply_raw(conn, req);
+            }
+        }
+        end_arr(conn, pos, keys.size());
+        return;
+    }
+
+    if (args.size() >= 3 && sub == "DELKEYS") {
+        // The keys moved to the node importing their slot, only those handed out
+        // by DUMPKEYS are deleted
+        std::int64_t removed = 0;
+        for (std::size_t i = 2; i < args.size(); i++) {
+            if (Cluster::moving(args[i]) && map.remove(args[i])) {
+                Replication::feed({"DEL", args[i]});
+                removed++;
+            }
+        }
+        add_reply_int(conn, removed);
+        return;
+    }
+
+    add_reply_err(conn, "ERR CLUSTER supports KEYSLOT, SLOTS, SETRANGE, SETSLOT, "
+                        "COUNTKEYSINSLOT, DUMPKEYS and DELKEYS");
+}
+
+void do_asking(std::unique_ptr<Connection> &conn) {
+    conn->asking = true;
+    add_reply_status(conn, "OK");
+}
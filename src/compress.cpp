@@ -0,0 +1,204 @@
+#include "compress.hpp"
+#include "latency.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm> // std::min
+#include <array>     // std::array
+#include <cstdint>   // std::uint32_t, std::uint64_t
+#include <cstring>   // std::memcpy
+#include <utility>   // std::move
+
+namespace {
+// Literal runs are at most LZF_MAX_LIT bytes, their control byte is below it
+constexpr std::size_t LZF_MAX_LIT = 1 << 5;
+constexpr std::size_t LZF_HASH_BITS = 14;
+
+struct State {
+    std::size_t min_size = 0;
+    // Where the 3 bytes hashing to each slot were last seen. Left over from the
+    // previous input, a candidate is only taken after checking its bytes.
+    std::array<std::uint32_t, 1 << LZF_HASH_BITS> table{};
+    std::string scratch;
+
+    std::uint64_t packs = 0;
+    std::uint64_t rejected = 0;
+    std::uint64_t in_bytes = 0;
+    std::uint64_t out_bytes = 0;
+    std::uint64_t pack_us = 0;
+    std::uint64_t unpacks = 0;
+    std::uint64_t unpack_us = 0;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+State state;
+
+std::size_t hash3(const unsigned char *p) {
+    const std::uint32_t v = (p[0] << 16U) | (p[1] << 8U) | p[2];
+    return (v * 2654435761U) >> (32 - LZF_HASH_BITS);
+}
+} // namespace
+
+std::size_t lzf_compress(const char *in, std::size_t in_len, char *out,
+                         std::size_t out_len) {
+    const auto *src = reinterpret_cast<const unsigned char *>(in);
+    auto *dst = reinterpret_cast<unsigned char *>(out);
+    std::size_t ip = 0;
+    std::size_t op = 0;
+    // Start of the bytes not encoded yet, they go out as literals
+    std::size_t lit = 0;
+
+    const auto add_literals = [&](std::size_t end) {
+        while (lit < end) {
+            const std::size_t n = std::min(end - lit, LZF_MAX_LIT);
+            if (op + 1 + n > out_len) {
+                return false;
+            }
+            dst[op++] = static_cast<unsigned char>(n - 1);
+            std::memcpy(dst + op, src + lit, n);
+            op += n;
+            lit += n;
+        }
+        return true;
+    };
+
+    while (ip + 2 < in_len) {
+        const std::size_t slot = hash3(src + ip);
+        const std::size_t ref = state.table[slot];
+        state.table[slot] = static_cast<std::uint32_t>(ip);
+        if (ref >= ip || ip - ref > LZF_MAX_OFF || src[ref] != src[ip] ||
+            src[ref + 1] != src[ip + 1] || src[ref + 2] != src[ip + 2]) {
+            ip++;
+            continue;
+        }
+
+        const std::size_t max = std::min(in_len - ip, LZF_MAX_MATCH);
+        std::size_t len = 3;
+        while (len < max && src[ref + len] == src[ip + len]) {
+            len++;
+        }
+        if (!add_literals(ip) || op + 3 > out_len) {
+            return 0;
+        }
+
+        // 3 bits of length, 7 meaning the next byte has the rest, then 13 bits
+        // of offset
+        const std::size_t off = ip - ref - 1;
+        const std::size_t code = len - 2;
+        if (code < 7) {
+            dst[op++] = static_cast<unsigned char>((code << 5) | (off >> 8));
+        } else {
+            dst[op++] = static_cast<unsigned char>((7 << 5) | (off >> 8));
+            dst[op++] = static_cast<unsigned char>(code - 7);
+        }
+        dst[op++] = static_cast<unsigned char>(off & 0xff);
+        ip += len;
+        lit = ip;
+    }
+
+    if (!add_literals(in_len)) {
+        return 0;
+    }
+    return op;
+}
+
+bool lzf_decompress(const char *in, std::size_t in_len, char *out, std::size_t out_len) {
+    const auto *src = reinterpret_cast<const unsigned char *>(in);
+    auto *dst = reinterpret_cast<unsigned char *>(out);
+    std::size_t ip = 0;
+    std::size_t op = 0;
+    while (ip < in_len) {
+        const std::size_t ctrl = src[ip++];
+        if (ctrl < LZF_MAX_LIT) {
+            const std::size_t n = ctrl + 1;
+            if (ip + n > in_len || op + n > out_len) {
+                return false;
+            }
+            std::memcpy(dst + op, src + ip, n);
+            ip += n;
+            op += n;
+            continue;
+        }
+
+        std::size_t len = ctrl >> 5;
+        if (len == 7) {
+            if (ip == in_len) {
+                return false;
+            }
+            len += src[ip++];
+        }
+        len += 2;
+        if (ip == in_len) {
+            return false;
+        }
+        const std::size_t off = ((ctrl & 0x1f) << 8) + src[ip++] + 1;
+        if (off > op || op + len > out_len) {
+            return false;
+        }
+        // Byte by byte, the match may overlap the bytes it produces
+        for (std::size_t i = 0; i < len; i++, op++) {
+            dst[op] = dst[op - off];
+        }
+    }
+    return op == out_len;
+}
+
+namespace Compress {
+void set_min_size(std::size_t size) { state.min_size = size; }
+
+std::size_t min_size() { return state.min_size; }
+
+std::optional<PackedStr> pack(std::string_view str) {
+    if (state.min_size == 0 || str.size() < state.min_size) {
+        return std::nullopt;
+    }
+
+    const std::uint64_t start = Latency::now_us();
+    const std::size_t limit = str.size() - str.size() / COMPRESS_MIN_GAIN;
+    if (state.scratch.size() < limit) {
+        state.scratch.resize(limit);
+    }
+    const std::size_t n =
+        lzf_compress(str.data(), str.size(), state.scratch.data(), limit);
+    state.pack_us += Latency::now_us() - start;
+    if (n == 0) {
+        state.rejected++;
+        return std::nullopt;
+    }
+
+    state.packs++;
+    state.in_bytes += str.size();
+    state.out_bytes += n;
+    return PackedStr{state.scratch.substr(0, n), str.size()};
+}
+
+void unpack(const PackedStr &value, char *out) {
+    const std::uint64_t start = Latency::now_us();
+    if (!lzf_decompress(value.data.data(), value.data.size(), out, value.len)) {
+        LOG_ERROR(fmt::format("Corrupt compressed value of {} bytes", value.len));
+    }
+    state.unpacks++;
+    state.unpack_us += Latency::now_us() - start;
+}
+
+std::string unpack(const PackedStr &value) {
+    std::string str(value.len, '\0');
+    unpack(value, str.data());
+    return str;
+}
+
+std::string info() {
+    const double ratio = state.out_bytes > 0 ? static_cast<double>(state.in_bytes) /
+                                                   static_cast<double>(state.out_bytes)
+                                             : 0.0;
+    return fmt::format("compress_min_size:{}\r\ncompress_packs:{}\r\n"
+                       "compress_rejected:{}\r\ncompress_input_bytes:{}\r\n"
+                       "compress_output_bytes:{}\r\ncompress_ratio:{:.2f}\r\n"
+                       "compress_cpu_usec:{}\r\ndecompress_unpacks:{}\r\n"
+                       "decompress_cpu_usec:{}\r\n",
+                       state.min_size, state.packs, state.rejected, state.in_bytes,
+                       state.out_bytes, ratio, state.pack_us, state.unpacks,
+                       state.unpack_us);
+}
+} // namespace Compress
@@ -0,0 +1,386 @@
+#include "config.hpp"
+#include "evict.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>   // std::min
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint16_t, SIZE_MAX
+#include <fstream>     // std::ifstream
+#include <limits>      // std::numeric_limits
+#include <optional>    // std::optional
+#include <string>      // std::string, std::getline
+#include <string_view> // std::string_view
+#include <utility>     // std::pair
+
+namespace {
+constexpr std::string_view WHITESPACE = " \t\r";
+
+std::string_view trim(std::string_view str) {
+    const std::size_t begin = str.find_first_not_of(WHITESPACE);
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    const std::size_t end = str.find_last_not_of(WHITESPACE);
+    return str.substr(begin, end - begin + 1);
+}
+
+std::optional<bool> to_bool(std::string_view str) {
+    if (str == "yes") {
+        return true;
+    }
+    if (str == "no") {
+        return false;
+    }
+    return std::nullopt;
+}
+
+template <typename T>
+std::optional<T> to_ranged(std::string_view str, std::int64_t min, std::int64_t max) {
+    const auto value = to_int64(str);
+    if (!value || *value < min || *value > max) {
+        return std::nullopt;
+    }
+    return static_cast<T>(*value);
+}
+
+std::optional<OutputLimit> to_output_limit(std::string_view str) {
+    std::array<std::string_view, 3> fields{};
+    for (auto &field : fields) {
+        str = trim(str);
+        const std::size_t end = std::min(str.find_first_of(WHITESPACE), str.size());
+        field = str.substr(0, end);
+        str.remove_prefix(end);
+    }
+    if (!trim(str).empty()) {
+        return std::nullopt;
+    }
+
+    const auto hard = to_memory(fields[0]);
+    const auto soft = to_memory(fields[1]);
+    const auto seconds = to_ranged<std::uint64_t>(fields[2], 0, INT64_MAX);
+    if (!hard || !soft || !seconds) {
+        return std::nullopt;
+    }
+    return OutputLimit{*hard, *soft, *seconds};
+}
+
+// "<host> <port>" into the replicaof fields
+bool set_replicaof(Config &config, std::string_view str) {
+    str = trim(str);
+    const std::size_t end = std::min(str.find_first_of(WHITESPACE), str.size());
+    const std::string_view host = str.substr(0, end);
+    const auto port = to_ranged<std::uint16_t>(trim(str.substr(end)), 1, UINT16_MAX);
+    if (host.empty() || !port) {
+        return false;
+    }
+    config.replicaof_host = host;
+    config.replicaof_port = *port;
+    return true;
+}
+
+std::string invalid(std::string_view name, std::string_view value) {
+    return fmt::format("Invalid value for '{}': '{}'", name, value);
+}
+} // namespace
+
+std::optional<std::string> set_option(Config &config, std::string_view name,
+                                      std::string_view value) {
+    constexpr std::int64_t INT_MAX_VALUE = std::numeric_limits<int>::max();
+
+    if (name == "bind") {
+        config.bind = value;
+    } else if (name == "port") {
+        const auto port = to_ranged<std::uint16_t>(value, 0, UINT16_MAX);
+        if (!port) {
+            return invalid(name, value);
+        }
+        config.port = *port;
+    } else if (name == "unixsocket") {
+        config.unixsocket = value;
+    } else if (name == "unixsocketperm") {
+        // Octal like chmod
+        std::uint32_t perm = 0;
+        for (const char c : value) {
+            if (c < '0' || c > '7' || perm > 0777) {
+                return invalid(name, value);
+            }
+            perm = perm * 8 + (c - '0');
+        }
+        if (value.empty() || perm > 0777) {
+            return invalid(name, value);
+        }
+        config.unixsocketperm = perm;
+    } else if (name == "tcp-backlog") {
+        const auto backlog = to_ranged<int>(value, 1, INT_MAX_VALUE);
+        if (!backlog) {
+            return invalid(name, value);
+        }
+        config.tcp_backlog = *backlog;
+    } else if (name == "tcp-nodelay" || name == "reuseport") {
+        const auto flag = to_bool(value);
+        if (!flag) {
+            return invalid(name, value);
+        }
+        (name == "tcp-nodelay" ? config.tcp_nodelay : config.reuseport) = *flag;
+    } else if (name == "busy-poll") {
+        const auto usec = to_ranged<int>(value, 0, INT_MAX_VALUE);
+        if (!usec) {
+            return invalid(name, value);
+        }
+        config.busy_poll = *usec;
+    } else if (name == "sndbuf" || name == "rcvbuf") {
+        const auto bytes = to_memory(value);
+        if (!bytes || *bytes > static_cast<std::size_t>(INT_MAX_VALUE)) {
+            return invalid(name, value);
+        }
+        (name == "sndbuf" ? config.sndbuf : config.rcvbuf) = static_cast<int>(*bytes);
+    } else if (name == "io-backend") {
+        if (value == "epoll") {
+            config.io_backend = LoopBackend::EPOLL;
+        } else if (value == "io_uring") {
+            config.io_backend = LoopBackend::IO_URING;
+        } else {
+            return invalid(name, value);
+        }
+    } else if (name == "events-per-wait") {
+        const auto events = to_ranged<int>(value, 1, 1 << 16);
+        if (!events) {
+            return invalid(name, value);
+        }
+        config.events_per_wait = *events;
+    } else if (name == "request-budget") {
+        const auto budget = to_ranged<int>(value, 1, 1 << 16);
+        if (!budget) {
+            return invalid(name, value);
+        }
+        config.request_budget = *budget;
+    } else if (name == "timeout") {
+        const auto seconds = to_ranged<std::uint32_t>(value, 0, UINT32_MAX);
+        if (!seconds) {
+            return invalid(name, value);
+        }
+        config.timeout = *seconds;
+    } else if (name == "client-output-buffer-limit") {
+        // <hard> <soft> <soft seconds>, like the classes of Redis
+        const auto limit = to_output_limit(value);
+        if (!limit) {
+            return invalid(name, value);
+        }
+        config.output_limit = *limit;
+    } else if (name == "proto-max-bulk-len") {
+        const auto bytes = to_memory(value);
+        if (!bytes || *bytes == 0) {
+            return invalid(name, value);
+        }
+        config.proto_max_bulk_len = *bytes;
+    } else if (name == "maxmemory") {
+        const auto bytes = to_memory(value);
+        if (!bytes) {
+            return invalid(name, value);
+        }
+        config.maxmemory = *bytes;
+    } else if (name == "maxmemory-policy") {
+        const auto policy = to_evict_policy(value);
+        if (!policy) {
+            return invalid(name, value);
+        }
+        config.maxmemory_policy = *policy;
+    } else if (name == "loglevel") {
+        if (value == "debug") {
+            config.loglevel = Logger::Level::DEBUG;
+        } else if (value == "info") {
+            config.loglevel = Logger::Level::INFO;
+        } else if (value == "warning") {
+            config.loglevel = Logger::Level::WARNING;
+        } else if (value == "error") {
+            config.loglevel = Logger::Level::ERROR;
+        } else if (value == "none") {
+            config.loglevel = Logger::Level::DISABLED;
+        } else {
+            return invalid(name, value);
+        }
+    } else if (name == "trace-sample-rate") {
+        const auto rate = to_ranged<std::uint32_t>(value, 0, UINT32_MAX);
+        if (!rate) {
+            return invalid(name, value);
+        }
+        config.trace_sample_rate = *rate;
+    } else if (name == "latency-monitor-threshold") {
+        const auto ms = to_ranged<std::uint32_t>(value, 0, UINT32_MAX);
+        if (!ms) {
+            return invalid(name, value);
+        }
+        config.latency_monitor_threshold = *ms;
+    } else if (name == "watchdog-period") {
+        const auto ms = to_ranged<std::uint32_t>(value, 0, UINT32_MAX);
+        if (!ms) {
+            return invalid(name, value);
+        }
+        config.watchdog_period = *ms;
+    } else if (name == "replicaof") {
+        if (!set_replicaof(config, value)) {
+            return invalid(name, value);
+        }
+    } else if (name == "repl-backlog-size") {
+        const auto bytes = to_memory(value);
+        if (!bytes || *bytes == 0) {
+            return invalid(name, value);
+        }
+        config.repl_backlog_size = *bytes;
+    } else if (name == "tier-dir") {
+        config.tier_dir = value;
+    } else if (name == "tier-idle-seconds") {
+        const auto seconds = to_ranged<std::uint32_t>(value, 0, UINT32_MAX);
+        if (!seconds) {
+            return invalid(name, value);
+        }
+        config.tier_idle_seconds = *seconds;
+    } else if (name == "tier-io-threads") {
+        const auto threads = to_ranged<std::size_t>(value, 1, 64);
+        if (!threads) {
+            return invalid(name, value);
+        }
+        config.tier_io_threads = *threads;
+    } else if (name == "compress-min-size") {
+        const auto bytes = to_memory(value);
+        if (!bytes) {
+            return invalid(name, value);
+        }
+        config.compress_min_size = *bytes;
+    } else if (name == "activedefrag") {
+        const auto flag = to_bool(value);
+        if (!flag) {
+            return invalid(name, value);
+        }
+        config.activedefrag = *flag;
+    } else if (name == "active-defrag-threshold") {
+        const auto percent = to_ranged<std::uint32_t>(value, 0, 1000);
+        if (!percent) {
+            return invalid(name, value);
+        }
+        config.active_defrag_threshold = *percent;
+    } else if (name == "active-defrag-ignore-bytes") {
+        const auto bytes = to_memory(value);
+        if (!bytes) {
+            return invalid(name, value);
+        }
+        config.active_defrag_ignore_bytes = *bytes;
+    } else if (name == "active-defrag-cpu") {
+        const auto percent = to_ranged<std::uint32_t>(value, 1, 100);
+        if (!percent) {
+            return invalid(name, value);
+        }
+        config.active_defrag_cpu = *percent;
+    } else if (name == "ordered-index") {
+        const auto flag = to_bool(value);
+        if (!flag) {
+            return invalid(name, value);
+        }
+        config.ordered_index = *flag;
+    } else if (name == "capture-file") {
+        config.capture_file = value;
+    } else if (name == "cluster-enabled") {
+        const auto flag = to_bool(value);
+        if (!flag) {
+            return invalid(name, value);
+        }
+        config.cluster_enabled = *flag;
+    } else if (name == "cluster-announce-host") {
+        if (value.empty()) {
+            return invalid(name, value);
+        }
+        config.cluster_announce_host = value;
+    } else {
+        return fmt::format("Unknown option '{}'", name);
+    }
+
+    return std::nullopt;
+}
+
+std::optional<std::string> load_config(Config &config, const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        return fmt::format("Cannot open config file '{}'", path);
+    }
+
+    std::string line;
+    for (std::size_t lineno = 1; std::getline(file, line); lineno++) {
+        const std::string_view sv = trim(line);
+        if (sv.empty() || sv[0] == '#') {
+            continue;
+        }
+
+        const std::size_t sep = sv.find_first_of(WHITESPACE);
+        const std::string_view name = sv.substr(0, sep);
+        const std::string_view value =
+            sep == std::string_view::npos ? std::string_view{} : trim(sv.substr(sep));
+
+        if (auto err = set_option(config, name, value)) {
+            return fmt::format("{}:{}: {}", path, lineno, *err);
+        }
+    }
+
+    return std::nullopt;
+}
+
+std::optional<std::string> parse_args(Config &config, int argc, char **argv) {
+    int i = 1;
+    if (i < argc && argv[i][0] != '-') {
+        if (auto err = load_config(config, argv[i])) {
+            return err;
+        }
+        i++;
+    }
+
+    for (; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        // Shorthands kept from before the config file existed
+        if (arg == "--io-uring") {
+            config.io_backend = LoopBackend::IO_URING;
+            continue;
+        }
+        if (arg == "--epoll") {
+            config.io_backend = LoopBackend::EPOLL;
+            continue;
+        }
+
+        if (arg.substr(0, 2) != "--" || i + 1 >= argc) {
+            return fmt::format("Invalid argument '{}'", arg);
+        }
+        if (auto err = set_option(config, arg.substr(2), argv[++i])) {
+            return err;
+        }
+    }
+
+    return std::nullopt;
+}
+
+std::optional<std::size_t> to_memory(std::string_view str) {
+    constexpr std::array<std::pair<std::string_view, std::size_t>, 6> units{{
+        {"kb", 1UL << 10},
+        {"mb", 1UL << 20},
+        {"gb", 1UL << 30},
+        {"k", 1000},
+        {"m", 1000 * 1000},
+        {"g", 1000 * 1000 * 1000},
+    }};
+
+    std::size_t unit = 1;
+    for (const auto &[suffix, bytes] : units) {
+        if (str.size() > suffix.size() &&
+            str.substr(str.size() - suffix.size()) == suffix) {
+            str.remove_suffix(suffix.size());
+            unit = bytes;
+            break;
+        }
+    }
+
+    const auto value = to_int64(str);
+    if (!value || *value < 0 || static_cast<std::size_t>(*value) > SIZE_MAX / unit) {
+        return std::nullopt;
+    }
+    return static_cast<std::size_t>(*value) * unit;
+}
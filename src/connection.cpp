@@ -1,20 +1,177 @@
 #include "connection.hpp"
+#include "capture.hpp"
+#include "cluster.hpp"
 #include "command.hpp"
+#include "evict.hpp"
+#include "hotkeys.hpp"
+#include "latency.hpp"
+#include "replication.hpp"
+#include "resp.hpp"
+#include "tier.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 #include <fmt/core.h> // fmt::format
 
-#include <cstddef> // std::size_t
-#include <cstring> // std::memcpy
-#include <memory>  // std::unique_ptr
+#include <algorithm>   // std::max, std::min, std::replace_if
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint64_t
+#include <cstring>     // std::memcpy, std::memmove
+#include <memory>      // std::unique_ptr
+#include <string_view> // std::string_view
+#include <utility>     // std::exchange, std::move
+#include <vector>      // std::vector
 
 namespace {
+// Free IOBUF_LEN buffers, reserved up front so returning one never allocates
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::vector<std::vector<std::byte>> buf_pool;
+std::size_t max_bulk_len = PROTO_MAX_BULK_LEN;
+// Bytes of the wbufs held by the connections, see output_buffer_memory
+std::size_t wbuf_bytes = 0;
+
+void take_buffer(std::vector<std::byte> &buf) {
+    if (buf_pool.empty()) {
+        buf.resize(IOBUF_LEN);
+        return;
+    }
+    buf = std::move(buf_pool.back());
+    buf_pool.pop_back();
+}
+
+void give_buffer(std::vector<std::byte> &buf) {
+    if (buf_pool.capacity() == 0) {
+        buf_pool.reserve(IOBUF_POOL_MAX);
+    }
+    // Buffers that grew for a large request or response are freed instead
+    if (buf.size() == IOBUF_LEN && buf_pool.size() < IOBUF_POOL_MAX) {
+        buf_pool.push_back(std::move(buf));
+    }
+    std::vector<std::byte>().swap(buf);
+}
+
+void reserve_wbuf(std::unique_ptr<Connection> &conn, std::size_t n) {
+    const std::size_t held = conn->wbuf.size();
+    if (conn->wbuf.empty()) {
+        take_buffer(conn->wbuf);
+    }
+    if (conn->wbuf_size + n > conn->wbuf.size()) {
+        conn->wbuf.resize(std::max(conn->wbuf.size() * 2, conn->wbuf_size + n));
+    }
+    wbuf_bytes += conn->wbuf.size() - held;
+}
+
+// Write the response header of a msg_len bytes reply
+void add_header(std::unique_ptr<Connection> &conn, ObjType type, std::size_t msg_len) {
+    reserve_wbuf(conn, sizeof(ObjType) + CMD_LEN_BYTES);
+
+    std::byte *p = &conn->wbuf[conn->wbuf_size];
+    std::memcpy(p, &type, sizeof(ObjType));
+    std::memcpy(p + sizeof(ObjType), &msg_len, CMD_LEN_BYTES);
+    conn->wbuf_size += sizeof(ObjType) + CMD_LEN_BYTES;
+}
+
+bool uses_resp(const std::unique_ptr<Connection> &conn) {
+    return conn->proto == Proto::RESP2 || conn->proto == Proto::RESP3;
+}
+
+void add_bytes(std::unique_ptr<Connection> &conn, std::string_view bytes) {
+    reserve_wbuf(conn, bytes.size());
+    std::memcpy(&conn->wbuf[conn->wbuf_size], bytes.data(), bytes.size());
+    conn->wbuf_size += bytes.size();
+}
+
+void add_resp_header(std::unique_ptr<Connection> &conn, char type, std::int64_t n) {
+    reserve_wbuf(conn, RESP_HEADER_MAX);
+    conn->wbuf_size += write_resp_header(&conn->wbuf[conn->wbuf_size], type, n);
+}
+
+// "<type><msg>\r\n", line breaks in msg would end the line early so become spaces
+void add_resp_line(std::unique_ptr<Connection> &conn, char type, std::string_view msg) {
+    reserve_wbuf(conn, 1 + msg.size() + 2);
+
+    std::byte *p = &conn->wbuf[conn->wbuf_size];
+    p[0] = static_cast<std::byte>(type);
+    std::memcpy(p + 1, msg.data(), msg.size());
+    std::replace_if(
+        p + 1, p + 1 + msg.size(),
+        [](std::byte c) { return c == std::byte{'\r'} || c == std::byte{'\n'}; },
+        std::byte{' '});
+    std::memcpy(p + 1 + msg.size(), "\r\n", 2);
+    conn->wbuf_size += 1 + msg.size() + 2;
+}
+
+// RESP has no framing around replies, so top level and nested replies are the same
+void add_resp_reply(std::unique_ptr<Connection> &conn, std::string_view msg,
+                    ObjType type) {
+    switch (type) {
+    case ObjType::NIL:
+        if (conn->proto == Proto::RESP3) {
+            add_resp_line(conn, '_', {});
+        } else {
+            add_resp_line(conn, '$', "-1");
+        }
+        return;
+    case ObjType::ERR:
+    case ObjType::INT:
+        add_resp_line(conn, static_cast<char>(type), msg);
+        return;
+    case ObjType::STR:
+    case ObjType::ARR:
+        add_resp_header(conn, '$', static_cast<std::int64_t>(msg.size()));
+        add_bytes(conn, msg);
+        add_bytes(conn, "\r\n");
+        return;
+    }
+}
+
+// Write the header reserved by begin_arr and close the gap it leaves
+void end_resp_aggregate(std::unique_ptr<Connection> &conn, std::size_t pos, char type,
+                        std::size_t n) {
+    const std::size_t len =
+        write_resp_header(&conn->wbuf[pos], type, static_cast<std::int64_t>(n));
+    const std::size_t gap = RESP_HEADER_MAX - len;
+    std::byte *elems = conn->wbuf.data() + pos + RESP_HEADER_MAX;
+    std::memmove(elems - gap, elems, conn->wbuf_size - pos - RESP_HEADER_MAX);
+    conn->wbuf_size -= gap;
+
+    for (auto ref = conn->wrefs.rbegin(); ref != conn->wrefs.rend() && ref->pos > pos;
+         ++ref) {
+        ref->pos -= gap;
+    }
+}
+
+// Minimum number of bytes to represent the value in two's complement
+std::size_t int_bytes(std::int64_t value) {
+    std::size_t n = 1;
+    while (n < sizeof(value)) {
+        const std::int64_t high = value >> (8 * n - 1);
+        if (high == 0 || high == -1) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// End of the current wbuf segment, the position of wrefs[idx] if any
+std::size_t wbuf_segment_end(const std::unique_ptr<Connection> &conn, std::size_t idx) {
+    return idx < conn->wrefs.size() ? conn->wrefs[idx].pos : conn->wbuf_size;
+}
+
+bool check_arity(const std::unique_ptr<Connection> &conn) {
+    const int n = arity(conn->req->cmd);
+    const auto nargs = static_cast<int>(conn->req->args.size());
+    return n >= 0 ? nargs == n : nargs >= -n;
+}
+
 ReqStatus parse_request(std::unique_ptr<Connection> &conn) {
     std::size_t nstr = 0;
     std::memcpy(&nstr, &conn->rbuf[conn->rbuf_pos], CMD_LEN_BYTES);
     conn->rbuf_pos += CMD_LEN_BYTES;
 
-    conn->req = std::make_unique<Request>();
+    // Reused across requests, args keeps its capacity
+    conn->req->args.clear();
 
     for (std::size_t i = 0; i < nstr; ++i) {
         std::size_t str_len = 0;
@@ -22,57 +179,354 @@ ReqStatus parse_request(std::unique_ptr<Connection> &conn) {
         conn->rbuf_pos += CMD_LEN_BYTES;
 
         if (conn->rbuf_size < conn->rbuf_pos + str_len) {
-            LOG_ERROR(fmt::format(
-                "Parse error: fd = {} at {}-th string. Expected length: {}, got: {}",
-                conn->fd, i, str_len, conn->rbuf_size - conn->rbuf_pos));
-            return ReqStatus::ERR;
+            return protocol_error(
+                conn, fmt::format("argument {} of {} bytes ends past the request", i,
+                                  str_len));
+        }
+        if (str_len > max_bulk_len) {
+            return protocol_error(conn, fmt::format("invalid bulk length {}", str_len));
         }
 
         conn->req->args.emplace_back(to_view(conn->rbuf, conn->rbuf_pos, str_len));
         conn->rbuf_pos += str_len;
     }
 
-    const std::string_view cmd_str{conn->req->args[0]};
+    return ReqStatus::OK;
+}
+
+// Native framing, the length of the request and then the request
+ReqStatus read_request(std::unique_ptr<Connection> &conn) {
+    {
+        TraceSpan span{*conn, Phase::FRAME};
+        if (conn->rbuf_size < conn->rbuf_pos + CMD_LEN_BYTES) {
+            span.discard();
+            return ReqStatus::AGAIN;
+        }
 
+        std::size_t len = 0;
+        std::memcpy(&len, &conn->rbuf[conn->rbuf_pos], CMD_LEN_BYTES);
+        conn->rbuf_pos += CMD_LEN_BYTES;
+
+        if (len > NATIVE_LEN_MAX) {
+            span.discard();
+            return protocol_error(conn, fmt::format("invalid request length {}", len));
+        }
+
+        if (conn->rbuf_size < conn->rbuf_pos + len) {
+            conn->rbuf_pos -= CMD_LEN_BYTES;
+            reserve_rbuf(conn, CMD_LEN_BYTES + len);
+            span.discard();
+            return ReqStatus::AGAIN;
+        }
+
+        LOG_DEBUG(fmt::format("Received: fd = {}, len = {}", conn->fd, len));
+    }
+
+    const TraceSpan span{*conn, Phase::PARSE};
+    return parse_request(conn);
+}
+
+Cmd to_cmd(std::string_view cmd_str) {
     if (cmd_str == "GET") {
-        conn->req->cmd = Cmd::GET;
-    } else if (cmd_str == "SET") {
-        conn->req->cmd = Cmd::SET;
-    } else if (cmd_str == "DEL") {
-        conn->req->cmd = Cmd::DEL;
-    } else if (cmd_str == "KEYS") {
-        conn->req->cmd = Cmd::KEYS;
-    } else {
-        conn->req->cmd = Cmd::NONE;
+        return Cmd::GET;
+    }
+    if (cmd_str == "SET") {
+        return Cmd::SET;
+    }
+    if (cmd_str == "DEL") {
+        return Cmd::DEL;
+    }
+    if (cmd_str == "KEYS") {
+        return Cmd::KEYS;
+    }
+    if (cmd_str == "SCANPREFIX") {
+        return Cmd::SCANPREFIX;
+    }
+    if (cmd_str == "KEYSRANGE") {
+        return Cmd::KEYSRANGE;
+    }
+    if (cmd_str == "SADD") {
+        return Cmd::SADD;
+    }
+    if (cmd_str == "SREM") {
+        return Cmd::SREM;
+    }
+    if (cmd_str == "SISMEMBER") {
+        return Cmd::SISMEMBER;
+    }
+    if (cmd_str == "SCARD") {
+        return Cmd::SCARD;
+    }
+    if (cmd_str == "SINTER") {
+        return Cmd::SINTER;
+    }
+    if (cmd_str == "SUNION") {
+        return Cmd::SUNION;
+    }
+    if (cmd_str == "SDIFF") {
+        return Cmd::SDIFF;
+    }
+    if (cmd_str == "INCR") {
+        return Cmd::INCR;
+    }
+    if (cmd_str == "DECR") {
+        return Cmd::DECR;
+    }
+    if (cmd_str == "INCRBY") {
+        return Cmd::INCRBY;
+    }
+    if (cmd_str == "DECRBY") {
+        return Cmd::DECRBY;
+    }
+    if (cmd_str == "PFADD") {
+        return Cmd::PFADD;
+    }
+    if (cmd_str == "PFCOUNT") {
+        return Cmd::PFCOUNT;
+    }
+    if (cmd_str == "PFMERGE") {
+        return Cmd::PFMERGE;
     }
+    if (cmd_str == "SETBIT") {
+        return Cmd::SETBIT;
+    }
+    if (cmd_str == "GETBIT") {
+        return Cmd::GETBIT;
+    }
+    if (cmd_str == "BITCOUNT") {
+        return Cmd::BITCOUNT;
+    }
+    if (cmd_str == "BITPOS") {
+        return Cmd::BITPOS;
+    }
+    if (cmd_str == "BITOP") {
+        return Cmd::BITOP;
+    }
+    if (cmd_str == "MGET") {
+        return Cmd::MGET;
+    }
+    if (cmd_str == "MSET") {
+        return Cmd::MSET;
+    }
+    if (cmd_str == "PING") {
+        return Cmd::PING;
+    }
+    if (cmd_str == "HELLO") {
+        return Cmd::HELLO;
+    }
+    if (cmd_str == "HOTKEYS") {
+        return Cmd::HOTKEYS;
+    }
+    if (cmd_str == "INFO") {
+        return Cmd::INFO;
+    }
+    if (cmd_str == "DEBUG") {
+        return Cmd::DEBUG;
+    }
+    if (cmd_str == "LATENCY") {
+        return Cmd::LATENCY;
+    }
+    if (cmd_str == "REPLICAOF") {
+        return Cmd::REPLICAOF;
+    }
+    if (cmd_str == "PSYNC") {
+        return Cmd::PSYNC;
+    }
+    if (cmd_str == "FULLRESYNC") {
+        return Cmd::FULLRESYNC;
+    }
+    if (cmd_str == "CONTINUE") {
+        return Cmd::CONTINUE;
+    }
+    if (cmd_str == "RESTORE") {
+        return Cmd::RESTORE;
+    }
+    if (cmd_str == "SUBSCRIBE") {
+        return Cmd::SUBSCRIBE;
+    }
+    if (cmd_str == "UNSUBSCRIBE") {
+        return Cmd::UNSUBSCRIBE;
+    }
+    if (cmd_str == "PSUBSCRIBE") {
+        return Cmd::PSUBSCRIBE;
+    }
+    if (cmd_str == "PUNSUBSCRIBE") {
+        return Cmd::PUNSUBSCRIBE;
+    }
+    if (cmd_str == "PUBLISH") {
+        return Cmd::PUBLISH;
+    }
+    if (cmd_str == "CLUSTER") {
+        return Cmd::CLUSTER;
+    }
+    if (cmd_str == "ASKING") {
+        return Cmd::ASKING;
+    }
+    return Cmd::NONE;
+}
 
-    return ReqStatus::OK;
+// Without the push type of RESP3, a subscribed client could not tell messages
+// from replies, so it is limited to these
+bool allowed_when_subscribed(Cmd cmd) {
+    return cmd == Cmd::SUBSCRIBE || cmd == Cmd::UNSUBSCRIBE || cmd == Cmd::PSUBSCRIBE ||
+           cmd == Cmd::PUNSUBSCRIBE || cmd == Cmd::PING;
+}
+
+// Count the keys of a sample of the requests for HOTKEYS
+void track_keys(const std::unique_ptr<Connection> &conn) {
+    const KeySpec spec = key_spec(conn->req->cmd);
+    if (spec.first == 0 || (fast_rand() & (HOTKEYS_SAMPLE - 1)) != 0) {
+        return;
+    }
+
+    const auto &args = conn->req->args;
+    const auto nargs = static_cast<int>(args.size());
+    const int last = spec.last < 0 ? nargs + spec.last : spec.last;
+    for (int i = spec.first; i <= last; i += spec.step) {
+        hotkeys.add(args[i]);
+    }
 }
 } // namespace
 
+Connection::~Connection() { wbuf_bytes -= wbuf.size(); }
+
+void acquire_rbuf(std::unique_ptr<Connection> &conn) {
+    if (conn->rbuf.empty()) {
+        take_buffer(conn->rbuf);
+    }
+}
+
+void release_rbuf(std::unique_ptr<Connection> &conn) {
+    if (conn->rbuf_pos == conn->rbuf_size && !conn->rbuf.empty()) {
+        conn->rbuf_pos = 0;
+        conn->rbuf_size = 0;
+        give_buffer(conn->rbuf);
+    }
+}
+
+void reserve_rbuf(std::unique_ptr<Connection> &conn, std::size_t n) {
+    // Doubled, so that a request of many arguments doesn't move for each one
+    if (n > conn->rbuf.size()) {
+        conn->rbuf.resize(std::max(n, conn->rbuf.size() * 2));
+    }
+}
+
+void set_proto_max_bulk_len(std::size_t bytes) { max_bulk_len = bytes; }
+
+std::size_t proto_max_bulk_len() { return max_bulk_len; }
+
+std::size_t output_buffer_memory() { return wbuf_bytes; }
+
+bool over_output_limit(std::unique_ptr<Connection> &conn, const OutputLimit &limit,
+                       std::uint64_t now) {
+    // A replica is sent the snapshot as it drains its output, falling behind the
+    // backlog is what disconnects it
+    if (conn->link != Link::CLIENT) {
+        return false;
+    }
+
+    const std::size_t pending = wbuf_pending_bytes(conn);
+    if (limit.hard > 0 && pending > limit.hard) {
+        return true;
+    }
+
+    if (limit.soft == 0 || pending <= limit.soft) {
+        conn->soft_limit_since = 0;
+        return false;
+    }
+    if (conn->soft_limit_since == 0) {
+        conn->soft_limit_since = now;
+    }
+    return now - conn->soft_limit_since >= limit.soft_seconds;
+}
+
+bool may_time_out(const Connection &conn) {
+    return conn.link == Link::CLIENT && conn.subscriptions == 0;
+}
+
+ReqStatus protocol_error(std::unique_ptr<Connection> &conn, std::string_view msg) {
+    LOG_ERROR(fmt::format("Protocol error: fd = {}, {}", conn->fd, msg));
+    add_reply_err(conn, fmt::format("ERR Protocol error: {}", msg));
+    return ReqStatus::ERR;
+}
+
 ReqStatus do_request(std::unique_ptr<Connection> &conn) {
-    if (conn->rbuf_size < conn->rbuf_pos + CMD_LEN_BYTES) {
-        return ReqStatus::AGAIN;
+    if (conn->proto == Proto::UNKNOWN) {
+        if (conn->rbuf_size < conn->rbuf_pos + 4) {
+            return ReqStatus::AGAIN;
+        }
+        conn->proto = is_resp(&conn->rbuf[conn->rbuf_pos]) ? Proto::RESP2 : Proto::NATIVE;
     }
 
-    std::size_t len = 0;
-    std::memcpy(&len, &conn->rbuf[conn->rbuf_pos], CMD_LEN_BYTES);
-    conn->rbuf_pos += CMD_LEN_BYTES;
+    const std::size_t start = conn->rbuf_pos;
+    ReqStatus status = ReqStatus::OK;
+    if (conn->proto == Proto::NATIVE) {
+        status = read_request(conn);
+    } else {
+        // RESP is framed by its own syntax, parsing is all there is
+        TraceSpan span{*conn, Phase::PARSE};
+        status = parse_resp(conn);
+        if (status == ReqStatus::AGAIN) {
+            span.discard();
+        }
+    }
+    if (status != ReqStatus::OK) {
+        return status;
+    }
+    conn->req->cmd = to_cmd(conn->req->args[0]);
+
+    // The command, replies included as they are encoded by the handlers
+    const TraceSpan span{*conn, Phase::EXEC, conn->req->cmd};
+    const LatencySpan latency{LatencyEvent::COMMAND};
+
+    if (!check_arity(conn)) {
+        add_reply_err(conn, fmt::format("ERR wrong number of arguments for '{}' command",
+                                        conn->req->args[0]));
+        return ReqStatus::OK;
+    }
 
-    if (len > IOBUF_LEN) {
-        LOG_ERROR(fmt::format("Invalid length: {}", len));
-        return ReqStatus::ERR;
+    if (conn->subscriptions > 0 && conn->proto != Proto::RESP3 &&
+        !allowed_when_subscribed(conn->req->cmd)) {
+        add_reply_err(conn,
+                      fmt::format("ERR Can't execute '{}': only (P)SUBSCRIBE / "
+                                  "(P)UNSUBSCRIBE / PING are allowed in this context",
+                                  conn->req->args[0]));
+        return ReqStatus::OK;
     }
 
-    if (conn->rbuf_size < conn->rbuf_pos + len) {
-        conn->rbuf_pos -= CMD_LEN_BYTES;
-        return ReqStatus::AGAIN;
+    // ASKING only holds for the request right after it
+    const bool asking = std::exchange(conn->asking, false);
+    if (const auto err = Cluster::redirect(*conn, asking)) {
+        add_reply_err(conn, *err);
+        return ReqStatus::OK;
     }
 
-    LOG_INFO(fmt::format("Received: fd = {}, len = {}", conn->fd, len));
+    // The request is parsed again once its spilled values are back in memory
+    if (Tier::load_keys(conn)) {
+        conn->rbuf_pos = start;
+        conn->asking = asking;
+        return ReqStatus::BLOCKED;
+    }
+
+    Capture::record(*conn);
+    track_keys(conn);
 
-    if (parse_request(conn) == ReqStatus::ERR) {
-        return ReqStatus::ERR;
+    const bool write = is_write(conn->req->cmd);
+    if (write && conn->link != Link::PRIMARY && Replication::is_replica()) {
+        add_reply_err(conn, "READONLY You can't write against a read only replica.");
+        return ReqStatus::OK;
+    }
+
+    // Evict before running the command, it may not fit otherwise. Replicas leave
+    // it to their primary, which sends them the evicted keys as DELs.
+    if (!Replication::is_replica() && !free_memory(map) &&
+        grows_memory(conn->req->cmd)) {
+        add_reply_err(conn, "OOM command not allowed when used memory > 'maxmemory'");
+        return ReqStatus::OK;
+    }
+
+    if (write) {
+        Replication::prepare_write(*conn);
     }
 
     switch (conn->req->cmd) {
@@ -88,19 +542,188 @@ ReqStatus do_request(std::unique_ptr<Connection> &conn) {
     case Cmd::KEYS:
         do_keys(conn);
         break;
+    case Cmd::SCANPREFIX:
+        do_scanprefix(conn);
+        break;
+    case Cmd::KEYSRANGE:
+        do_keysrange(conn);
+        break;
+    case Cmd::SADD:
+        do_sadd(conn);
+        break;
+    case Cmd::SREM:
+        do_srem(conn);
+        break;
+    case Cmd::SISMEMBER:
+        do_sismember(conn);
+        break;
+    case Cmd::SCARD:
+        do_scard(conn);
+        break;
+    case Cmd::SINTER:
+        do_sinter(conn);
+        break;
+    case Cmd::SUNION:
+        do_sunion(conn);
+        break;
+    case Cmd::SDIFF:
+        do_sdiff(conn);
+        break;
+    case Cmd::INCR:
+        do_incr(conn);
+        break;
+    case Cmd::DECR:
+        do_decr(conn);
+        break;
+    case Cmd::INCRBY:
+        do_incrby(conn);
+        break;
+    case Cmd::DECRBY:
+        do_decrby(conn);
+        break;
+    case Cmd::PFADD:
+        do_pfadd(conn);
+        break;
+    case Cmd::PFCOUNT:
+        do_pfcount(conn);
+        break;
+    case Cmd::PFMERGE:
+        do_pfmerge(conn);
+        break;
+    case Cmd::SETBIT:
+        do_setbit(conn);
+        break;
+    case Cmd::GETBIT:
+        do_getbit(conn);
+        break;
+    case Cmd::BITCOUNT:
+        do_bitcount(conn);
+        break;
+    case Cmd::BITPOS:
+        do_bitpos(conn);
+        break;
+    case Cmd::BITOP:
+        do_bitop(conn);
+        break;
+    case Cmd::MGET:
+        do_mget(conn);
+        break;
+    case Cmd::MSET:
+        do_mset(conn);
+        break;
+    case Cmd::PING:
+        do_ping(conn);
+        break;
+    case Cmd::HELLO:
+        do_hello(conn);
+        break;
+    case Cmd::HOTKEYS:
+        do_hotkeys(conn);
+        break;
+    case Cmd::INFO:
+        do_info(conn);
+        break;
+    case Cmd::DEBUG:
+        do_debug(conn);
+        break;
+    case Cmd::LATENCY:
+        do_latency(conn);
+        break;
+    case Cmd::REPLICAOF:
+        do_replicaof(conn);
+        break;
+    case Cmd::PSYNC:
+        do_psync(conn);
+        break;
+    case Cmd::FULLRESYNC:
+        do_fullresync(conn);
+        break;
+    case Cmd::CONTINUE:
+        do_continue(conn);
+        break;
+    case Cmd::RESTORE:
+        do_restore(conn);
+        break;
+    case Cmd::SUBSCRIBE:
+        do_subscribe(conn);
+        break;
+    case Cmd::UNSUBSCRIBE:
+        do_unsubscribe(conn);
+        break;
+    case Cmd::PSUBSCRIBE:
+        do_psubscribe(conn);
+        break;
+    case Cmd::PUNSUBSCRIBE:
+        do_punsubscribe(conn);
+        break;
+    case Cmd::PUBLISH:
+        do_publish(conn);
+        break;
+    case Cmd::CLUSTER:
+        do_cluster(conn);
+        break;
+    case Cmd::ASKING:
+        do_asking(conn);
+        break;
     case Cmd::NONE:
         do_unknown(conn);
         break;
     }
 
+    // The command found spilled values it reads besides its keys, it runs again
+    // once they are back in memory
+    if (conn->io_pending > 0) {
+        conn->rbuf_pos = start;
+        conn->asking = asking;
+        return ReqStatus::BLOCKED;
+    }
+
+    if (write) {
+        Replication::feed(conn->req->args);
+    }
     return ReqStatus::OK;
 }
 
-void add_reply(std::unique_ptr<Connection> &conn, const std::vector<std::byte> &msg,
-               ObjType type) {
+bool try_one_request(std::unique_ptr<Connection> &conn) {
+    // A link to a primary this server no longer replicates
+    if (conn->link == Link::PRIMARY && !Replication::is_link(*conn)) {
+        conn->state = ConnState::END;
+    }
+    if (conn->state == ConnState::END || conn->io_pending > 0) {
+        return false;
+    }
+
+    // Process the request
+    const std::size_t start = conn->rbuf_pos;
+    const ReqStatus status = do_request(conn);
+
+    if (status == ReqStatus::AGAIN || status == ReqStatus::BLOCKED) {
+        return false;
+    }
+
+    if (status == ReqStatus::ERR) {
+        conn->state = ConnState::END;
+        return false;
+    }
+
+    if (conn->link == Link::PRIMARY) {
+        // The primary gets no replies, only PSYNC was ever sent to it
+        wbuf_discard(conn);
+        Replication::applied(conn, conn->rbuf_pos - start);
+    }
+
+    return conn->state == ConnState::REQUEST;
+}
+
+void add_reply(std::unique_ptr<Connection> &conn, std::string_view msg, ObjType type) {
+    if (uses_resp(conn)) {
+        add_resp_reply(conn, msg, type);
+        return;
+    }
+
     const std::size_t len = sizeof(ObjType) + CMD_LEN_BYTES + msg.size();
 
-    // TODO(_): Handle the case when wbuf is full
+    reserve_wbuf(conn, CMD_LEN_BYTES + len);
 
     // Protocol header
     std::memcpy(&conn->wbuf[conn->wbuf_size], &len, CMD_LEN_BYTES);
@@ -110,10 +733,17 @@ void add_reply(std::unique_ptr<Connection> &conn, const std::vector<std::byte> &
     add_reply_raw(conn, msg, type);
 }
 
-void add_reply_raw(std::unique_ptr<Connection> &conn, const std::vector<std::byte> &msg,
+void add_reply_raw(std::unique_ptr<Connection> &conn, std::string_view msg,
                    ObjType type) {
+    if (uses_resp(conn)) {
+        add_resp_reply(conn, msg, type);
+        return;
+    }
+
     const std::size_t msg_len = msg.size();
 
+    reserve_wbuf(conn, sizeof(ObjType) + CMD_LEN_BYTES + msg_len);
+
     // Response header
     std::memcpy(&conn->wbuf[conn->wbuf_size], &type, sizeof(ObjType));
     conn->wbuf_size += sizeof(ObjType);
@@ -125,3 +755,276 @@ void add_reply_raw(std::unique_ptr<Connection> &conn, const std::vector<std::byt
     std::memcpy(&conn->wbuf[conn->wbuf_size], msg.data(), msg_len);
     conn->wbuf_size += msg_len;
 }
+
+void add_reply_err(std::unique_ptr<Connection> &conn, std::string_view msg) {
+    add_reply(conn, msg, ObjType::ERR);
+}
+
+void add_reply_status(std::unique_ptr<Connection> &conn, std::string_view msg) {
+    if (uses_resp(conn)) {
+        add_resp_line(conn, '+', msg);
+        return;
+    }
+    add_reply(conn, msg);
+}
+
+void add_reply_int(std::unique_ptr<Connection> &conn, std::int64_t value) {
+    if (!uses_resp(conn)) {
+        const std::size_t len = sizeof(ObjType) + CMD_LEN_BYTES + int_bytes(value);
+        reserve_wbuf(conn, CMD_LEN_BYTES);
+
+        // Protocol header
+        std::memcpy(&conn->wbuf[conn->wbuf_size], &len, CMD_LEN_BYTES);
+        conn->wbuf_size += CMD_LEN_BYTES;
+    }
+
+    // Protocol body
+    add_reply_raw_int(conn, value);
+}
+
+void add_reply_raw_int(std::unique_ptr<Connection> &conn, std::int64_t value) {
+    if (uses_resp(conn)) {
+        add_resp_header(conn, ':', value);
+        return;
+    }
+
+    const std::size_t n = int_bytes(value);
+    add_header(conn, ObjType::INT, n);
+    reserve_wbuf(conn, n);
+    std::memcpy(&conn->wbuf[conn->wbuf_size], &value, n);
+    conn->wbuf_size += n;
+}
+
+std::size_t begin_arr(std::unique_ptr<Connection> &conn) {
+    const std::size_t pos = conn->wbuf_size;
+    // Reserve space for the headers, RESP ones are shrunk to fit by end_arr
+    const std::size_t reserve = uses_resp(conn)
+                                    ? RESP_HEADER_MAX
+                                    : CMD_LEN_BYTES + sizeof(ObjType) + CMD_LEN_BYTES;
+    reserve_wbuf(conn, reserve);
+    conn->wbuf_size += reserve;
+    return pos;
+}
+
+void end_arr(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t nelems) {
+    if (uses_resp(conn)) {
+        end_resp_aggregate(conn, pos, '*', nelems);
+        return;
+    }
+
+    // wbuf may have been reallocated, so only refer to it by offset
+    std::size_t len = conn->wbuf_size - pos - CMD_LEN_BYTES;
+    // Plus the values referenced by the elements
+    for (auto ref = conn->wrefs.rbegin(); ref != conn->wrefs.rend() && ref->pos > pos;
+         ++ref) {
+        len += ref->value->size();
+    }
+    const ObjType type = ObjType::ARR;
+
+    // Protocol header
+    std::memcpy(&conn->wbuf[pos], &len, CMD_LEN_BYTES);
+    // Response header
+    std::memcpy(&conn->wbuf[pos + CMD_LEN_BYTES], &type, sizeof(ObjType));
+    std::memcpy(&conn->wbuf[pos + CMD_LEN_BYTES + sizeof(ObjType)], &nelems,
+                CMD_LEN_BYTES);
+}
+
+void add_request(std::unique_ptr<Connection> &conn,
+                 const std::vector<std::string_view> &args) {
+    std::size_t len = CMD_LEN_BYTES;
+    for (const auto &arg : args) {
+        len += CMD_LEN_BYTES + arg.size();
+    }
+    reserve_wbuf(conn, CMD_LEN_BYTES + len);
+
+    // Same encoding as make_request
+    std::byte *p = &conn->wbuf[conn->wbuf_size];
+    std::memcpy(p, &len, CMD_LEN_BYTES);
+    p += CMD_LEN_BYTES;
+    const std::size_t n = args.size();
+    std::memcpy(p, &n, CMD_LEN_BYTES);
+    p += CMD_LEN_BYTES;
+    for (const auto &arg : args) {
+        const std::size_t size = arg.size();
+        std::memcpy(p, &size, CMD_LEN_BYTES);
+        p += CMD_LEN_BYTES;
+        std::memcpy(p, arg.data(), size);
+        p += size;
+    }
+    conn->wbuf_size += CMD_LEN_BYTES + len;
+}
+
+void add_raw(std::unique_ptr<Connection> &conn, const std::byte *data, std::size_t n) {
+    reserve_wbuf(conn, n);
+    std::memcpy(&conn->wbuf[conn->wbuf_size], data, n);
+    conn->wbuf_size += n;
+}
+
+void add_arr_header(std::unique_ptr<Connection> &conn, std::size_t nelems) {
+    if (uses_resp(conn)) {
+        add_resp_header(conn, '*', static_cast<std::int64_t>(nelems));
+        return;
+    }
+    add_header(conn, ObjType::ARR, nelems);
+}
+
+void end_map(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t npairs) {
+    if (conn->proto == Proto::RESP3) {
+        end_resp_aggregate(conn, pos, '%', npairs);
+        return;
+    }
+    end_arr(conn, pos, npairs * 2);
+}
+
+void end_push(std::unique_ptr<Connection> &conn, std::size_t pos, std::size_t nelems) {
+    if (conn->proto == Proto::RESP3) {
+        end_resp_aggregate(conn, pos, '>', nelems);
+        return;
+    }
+    end_arr(conn, pos, nelems);
+}
+
+void add_shared(Connection &conn, const SharedStr &reply) {
+    // Sent in place like a value, with no header of its own
+    conn.wrefs.push_back({conn.wbuf_size, reply});
+    conn.wref_bytes += reply->size();
+}
+
+void add_reply_str(std::unique_ptr<Connection> &conn, const SharedStr &value) {
+    if (!uses_resp(conn)) {
+        const std::size_t len = sizeof(ObjType) + CMD_LEN_BYTES + value->size();
+        reserve_wbuf(conn, CMD_LEN_BYTES);
+
+        // Protocol header
+        std::memcpy(&conn->wbuf[conn->wbuf_size], &len, CMD_LEN_BYTES);
+        conn->wbuf_size += CMD_LEN_BYTES;
+    }
+
+    // Protocol body
+    add_reply_raw_str(conn, value);
+}
+
+void add_reply_raw_str(std::unique_ptr<Connection> &conn, const SharedStr &value) {
+    const bool resp = uses_resp(conn);
+    if (resp) {
+        add_resp_header(conn, '$', static_cast<std::int64_t>(value->size()));
+    } else {
+        add_header(conn, ObjType::STR, value->size());
+    }
+
+    if (value->size() >= WBUF_REF_MIN) {
+        conn->wrefs.push_back({conn->wbuf_size, value});
+        conn->wref_bytes += value->size();
+    } else {
+        add_bytes(conn, *value);
+    }
+
+    if (resp) {
+        add_bytes(conn, "\r\n");
+    }
+}
+
+char *add_reply_space(std::unique_ptr<Connection> &conn, std::size_t len) {
+    if (!uses_resp(conn)) {
+        const std::size_t total = sizeof(ObjType) + CMD_LEN_BYTES + len;
+        reserve_wbuf(conn, CMD_LEN_BYTES);
+
+        // Protocol header
+        std::memcpy(&conn->wbuf[conn->wbuf_size], &total, CMD_LEN_BYTES);
+        conn->wbuf_size += CMD_LEN_BYTES;
+    }
+
+    // Protocol body
+    return add_reply_raw_space(conn, len);
+}
+
+char *add_reply_raw_space(std::unique_ptr<Connection> &conn, std::size_t len) {
+    const bool resp = uses_resp(conn);
+    if (resp) {
+        add_resp_header(conn, '$', static_cast<std::int64_t>(len));
+    } else {
+        add_header(conn, ObjType::STR, len);
+    }
+
+    // With the trailer, the buffer must not move once the space is handed out
+    reserve_wbuf(conn, len + 2);
+    auto *space = reinterpret_cast<char *>(&conn->wbuf[conn->wbuf_size]);
+    conn->wbuf_size += len;
+    if (resp) {
+        add_bytes(conn, "\r\n");
+    }
+    return space;
+}
+
+bool wbuf_pending(const std::unique_ptr<Connection> &conn) {
+    return conn->wbuf_pos < conn->wbuf_size || conn->wref_idx < conn->wrefs.size();
+}
+
+std::size_t wbuf_pending_bytes(const std::unique_ptr<Connection> &conn) {
+    return conn->wbuf_size - conn->wbuf_pos + conn->wref_bytes;
+}
+
+std::size_t wbuf_iov(const std::unique_ptr<Connection> &conn, iovec *iov, std::size_t n) {
+    std::size_t pos = conn->wbuf_pos;
+    std::size_t idx = conn->wref_idx;
+    std::size_t off = conn->wref_pos;
+    std::size_t count = 0;
+
+    while (count < n) {
+        if (idx < conn->wrefs.size() && conn->wrefs[idx].pos == pos) {
+            std::string &value = *conn->wrefs[idx].value;
+            iov[count++] = {value.data() + off, value.size() - off};
+            off = 0;
+            idx++;
+            continue;
+        }
+
+        const std::size_t end = wbuf_segment_end(conn, idx);
+        if (pos == end) {
+            break;
+        }
+        iov[count++] = {&conn->wbuf[pos], end - pos};
+        pos = end;
+    }
+
+    return count;
+}
+
+void wbuf_discard(std::unique_ptr<Connection> &conn) {
+    wbuf_consume(conn, wbuf_pending_bytes(conn));
+}
+
+void wbuf_consume(std::unique_ptr<Connection> &conn, std::size_t n) {
+    while (n > 0) {
+        const std::size_t idx = conn->wref_idx;
+        if (idx < conn->wrefs.size() && conn->wrefs[idx].pos == conn->wbuf_pos) {
+            const std::size_t size = conn->wrefs[idx].value->size();
+            const std::size_t sent = std::min(n, size - conn->wref_pos);
+            conn->wref_pos += sent;
+            conn->wref_bytes -= sent;
+            n -= sent;
+            if (conn->wref_pos == size) {
+                conn->wref_idx++;
+                conn->wref_pos = 0;
+            }
+            continue;
+        }
+
+        const std::size_t sent =
+            std::min(n, wbuf_segment_end(conn, idx) - conn->wbuf_pos);
+        conn->wbuf_pos += sent;
+        n -= sent;
+    }
+
+    if (!wbuf_pending(conn)) {
+        // Everything was sent, drop the references and give wbuf back
+        conn->wbuf_size = 0;
+        conn->wbuf_pos = 0;
+        wbuf_bytes -= conn->wbuf.size();
+        give_buffer(conn->wbuf);
+        conn->wrefs.clear();
+        conn->wref_idx = 0;
+        conn->wref_pos = 0;
+        conn->wref_bytes = 0;
+    }
+}
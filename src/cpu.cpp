@@ -0,0 +1,28 @@
+#include "cpu.hpp"
+
+namespace Cpu {
+namespace {
+bool simd_enabled = true;
+
+bool supports(bool feature) { return simd_enabled && feature; }
+} // namespace
+
+bool has_sse2() { return supports(true); }
+
+bool has_sse42() {
+    static const bool sse42 = __builtin_cpu_supports("sse4.2") != 0;
+    return supports(sse42);
+}
+
+bool has_avx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2") != 0;
+    return supports(avx2);
+}
+
+bool has_popcnt() {
+    static const bool popcnt = __builtin_cpu_supports("popcnt") != 0;
+    return supports(popcnt);
+}
+
+void set_simd_enabled(bool enabled) { simd_enabled = enabled; }
+} // namespace Cpu
@@ -0,0 +1,210 @@
+#include "defrag.hpp"
+#include "hashtable.hpp"
+#include "latency.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <memory>  // std::unique_ptr, std::make_shared
+#include <string>  // std::string
+#include <utility> // std::move, std::swap
+#include <variant> // std::get_if
+#include <vector>  // std::vector
+
+#include <malloc.h> // malloc_trim
+
+namespace {
+struct State {
+    bool enabled = false;
+    std::uint32_t threshold = 0;
+    std::size_t ignore_bytes = 0;
+    std::uint32_t cpu_percent = 0;
+
+    bool running = false;
+    std::size_t cursor = 0;
+    std::uint64_t last_check = 0;
+    std::uint64_t last_cycle = 0;
+
+    // Freed at the end of the cycle, see Defrag
+    std::vector<std::unique_ptr<HashNode>> dead_nodes;
+    std::vector<SharedStr> dead_values;
+    std::vector<std::string> dead_strs;
+
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t scanned = 0;
+    std::uint64_t passes = 0;
+    std::uint64_t time_us = 0;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+State state;
+
+// The capacity of a string that holds its characters in place
+const std::size_t SSO_CAPACITY = std::string().capacity();
+
+bool sparse(const void *ptr) { return page_used(ptr) < DEFRAG_SPARSE_BYTES; }
+
+// Each page counts one of the two, which are the same size
+bool denser(const void *copy, const void *ptr) {
+    return page_used(copy) > page_used(ptr);
+}
+
+void move_str(std::string &str) {
+    if (str.capacity() <= SSO_CAPACITY || str.size() > DEFRAG_MAX_ALLOC ||
+        !sparse(str.data())) {
+        return;
+    }
+
+    std::string copy(str);
+    if (denser(copy.data(), str.data())) {
+        std::swap(str, copy);
+        state.hits++;
+    } else {
+        state.misses++;
+    }
+    state.dead_strs.push_back(std::move(copy));
+}
+
+void move_value(Value &value) {
+    if (auto *packed = std::get_if<PackedStr>(&value)) {
+        move_str(packed->data);
+        return;
+    }
+
+    auto *str = std::get_if<SharedStr>(&value);
+    // A string a pending reply refers to would only be copied
+    if (str == nullptr || str->use_count() > 1) {
+        return;
+    }
+    if (sparse(str->get())) {
+        auto copy = std::make_shared<std::string>();
+        if (denser(copy.get(), str->get())) {
+            *copy = std::move(**str);
+            std::swap(*str, copy);
+            state.hits++;
+        } else {
+            state.misses++;
+        }
+        state.dead_values.push_back(std::move(copy));
+    }
+    move_str(**str);
+}
+
+HashNode *move_node(HashNode *node) {
+    state.scanned++;
+    move_str(node->key);
+    move_value(node->value);
+    if (!sparse(node)) {
+        return node;
+    }
+
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+    auto *copy = new HashNode{};
+    if (!denser(copy, node)) {
+        state.misses++;
+        state.dead_nodes.emplace_back(copy);
+        return node;
+    }
+    *copy = std::move(*node);
+    state.hits++;
+    state.dead_nodes.emplace_back(node);
+    return copy;
+}
+
+bool fragmented() {
+    const std::size_t rss = rss_memory();
+    const std::size_t used = used_memory();
+    return rss > used && rss - used >= state.ignore_bytes &&
+           (rss - used) * 100 >= used * state.threshold;
+}
+
+void free_dead() {
+    state.dead_nodes.clear();
+    state.dead_values.clear();
+    state.dead_strs.clear();
+}
+
+void end_pass() {
+    free_dead();
+    malloc_trim(0);
+    state.running = false;
+    state.passes++;
+    LOG_INFO(fmt::format("Active defrag pass done, rss: {}", rss_memory()));
+}
+} // namespace
+
+namespace Defrag {
+void enable(std::uint32_t threshold, std::size_t ignore_bytes,
+            std::uint32_t cpu_percent) {
+    track_pages();
+    state.enabled = true;
+    state.threshold = threshold;
+    state.ignore_bytes = ignore_bytes;
+    state.cpu_percent = cpu_percent;
+}
+
+bool enabled() { return state.enabled; }
+
+bool running() { return state.running; }
+
+void cycle() {
+    if (!state.enabled) {
+        return;
+    }
+
+    const std::uint64_t start = Latency::now_us();
+    if (!state.running) {
+        if (start - state.last_check < DEFRAG_CHECK_MS * 1000) {
+            return;
+        }
+        state.last_check = start;
+        if (!fragmented()) {
+            return;
+        }
+        LOG_INFO(fmt::format("Active defrag started, rss: {}, used: {}", rss_memory(),
+                             used_memory()));
+        state.running = true;
+        state.cursor = 0;
+    }
+    if (start - state.last_cycle < DEFRAG_CYCLE_MS * 1000) {
+        return;
+    }
+    state.last_cycle = start;
+
+    const std::uint64_t budget = DEFRAG_CYCLE_MS * 1000 * state.cpu_percent / 100;
+    do {
+        state.cursor = map.relocate(state.cursor, DEFRAG_BUCKETS, move_node);
+    } while (state.cursor != 0 && Latency::now_us() - start < budget);
+
+    if (state.cursor == 0) {
+        end_pass();
+    } else {
+        free_dead();
+    }
+    state.time_us += Latency::now_us() - start;
+}
+
+void run_pass() {
+    state.cursor = 0;
+    do {
+        state.cursor = map.relocate(state.cursor, DEFRAG_BUCKETS, move_node);
+    } while (state.cursor != 0);
+    end_pass();
+}
+
+std::string info() {
+    const std::size_t rss = rss_memory();
+    const std::size_t used = used_memory();
+    const double ratio =
+        used > 0 ? static_cast<double>(rss) / static_cast<double>(used) : 0.0;
+    return fmt::format("rss_memory:{}\r\nmem_fragmentation_ratio:{:.2f}\r\n"
+                       "active_defrag_enabled:{}\r\nactive_defrag_running:{}\r\n"
+                       "active_defrag_hits:{}\r\nactive_defrag_misses:{}\r\n"
+                       "active_defrag_scanned:{}\r\nactive_defrag_passes:{}\r\n"
+                       "active_defrag_time_usec:{}\r\n",
+                       rss, ratio, state.enabled ? 1 : 0,
+                       state.running ? 1 : 0, state.hits, state.misses, state.scanned,
+                       state.passes, state.time_us);
+}
+} // namespace Defrag
@@ -0,0 +1,590 @@
+#include "connection.hpp"
+#include "defrag.hpp"
+#include "event_loop.hpp"
+#include "latency.hpp"
+#include "pubsub.hpp"
+#include "replication.hpp"
+#include "tier.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+#include <fmt/ranges.h> // fmt::format
+
+#include <algorithm> // std::any_of, std::max
+#include <array>     // std::array
+#include <chrono>    // std::chrono::steady_clock
+#include <cerrno>    // errno
+#include <cstddef>   // std::size_t
+#include <cstdint>   // std::uint32_t, std::uint64_t
+#include <cstdlib>   // EXIT_FAILURE
+#include <cstring>   // std::strerror, std::memmove
+#include <memory>    // std::unique_ptr, std::make_unique
+#include <vector>    // std::vector
+
+#include <sys/epoll.h>  // epoll_event, epoll_create1, epoll_ctl
+#include <sys/socket.h> // accept4, sendmsg, msghdr, MSG_NOSIGNAL
+#include <sys/types.h>  // ssize_t
+#include <sys/uio.h>    // iovec
+#include <unistd.h>     // close, read
+
+namespace {
+int accept_new_connection(int listen_fd) {
+    // Socket options are inherited from the listener
+    const int client_fd =
+        accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1) {
+        LOG_ERROR(fmt::format("accept failed: {}", std::strerror(errno)));
+    }
+    return client_fd;
+}
+
+// Write as much of the pending output as the socket takes
+void flush_buffer(std::unique_ptr<Connection> &conn) {
+    const TraceSpan span{*conn, Phase::WRITE};
+    std::array<iovec, WBUF_IOV_MAX> iov{};
+    msghdr msg{};
+    msg.msg_iov = iov.data();
+
+    while (wbuf_pending(conn)) {
+        msg.msg_iovlen = wbuf_iov(conn, iov.data(), iov.size());
+        std::size_t len = 0;
+        for (std::size_t i = 0; i < msg.msg_iovlen; i++) {
+            len += iov[i].iov_len;
+        }
+
+        ssize_t n = 0;
+        do {
+            // Values are sent from where they are stored, a closed peer is an
+            // error instead of SIGPIPE
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == -1 && errno == EAGAIN) {
+            // Resource temporarily unavailable, wait for EPOLLOUT
+            return;
+        }
+
+        if (n == -1) {
+            LOG_ERROR(fmt::format("sendmsg failed: {}", std::strerror(errno)));
+            conn->state = ConnState::END;
+            return;
+        }
+
+        wbuf_consume(conn, n);
+
+        if (static_cast<std::size_t>(n) < len) {
+            // The socket buffer is full, another call would only get EAGAIN
+            return;
+        }
+    }
+}
+
+bool output_full(const std::unique_ptr<Connection> &conn) {
+    return wbuf_pending_bytes(conn) >= WBUF_HIGH_WATER;
+}
+
+// Handle up to budget of the buffered requests, the responses are sent at the
+// end of the loop iteration. Returns true if more requests can be read and
+// handled right away.
+bool process_requests(std::unique_ptr<Connection> &conn, std::size_t &budget) {
+    while (budget > 0 && !output_full(conn) && try_one_request(conn)) {
+        budget--;
+    }
+
+    if (conn->state == ConnState::END) {
+        LOG_ERROR(fmt::format("Connection closed without respond: fd = {}", conn->fd));
+        return false;
+    }
+
+    // A request waiting for spilled values holds up the ones behind it
+    return budget > 0 && !output_full(conn) && conn->io_pending == 0;
+}
+
+bool try_fill_buffer(std::unique_ptr<Connection> &conn, std::size_t &budget) {
+    acquire_rbuf(conn);
+    auto &rbuf = conn->rbuf;
+
+    if (conn->rbuf_pos > 0) {
+        // Remove handled requests from the buffer
+        const std::size_t remain = conn->rbuf_size - conn->rbuf_pos;
+        std::memmove(rbuf.data(), &rbuf[conn->rbuf_pos], remain);
+        conn->rbuf_size = remain;
+        conn->rbuf_pos = 0;
+    }
+
+    ssize_t n = 0;
+    conn->traced = Trace::sample();
+
+    {
+        const TraceSpan span{*conn, Phase::READ};
+        do {
+            // Read as much data as possible, up to the buffer size
+            const std::size_t remain = conn->rbuf.size() - conn->rbuf_size;
+            n = read(conn->fd, &rbuf[conn->rbuf_size], remain);
+        } while (n == -1 && errno == EINTR); // Interrupt occurred before read
+    }
+
+    if (n == -1 && errno == EAGAIN) {
+        // Resource temporarily unavailable, try again later
+        return false;
+    }
+
+    if (n <= 0) {
+        if (n == -1) {
+            // Error
+            LOG_ERROR(fmt::format("read failed: {}", std::strerror(errno)));
+        } else {
+            // EOF
+            LOG_INFO(fmt::format("Connection closed: fd = {}", conn->fd));
+        }
+        conn->state = ConnState::END;
+        return false;
+    }
+
+    conn->rbuf_size += n;
+
+    return process_requests(conn, budget);
+}
+
+// Returns true if the budget ran out before the socket was drained
+bool state_req(std::unique_ptr<Connection> &conn, std::size_t budget) {
+    // Requests left over from the previous turn come first
+    if (process_requests(conn, budget)) {
+        while (try_fill_buffer(conn, budget)) {
+        }
+    }
+    return conn->state == ConnState::REQUEST && budget == 0;
+}
+
+// Per connection state only the epoll backend needs
+struct EpollConn {
+    bool ready = false;     // Has requests left, waits in the ready queue
+    bool flushing = false;  // Has output to send at the end of the iteration
+    bool out_armed = false; // EPOLLOUT is registered, the socket buffer was full
+    bool paused = false;    // Stopped handling requests with too much output pending
+    std::uint64_t timer = 0; // When the current idle timer fires, 0 if none
+};
+
+std::uint64_t now_seconds() {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::seconds>(now).count();
+}
+
+/*
+    epoll backend. Clients are registered edge triggered, so a connection that
+    stops before its socket is drained has to remember to come back by itself:
+    one that uses up its request budget waits in the ready queue, one that
+    stopped for a slow reader resumes once its output drains.
+
+    Requests are handled as they are read and the responses of all of them are
+    sent with one sendmsg per connection at the end of the loop iteration.
+    EPOLLOUT is only registered while the socket buffer is full.
+
+    With a timeout, epoll_wait wakes up every second to expire the idle timers.
+    Rather than moving a timer on every request, an expired timer that finds
+    the connection was active meanwhile is added again for the new deadline.
+
+    Replication rides on the same machinery: the link to the primary is a
+    connection the loop opened itself, and what the clients wrote is copied to
+    the replicas after the requests of the iteration were handled. A replica
+    that took all of its output while the snapshot goes on keeps the loop from
+    blocking.
+
+    A connection whose request waits for spilled values reads nothing more
+    until Tier::event_fd reports them loaded, it is then queued as ready.
+*/
+class EpollLoop : public EventLoop {
+  public:
+    explicit EpollLoop(const Config &config) : config{config} {}
+    ~EpollLoop() override;
+
+    int run(const std::vector<Listener> &listeners) override;
+
+  private:
+    bool add_connection(int fd);
+    bool set_events(int fd, std::uint32_t events);
+
+    void on_readable(int fd);
+    void on_writable(int fd);
+    void queue_ready(int fd);
+    void queue_flush(int fd);
+    void run_ready();
+    void sync_replication();
+    bool snapshot_due() const;
+    void wake_subscribers();
+    void sync_tier();
+    void flush_all();
+    void add_timer(int fd, std::uint64_t when);
+    void expire_idle();
+    void close_conn(int fd);
+
+    const Config &config;
+    int epfd = -1;
+
+    std::vector<std::unique_ptr<Connection>> connections; // index is fd
+    std::vector<EpollConn> states;                        // index is fd
+    // Connections that used up their budget and the ones being run, by fd
+    std::vector<int> ready;
+    std::vector<int> running;
+    // Connections with output to send at the end of the iteration, by fd
+    std::vector<int> flushes;
+    // Replication::replicas(), which closing a replica changes
+    std::vector<int> replicas;
+    std::vector<int> woken; // See PubSub::take_woken
+    std::vector<int> loaded; // See Tier::complete
+    bool tier_ready = false; // Tier::event_fd is readable
+
+    TimerWheel timers;
+    std::vector<Timer> due;
+    std::uint64_t now = 0; // Seconds, updated once per iteration
+};
+
+EpollLoop::~EpollLoop() {
+    if (epfd != -1) {
+        close(epfd);
+    }
+}
+
+bool is_listener(const std::vector<Listener> &listeners, int fd) {
+    return std::any_of(listeners.begin(), listeners.end(),
+                       [fd](const Listener &listener) { return listener.fd == fd; });
+}
+
+int EpollLoop::run(const std::vector<Listener> &listeners) {
+    std::vector<epoll_event> events(config.events_per_wait);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        LOG_ERROR(fmt::format("epoll_create1 failed: {}", std::strerror(errno)));
+        return EXIT_FAILURE;
+    }
+
+    epoll_event ev{};
+
+    // Add the listening sockets to the epoll set
+    for (const auto &listener : listeners) {
+        ev.events = EPOLLIN;
+        ev.data.fd = listener.fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener.fd, &ev) == -1) {
+            LOG_ERROR(fmt::format("epoll_ctl failed: {}", std::strerror(errno)));
+            return EXIT_FAILURE;
+        }
+    }
+    if (Tier::enabled()) {
+        ev.events = EPOLLIN;
+        ev.data.fd = Tier::event_fd();
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, Tier::event_fd(), &ev) == -1) {
+            LOG_ERROR(fmt::format("epoll_ctl failed: {}", std::strerror(errno)));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A replica connects to its primary right away
+    now = now_seconds();
+    sync_replication();
+    flush_all();
+
+    while (true) {
+        // Don't block while queued connections have work left, and wake up for
+        // the idle timers, to connect to the primary, to spill cold values and
+        // to defragment
+        const bool tick = config.timeout > 0 || Replication::is_replica() ||
+                          Tier::enabled() || Defrag::enabled();
+        int timeout = tick ? 1000 : -1;
+        if (Defrag::running()) {
+            timeout = static_cast<int>(DEFRAG_CYCLE_MS);
+        }
+        if (!ready.empty() || snapshot_due()) {
+            timeout = 0;
+        }
+        const int nready =
+            epoll_wait(epfd, events.data(), static_cast<int>(events.size()), timeout);
+        if (nready < 0) {
+            LOG_ERROR(fmt::format("epoll_wait failed: {}", std::strerror(errno)));
+            return EXIT_FAILURE;
+        }
+        now = now_seconds();
+        Latency::begin_iteration();
+
+        for (int i = 0; i < nready; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == Tier::event_fd()) {
+                tier_ready = true;
+                continue;
+            }
+            if (is_listener(listeners, fd)) {
+                const int client_fd = accept_new_connection(fd);
+                if (client_fd == -1) {
+                    continue;
+                }
+                LOG_INFO(fmt::format("Accepted new connection: fd = {}", client_fd));
+
+                if (!add_connection(client_fd)) {
+                    return EXIT_FAILURE;
+                }
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) != 0) {
+                on_writable(fd);
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0 &&
+                connections[fd] != nullptr) {
+                on_readable(fd);
+            }
+        }
+
+        run_ready();
+        sync_tier();
+        sync_replication();
+        wake_subscribers();
+        flush_all();
+        expire_idle();
+        Latency::end_iteration();
+    }
+}
+
+bool EpollLoop::add_connection(int fd) {
+    if (connections.size() <= static_cast<std::size_t>(fd)) {
+        connections.resize(fd + 1);
+        states.resize(fd + 1);
+    }
+    connections[fd] = std::make_unique<Connection>(fd);
+    connections[fd]->last_active = now;
+    if (config.timeout > 0) {
+        add_timer(fd, now + config.timeout);
+    }
+
+    // Add the new connection to the epoll set
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        LOG_ERROR(fmt::format("epoll_ctl failed: {}", std::strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+bool EpollLoop::set_events(int fd, std::uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        LOG_ERROR(fmt::format("epoll_ctl failed: {}", std::strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+void EpollLoop::on_readable(int fd) {
+    auto &conn = connections[fd];
+    EpollConn &state = states[fd];
+    // A queued or paused connection gets its turn later
+    if (state.ready || state.paused) {
+        return;
+    }
+
+    conn->last_active = now;
+    const bool more = state_req(conn, static_cast<std::size_t>(config.request_budget));
+
+    if (conn->state == ConnState::END) {
+        // Best effort for the responses to a client that closed its side
+        flush_buffer(conn);
+        close_conn(fd);
+        return;
+    }
+
+    if (output_full(conn)) {
+        state.paused = true;
+    } else if (more) {
+        queue_ready(fd);
+    }
+    release_rbuf(conn);
+    queue_flush(fd);
+}
+
+void EpollLoop::on_writable(int fd) {
+    if (connections[fd] != nullptr && states[fd].out_armed) {
+        queue_flush(fd);
+    }
+}
+
+void EpollLoop::queue_ready(int fd) {
+    states[fd].ready = true;
+    ready.push_back(fd);
+}
+
+void EpollLoop::queue_flush(int fd) {
+    if (!states[fd].flushing && wbuf_pending(connections[fd])) {
+        states[fd].flushing = true;
+        flushes.push_back(fd);
+    }
+}
+
+void EpollLoop::run_ready() {
+    // One more turn for each connection queued so far, in order. The ones still
+    // not done queue up again behind the new ones.
+    running.swap(ready);
+    for (const int fd : running) {
+        // The fd may have been closed and reused meanwhile
+        if (connections[fd] != nullptr && states[fd].ready) {
+            states[fd].ready = false;
+            on_readable(fd);
+        }
+    }
+    running.clear();
+}
+
+void EpollLoop::sync_replication() {
+    const int link_fd = Replication::connect_primary(now);
+    if (link_fd != -1) {
+        const bool added = add_connection(link_fd);
+        Replication::on_link(connections[link_fd]);
+        if (!added) {
+            close_conn(link_fd);
+            return;
+        }
+        // Fails with EAGAIN until connected, then EPOLLOUT sends the PSYNC
+        queue_flush(link_fd);
+    }
+
+    replicas = Replication::replicas();
+    for (const int fd : replicas) {
+        if (!Replication::catch_up(connections[fd])) {
+            close_conn(fd);
+            continue;
+        }
+        queue_flush(fd);
+    }
+}
+
+// A replica took all its output and has more of the snapshot to come, nothing
+// would wake the loop up for it
+bool EpollLoop::snapshot_due() const {
+    for (const int fd : Replication::replicas()) {
+        const auto &conn = connections[fd];
+        if (Replication::sending_snapshot(*conn) && conn->io_pending == 0 &&
+            !wbuf_pending(conn)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EpollLoop::wake_subscribers() {
+    PubSub::take_woken(woken);
+    for (const int fd : woken) {
+        // Subscribers closed since are out of the index but may still be here
+        if (connections[fd] != nullptr) {
+            queue_flush(fd);
+        }
+    }
+}
+
+void EpollLoop::sync_tier() {
+    if (tier_ready) {
+        tier_ready = false;
+        Tier::complete(loaded);
+        for (const int fd : loaded) {
+            // Closed since, or a new connection on the same fd
+            auto &conn = connections[fd];
+            if (conn == nullptr || conn->io_pending == 0 || --conn->io_pending > 0) {
+                continue;
+            }
+            if (!states[fd].ready && !states[fd].paused) {
+                queue_ready(fd);
+            }
+        }
+    }
+    Tier::cycle();
+    Defrag::cycle();
+}
+
+void EpollLoop::flush_all() {
+    for (const int fd : flushes) {
+        auto &conn = connections[fd];
+        EpollConn &state = states[fd];
+        if (conn == nullptr || !state.flushing) {
+            continue;
+        }
+        state.flushing = false;
+
+        flush_buffer(conn);
+        conn->last_active = now;
+        if (conn->state == ConnState::END) {
+            close_conn(fd);
+            continue;
+        }
+        if (over_output_limit(conn, config.output_limit, now)) {
+            LOG_WARNING(fmt::format("Client over the output buffer limit: fd = {}", fd));
+            close_conn(fd);
+            continue;
+        }
+
+        // Only wait for EPOLLOUT while the socket buffer is full
+        const bool pending = wbuf_pending(conn);
+        if (pending != state.out_armed) {
+            state.out_armed = pending;
+            const std::uint32_t events = EPOLLIN | EPOLLET | (pending ? EPOLLOUT : 0U);
+            if (!set_events(fd, events)) {
+                close_conn(fd);
+                continue;
+            }
+        }
+
+        if (state.paused && !output_full(conn)) {
+            // Edge triggered epoll won't report the requests that arrived meanwhile
+            state.paused = false;
+            queue_ready(fd);
+        }
+    }
+    flushes.clear();
+}
+
+void EpollLoop::add_timer(int fd, std::uint64_t when) {
+    states[fd].timer = when;
+    timers.add(fd, when);
+}
+
+void EpollLoop::expire_idle() {
+    if (config.timeout == 0) {
+        return;
+    }
+
+    const LatencySpan latency{LatencyEvent::EXPIRE_CYCLE};
+    timers.expire(now, due);
+    for (const Timer &timer : due) {
+        // Skip the timers of closed connections
+        if (connections[timer.fd] == nullptr || states[timer.fd].timer != timer.when) {
+            continue;
+        }
+
+        const std::uint64_t deadline =
+            connections[timer.fd]->last_active + config.timeout;
+        if (deadline > now || !may_time_out(*connections[timer.fd])) {
+            add_timer(timer.fd, std::max(deadline, now + 1));
+            continue;
+        }
+
+        LOG_INFO(fmt::format("Closing idle client: fd = {}", timer.fd));
+        close_conn(timer.fd);
+    }
+    due.clear();
+}
+
+void EpollLoop::close_conn(int fd) {
+    Replication::on_close(*connections[fd], now);
+    if (connections[fd]->subscriptions > 0) {
+        PubSub::on_close(*connections[fd]);
+    }
+    close(fd);
+    connections[fd].reset();
+    states[fd] = {};
+}
+} // namespace
+
+std::unique_ptr<EventLoop> make_epoll_loop(const Config &config) {
+    return std::make_unique<EpollLoop>(config);
+}
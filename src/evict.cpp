@@ -0,0 +1,289 @@
+#include "evict.hpp"
+#include "alloc.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "latency.hpp"
+#include "replication.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint8_t, std::uint32_t, std::uint64_t
+#include <ctime>       // clock_gettime, timespec
+#include <optional>    // std::optional
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <utility>     // std::swap
+
+namespace {
+// A candidate kept across eviction rounds, re-checked before evicting since the
+// key may be gone by then
+struct PoolEntry {
+    std::uint64_t idle = 0; // Higher is a better candidate
+    std::string key;        // Empty if unused
+};
+
+struct MaxMemory {
+    std::size_t bytes = 0;
+    EvictPolicy policy = EvictPolicy::NOEVICTION;
+    // Sorted by idle, best candidate last
+    std::array<PoolEntry, EVICT_POOL_SIZE> pool;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+MaxMemory config;
+
+std::uint64_t coarse_seconds() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec);
+}
+
+std::uint32_t lfu_minutes() { return (coarse_seconds() / 60) & 0xFFFF; }
+
+bool is_lfu(EvictPolicy policy) {
+    return policy == EvictPolicy::ALLKEYS_LFU || policy == EvictPolicy::VOLATILE_LFU;
+}
+
+std::uint8_t lfu_log_incr(std::uint8_t counter) {
+    if (counter == UINT8_MAX) {
+        return counter;
+    }
+    const double r = static_cast<double>(fast_rand() >> 11) * 0x1.0p-53;
+    const double base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+    const double p = 1.0 / (base * LFU_LOG_FACTOR + 1);
+    return r < p ? counter + 1 : counter;
+}
+
+std::uint64_t idle_score(const HashNode *node) {
+    if (is_lfu(config.policy)) {
+        return UINT8_MAX - lfu_counter(node);
+    }
+    return idle_seconds(node);
+}
+
+void pool_insert(std::uint64_t idle, const std::string &key) {
+    auto &pool = config.pool;
+    const std::size_t size = pool.size();
+
+    // The same key may be sampled again
+    for (const auto &entry : pool) {
+        if (entry.key == key) {
+            return;
+        }
+    }
+
+    // First entry that is unused or has a higher idle
+    std::size_t pos = 0;
+    while (pos < size && !pool[pos].key.empty() && pool[pos].idle < idle) {
+        pos++;
+    }
+
+    if (pos == 0 && !pool[size - 1].key.empty()) {
+        // Full and worse than every candidate
+        return;
+    }
+
+    if (pos == size || !pool[pos].key.empty()) {
+        if (pool[size - 1].key.empty()) {
+            // Make room by shifting the better candidates right
+            for (std::size_t i = size - 1; i > pos; i--) {
+                std::swap(pool[i], pool[i - 1]);
+            }
+        } else {
+            // Drop the worst candidate by shifting the worse ones left
+            pos--;
+            for (std::size_t i = 0; i < pos; i++) {
+                std::swap(pool[i], pool[i + 1]);
+            }
+        }
+    }
+
+    pool[pos].idle = idle;
+    pool[pos].key = key; // Reuses the capacity of the dropped key
+}
+
+void populate_pool(HashTable &ht) {
+    std::array<HashNode *, EVICT_SAMPLES> samples{};
+    const std::size_t n = ht.sample(samples.data(), samples.size());
+    for (std::size_t i = 0; i < n; i++) {
+        pool_insert(idle_score(samples[i]), samples[i]->key);
+    }
+}
+
+// Remove the best candidate still in ht, returns false if the pool ran dry
+bool evict_from_pool(HashTable &ht) {
+    auto &pool = config.pool;
+    for (std::size_t i = pool.size(); i-- > 0;) {
+        if (pool[i].key.empty()) {
+            continue;
+        }
+        const bool removed = ht.remove(pool[i].key);
+        if (removed) {
+            LOG_DEBUG(fmt::format("Evicted key: {}", pool[i].key));
+            // Replicas don't evict, they delete what their primary evicted
+            Replication::feed({"DEL", pool[i].key});
+        }
+        pool[i].key.clear();
+        if (removed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool evict_random(HashTable &ht) {
+    HashNode *node = nullptr;
+    if (ht.sample(&node, 1) == 0) {
+        return false;
+    }
+    const std::string key = node->key;
+    LOG_DEBUG(fmt::format("Evicted key: {}", key));
+    Replication::feed({"DEL", key});
+    return ht.remove(key);
+}
+
+// Evict one key, returns false if no candidate was left
+bool evict_one(HashTable &ht) {
+    if (config.policy == EvictPolicy::ALLKEYS_RANDOM) {
+        return evict_random(ht);
+    }
+    // Each round samples a few keys and evicts the best candidate seen so far
+    populate_pool(ht);
+    return evict_from_pool(ht);
+}
+} // namespace
+
+std::optional<EvictPolicy> to_evict_policy(std::string_view name) {
+    for (const auto policy :
+         {EvictPolicy::NOEVICTION, EvictPolicy::ALLKEYS_LRU, EvictPolicy::ALLKEYS_LFU,
+          EvictPolicy::ALLKEYS_RANDOM, EvictPolicy::VOLATILE_LRU, EvictPolicy::VOLATILE_LFU,
+          EvictPolicy::VOLATILE_RANDOM, EvictPolicy::VOLATILE_TTL}) {
+        if (to_string(policy) == name) {
+            return policy;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view to_string(EvictPolicy policy) {
+    switch (policy) {
+    case EvictPolicy::NOEVICTION:
+        return "noeviction";
+    case EvictPolicy::ALLKEYS_LRU:
+        return "allkeys-lru";
+    case EvictPolicy::ALLKEYS_LFU:
+        return "allkeys-lfu";
+    case EvictPolicy::ALLKEYS_RANDOM:
+        return "allkeys-random";
+    case EvictPolicy::VOLATILE_LRU:
+        return "volatile-lru";
+    case EvictPolicy::VOLATILE_LFU:
+        return "volatile-lfu";
+    case EvictPolicy::VOLATILE_RANDOM:
+        return "volatile-random";
+    case EvictPolicy::VOLATILE_TTL:
+        return "volatile-ttl";
+    }
+}
+
+void set_maxmemory(std::size_t bytes, EvictPolicy policy) {
+    config.bytes = bytes;
+    config.policy = policy;
+    for (auto &entry : config.pool) {
+        entry.key.clear();
+    }
+}
+
+std::size_t maxmemory() { return config.bytes; }
+
+std::size_t maxmemory_used() {
+    const std::size_t used = used_memory();
+    const std::size_t buffers = output_buffer_memory() + Replication::buffer_memory();
+    return used > buffers ? used - buffers : 0;
+}
+EvictPolicy maxmemory_policy() { return config.policy; }
+
+std::uint32_t lru_clock() { return coarse_seconds() & LRU_CLOCK_MAX; }
+
+void touch_key(HashNode *node, bool created) {
+    if (is_lfu(config.policy)) {
+        const std::uint8_t counter =
+            created ? LFU_INIT_VAL : lfu_log_incr(lfu_counter(node));
+        node->lru = lfu_minutes() << 8 | counter;
+    } else {
+        node->lru = lru_clock();
+    }
+}
+
+std::uint8_t lfu_counter(const HashNode *node) {
+    const std::uint32_t last = node->lru >> 8;
+    const std::uint32_t now = lfu_minutes();
+    const std::uint32_t elapsed = now >= last ? now - last : 0xFFFF - last + now;
+    const std::uint32_t periods = elapsed / LFU_DECAY_MINUTES;
+    const std::uint32_t counter = node->lru & 0xFF;
+    return periods > counter ? 0 : counter - periods;
+}
+
+std::uint64_t idle_seconds(const HashNode *node) {
+    if (is_lfu(config.policy)) {
+        const std::uint32_t last = node->lru >> 8;
+        const std::uint32_t now = lfu_minutes();
+        return std::uint64_t{now >= last ? now - last : 0xFFFF - last + now} * 60;
+    }
+    const std::uint32_t now = lru_clock();
+    return now >= node->lru ? now - node->lru : LRU_CLOCK_MAX - node->lru + now;
+}
+
+bool free_memory(HashTable &ht) {
+    if (config.bytes == 0 || maxmemory_used() <= config.bytes) {
+        return true;
+    }
+
+    switch (config.policy) {
+    case EvictPolicy::NOEVICTION:
+    case EvictPolicy::VOLATILE_LRU:
+    case EvictPolicy::VOLATILE_LFU:
+    case EvictPolicy::VOLATILE_RANDOM:
+    case EvictPolicy::VOLATILE_TTL:
+        return false;
+    case EvictPolicy::ALLKEYS_LRU:
+    case EvictPolicy::ALLKEYS_LFU:
+    case EvictPolicy::ALLKEYS_RANDOM:
+        break;
+    }
+
+    const LatencySpan latency{LatencyEvent::EVICTION};
+    const std::uint64_t start = Latency::now_us();
+    std::size_t used = maxmemory_used();
+    std::size_t stalled = 0;
+
+    for (std::size_t round = 1; used > config.bytes; round++) {
+        if (ht.is_empty()) {
+            return false;
+        }
+
+        // A round may find no candidate in a sparse table, only evicted keys count
+        if (evict_one(ht)) {
+            const std::size_t now = maxmemory_used();
+            // The value of a key may outlive it in a reply not sent yet
+            stalled = now < used ? 0 : stalled + 1;
+            used = now;
+            if (stalled == EVICT_STALL_KEYS) {
+                LOG_WARNING(fmt::format(
+                    "Eviction freed nothing in {} keys, {} bytes used", stalled, used));
+                return false;
+            }
+        }
+
+        // The next write goes on from here
+        if (round % EVICT_CHECK_ROUNDS == 0 &&
+            Latency::now_us() - start >= EVICT_BUDGET_US) {
+            return true;
+        }
+    }
+
+    return true;
+}
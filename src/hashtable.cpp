@@ -1,7 +1,13 @@
 #include "hashtable.hpp"
+#include "art.hpp"
+#include "latency.hpp"
+#include "utils.hpp"
 
-#include <cstddef> // std::size_t
-#include <utility> // std::move
+#include <algorithm> // std::max, std::min
+#include <cstddef>   // std::size_t
+#include <memory>    // std::make_unique
+#include <utility>   // std::move
+#include <vector>    // std::vector
 
 namespace {
 std::int8_t next_exp(std::size_t size);
@@ -14,7 +20,8 @@ HashTable::HashTable() {
 
 HashTable::HashTable(HashTable &&other) noexcept
     : table(other.table), used(other.used), size_exp(other.size_exp),
-      rehash_idx(other.rehash_idx), hash_fn(other.hash_fn) {
+      rehash_idx(other.rehash_idx), hash_fn(other.hash_fn),
+      ordered(std::move(other.ordered)), key_hook(std::move(other.key_hook)) {
     other.reset(0);
     other.reset(1);
 }
@@ -25,6 +32,8 @@ HashTable &HashTable::operator=(HashTable &&other) noexcept {
     size_exp = other.size_exp;
     rehash_idx = other.rehash_idx;
     hash_fn = other.hash_fn;
+    ordered = std::move(other.ordered);
+    key_hook = std::move(other.key_hook);
 
     other.reset(0);
     other.reset(1);
@@ -37,7 +46,7 @@ HashTable::~HashTable() {
     clear(1);
 }
 
-void HashTable::set(std::string key, std::string value) {
+HashNode *HashTable::set(std::string key, Value value) {
     const std::size_t hash = hash_fn(key);
     auto idx = static_cast<std::int64_t>(hash & HT_MASK(size_exp[0]));
 
@@ -55,7 +64,7 @@ void HashTable::set(std::string key, std::string value) {
         while (node != nullptr) {
             if (node->key == key || cmp(node->key, key)) {
                 node->value = std::move(value);
-                return;
+                return node;
             }
             node = node->next;
         }
@@ -69,43 +78,72 @@ void HashTable::set(std::string key, std::string value) {
        If we are during rehashing, always add new node at the new table. */
     HashNode **bucket = &table[is_rehashing() ? 1 : 0][idx];
 
+    if (ordered != nullptr) {
+        ordered->insert(key);
+    }
+    if (key_hook) {
+        key_hook(key, true);
+    }
     // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
     *bucket = new HashNode{std::move(key), std::move(value), *bucket};
     used[is_rehashing() ? 1 : 0]++;
+    return *bucket;
 }
 
-HashNode *HashTable::get(const std::string &key) {
+HashNode *HashTable::get(std::string_view key) {
     if (is_empty()) {
         return nullptr;
     }
 
     const std::size_t hash = hash_fn(key);
-    auto idx = static_cast<std::int64_t>(hash & HT_MASK(size_exp[0]));
-    try_rehash(idx);
+    try_rehash(static_cast<std::int64_t>(hash & HT_MASK(size_exp[0])));
 
-    for (std::size_t htidx = 0; htidx <= 1; htidx++) {
-        if (htidx == 0 && idx < rehash_idx) {
-            continue;
-        }
+    return find(hash, key);
+}
 
-        idx = static_cast<std::int64_t>(hash & HT_MASK(size_exp[htidx]));
-        HashNode *node = table[htidx][idx];
-        while (node != nullptr) {
-            if (node->key == key || cmp(node->key, key)) {
-                return node;
-            }
-            node = node->next;
+void HashTable::get_many(const std::string_view *keys, std::size_t count,
+                         std::size_t stride, std::vector<HashNode *> &out) {
+    out.assign(count, nullptr);
+    if (is_empty()) {
+        return;
+    }
+
+    // The same amount of rehashing as that many gets
+    if (is_rehashing()) {
+        const LatencySpan latency{LatencyEvent::REHASH};
+        rehash_steps(count);
+        check_rehash_complete();
+    }
+
+    // Hash everything and prefetch the buckets
+    hashes.resize(count);
+    for (std::size_t i = 0; i < count; i++) {
+        hashes[i] = hash_fn(keys[i * stride]);
+        __builtin_prefetch(&table[0][hashes[i] & HT_MASK(size_exp[0])]);
+        if (is_rehashing()) {
+            __builtin_prefetch(&table[1][hashes[i] & HT_MASK(size_exp[1])]);
         }
+    }
 
-        if (!is_rehashing()) {
-            break;
+    // Then the first node of each chain
+    for (std::size_t i = 0; i < count; i++) {
+        for (std::size_t htidx = 0; htidx <= 1; htidx++) {
+            const HashNode *node = table[htidx][hashes[i] & HT_MASK(size_exp[htidx])];
+            if (node != nullptr) {
+                __builtin_prefetch(node);
+            }
+            if (!is_rehashing()) {
+                break;
+            }
         }
     }
 
-    return nullptr;
+    for (std::size_t i = 0; i < count; i++) {
+        out[i] = find(hashes[i], keys[i * stride]);
+    }
 }
 
-bool HashTable::remove(const std::string &key) {
+bool HashTable::remove(std::string_view key) {
     if (is_empty()) {
         return false;
     }
@@ -125,7 +163,17 @@ bool HashTable::remove(const std::string &key) {
         while (*node != nullptr) {
             if ((*node)->key == key || cmp((*node)->key, key)) {
                 HashNode *next = (*node)->next;
-                delete *node; // NOLINT(cppcoreguidelines-owning-memory)
+                if (ordered != nullptr) {
+                    ordered->remove((*node)->key);
+                }
+                if (key_hook) {
+                    key_hook((*node)->key, false);
+                }
+                {
+                    // The value may be a large set freed node by node
+                    const LatencySpan latency{LatencyEvent::FREE};
+                    delete *node; // NOLINT(cppcoreguidelines-owning-memory)
+                }
                 *node = next;
                 used[htidx]--;
                 return true;
@@ -156,6 +204,81 @@ std::vector<std::string> HashTable::keys() {
     return buf;
 }
 
+void HashTable::for_each(const std::function<void(const HashNode &)> &fn) const {
+    for (std::size_t htidx = 0; htidx <= 1; htidx++) {
+        for (std::size_t idx = 0; idx < HT_SIZE(size_exp[htidx]); idx++) {
+            for (const HashNode *node = table[htidx][idx]; node != nullptr;
+                 node = node->next) {
+                fn(*node);
+            }
+        }
+    }
+}
+
+std::size_t HashTable::sample(HashNode **out, std::size_t count) {
+    if (is_empty()) {
+        return 0;
+    }
+
+    count = std::min(count, size());
+    const std::size_t mask = std::max(HT_MASK(size_exp[0]), HT_MASK(size_exp[1]));
+    std::size_t steps = count * 10;
+    std::size_t empty = 0;
+    std::size_t stored = 0;
+    std::size_t idx = fast_rand() & mask;
+
+    while (stored < count && steps-- != 0) {
+        for (std::size_t htidx = 0; htidx <= 1 && stored < count; htidx++) {
+            if (htidx == 1 && !is_rehashing()) {
+                break;
+            }
+            // Buckets of the old table before rehash_idx are empty
+            if (htidx == 0 && is_rehashing() && static_cast<std::int64_t>(idx) < rehash_idx) {
+                continue;
+            }
+            if (idx > HT_MASK(size_exp[htidx])) {
+                continue;
+            }
+
+            HashNode *node = table[htidx][idx];
+            if (node == nullptr) {
+                // Jump elsewhere after a run of empty buckets
+                if (++empty >= 5 && empty > count) {
+                    idx = fast_rand() & mask;
+                    empty = 0;
+                }
+                continue;
+            }
+
+            empty = 0;
+            while (node != nullptr && stored < count) {
+                out[stored++] = node;
+                node = node->next;
+            }
+        }
+        idx = (idx + 1) & mask;
+    }
+
+    return stored;
+}
+
+std::size_t HashTable::relocate(std::size_t cursor, std::size_t count,
+                               const std::function<HashNode *(HashNode *)> &fn) {
+    const std::size_t end = std::max(HT_SIZE(size_exp[0]), HT_SIZE(size_exp[1]));
+    for (; cursor < end && count != 0; cursor++, count--) {
+        for (std::size_t htidx = 0; htidx <= 1; htidx++) {
+            if (cursor >= HT_SIZE(size_exp[htidx])) {
+                continue;
+            }
+            for (HashNode **link = &table[htidx][cursor]; *link != nullptr;
+                 link = &(*link)->next) {
+                *link = fn(*link);
+            }
+        }
+    }
+    return cursor < end ? cursor : 0;
+}
+
 bool HashTable::is_empty() const { return used[0] + used[1] == 0; }
 
 HTState HashTable::state(std::size_t htidx) const {
@@ -167,9 +290,30 @@ std::size_t HashTable::buckets() const {
     return HT_SIZE(size_exp[0]) + HT_SIZE(size_exp[1]);
 }
 
+void HashTable::enable_index() {
+    if (ordered == nullptr) {
+        ordered = std::make_unique<ArtTree>();
+    }
+}
+
+const ArtTree *HashTable::index() const { return ordered.get(); }
+
+void HashTable::set_key_hook(KeyHook hook) { key_hook = std::move(hook); }
 void HashTable::set_cmp(KeyCompare cmp) { this->cmp = std::move(cmp); }
 void HashTable::set_hash(Hash fn) { hash_fn = std::move(fn); }
 
+void HashTable::clear() {
+    if (key_hook) {
+        for_each([this](const HashNode &node) { key_hook(node.key, false); });
+    }
+    clear(0);
+    clear(1);
+    rehash_idx = -1;
+    if (ordered != nullptr) {
+        ordered->clear();
+    }
+}
+
 void HashTable::force_rehash() {
     while (is_rehashing()) {
         rehash_steps(100);
@@ -177,6 +321,29 @@ void HashTable::force_rehash() {
     }
 }
 
+HashNode *HashTable::find(std::size_t hash, std::string_view key) const {
+    for (std::size_t htidx = 0; htidx <= 1; htidx++) {
+        const std::size_t idx = hash & HT_MASK(size_exp[htidx]);
+        if (htidx == 0 && static_cast<std::int64_t>(idx) < rehash_idx) {
+            continue;
+        }
+
+        HashNode *node = table[htidx][idx];
+        while (node != nullptr) {
+            if (node->key == key || cmp(node->key, key)) {
+                return node;
+            }
+            node = node->next;
+        }
+
+        if (!is_rehashing()) {
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
 void HashTable::reset(std::size_t htidx) {
     table[htidx] = nullptr;
     used[htidx] = 0;
@@ -225,6 +392,8 @@ bool HashTable::expand(std::size_t size) {
         return false;
     }
 
+    // Zeroing a large table takes a while
+    const LatencySpan latency{LatencyEvent::REHASH};
     // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
     auto *new_table = new HashNode *[new_size]();
 
@@ -298,7 +467,10 @@ bool HashTable::check_rehash_complete() {
         return false;
     }
 
-    delete[] table[0]; // NOLINT(cppcoreguidelines-owning-memory)
+    {
+        const LatencySpan latency{LatencyEvent::REHASH};
+        delete[] table[0]; // NOLINT(cppcoreguidelines-owning-memory)
+    }
 
     table[0] = table[1];
     used[0] = used[1];
@@ -0,0 +1,146 @@
+#include "hotkeys.hpp"
+
+#include <algorithm>   // std::max, std::min, std::sort
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint32_t, std::uint64_t
+#include <cstring>     // std::memcpy
+#include <functional>  // std::hash
+#include <limits>      // std::numeric_limits
+#include <string_view> // std::string_view
+#include <utility>     // std::swap
+#include <vector>      // std::vector
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+HotKeys hotkeys;
+
+namespace {
+// The rows take 16 bits of the hash each
+static_assert(HOTKEYS_DEPTH * 16 <= 64 && HOTKEYS_WIDTH <= 1U << 16);
+static_assert((HOTKEYS_WIDTH & (HOTKEYS_WIDTH - 1)) == 0);
+static_assert(HOTKEYS_KEY_MAX <= 255 && HOTKEYS_TOP <= 256);
+
+std::size_t cell(std::uint64_t hash, std::size_t row) {
+    return (hash >> (16 * row)) & (HOTKEYS_WIDTH - 1);
+}
+
+std::uint64_t hash_key(std::string_view key) {
+    return std::hash<std::string_view>{}(key);
+}
+} // namespace
+
+std::uint32_t HotKeys::add(std::string_view key) {
+    const std::uint64_t hash = hash_key(key);
+
+    std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
+    for (std::size_t i = 0; i < HOTKEYS_DEPTH; i++) {
+        min = std::min(min, rows[i][cell(hash, i)]);
+    }
+
+    // Conservative update, only the counters at the minimum grow, which keeps
+    // the keys sharing the others from being overestimated
+    const std::uint32_t count = min + 1;
+    for (std::size_t i = 0; i < HOTKEYS_DEPTH; i++) {
+        auto &counter = rows[i][cell(hash, i)];
+        counter = std::max(counter, count);
+    }
+
+    if (heap_size < HOTKEYS_TOP || count > heap[0].count) {
+        offer(hash, key, count);
+    }
+
+    total++;
+    if (++since_decay == HOTKEYS_DECAY_PERIOD) {
+        decay();
+    }
+    return count;
+}
+
+std::uint32_t HotKeys::estimate(std::string_view key) const {
+    const std::uint64_t hash = hash_key(key);
+    std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
+    for (std::size_t i = 0; i < HOTKEYS_DEPTH; i++) {
+        min = std::min(min, rows[i][cell(hash, i)]);
+    }
+    return min;
+}
+
+std::vector<HotKey> HotKeys::top(std::size_t n) const {
+    std::vector<HotKey> result;
+    result.reserve(heap_size);
+    for (std::size_t i = 0; i < heap_size; i++) {
+        const Entry &entry = heap[i];
+        result.push_back({std::string(keys[entry.slot].data(), key_lens[entry.slot]),
+                          entry.count});
+    }
+    std::sort(result.begin(), result.end(),
+              [](const HotKey &a, const HotKey &b) { return a.count > b.count; });
+    result.resize(std::min(n, result.size()));
+    return result;
+}
+
+void HotKeys::clear() { *this = HotKeys{}; }
+
+void HotKeys::offer(std::uint64_t hash, std::string_view key, std::uint32_t count) {
+    // Already one of the top keys, its count only grows
+    for (std::size_t i = 0; i < heap_size; i++) {
+        if (heap_hashes[i] == hash) {
+            heap[i].count = count;
+            sift_down(i);
+            return;
+        }
+    }
+
+    std::size_t i = 0;
+    if (heap_size < HOTKEYS_TOP) {
+        // Sift the new entry up from the end
+        i = heap_size;
+        heap[i].slot = static_cast<std::uint8_t>(heap_size++);
+        while (i > 0 && heap[(i - 1) / 2].count > count) {
+            swap_entries(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+    // Otherwise the coldest key is replaced, reusing its slot
+
+    const std::size_t len = std::min(key.size(), HOTKEYS_KEY_MAX);
+    std::memcpy(keys[heap[i].slot].data(), key.data(), len);
+    key_lens[heap[i].slot] = static_cast<std::uint8_t>(len);
+    heap_hashes[i] = hash;
+    heap[i].count = count;
+    sift_down(i);
+}
+
+void HotKeys::swap_entries(std::size_t i, std::size_t j) {
+    std::swap(heap[i], heap[j]);
+    std::swap(heap_hashes[i], heap_hashes[j]);
+}
+
+void HotKeys::sift_down(std::size_t i) {
+    while (true) {
+        std::size_t min = i;
+        for (const std::size_t child : {2 * i + 1, 2 * i + 2}) {
+            if (child < heap_size && heap[child].count < heap[min].count) {
+                min = child;
+            }
+        }
+        if (min == i) {
+            return;
+        }
+        swap_entries(i, min);
+        i = min;
+    }
+}
+
+void HotKeys::decay() {
+    since_decay = 0;
+    for (auto &row : rows) {
+        for (auto &counter : row) {
+            counter >>= 1;
+        }
+    }
+    // Halving keeps the heap order
+    for (std::size_t i = 0; i < heap_size; i++) {
+        heap[i].count >>= 1;
+    }
+}
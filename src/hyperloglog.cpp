@@ -0,0 +1,314 @@
+#include "hyperloglog.hpp"
+#include "cpu.hpp"
+
+#include <immintrin.h> // AVX2 intrinsics
+
+#include <algorithm> // std::lower_bound, std::max
+#include <cmath>     // std::log, std::ldexp, std::llround
+#include <cstddef>   // std::size_t
+#include <cstdint>   // std::uint8_t, std::uint32_t, std::uint64_t
+#include <cstring>   // std::memcpy
+
+namespace {
+// MurmurHash64A, the same hash Redis uses for its HyperLogLog
+std::uint64_t murmur64(std::string_view key) {
+    constexpr std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+    constexpr int r = 47;
+    constexpr std::uint64_t seed = 0xadc83b19ULL;
+
+    std::uint64_t h = seed ^ (key.size() * m);
+    const char *p = key.data();
+    const char *end = p + (key.size() & ~std::size_t{7});
+
+    for (; p != end; p += 8) {
+        std::uint64_t k = 0;
+        std::memcpy(&k, p, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const std::size_t tail = key.size() & 7;
+    for (std::size_t i = tail; i > 0; i--) {
+        h ^= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i - 1]))
+             << (8 * (i - 1));
+    }
+    if (tail != 0) {
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+constexpr std::uint8_t REG_MASK = (1 << HLL_BITS) - 1;
+
+// Register i lives at bit 6 * i, least significant bits first
+std::uint8_t get_reg(const std::uint8_t *p, std::size_t idx) {
+    const std::size_t bit = idx * HLL_BITS;
+    const std::size_t byte = bit / 8;
+    const std::size_t shift = bit % 8;
+    unsigned v = p[byte] >> shift;
+    if (shift > 8 - HLL_BITS) {
+        v |= static_cast<unsigned>(p[byte + 1]) << (8 - shift);
+    }
+    return v & REG_MASK;
+}
+
+void set_reg(std::uint8_t *p, std::size_t idx, std::uint8_t value) {
+    const std::size_t bit = idx * HLL_BITS;
+    const std::size_t byte = bit / 8;
+    const std::size_t shift = bit % 8;
+    p[byte] = (p[byte] & ~(REG_MASK << shift)) | (value << shift);
+    if (shift > 8 - HLL_BITS) {
+        const std::size_t high = 8 - shift;
+        p[byte + 1] = (p[byte + 1] & ~(REG_MASK >> high)) | (value >> high);
+    }
+}
+
+void merge_dense_scalar(const std::uint8_t *p, HLLRegisters &regs, std::size_t from) {
+    for (std::size_t i = from; i < HLL_REGISTERS; i++) {
+        regs[i] = std::max(regs[i], get_reg(p, i));
+    }
+}
+
+/*
+    Every 3 bytes hold 4 registers. Each iteration spreads 8 such groups into the
+    8 32-bit lanes, then splits every lane into 4 bytes, one register each.
+*/
+__attribute__((target("avx2"))) void merge_dense_avx2(const std::uint8_t *p,
+                                                      HLLRegisters &regs) {
+    const __m256i perm = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10,
+                                          11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8,
+                                          -1, 9, 10, 11, -1);
+    const __m256i mask = _mm256_set1_epi32(REG_MASK);
+
+    std::size_t in = 0;
+    std::size_t out = 0;
+    // Each load reads 32 bytes but only consumes 24
+    for (; in + 32 <= HLL_DENSE_BYTES; in += 24, out += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + in));
+        x = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(x, perm), shuf);
+
+        const __m256i r0 = _mm256_and_si256(x, mask);
+        const __m256i r1 = _mm256_and_si256(_mm256_srli_epi32(x, 6), mask);
+        const __m256i r2 = _mm256_and_si256(_mm256_srli_epi32(x, 12), mask);
+        const __m256i r3 = _mm256_and_si256(_mm256_srli_epi32(x, 18), mask);
+        const __m256i y = _mm256_or_si256(
+            _mm256_or_si256(r0, _mm256_slli_epi32(r1, 8)),
+            _mm256_or_si256(_mm256_slli_epi32(r2, 16), _mm256_slli_epi32(r3, 24)));
+
+        auto *dst = reinterpret_cast<__m256i *>(regs.data() + out);
+        _mm256_storeu_si256(dst, _mm256_max_epu8(y, _mm256_loadu_si256(dst)));
+    }
+    merge_dense_scalar(p, regs, out);
+}
+
+void pack_scalar(const HLLRegisters &regs, std::uint8_t *p, std::size_t from) {
+    for (std::size_t i = from; i < HLL_REGISTERS; i++) {
+        set_reg(p, i, regs[i]);
+    }
+}
+
+// The inverse of merge_dense_avx2, 32 registers into 24 bytes per iteration
+__attribute__((target("avx2"))) void pack_avx2(const HLLRegisters &regs,
+                                               std::uint8_t *p) {
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1,
+                                          -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12,
+                                          13, 14, -1, -1, -1, -1);
+    const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    const __m256i store_mask = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+    const __m256i mask = _mm256_set1_epi32(REG_MASK);
+
+    std::size_t in = 0;
+    std::size_t out = 0;
+    for (; in + 32 <= HLL_REGISTERS; in += 32, out += 24) {
+        const __m256i v =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(regs.data() + in));
+
+        const __m256i r0 = _mm256_and_si256(v, mask);
+        const __m256i r1 = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+        const __m256i r2 = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+        const __m256i r3 = _mm256_and_si256(_mm256_srli_epi32(v, 24), mask);
+        __m256i x = _mm256_or_si256(
+            _mm256_or_si256(r0, _mm256_slli_epi32(r1, 6)),
+            _mm256_or_si256(_mm256_slli_epi32(r2, 12), _mm256_slli_epi32(r3, 18)));
+        x = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(x, shuf), perm);
+
+        _mm256_maskstore_epi32(reinterpret_cast<int *>(p + out), store_mask, x);
+    }
+}
+
+// Sum of 2^-reg and the number of zero registers
+void harmonic_scalar(const HLLRegisters &regs, double &sum, std::size_t &zeros) {
+    sum = 0;
+    zeros = 0;
+    for (const auto reg : regs) {
+        sum += std::ldexp(1.0, -reg);
+        zeros += reg == 0 ? 1 : 0;
+    }
+}
+
+__attribute__((target("avx2,popcnt"))) void
+harmonic_avx2(const HLLRegisters &regs, double &sum, std::size_t &zeros) {
+    // 2^-reg is the float with a biased exponent of 127 - reg and no mantissa
+    const __m256i bias = _mm256_set1_epi32(127);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256 acc = _mm256_setzero_ps();
+    zeros = 0;
+
+    for (std::size_t i = 0; i < HLL_REGISTERS; i += 32) {
+        const auto *base = regs.data() + i;
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(base));
+        zeros += _mm_popcnt_u32(
+            static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))));
+
+        for (std::size_t j = 0; j < 32; j += 8) {
+            const __m256i r = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(base + j)));
+            const __m256i bits = _mm256_slli_epi32(_mm256_sub_epi32(bias, r), 23);
+            acc = _mm256_add_ps(acc, _mm256_castsi256_ps(bits));
+        }
+    }
+
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, acc);
+    sum = 0;
+    for (const float lane : lanes) {
+        sum += lane;
+    }
+}
+
+std::uint64_t estimate_from(double sum, std::size_t zeros) {
+    constexpr auto m = static_cast<double>(HLL_REGISTERS);
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+
+    double e = alpha * m * m / sum;
+    // Small range correction, linear counting is more accurate there
+    if (e <= 2.5 * m && zeros != 0) {
+        e = m * std::log(m / static_cast<double>(zeros));
+    }
+    return static_cast<std::uint64_t>(std::llround(e));
+}
+
+std::size_t sparse_idx(std::uint32_t entry) { return entry >> 8; }
+std::uint8_t sparse_value(std::uint32_t entry) { return entry & 0xFF; }
+} // namespace
+
+bool HyperLogLog::add(std::string_view element) {
+    const std::uint64_t hash = murmur64(element);
+    const std::size_t idx = hash & (HLL_REGISTERS - 1);
+    // Make sure the count stops at the highest bit
+    const std::uint64_t rest = (hash >> HLL_P) | (1ULL << (64 - HLL_P));
+    const auto rank = static_cast<std::uint8_t>(__builtin_ctzll(rest) + 1);
+
+    return set_max(idx, rank);
+}
+
+std::uint64_t HyperLogLog::count() {
+    if (cached >= 0) {
+        return static_cast<std::uint64_t>(cached);
+    }
+
+    std::uint64_t card = 0;
+    if (is_sparse()) {
+        double sum = static_cast<double>(HLL_REGISTERS - sparse.size());
+        for (const auto entry : sparse) {
+            sum += std::ldexp(1.0, -sparse_value(entry));
+        }
+        card = estimate_from(sum, HLL_REGISTERS - sparse.size());
+    } else {
+        HLLRegisters regs{};
+        merge_into(regs);
+        card = estimate(regs);
+    }
+
+    cached = static_cast<std::int64_t>(card);
+    return card;
+}
+
+void HyperLogLog::merge_into(HLLRegisters &regs) const {
+    if (is_sparse()) {
+        for (const auto entry : sparse) {
+            auto &reg = regs[sparse_idx(entry)];
+            reg = std::max(reg, sparse_value(entry));
+        }
+        return;
+    }
+
+    if (Cpu::has_avx2()) {
+        merge_dense_avx2(dense.data(), regs);
+    } else {
+        merge_dense_scalar(dense.data(), regs, 0);
+    }
+}
+
+void HyperLogLog::assign(const HLLRegisters &regs) {
+    sparse = {};
+    dense.resize(HLL_DENSE_BYTES);
+    cached = -1;
+
+    if (Cpu::has_avx2()) {
+        pack_avx2(regs, dense.data());
+    } else {
+        pack_scalar(regs, dense.data(), 0);
+    }
+}
+
+bool HyperLogLog::is_sparse() const { return dense.empty(); }
+
+std::size_t HyperLogLog::bytes() const {
+    return is_sparse() ? sparse.size() * sizeof(std::uint32_t) : dense.size();
+}
+
+std::uint64_t HyperLogLog::estimate(const HLLRegisters &regs) {
+    double sum = 0;
+    std::size_t zeros = 0;
+    if (Cpu::has_avx2() && Cpu::has_popcnt()) {
+        harmonic_avx2(regs, sum, zeros);
+    } else {
+        harmonic_scalar(regs, sum, zeros);
+    }
+    return estimate_from(sum, zeros);
+}
+
+bool HyperLogLog::set_max(std::size_t idx, std::uint8_t value) {
+    if (!is_sparse()) {
+        if (get_reg(dense.data(), idx) >= value) {
+            return false;
+        }
+        set_reg(dense.data(), idx, value);
+        cached = -1;
+        return true;
+    }
+
+    const auto key = static_cast<std::uint32_t>(idx << 8);
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), key);
+    if (it != sparse.end() && sparse_idx(*it) == idx) {
+        if (sparse_value(*it) >= value) {
+            return false;
+        }
+        *it = key | value;
+    } else {
+        sparse.insert(it, key | value);
+    }
+    cached = -1;
+
+    if (sparse.size() > HLL_SPARSE_MAX) {
+        to_dense();
+    }
+    return true;
+}
+
+void HyperLogLog::to_dense() {
+    dense.resize(HLL_DENSE_BYTES);
+    for (const auto entry : sparse) {
+        set_reg(dense.data(), sparse_idx(entry), sparse_value(entry));
+    }
+    sparse = {};
+}
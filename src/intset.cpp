@@ -0,0 +1,420 @@
+#include "intset.hpp"
+#include "cpu.hpp"
+
+#include <immintrin.h> // SSE4.2, AVX2 intrinsics
+
+#include <algorithm>   // std::sort, std::unique, std::lower_bound, std::max
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::int16_t, std::int32_t, std::int64_t
+#include <cstring>     // std::memcpy, std::memmove
+#include <limits>      // std::numeric_limits
+#include <type_traits> // std::remove_const_t, std::remove_pointer_t
+#include <utility>     // std::move
+
+namespace {
+IntSetEnc enc_for(std::int64_t value) {
+    if (value >= std::numeric_limits<std::int16_t>::min() &&
+        value <= std::numeric_limits<std::int16_t>::max()) {
+        return IntSetEnc::INT16;
+    }
+    if (value >= std::numeric_limits<std::int32_t>::min() &&
+        value <= std::numeric_limits<std::int32_t>::max()) {
+        return IntSetEnc::INT32;
+    }
+    return IntSetEnc::INT64;
+}
+
+std::size_t width(IntSetEnc enc) { return static_cast<std::size_t>(enc); }
+
+std::int64_t load(const std::byte *p, IntSetEnc enc) {
+    switch (enc) {
+    case IntSetEnc::INT16: {
+        std::int16_t v = 0;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case IntSetEnc::INT32: {
+        std::int32_t v = 0;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case IntSetEnc::INT64:
+        break;
+    }
+    std::int64_t v = 0;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void store(std::byte *p, IntSetEnc enc, std::int64_t value) {
+    switch (enc) {
+    case IntSetEnc::INT16: {
+        const auto v = static_cast<std::int16_t>(value);
+        std::memcpy(p, &v, sizeof(v));
+        return;
+    }
+    case IntSetEnc::INT32: {
+        const auto v = static_cast<std::int32_t>(value);
+        std::memcpy(p, &v, sizeof(v));
+        return;
+    }
+    case IntSetEnc::INT64:
+        std::memcpy(p, &value, sizeof(value));
+        return;
+    }
+}
+
+/*
+    Intersection kernels. All of them take two sorted arrays without duplicates
+    and append the common elements to out in ascending order.
+
+    The SIMD kernels compare a block of a against a block of b all-to-all, then
+    advance whichever block has the smaller maximum (or both). An element can only
+    match once because b has no duplicates, so the output stays sorted. The
+    leftover tails are handled by the scalar merge.
+*/
+template <typename T>
+void intersect_scalar(const T *a, std::size_t na, const T *b, std::size_t nb,
+                      std::vector<std::int64_t> &out) {
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out.push_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+}
+
+// One side is much smaller than the other, binary search it into the bigger one
+template <typename T>
+void intersect_search(const T *small, std::size_t ns, const T *large, std::size_t nl,
+                      std::vector<std::int64_t> &out) {
+    const T *lo = large;
+    const T *end = large + nl;
+    for (std::size_t i = 0; i < ns && lo != end; i++) {
+        lo = std::lower_bound(lo, end, small[i]);
+        if (lo != end && *lo == small[i]) {
+            out.push_back(small[i]);
+        }
+    }
+}
+
+template <typename T>
+void emit_mask(const T *a, unsigned mask, std::vector<std::int64_t> &out) {
+    while (mask != 0) {
+        out.push_back(a[__builtin_ctz(mask)]);
+        mask &= mask - 1;
+    }
+}
+
+template <typename T>
+void advance_blocks(const T *a, std::size_t &i, const T *b, std::size_t &j,
+                    std::size_t block) {
+    const T amax = a[i + block - 1];
+    const T bmax = b[j + block - 1];
+    if (amax <= bmax) {
+        i += block;
+    }
+    if (bmax <= amax) {
+        j += block;
+    }
+}
+
+// 8 x 16-bit lanes, pcmpestrm reports which lanes of a equal any lane of b
+__attribute__((target("sse4.2"))) void
+intersect_sse42(const std::int16_t *a, std::size_t na, const std::int16_t *b,
+                std::size_t nb, std::vector<std::int64_t> &out) {
+    constexpr std::size_t block = 8;
+    constexpr int mode = _SIDD_SWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i + block <= na && j + block <= nb) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+        const __m128i res = _mm_cmpestrm(vb, block, va, block, mode);
+        emit_mask(a + i, static_cast<unsigned>(_mm_cvtsi128_si32(res)), out);
+        advance_blocks(a, i, b, j, block);
+    }
+    intersect_scalar(a + i, na - i, b + j, nb - j, out);
+}
+
+// 4 x 32-bit lanes, compare against every rotation of the b block
+__attribute__((target("sse4.2"))) void
+intersect_sse42(const std::int32_t *a, std::size_t na, const std::int32_t *b,
+                std::size_t nb, std::vector<std::int64_t> &out) {
+    constexpr std::size_t block = 4;
+
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i + block <= na && j + block <= nb) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+        __m128i eq = _mm_cmpeq_epi32(va, vb);
+        for (std::size_t r = 1; r < block; r++) {
+            vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        }
+        emit_mask(a + i, _mm_movemask_ps(_mm_castsi128_ps(eq)), out);
+        advance_blocks(a, i, b, j, block);
+    }
+    intersect_scalar(a + i, na - i, b + j, nb - j, out);
+}
+
+// 8 x 32-bit lanes
+__attribute__((target("avx2"))) void
+intersect_avx2(const std::int32_t *a, std::size_t na, const std::int32_t *b,
+               std::size_t nb, std::vector<std::int64_t> &out) {
+    constexpr std::size_t block = 8;
+    const __m256i rotate = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i + block <= na && j + block <= nb) {
+        const __m256i va =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (std::size_t r = 1; r < block; r++) {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+        }
+        emit_mask(a + i, _mm256_movemask_ps(_mm256_castsi256_ps(eq)), out);
+        advance_blocks(a, i, b, j, block);
+    }
+    intersect_scalar(a + i, na - i, b + j, nb - j, out);
+}
+
+// 4 x 64-bit lanes
+__attribute__((target("avx2"))) void
+intersect_avx2(const std::int64_t *a, std::size_t na, const std::int64_t *b,
+               std::size_t nb, std::vector<std::int64_t> &out) {
+    constexpr std::size_t block = 4;
+
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i + block <= na && j + block <= nb) {
+        const __m256i va =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+        __m256i eq = _mm256_cmpeq_epi64(va, vb);
+        for (std::size_t r = 1; r < block; r++) {
+            vb = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(0, 3, 2, 1));
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, vb));
+        }
+        emit_mask(a + i, _mm256_movemask_pd(_mm256_castsi256_pd(eq)), out);
+        advance_blocks(a, i, b, j, block);
+    }
+    intersect_scalar(a + i, na - i, b + j, nb - j, out);
+}
+
+template <typename T>
+void intersect_same(const T *a, std::size_t na, const T *b, std::size_t nb,
+                    std::vector<std::int64_t> &out) {
+    // Merging costs O(na + nb), searching costs O(ns * log(nl))
+    constexpr std::size_t skew = 64;
+    if (na * skew < nb) {
+        intersect_search(a, na, b, nb, out);
+        return;
+    }
+    if (nb * skew < na) {
+        intersect_search(b, nb, a, na, out);
+        return;
+    }
+
+    if constexpr (sizeof(T) == sizeof(std::int16_t)) {
+        if (Cpu::has_sse42()) {
+            intersect_sse42(a, na, b, nb, out);
+            return;
+        }
+    } else if constexpr (sizeof(T) == sizeof(std::int32_t)) {
+        if (Cpu::has_avx2()) {
+            intersect_avx2(a, na, b, nb, out);
+            return;
+        }
+        if (Cpu::has_sse42()) {
+            intersect_sse42(a, na, b, nb, out);
+            return;
+        }
+    } else {
+        if (Cpu::has_avx2()) {
+            intersect_avx2(a, na, b, nb, out);
+            return;
+        }
+    }
+    intersect_scalar(a, na, b, nb, out);
+}
+} // namespace
+
+bool IntSet::add(std::int64_t value) {
+    const IntSetEnc value_enc = enc_for(value);
+    if (value_enc > enc) {
+        // The value is out of range, so it is either the smallest or the largest
+        upgrade(value_enc);
+        data.resize((len + 1) * width(enc));
+        if (value < 0) {
+            std::memmove(&data[width(enc)], data.data(), len * width(enc));
+            set_at(0, value);
+        } else {
+            set_at(len, value);
+        }
+        len++;
+        return true;
+    }
+
+    std::size_t pos = 0;
+    if (search(value, pos)) {
+        return false;
+    }
+
+    const std::size_t w = width(enc);
+    data.resize((len + 1) * w);
+    std::memmove(&data[(pos + 1) * w], &data[pos * w], (len - pos) * w);
+    set_at(pos, value);
+    len++;
+
+    return true;
+}
+
+std::size_t IntSet::add(std::vector<std::int64_t> values) {
+    if (values.empty()) {
+        return 0;
+    }
+    if (values.size() == 1) {
+        return add(values[0]) ? 1 : 0;
+    }
+
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    const IntSetEnc new_enc =
+        std::max({enc, enc_for(values.front()), enc_for(values.back())});
+    if (new_enc > enc) {
+        upgrade(new_enc);
+    }
+
+    // Merge the old elements and the batch into a new array
+    const std::size_t w = width(enc);
+    std::vector<std::byte> merged((len + values.size()) * w);
+    std::size_t i = 0;
+    std::size_t j = 0;
+    std::size_t n = 0;
+    while (i < len || j < values.size()) {
+        std::int64_t value = 0;
+        if (j == values.size() || (i < len && at(i) < values[j])) {
+            value = at(i++);
+        } else if (i == len || values[j] < at(i)) {
+            value = values[j++];
+        } else {
+            value = at(i++);
+            j++;
+        }
+        store(&merged[n++ * w], enc, value);
+    }
+
+    const std::size_t added = n - len;
+    merged.resize(n * w);
+    data = std::move(merged);
+    len = n;
+
+    return added;
+}
+
+bool IntSet::remove(std::int64_t value) {
+    std::size_t pos = 0;
+    if (enc_for(value) > enc || !search(value, pos)) {
+        return false;
+    }
+
+    const std::size_t w = width(enc);
+    std::memmove(&data[pos * w], &data[(pos + 1) * w], (len - pos - 1) * w);
+    len--;
+    data.resize(len * w);
+
+    return true;
+}
+
+bool IntSet::contains(std::int64_t value) const {
+    std::size_t pos = 0;
+    return enc_for(value) <= enc && search(value, pos);
+}
+
+std::int64_t IntSet::at(std::size_t idx) const {
+    return load(&data[idx * width(enc)], enc);
+}
+
+std::vector<std::int64_t> IntSet::values() const {
+    return visit([this](const auto *p) { return std::vector<std::int64_t>(p, p + len); });
+}
+
+std::size_t IntSet::size() const { return len; }
+std::size_t IntSet::bytes() const { return data.size(); }
+IntSetEnc IntSet::encoding() const { return enc; }
+
+void IntSet::intersect(const IntSet &a, const IntSet &b,
+                       std::vector<std::int64_t> &out) {
+    if (a.len == 0 || b.len == 0) {
+        return;
+    }
+
+    if (a.enc != b.enc) {
+        // Rare enough that a merge through the generic accessor will do
+        std::size_t i = 0;
+        std::size_t j = 0;
+        while (i < a.len && j < b.len) {
+            const std::int64_t x = a.at(i);
+            const std::int64_t y = b.at(j);
+            if (x < y) {
+                i++;
+            } else if (y < x) {
+                j++;
+            } else {
+                out.push_back(x);
+                i++;
+                j++;
+            }
+        }
+        return;
+    }
+
+    out.reserve(out.size() + std::min(a.len, b.len));
+    a.visit([&](const auto *pa) {
+        using T = std::remove_const_t<std::remove_pointer_t<decltype(pa)>>;
+        const auto *pb = reinterpret_cast<const T *>(b.data.data());
+        intersect_same(pa, a.len, pb, b.len, out);
+    });
+}
+
+bool IntSet::search(std::int64_t value, std::size_t &pos) const {
+    return visit([&](const auto *p) {
+        using T = std::remove_const_t<std::remove_pointer_t<decltype(p)>>;
+        const auto *it = std::lower_bound(p, p + len, static_cast<T>(value));
+        pos = it - p;
+        return it != p + len && *it == value;
+    });
+}
+
+void IntSet::set_at(std::size_t idx, std::int64_t value) {
+    store(&data[idx * width(enc)], enc, value);
+}
+
+void IntSet::upgrade(IntSetEnc new_enc) {
+    const IntSetEnc old_enc = enc;
+    const std::size_t old_w = width(old_enc);
+    const std::size_t new_w = width(new_enc);
+
+    data.resize(len * new_w);
+
+    // Widen from the back so no element is overwritten before it is read
+    for (std::size_t i = len; i-- > 0;) {
+        store(&data[i * new_w], new_enc, load(&data[i * old_w], old_enc));
+    }
+
+    enc = new_enc;
+}
@@ -0,0 +1,198 @@
+#include "latency.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>   // std::max, std::min
+#include <array>       // std::array
+#include <atomic>      // std::atomic
+#include <cerrno>      // errno
+#include <chrono>      // std::chrono::milliseconds
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint32_t, std::uint64_t
+#include <cstring>     // std::strerror
+#include <ctime>       // clock_gettime, timespec, std::time
+#include <optional>    // std::optional, std::nullopt
+#include <string_view> // std::string_view
+#include <thread>      // std::thread, std::this_thread
+#include <vector>      // std::vector
+
+#include <csignal>    // sigaction, SIGALRM
+#include <execinfo.h> // backtrace, backtrace_symbols_fd
+#include <pthread.h>  // pthread_self, pthread_kill
+#include <unistd.h>   // write, STDERR_FILENO
+
+namespace {
+constexpr std::array<std::string_view, LATENCY_EVENTS> EVENT_NAMES = {
+    "command", "event-loop", "rehash", "expire-cycle", "eviction", "free"};
+constexpr std::size_t WATCHDOG_FRAMES = 64;
+
+struct History {
+    std::array<LatencySample, LATENCY_HISTORY_LEN> samples{};
+    std::size_t next = 0;
+    std::size_t size = 0;
+    std::uint32_t max = 0;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+std::array<History, LATENCY_EVENTS> histories;
+
+std::size_t last(const History &history) {
+    return (history.next + LATENCY_HISTORY_LEN - 1) % LATENCY_HISTORY_LEN;
+}
+
+std::uint64_t iteration_start = 0;
+// Start of the running iteration in microseconds, 0 while waiting for events
+std::atomic<std::uint64_t> busy_since{0};
+bool watchdog = false;
+pthread_t loop_thread{};
+
+void on_stall(int /*sig*/) {
+    // Only async-signal-safe calls, backtrace was called once before
+    constexpr std::string_view msg = "--- WATCHDOG: event loop stalled, its stack:\n";
+    const ssize_t n = write(STDERR_FILENO, msg.data(), msg.size());
+    (void)n;
+    std::array<void *, WATCHDOG_FRAMES> frames{};
+    const int nframes = backtrace(frames.data(), static_cast<int>(frames.size()));
+    backtrace_symbols_fd(frames.data(), nframes, STDERR_FILENO);
+}
+
+void watch(std::uint32_t period_ms) {
+    std::uint64_t reported = 0;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(period_ms / 2 + 1));
+        const std::uint64_t start = busy_since.load(std::memory_order_relaxed);
+        if (start == 0 || start == reported ||
+            Latency::now_us() - start < std::uint64_t{period_ms} * 1000) {
+            continue;
+        }
+        reported = start;
+        pthread_kill(loop_thread, SIGALRM);
+    }
+}
+} // namespace
+
+std::optional<LatencyEvent> to_latency_event(std::string_view name) {
+    for (std::size_t i = 0; i < EVENT_NAMES.size(); i++) {
+        if (EVENT_NAMES[i] == name) {
+            return static_cast<LatencyEvent>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view to_string(LatencyEvent event) {
+    return EVENT_NAMES[static_cast<std::size_t>(event)];
+}
+
+namespace Latency {
+std::uint32_t threshold_ms = 0;
+
+void set_threshold(std::uint32_t ms) { threshold_ms = ms; }
+
+std::uint32_t threshold() { return threshold_ms; }
+
+std::uint64_t now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000ULL + ts.tv_nsec / 1000;
+}
+
+void add_sample(LatencyEvent event, std::uint64_t us) {
+    if (threshold_ms == 0 || us < std::uint64_t{threshold_ms} * 1000) {
+        return;
+    }
+
+    const auto ms = static_cast<std::uint32_t>(us / 1000);
+    const std::int64_t time = std::time(nullptr);
+    History &history = histories[static_cast<std::size_t>(event)];
+    history.max = std::max(history.max, ms);
+
+    // Several samples in the same second keep the worst
+    if (history.size > 0) {
+        LatencySample &sample = history.samples[last(history)];
+        if (sample.time == time) {
+            sample.ms = std::max(sample.ms, ms);
+            return;
+        }
+    }
+
+    history.samples[history.next] = {time, ms};
+    history.next = (history.next + 1) % LATENCY_HISTORY_LEN;
+    history.size = std::min(history.size + 1, LATENCY_HISTORY_LEN);
+}
+
+std::vector<LatencyStats> latest() {
+    std::vector<LatencyStats> stats;
+    for (std::size_t i = 0; i < LATENCY_EVENTS; i++) {
+        const History &history = histories[i];
+        if (history.size == 0) {
+            continue;
+        }
+        const LatencySample &sample = history.samples[last(history)];
+        stats.push_back(
+            {static_cast<LatencyEvent>(i), sample.time, sample.ms, history.max});
+    }
+    return stats;
+}
+
+std::vector<LatencySample> history(LatencyEvent event) {
+    const History &history = histories[static_cast<std::size_t>(event)];
+    std::vector<LatencySample> samples;
+    samples.reserve(history.size);
+    const std::size_t first =
+        (history.next + LATENCY_HISTORY_LEN - history.size) % LATENCY_HISTORY_LEN;
+    for (std::size_t i = 0; i < history.size; i++) {
+        samples.push_back(history.samples[(first + i) % LATENCY_HISTORY_LEN]);
+    }
+    return samples;
+}
+
+bool reset(LatencyEvent event) {
+    History &history = histories[static_cast<std::size_t>(event)];
+    const bool had_samples = history.size > 0;
+    history = History{};
+    return had_samples;
+}
+
+void begin_iteration() {
+    if (!enabled() && !watchdog) {
+        return;
+    }
+    iteration_start = now_us();
+    if (watchdog) {
+        busy_since.store(iteration_start, std::memory_order_relaxed);
+    }
+}
+
+void end_iteration() {
+    if (iteration_start == 0) {
+        return;
+    }
+    add_sample(LatencyEvent::EVENT_LOOP, now_us() - iteration_start);
+    iteration_start = 0;
+    if (watchdog) {
+        busy_since.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool start_watchdog(std::uint32_t period_ms) {
+    // The first call may allocate, which is not safe in a signal handler
+    std::array<void *, 1> frame{};
+    backtrace(frame.data(), 1);
+
+    struct sigaction action {};
+    action.sa_handler = on_stall;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGALRM, &action, nullptr) == -1) {
+        LOG_ERROR(fmt::format("sigaction failed: {}", std::strerror(errno)));
+        return false;
+    }
+
+    loop_thread = pthread_self();
+    watchdog = true;
+    std::thread{watch, period_ms}.detach();
+    return true;
+}
+} // namespace Latency
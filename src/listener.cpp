@@ -0,0 +1,170 @@
+#include "listener.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <cerrno>  // errno
+#include <cstring> // std::strerror
+#include <vector>  // std::vector
+
+#include <arpa/inet.h>   // inet_pton
+#include <netinet/in.h>  // sockaddr_in, IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <sys/socket.h>  // bind, listen, setsockopt, socket, sockaddr
+#include <sys/stat.h>    // chmod
+#include <sys/un.h>      // sockaddr_un
+#include <unistd.h>      // close, unlink
+
+namespace {
+bool set_int_option(int fd, int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+        LOG_ERROR(fmt::format("setsockopt {} failed: {}", what, std::strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+// Options inherited by the accepted sockets
+bool set_options(int fd, const Config &config, bool is_unix) {
+    if (config.sndbuf > 0 &&
+        !set_int_option(fd, SOL_SOCKET, SO_SNDBUF, config.sndbuf, "SO_SNDBUF")) {
+        return false;
+    }
+    // Before listen, the TCP window scale is negotiated from it
+    if (config.rcvbuf > 0 &&
+        !set_int_option(fd, SOL_SOCKET, SO_RCVBUF, config.rcvbuf, "SO_RCVBUF")) {
+        return false;
+    }
+    if (is_unix) {
+        return true;
+    }
+
+    if (config.tcp_nodelay &&
+        !set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY")) {
+        return false;
+    }
+    if (config.busy_poll > 0 &&
+        !set_int_option(fd, SOL_SOCKET, SO_BUSY_POLL, config.busy_poll, "SO_BUSY_POLL")) {
+        return false;
+    }
+    return true;
+}
+
+int listen_tcp(const Config &config) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.bind.c_str(), &addr.sin_addr) != 1) {
+        LOG_ERROR(fmt::format("Invalid bind address: {}", config.bind));
+        return -1;
+    }
+
+    const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        LOG_ERROR(fmt::format("socket failed: {}", std::strerror(errno)));
+        return -1;
+    }
+
+    if (!set_int_option(listen_fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR") ||
+        (config.reuseport &&
+         !set_int_option(listen_fd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT")) ||
+        !set_options(listen_fd, config, false)) {
+        close(listen_fd);
+        return -1;
+    }
+
+    if (bind(listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1) {
+        LOG_ERROR(fmt::format("bind failed: {}", std::strerror(errno)));
+        close(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, config.tcp_backlog) == -1) {
+        LOG_ERROR(fmt::format("listen failed: {}", std::strerror(errno)));
+        close(listen_fd);
+        return -1;
+    }
+
+    LOG_INFO(fmt::format("Listening on {}:{}", config.bind, config.port));
+    return listen_fd;
+}
+
+int listen_unix(const Config &config) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (config.unixsocket.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR(fmt::format("Unix socket path too long: {}", config.unixsocket));
+        return -1;
+    }
+    config.unixsocket.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        LOG_ERROR(fmt::format("socket failed: {}", std::strerror(errno)));
+        return -1;
+    }
+
+    if (!set_options(listen_fd, config, true)) {
+        close(listen_fd);
+        return -1;
+    }
+
+    // Remove the socket file left behind by a previous run
+    unlink(config.unixsocket.c_str());
+
+    if (bind(listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1) {
+        LOG_ERROR(fmt::format("bind failed: {}", std::strerror(errno)));
+        close(listen_fd);
+        return -1;
+    }
+
+    if (config.unixsocketperm != 0 &&
+        chmod(config.unixsocket.c_str(), config.unixsocketperm) == -1) {
+        LOG_ERROR(fmt::format("chmod failed: {}", std::strerror(errno)));
+        close(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, config.tcp_backlog) == -1) {
+        LOG_ERROR(fmt::format("listen failed: {}", std::strerror(errno)));
+        close(listen_fd);
+        return -1;
+    }
+
+    LOG_INFO(fmt::format("Listening on {}", config.unixsocket));
+    return listen_fd;
+}
+} // namespace
+
+std::vector<Listener> open_listeners(const Config &config) {
+    std::vector<Listener> listeners;
+
+    if (config.port != 0) {
+        const int fd = listen_tcp(config);
+        if (fd == -1) {
+            return {};
+        }
+        listeners.push_back({fd, false});
+    }
+
+    if (!config.unixsocket.empty()) {
+        const int fd = listen_unix(config);
+        if (fd == -1) {
+            for (const auto &listener : listeners) {
+                close(listener.fd);
+            }
+            return {};
+        }
+        listeners.push_back({fd, true});
+    }
+
+    if (listeners.empty()) {
+        LOG_ERROR("Nothing to listen on, set a port or a unixsocket");
+    }
+
+    for (const auto &listener : listeners) {
+        set_nonblocking(listener.fd);
+    }
+    return listeners;
+}
@@ -0,0 +1,249 @@
+#include "pubsub.hpp"
+#include "connection.hpp"
+#include "utils.hpp"
+
+#include <algorithm>     // std::find, std::find_if
+#include <array>         // std::array
+#include <cstddef>       // std::size_t
+#include <map>           // std::map
+#include <memory>        // std::make_shared, std::make_unique, std::unique_ptr
+#include <string>        // std::string
+#include <string_view>   // std::string_view
+#include <unordered_map> // std::unordered_map
+#include <unordered_set> // std::unordered_set
+#include <vector>        // std::vector
+
+namespace {
+using Subscribers = std::vector<Connection *>;
+
+struct Pattern {
+    std::string pattern;
+    Subscribers subscribers;
+};
+
+struct Client {
+    std::unordered_set<std::string> channels;
+    std::unordered_set<std::string> patterns;
+};
+
+struct State {
+    std::unordered_map<std::string, Subscribers> channels;
+    // Patterns by glob_prefix
+    std::unordered_map<std::string, std::vector<Pattern>> patterns;
+    // Lengths of the prefixes in patterns, with how many prefixes have each
+    std::map<std::size_t, std::size_t> prefix_lens;
+    std::size_t num_patterns = 0;
+    std::unordered_map<const Connection *, Client> clients;
+    std::vector<int> woken;
+
+    // Encodes the messages, see encode
+    std::unique_ptr<Connection> scratch = std::make_unique<Connection>(-1);
+    std::string prefix;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+State state;
+
+// A message in each protocol, encoded on first use. Indexed by Proto - 1, a
+// subscriber has sent a request so its protocol is known.
+using Frames = std::array<SharedStr, 3>;
+
+SharedStr encode(Proto proto, const std::vector<std::string_view> &elems) {
+    auto &scratch = state.scratch;
+    scratch->proto = proto;
+    const std::size_t pos = begin_arr(scratch);
+    for (const auto elem : elems) {
+        add_reply_raw(scratch, elem);
+    }
+    end_push(scratch, pos, elems.size());
+
+    auto frame = std::make_shared<std::string>(
+        reinterpret_cast<const char *>(scratch->wbuf.data()), scratch->wbuf_size);
+    wbuf_discard(scratch);
+    return frame;
+}
+
+void deliver(Connection &conn, Frames &frames,
+             const std::vector<std::string_view> &elems) {
+    SharedStr &frame = frames[static_cast<std::size_t>(conn.proto) - 1];
+    if (frame == nullptr) {
+        frame = encode(conn.proto, elems);
+    }
+
+    // A connection with output pending is already on its way to be sent
+    const bool idle = conn.wbuf_pos == conn.wbuf_size && conn.wref_bytes == 0;
+    add_shared(conn, frame);
+    if (idle) {
+        state.woken.push_back(conn.fd);
+    }
+}
+
+void remove(Subscribers &subscribers, const Connection *conn) {
+    const auto it = std::find(subscribers.begin(), subscribers.end(), conn);
+    if (it != subscribers.end()) {
+        *it = subscribers.back();
+        subscribers.pop_back();
+    }
+}
+
+void drop_client_if_empty(const Connection &conn) {
+    const auto it = state.clients.find(&conn);
+    if (it != state.clients.end() && it->second.channels.empty() &&
+        it->second.patterns.empty()) {
+        state.clients.erase(it);
+    }
+}
+} // namespace
+
+namespace PubSub {
+bool subscribe(Connection &conn, std::string_view channel) {
+    if (!state.clients[&conn].channels.emplace(channel).second) {
+        return false;
+    }
+    state.channels[std::string(channel)].push_back(&conn);
+    conn.subscriptions++;
+    return true;
+}
+
+bool unsubscribe(Connection &conn, std::string_view channel) {
+    const auto client = state.clients.find(&conn);
+    if (client == state.clients.end() ||
+        client->second.channels.erase(std::string(channel)) == 0) {
+        return false;
+    }
+
+    const auto it = state.channels.find(std::string(channel));
+    remove(it->second, &conn);
+    if (it->second.empty()) {
+        state.channels.erase(it);
+    }
+    conn.subscriptions--;
+    drop_client_if_empty(conn);
+    return true;
+}
+
+bool psubscribe(Connection &conn, std::string_view pattern) {
+    if (!state.clients[&conn].patterns.emplace(pattern).second) {
+        return false;
+    }
+
+    const std::string_view prefix = glob_prefix(pattern);
+    auto &list = state.patterns[std::string(prefix)];
+    if (list.empty()) {
+        state.prefix_lens[prefix.size()]++;
+    }
+    auto it = std::find_if(list.begin(), list.end(),
+                           [pattern](const Pattern &p) { return p.pattern == pattern; });
+    if (it == list.end()) {
+        list.push_back({std::string(pattern), {}});
+        it = list.end() - 1;
+        state.num_patterns++;
+    }
+    it->subscribers.push_back(&conn);
+    conn.subscriptions++;
+    return true;
+}
+
+bool punsubscribe(Connection &conn, std::string_view pattern) {
+    const auto client = state.clients.find(&conn);
+    if (client == state.clients.end() ||
+        client->second.patterns.erase(std::string(pattern)) == 0) {
+        return false;
+    }
+
+    const std::string_view prefix = glob_prefix(pattern);
+    const auto found = state.patterns.find(std::string(prefix));
+    auto &list = found->second;
+    const auto it = std::find_if(list.begin(), list.end(), [pattern](const Pattern &p) {
+        return p.pattern == pattern;
+    });
+    remove(it->subscribers, &conn);
+    if (it->subscribers.empty()) {
+        list.erase(it);
+        state.num_patterns--;
+    }
+    if (list.empty()) {
+        state.patterns.erase(found);
+        if (--state.prefix_lens[prefix.size()] == 0) {
+            state.prefix_lens.erase(prefix.size());
+        }
+    }
+    conn.subscriptions--;
+    drop_client_if_empty(conn);
+    return true;
+}
+
+std::vector<std::string> channels(const Connection &conn) {
+    const auto it = state.clients.find(&conn);
+    if (it == state.clients.end()) {
+        return {};
+    }
+    return {it->second.channels.begin(), it->second.channels.end()};
+}
+
+std::vector<std::string> patterns(const Connection &conn) {
+    const auto it = state.clients.find(&conn);
+    if (it == state.clients.end()) {
+        return {};
+    }
+    return {it->second.patterns.begin(), it->second.patterns.end()};
+}
+
+std::size_t publish(std::string_view channel, std::string_view message) {
+    std::size_t receivers = 0;
+
+    const auto it = state.channels.find(std::string(channel));
+    if (it != state.channels.end()) {
+        Frames frames;
+        const std::vector<std::string_view> elems{"message", channel, message};
+        for (Connection *conn : it->second) {
+            deliver(*conn, frames, elems);
+        }
+        receivers += it->second.size();
+    }
+
+    // Only the patterns whose literal prefix starts the channel can match
+    for (const auto &[len, count] : state.prefix_lens) {
+        if (len > channel.size()) {
+            break;
+        }
+        state.prefix.assign(channel.substr(0, len));
+        const auto found = state.patterns.find(state.prefix);
+        if (found == state.patterns.end()) {
+            continue;
+        }
+        for (const Pattern &pattern : found->second) {
+            if (!glob_match(pattern.pattern, channel)) {
+                continue;
+            }
+            Frames frames;
+            const std::vector<std::string_view> elems{"pmessage", pattern.pattern,
+                                                      channel, message};
+            for (Connection *conn : pattern.subscribers) {
+                deliver(*conn, frames, elems);
+            }
+            receivers += pattern.subscribers.size();
+        }
+    }
+
+    return receivers;
+}
+
+void take_woken(std::vector<int> &fds) {
+    fds.clear();
+    fds.swap(state.woken);
+}
+
+void on_close(Connection &conn) {
+    for (const auto &channel : channels(conn)) {
+        unsubscribe(conn, channel);
+    }
+    for (const auto &pattern : patterns(conn)) {
+        punsubscribe(conn, pattern);
+    }
+}
+
+std::size_t num_channels() { return state.channels.size(); }
+
+std::size_t num_patterns() { return state.num_patterns; }
+} // namespace PubSub
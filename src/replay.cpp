@@ -0,0 +1,257 @@
+#include "capture.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format, fmt::print
+
+#include <algorithm>   // std::find, std::sort, std::max
+#include <array>       // std::array
+#include <cerrno>      // errno
+#include <chrono>      // std::chrono
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::uint16_t, std::uint32_t, std::uint64_t, UINT16_MAX
+#include <cstring>     // std::memcpy, std::strerror
+#include <fstream>     // std::ifstream
+#include <functional>  // std::ref, std::cref
+#include <iterator>    // std::istreambuf_iterator
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <thread>      // std::thread, std::this_thread
+#include <vector>      // std::vector
+
+#include <netinet/in.h> // sockaddr_in, htons
+#include <sys/socket.h> // connect, socket
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Their replies do not come one per request, or they would change the server
+// rather than load it
+constexpr std::array<std::string_view, 11> SKIPPED = {
+    "SUBSCRIBE", "UNSUBSCRIBE", "PSUBSCRIBE", "PUNSUBSCRIBE", "PSYNC",  "FULLRESYNC",
+    "CONTINUE",  "RESTORE",     "REPLICAOF",  "HELLO",        "DEBUG"};
+
+struct Options {
+    std::uint16_t port = PORT;
+    std::string_view unixsocket;
+    // 0: one per captured connection
+    std::size_t conns = 0;
+    // Send at the recorded times rather than as fast as possible
+    bool paced = false;
+    std::string_view file;
+};
+
+struct Request {
+    std::uint64_t time_us = 0;
+    std::vector<std::byte> bytes;
+};
+
+struct Worker {
+    std::vector<Request> requests;
+    std::vector<std::uint64_t> latencies_us;
+    std::size_t errors = 0;
+    bool failed = false;
+};
+
+int connect_to(const Options &opts) {
+    const int fd = socket(opts.unixsocket.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        LOG_ERROR(fmt::format("socket failed: {}", std::strerror(errno)));
+        return -1;
+    }
+
+    int rv = 0;
+    if (opts.unixsocket.empty()) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opts.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        rv = connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    } else {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        opts.unixsocket.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+        rv = connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    }
+    if (rv != 0) {
+        LOG_ERROR(fmt::format("connect failed: {}", std::strerror(errno)));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool skipped(std::string_view cmd) {
+    return std::find(SKIPPED.begin(), SKIPPED.end(), cmd) != SKIPPED.end();
+}
+
+// Split the capture among conns workers, by captured connection so that the
+// requests of each keep their order. Returns false if the file is not a capture.
+bool load(const Options &opts, std::vector<Worker> &workers, std::size_t &skips) {
+    std::ifstream file{std::string(opts.file), std::ios::binary};
+    if (!file) {
+        LOG_ERROR(fmt::format("Cannot open {}", opts.file));
+        return false;
+    }
+    const std::string data{std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>()};
+    std::string_view in = data;
+    if (in.substr(0, CAPTURE_MAGIC.size()) != CAPTURE_MAGIC) {
+        LOG_ERROR(fmt::format("{} is not a capture file", opts.file));
+        return false;
+    }
+    in.remove_prefix(CAPTURE_MAGIC.size());
+
+    std::vector<CaptureRecord> records;
+    CaptureRecord record;
+    std::uint32_t conns = 0;
+    while (Capture::decode(in, record)) {
+        conns = std::max(conns, record.conn);
+        records.push_back(record);
+    }
+    // The server may have stopped in the middle of a write
+    if (!in.empty()) {
+        LOG_WARNING(
+            fmt::format("Ignoring {} bytes at the end of {}", in.size(), opts.file));
+    }
+
+    workers.resize(opts.conns != 0 ? opts.conns : std::max<std::size_t>(conns, 1));
+    std::vector<std::string_view> args;
+    for (const auto &rec : records) {
+        if (rec.args.empty() || skipped(rec.args[0])) {
+            skips++;
+            continue;
+        }
+        args.assign(rec.args.begin(), rec.args.end());
+        workers[(rec.conn - 1) % workers.size()].requests.push_back(
+            {rec.time_us, make_request(args)});
+    }
+    return true;
+}
+
+// Send each request and wait for its reply, the latency runs from the send
+void run(Worker &worker, const Options &opts, Clock::time_point start) {
+    const int fd = connect_to(opts);
+    if (fd == -1) {
+        worker.failed = true;
+        return;
+    }
+
+    std::vector<std::byte> buf(CMD_LEN_BYTES);
+    worker.latencies_us.reserve(worker.requests.size());
+    for (const auto &req : worker.requests) {
+        if (opts.paced) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(req.time_us));
+        }
+        const Clock::time_point sent = Clock::now();
+        if (write_all(fd, req.bytes, req.bytes.size()) != 0 ||
+            read_all(fd, buf, CMD_LEN_BYTES) != 0) {
+            worker.failed = true;
+            break;
+        }
+        std::uint32_t len = 0;
+        std::memcpy(&len, buf.data(), CMD_LEN_BYTES);
+        buf.resize(std::max<std::size_t>(len, CMD_LEN_BYTES));
+        if (read_all(fd, buf, len) != 0) {
+            worker.failed = true;
+            break;
+        }
+        worker.latencies_us.push_back(static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent)
+                .count()));
+        if (len > 0 && static_cast<char>(buf[0]) == '-') {
+            worker.errors++;
+        }
+    }
+    close(fd);
+}
+
+std::uint64_t percentile(const std::vector<std::uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    const auto idx = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1));
+    return sorted[idx];
+}
+
+void report(const std::vector<Worker> &workers, std::size_t skips, double seconds) {
+    std::vector<std::uint64_t> latencies;
+    std::size_t errors = 0;
+    std::size_t failed = 0;
+    std::uint64_t total_us = 0;
+    for (const auto &worker : workers) {
+        latencies.insert(latencies.end(), worker.latencies_us.begin(),
+                         worker.latencies_us.end());
+        errors += worker.errors;
+        failed += worker.failed ? 1 : 0;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    for (const auto latency : latencies) {
+        total_us += latency;
+    }
+
+    const double count = static_cast<double>(latencies.size());
+    fmt::print("requests: {}\nskipped: {}\nerror replies: {}\nconnections: {}\n"
+               "failed connections: {}\n",
+               latencies.size(), skips, errors, workers.size(), failed);
+    fmt::print("elapsed: {:.3f} s\nthroughput: {:.0f} requests/s\n", seconds,
+               seconds > 0 ? count / seconds : 0.0);
+    fmt::print("latency usec: avg {:.1f}, p50 {}, p99 {}, p99.9 {}, max {}\n",
+               count > 0 ? static_cast<double>(total_us) / count : 0.0,
+               percentile(latencies, 0.5), percentile(latencies, 0.99),
+               percentile(latencies, 0.999), latencies.empty() ? 0 : latencies.back());
+}
+} // namespace
+
+// replay [-p port | -s unixsocket] [-c connections] [-r] file
+int main(int argc, char **argv) {
+    Options opts;
+    int i = 1;
+    for (; i < argc; i++) {
+        const std::string_view opt = argv[i];
+        if (opt == "-r") {
+            opts.paced = true;
+        } else if ((opt == "-p" || opt == "-c") && i + 1 < argc) {
+            const auto value = to_int64(argv[++i]);
+            if (!value || *value <= 0 || (opt == "-p" && *value > UINT16_MAX)) {
+                LOG_ERROR(fmt::format("Invalid {} value: {}", opt, argv[i]));
+                return 1;
+            }
+            if (opt == "-p") {
+                opts.port = static_cast<std::uint16_t>(*value);
+            } else {
+                opts.conns = static_cast<std::size_t>(*value);
+            }
+        } else if (opt == "-s" && i + 1 < argc) {
+            opts.unixsocket = argv[++i];
+        } else {
+            break;
+        }
+    }
+    if (i + 1 != argc) {
+        LOG_ERROR("Usage: replay [-p port | -s unixsocket] [-c connections] [-r] file");
+        return 1;
+    }
+    opts.file = argv[i];
+
+    std::vector<Worker> workers;
+    std::size_t skips = 0;
+    if (!load(opts, workers, skips)) {
+        return 1;
+    }
+
+    const Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    threads.reserve(workers.size());
+    for (auto &worker : workers) {
+        threads.emplace_back(run, std::ref(worker), std::cref(opts), start);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    report(workers, skips, seconds);
+    return 0;
+}
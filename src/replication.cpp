@@ -0,0 +1,531 @@
+#include "replication.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "tier.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>   // std::all_of, std::find, std::find_if, std::min
+#include <array>       // std::array
+#include <cerrno>      // errno, EINPROGRESS
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::int64_t, std::uint16_t, std::uint64_t
+#include <cstring>     // std::memcpy, std::strerror
+#include <optional>    // std::optional
+#include <random>      // std::random_device
+#include <string>      // std::string, std::to_string
+#include <string_view> // std::string_view
+#include <utility>     // std::pair
+#include <variant>     // std::get_if, std::holds_alternative
+#include <vector>      // std::vector
+
+#include <netdb.h>       // getaddrinfo, freeaddrinfo, gai_strerror, addrinfo
+#include <netinet/in.h>  // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <sys/socket.h>  // connect, setsockopt, shutdown, socket
+#include <unistd.h>      // close
+
+namespace {
+constexpr std::size_t REPLID_LEN = 40;
+
+// A replica being sent the snapshot
+struct Snapshot {
+    int fd = -1;
+    std::size_t cursor = 0; // The next bucket of map, see HashTable::relocate
+    // Requests to send once the stream reaches the offset, see prepare_write
+    std::vector<std::pair<std::uint64_t, std::vector<std::byte>>> inserts;
+};
+
+struct State {
+    std::string replid;       // Of the stream this server writes or follows
+    std::uint64_t offset = 0; // Bytes of the stream written or applied
+
+    // Primary
+    std::vector<std::byte> backlog; // Circular, empty until a replica connects
+    std::size_t backlog_size = REPL_BACKLOG_SIZE;
+    std::uint64_t backlog_start = 0; // Offset of the oldest byte held
+    std::vector<int> replicas;
+    std::vector<Snapshot> snapshots;
+
+    // Replica
+    std::string primary_host; // Empty on a primary
+    std::uint16_t primary_port = 0;
+    int link_fd = -1;
+    bool link_up = false; // FULLRESYNC or CONTINUE was received
+    bool loading = false; // FULLRESYNC was received, the snapshot is not complete
+    std::uint64_t next_connect = 0;
+};
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+State state;
+
+// Random, so a restarted primary never passes for the one it was
+std::string new_replid() {
+    constexpr std::string_view HEX = "0123456789abcdef";
+    std::random_device rd;
+    std::string id(REPLID_LEN, '0');
+    for (char &c : id) {
+        c = HEX[rd() % HEX.size()];
+    }
+    return id;
+}
+
+const std::string &replid() {
+    if (state.replid.empty()) {
+        state.replid = new_replid();
+    }
+    return state.replid;
+}
+
+void append(const std::byte *data, std::size_t n) {
+    const std::size_t size = state.backlog.size();
+    for (std::size_t done = 0; done < n;) {
+        const std::size_t pos = state.offset % size;
+        const std::size_t len = std::min(n - done, size - pos);
+        std::memcpy(&state.backlog[pos], data + done, len);
+        done += len;
+        state.offset += len;
+    }
+    if (state.offset - state.backlog_start > size) {
+        state.backlog_start = state.offset - size;
+    }
+}
+
+void send_string(const Replication::Emit &emit, std::string_view key,
+                 std::string_view value) {
+    // Appended chunk by chunk, an empty string is one empty chunk
+    std::size_t pos = 0;
+    do {
+        emit({"RESTORE", key, "str", value.substr(pos, REPL_CHUNK)});
+        pos += REPL_CHUNK;
+    } while (pos < value.size());
+}
+
+// The compressed bytes as they are, len is the size of the string
+void send_packed(const Replication::Emit &emit, std::string_view key,
+                 const PackedStr &packed) {
+    const std::string len = std::to_string(packed.len);
+    const std::string_view data = packed.data;
+    for (std::size_t pos = 0; pos < data.size(); pos += REPL_CHUNK) {
+        emit({"RESTORE", key, "packed", len, data.substr(pos, REPL_CHUNK)});
+    }
+}
+
+void send_set(const Replication::Emit &emit, std::string_view key, const Set &set) {
+    const std::vector<std::string> members = set.members();
+    std::vector<std::string_view> args{"RESTORE", key, "set"};
+    std::size_t bytes = 0;
+    for (const auto &member : members) {
+        if (bytes + member.size() > REPL_CHUNK && args.size() > 3) {
+            emit(args);
+            args.resize(3);
+            bytes = 0;
+        }
+        args.emplace_back(member);
+        bytes += CMD_LEN_BYTES + member.size();
+    }
+    emit(args);
+}
+
+void send_hll(const Replication::Emit &emit, std::string_view key,
+              const HyperLogLog &hll) {
+    HLLRegisters regs{};
+    hll.merge_into(regs);
+    for (std::size_t offset = 0; offset < HLL_REGISTERS; offset += REPL_CHUNK) {
+        const std::size_t len = std::min(REPL_CHUNK, HLL_REGISTERS - offset);
+        const auto *begin = &regs[offset];
+        // Sparse counters are mostly zeros, the first chunk creates the key
+        const bool zeros = std::all_of(begin, begin + len, [](auto r) { return r == 0; });
+        if (offset > 0 && zeros) {
+            continue;
+        }
+        const std::string pos = std::to_string(offset);
+        emit({"RESTORE", key, "hll", pos, {reinterpret_cast<const char *>(begin), len}});
+    }
+}
+
+Snapshot *snapshot_of(int fd) {
+    for (auto &snapshot : state.snapshots) {
+        if (snapshot.fd == fd) {
+            return &snapshot;
+        }
+    }
+    return nullptr;
+}
+
+void drop_snapshot(int fd) {
+    const auto it =
+        std::find_if(state.snapshots.begin(), state.snapshots.end(),
+                     [fd](const Snapshot &snapshot) { return snapshot.fd == fd; });
+    if (it != state.snapshots.end()) {
+        state.snapshots.erase(it);
+    }
+}
+
+// The key as it is now. The replica may have an older copy already, or the
+// writes to it since the snapshot started.
+void send_key(const HashNode &node, const Replication::Emit &emit) {
+    emit({"DEL", node.key});
+    Replication::dump_key(node, emit);
+}
+
+// Add the stream from the offset of the replica to offset
+void send_stream(std::unique_ptr<Connection> &conn, std::uint64_t offset) {
+    const std::size_t size = state.backlog.size();
+    while (conn->repl_offset < offset) {
+        const std::size_t pos = conn->repl_offset % size;
+        const std::size_t n =
+            std::min<std::uint64_t>(offset - conn->repl_offset, size - pos);
+        add_raw(conn, &state.backlog[pos], n);
+        conn->repl_offset += n;
+    }
+}
+
+// Add the next buckets of the keyspace until REPL_SNAPSHOT_BUFFER bytes wait for
+// the replica. Returns true once the last bucket was sent.
+bool send_snapshot(std::unique_ptr<Connection> &conn, Snapshot &snapshot) {
+    const Replication::Emit emit = [&conn](const std::vector<std::string_view> &args) {
+        add_request(conn, args);
+    };
+    std::vector<std::string> spilled;
+    do {
+        spilled.clear();
+        map.relocate(snapshot.cursor, 1, [&spilled](HashNode *node) {
+            if (std::holds_alternative<SpilledStr>(node->value)) {
+                spilled.push_back(node->key);
+            }
+            return node;
+        });
+        // The bucket is sent once its values are back in memory
+        if (Tier::load_keys(conn, spilled)) {
+            return false;
+        }
+        snapshot.cursor = map.relocate(snapshot.cursor, 1, [&emit](HashNode *node) {
+            send_key(*node, emit);
+            return node;
+        });
+    } while (snapshot.cursor != 0 && wbuf_pending_bytes(conn) < REPL_SNAPSHOT_BUFFER);
+    return snapshot.cursor == 0;
+}
+
+// An incomplete snapshot cannot be resumed, the next PSYNC asks for another
+void abort_loading() {
+    if (state.loading) {
+        LOG_WARNING("The snapshot from the primary is incomplete");
+        state.loading = false;
+        state.replid.clear();
+    }
+}
+
+void drop_link() {
+    if (state.link_fd == -1) {
+        return;
+    }
+    abort_loading();
+    // The loop sees the connection fail and closes it, see is_link
+    shutdown(state.link_fd, SHUT_RDWR);
+    state.link_fd = -1;
+    state.link_up = false;
+}
+} // namespace
+
+namespace Replication {
+void set_backlog_size(std::size_t bytes) { state.backlog_size = bytes; }
+
+void dump_key(const HashNode &node, const Emit &emit) {
+    const std::string_view key = node.key;
+    if (const auto *str = std::get_if<SharedStr>(&node.value)) {
+        send_string(emit, key, **str);
+    } else if (const auto *num = std::get_if<std::int64_t>(&node.value)) {
+        emit({"RESTORE", key, "int", std::to_string(*num)});
+    } else if (const auto *set = std::get_if<Set>(&node.value)) {
+        send_set(emit, key, *set);
+    } else if (const auto *hll = std::get_if<HyperLogLog>(&node.value)) {
+        send_hll(emit, key, *hll);
+    } else if (const auto *packed = std::get_if<PackedStr>(&node.value)) {
+        send_packed(emit, key, *packed);
+    }
+}
+
+void feed(const std::vector<std::string_view> &args) {
+    if (state.backlog.empty()) {
+        return;
+    }
+    const std::vector<std::byte> req = make_request(args);
+    append(req.data(), req.size());
+}
+
+void psync(std::unique_ptr<Connection> &conn, std::string_view id,
+           std::string_view offset) {
+    if (is_replica()) {
+        add_reply_err(conn, "ERR a replica does not serve replicas of its own");
+        return;
+    }
+    if (conn->proto != Proto::NATIVE) {
+        add_reply_err(conn, "ERR PSYNC needs the native protocol");
+        return;
+    }
+
+    if (state.backlog.empty()) {
+        state.backlog.resize(state.backlog_size);
+        state.backlog_start = state.offset;
+    }
+
+    const auto from = to_int64(offset);
+    if (id == replid() && from && *from >= 0 &&
+        static_cast<std::uint64_t>(*from) >= state.backlog_start &&
+        static_cast<std::uint64_t>(*from) <= state.offset) {
+        // The rest is sent with the new writes by catch_up
+        add_request(conn, {"CONTINUE", replid()});
+        conn->repl_offset = *from;
+        LOG_INFO(
+            fmt::format("Partial resync of replica fd = {} from {}", conn->fd, *from));
+        drop_snapshot(conn->fd);
+    } else {
+        // The keyspace follows with the stream as the replica takes it, see
+        // catch_up
+        add_request(conn, {"FULLRESYNC", replid(), std::to_string(state.offset)});
+        conn->repl_offset = state.offset;
+        drop_snapshot(conn->fd);
+        state.snapshots.push_back({conn->fd, 0, {}});
+        LOG_INFO(fmt::format("Full resync of replica fd = {}, {} keys", conn->fd,
+                             map.size()));
+    }
+
+    if (conn->link != Link::REPLICA) {
+        conn->link = Link::REPLICA;
+        state.replicas.push_back(conn->fd);
+    }
+}
+
+const std::vector<int> &replicas() { return state.replicas; }
+
+void prepare_write(const Connection &conn) {
+    const Cmd cmd = conn.req->cmd;
+    if (state.snapshots.empty() || (cmd != Cmd::BITOP && cmd != Cmd::PFMERGE)) {
+        return;
+    }
+
+    std::vector<std::byte> bytes;
+    const Emit emit = [&bytes](const std::vector<std::string_view> &args) {
+        const std::vector<std::byte> req = make_request(args);
+        bytes.insert(bytes.end(), req.begin(), req.end());
+    };
+    const KeySpec spec = key_spec(cmd);
+    const auto &args = conn.req->args;
+    const auto nargs = static_cast<int>(args.size());
+    const int last = spec.last < 0 ? nargs + spec.last : spec.last;
+    for (int i = spec.first; i <= last; i += spec.step) {
+        emit({"DEL", args[i]});
+        if (const HashNode *node = map.get(args[i])) {
+            dump_key(*node, emit);
+        }
+    }
+    for (auto &snapshot : state.snapshots) {
+        snapshot.inserts.emplace_back(state.offset, bytes);
+    }
+}
+
+bool catch_up(std::unique_ptr<Connection> &conn) {
+    if (conn->repl_offset < state.backlog_start) {
+        LOG_WARNING(fmt::format("Replica fd = {} fell out of the backlog", conn->fd));
+        return false;
+    }
+
+    Snapshot *snapshot = snapshot_of(conn->fd);
+    if (snapshot == nullptr) {
+        send_stream(conn, state.offset);
+        return true;
+    }
+
+    for (const auto &[offset, bytes] : snapshot->inserts) {
+        send_stream(conn, offset);
+        add_raw(conn, bytes.data(), bytes.size());
+    }
+    snapshot->inserts.clear();
+    send_stream(conn, state.offset);
+
+    // Spilled values of the next bucket are being read
+    if (conn->io_pending > 0 || wbuf_pending_bytes(conn) >= REPL_SNAPSHOT_BUFFER) {
+        return true;
+    }
+    if (send_snapshot(conn, *snapshot)) {
+        add_request(conn, {"CONTINUE", replid(), std::to_string(state.offset)});
+        drop_snapshot(conn->fd);
+        LOG_INFO(fmt::format("Snapshot sent to replica fd = {}", conn->fd));
+    }
+    return true;
+}
+
+bool sending_snapshot(const Connection &conn) {
+    return conn.link == Link::REPLICA && snapshot_of(conn.fd) != nullptr;
+}
+
+std::size_t buffer_memory() {
+    std::size_t bytes = state.backlog.size();
+    for (const auto &snapshot : state.snapshots) {
+        for (const auto &[offset, insert] : snapshot.inserts) {
+            bytes += insert.size();
+        }
+    }
+    return bytes;
+}
+
+bool is_replica() { return !state.primary_host.empty(); }
+
+bool is_link(const Connection &conn) { return conn.fd == state.link_fd; }
+
+void replicate_from(std::string host, std::uint16_t port) {
+    drop_link();
+
+    if (host.empty()) {
+        if (is_replica()) {
+            LOG_INFO("Replication stopped, this server is a primary");
+            state.primary_host.clear();
+            // The keyspace goes its own way from here
+            state.replid = new_replid();
+            state.backlog_start = state.offset;
+        }
+        return;
+    }
+
+    // Replicas of ours would follow a stream that is about to change
+    for (const int fd : state.replicas) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    state.replicas.clear();
+    state.snapshots.clear();
+    std::vector<std::byte>().swap(state.backlog);
+
+    state.primary_host = std::move(host);
+    state.primary_port = port;
+    state.next_connect = 0;
+}
+
+int connect_primary(std::uint64_t now) {
+    if (!is_replica() || state.link_fd != -1 || now < state.next_connect) {
+        return -1;
+    }
+    state.next_connect = now + REPL_RETRY_SECONDS;
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs = nullptr;
+    const std::string port = std::to_string(state.primary_port);
+    const int err = getaddrinfo(state.primary_host.c_str(), port.c_str(), &hints, &addrs);
+    if (err != 0) {
+        LOG_ERROR(fmt::format("Cannot resolve the primary {}: {}", state.primary_host,
+                              gai_strerror(err)));
+        return -1;
+    }
+
+    const int fd =
+        socket(addrs->ai_family, addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // Connects in the background, PSYNC goes out once it is connected
+    if (fd == -1 || (connect(fd, addrs->ai_addr, addrs->ai_addrlen) == -1 &&
+                     errno != EINPROGRESS)) {
+        LOG_ERROR(fmt::format("Cannot connect to the primary {}:{}: {}",
+                              state.primary_host, port, std::strerror(errno)));
+        if (fd != -1) {
+            close(fd);
+        }
+        freeaddrinfo(addrs);
+        return -1;
+    }
+    freeaddrinfo(addrs);
+
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    LOG_INFO(fmt::format("Connecting to the primary {}:{}", state.primary_host, port));
+    state.link_fd = fd;
+    state.link_up = false;
+    return fd;
+}
+
+void on_link(std::unique_ptr<Connection> &conn) {
+    conn->link = Link::PRIMARY;
+    conn->proto = Proto::NATIVE;
+    add_request(conn, {"PSYNC", replid(), std::to_string(state.offset)});
+}
+
+void full_resync(std::string_view id, std::uint64_t offset) {
+    map.clear();
+    state.replid = id;
+    state.offset = offset;
+    state.link_up = true;
+    state.loading = true;
+    LOG_INFO(fmt::format("Full resync from the primary at offset {}", offset));
+}
+
+bool resume(std::string_view id, std::optional<std::uint64_t> offset) {
+    if (id != state.replid || state.loading != offset.has_value()) {
+        return false;
+    }
+    state.link_up = true;
+    if (state.loading) {
+        state.loading = false;
+        state.offset = *offset;
+        LOG_INFO(fmt::format("Snapshot loaded, {} keys", map.size()));
+        return true;
+    }
+    LOG_INFO(fmt::format("Partial resync from the primary at offset {}", state.offset));
+    return true;
+}
+
+void applied(const std::unique_ptr<Connection> &conn, std::size_t bytes) {
+    // The snapshot and the stream are mixed until CONTINUE gives the offset
+    if (state.loading) {
+        return;
+    }
+    switch (conn->req->cmd) {
+    case Cmd::FULLRESYNC:
+    case Cmd::CONTINUE:
+        // Not part of the stream
+        return;
+    default:
+        state.offset += bytes;
+    }
+}
+
+void on_close(const Connection &conn, std::uint64_t now) {
+    if (conn.link == Link::REPLICA) {
+        drop_snapshot(conn.fd);
+        const auto it = std::find(state.replicas.begin(), state.replicas.end(), conn.fd);
+        if (it != state.replicas.end()) {
+            state.replicas.erase(it);
+            LOG_INFO(fmt::format("Replica disconnected: fd = {}", conn.fd));
+        }
+    } else if (conn.link == Link::PRIMARY && is_link(conn)) {
+        LOG_WARNING("Lost the link to the primary");
+        abort_loading();
+        state.link_fd = -1;
+        state.link_up = false;
+        state.next_connect = now + REPL_RETRY_SECONDS;
+    }
+}
+
+std::string info() {
+    // The field names are the ones of Redis
+    std::string info;
+    if (is_replica()) {
+        info += fmt::format("role:slave\r\nmaster_host:{}\r\nmaster_port:{}\r\n"
+                            "master_link_status:{}\r\nmaster_sync_in_progress:{}\r\n"
+                            "slave_repl_offset:{}\r\n",
+                            state.primary_host, state.primary_port,
+                            state.link_up ? "up" : "down", state.loading ? 1 : 0,
+                            state.offset);
+    } else {
+        info += fmt::format(
+            "role:master\r\nconnected_slaves:{}\r\nrepl_snapshots_in_progress:{}\r\n",
+            state.replicas.size(), state.snapshots.size());
+    }
+    info += fmt::format("master_replid:{}\r\nmaster_repl_offset:{}\r\n"
+                        "repl_backlog_active:{}\r\nrepl_backlog_size:{}\r\n"
+                        "repl_backlog_first_byte_offset:{}\r\n",
+                        replid(), state.offset, state.backlog.empty() ? 0 : 1,
+                        state.backlog_size, state.backlog_start);
+    return info;
+}
+} // namespace Replication
@@ -0,0 +1,169 @@
+#include "resp.hpp"
+#include "cpu.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <immintrin.h> // AVX2 intrinsics
+
+#include <charconv>    // std::from_chars, std::to_chars
+#include <cstddef>     // std::byte, std::size_t
+#include <cstdint>     // std::int64_t, std::uint32_t, std::uint64_t
+#include <cstring>     // std::memchr, std::memcpy
+#include <string_view> // std::string_view
+
+namespace {
+// Arguments of a request at most, the limit of Redis
+constexpr std::int64_t RESP_NARGS_MAX = 1024 * 1024;
+
+std::size_t find_crlf_scalar(const char *p, std::size_t n) {
+    std::size_t i = 0;
+    while (i < n) {
+        const auto *cr = static_cast<const char *>(std::memchr(p + i, '\r', n - i));
+        if (cr == nullptr) {
+            return n;
+        }
+        i = cr - p;
+        if (i + 1 < n && p[i + 1] == '\n') {
+            return i;
+        }
+        i++;
+    }
+    return n;
+}
+
+// Match "\r" and "\n" on two loads one byte apart, 32 positions per iteration
+__attribute__((target("avx2"))) std::size_t find_crlf_avx2(const char *p,
+                                                           std::size_t n) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; i + 33 <= n; i += 32) {
+        const __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        const __m256i v1 =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 1));
+        const __m256i both =
+            _mm256_and_si256(_mm256_cmpeq_epi8(v0, cr), _mm256_cmpeq_epi8(v1, lf));
+        const auto mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(both));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_crlf_scalar(p + i, n - i);
+}
+
+/*
+    Parse the "<type><int>\r\n" line at pos of rbuf and move pos past it. Returns
+    AGAIN if the line is not complete yet.
+*/
+ReqStatus read_int_line(std::unique_ptr<Connection> &conn, std::size_t &pos, char type,
+                        std::int64_t &value) {
+    const auto *buf = reinterpret_cast<const char *>(conn->rbuf.data());
+    const std::size_t end = conn->rbuf_size;
+    if (pos == end) {
+        return ReqStatus::AGAIN;
+    }
+    if (buf[pos] != type) {
+        return protocol_error(conn,
+                              fmt::format("expected '{}', got '{}'", type, buf[pos]));
+    }
+
+    const char *line = buf + pos + 1;
+    const std::size_t len = find_crlf(line, end - pos - 1);
+    if (len == end - pos - 1) {
+        if (end - pos > RESP_HEADER_MAX) {
+            return protocol_error(conn, "header line too long");
+        }
+        return ReqStatus::AGAIN;
+    }
+
+    const auto [ptr, ec] = std::from_chars(line, line + len, value);
+    if (ec != std::errc{} || ptr != line + len || len == 0) {
+        return protocol_error(
+            conn, fmt::format("invalid length '{}'", std::string_view{line, len}));
+    }
+
+    pos += 1 + len + 2;
+    return ReqStatus::OK;
+}
+} // namespace
+
+bool is_resp(const std::byte *buf) {
+    const auto second = static_cast<char>(buf[1]);
+    return static_cast<char>(buf[0]) == '*' && second >= '0' && second <= '9' &&
+           buf[3] != std::byte{0};
+}
+
+std::size_t find_crlf(const char *p, std::size_t n) {
+    return Cpu::has_avx2() ? find_crlf_avx2(p, n) : find_crlf_scalar(p, n);
+}
+
+ReqStatus parse_resp(std::unique_ptr<Connection> &conn) {
+    const auto *buf = reinterpret_cast<const char *>(conn->rbuf.data());
+    const std::size_t end = conn->rbuf_size;
+    auto &args = conn->req->args;
+
+    // Reused across requests, args keeps its capacity
+    args.clear();
+
+    std::size_t pos = conn->rbuf_pos;
+    std::int64_t nargs = 0;
+    while (nargs <= 0) {
+        const ReqStatus status = read_int_line(conn, pos, '*', nargs);
+        if (status != ReqStatus::OK) {
+            return status;
+        }
+        if (nargs > RESP_NARGS_MAX) {
+            return protocol_error(conn,
+                                  fmt::format("invalid multibulk length {}", nargs));
+        }
+        if (nargs <= 0) {
+            // Empty requests are skipped, like Redis does
+            conn->rbuf_pos = pos;
+        }
+    }
+
+    for (std::int64_t i = 0; i < nargs; i++) {
+        std::int64_t len = 0;
+        const ReqStatus status = read_int_line(conn, pos, '$', len);
+        if (status == ReqStatus::ERR) {
+            return status;
+        }
+        if (status == ReqStatus::OK &&
+            (len < 0 || static_cast<std::uint64_t>(len) > proto_max_bulk_len())) {
+            return protocol_error(conn, fmt::format("invalid bulk length {}", len));
+        }
+
+        const auto n = static_cast<std::size_t>(len);
+        if (status == ReqStatus::AGAIN || end - pos < n + 2) {
+            // Room in rbuf for the rest of the argument, or of the header line
+            args.clear();
+            const std::size_t have = end - conn->rbuf_pos;
+            reserve_rbuf(conn, status == ReqStatus::AGAIN ? have + RESP_HEADER_MAX
+                                                          : pos + n + 2 - conn->rbuf_pos);
+            return ReqStatus::AGAIN;
+        }
+
+        if (buf[pos + n] != '\r' || buf[pos + n + 1] != '\n') {
+            return protocol_error(conn, "bulk string without CRLF");
+        }
+
+        // Zero copy, the argument stays in rbuf until the request is handled
+        args.emplace_back(buf + pos, n);
+        pos += n + 2;
+    }
+
+    conn->rbuf_pos = pos;
+    return ReqStatus::OK;
+}
+
+std::size_t write_resp_header(std::byte *p, char type, std::int64_t n) {
+    char line[RESP_HEADER_MAX];
+    line[0] = type;
+    const auto [end, ec] = std::to_chars(line + 1, line + RESP_HEADER_MAX - 2, n);
+    end[0] = '\r';
+    end[1] = '\n';
+    const auto len = static_cast<std::size_t>(end + 2 - line);
+    std::memcpy(p, line, len);
+    return len;
+}
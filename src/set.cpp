@@ -0,0 +1,112 @@
+#include "set.hpp"
+#include "hashtable.hpp"
+#include "utils.hpp"
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t
+#include <memory>      // std::make_unique
+#include <optional>    // std::optional
+#include <string>      // std::string, std::to_string
+#include <string_view> // std::string_view
+#include <utility>     // std::move
+#include <vector>      // std::vector
+
+Set::Set() = default;
+Set::Set(Set &&other) noexcept = default;
+Set &Set::operator=(Set &&other) noexcept = default;
+Set::~Set() = default;
+
+bool Set::add(std::string_view member) {
+    if (is_intset()) {
+        const std::optional<std::int64_t> value = to_int64(member);
+        if (value && intset.size() < SET_MAX_INTSET_ENTRIES) {
+            return intset.add(*value);
+        }
+        convert();
+    }
+
+    const std::string key(member);
+    if (ht->get(key) != nullptr) {
+        return false;
+    }
+    ht->set(key, SharedStr{});
+    return true;
+}
+
+std::size_t Set::add(const std::vector<std::string_view> &members) {
+    if (is_intset() && intset.size() + members.size() <= SET_MAX_INTSET_ENTRIES) {
+        std::vector<std::int64_t> values;
+        values.reserve(members.size());
+        for (const auto &member : members) {
+            const std::optional<std::int64_t> value = to_int64(member);
+            if (!value) {
+                break;
+            }
+            values.push_back(*value);
+        }
+        if (values.size() == members.size()) {
+            return intset.add(std::move(values));
+        }
+    }
+
+    std::size_t added = 0;
+    for (const auto &member : members) {
+        added += add(member) ? 1 : 0;
+    }
+    return added;
+}
+
+bool Set::remove(std::string_view member) {
+    if (is_intset()) {
+        const std::optional<std::int64_t> value = to_int64(member);
+        return value && intset.remove(*value);
+    }
+    return ht->remove(std::string(member));
+}
+
+bool Set::contains(std::string_view member) {
+    if (is_intset()) {
+        const std::optional<std::int64_t> value = to_int64(member);
+        return value && intset.contains(*value);
+    }
+    return ht->get(std::string(member)) != nullptr;
+}
+
+void Set::merge(Set &other) {
+    if (is_intset() && other.is_intset() &&
+        intset.size() + other.size() <= SET_MAX_INTSET_ENTRIES) {
+        intset.add(other.intset.values());
+        return;
+    }
+
+    for (const auto &member : other.members()) {
+        add(member);
+    }
+}
+
+std::size_t Set::size() const { return is_intset() ? intset.size() : ht->size(); }
+
+bool Set::is_intset() const { return ht == nullptr; }
+
+const IntSet &Set::ints() const { return intset; }
+
+std::vector<std::string> Set::members() const {
+    if (!is_intset()) {
+        return ht->keys();
+    }
+
+    std::vector<std::string> buf;
+    buf.reserve(intset.size());
+    for (std::size_t i = 0; i < intset.size(); i++) {
+        buf.push_back(std::to_string(intset.at(i)));
+    }
+    return buf;
+}
+
+void Set::convert() {
+    ht = std::make_unique<HashTable>();
+    for (std::size_t i = 0; i < intset.size(); i++) {
+        ht->set(std::to_string(intset.at(i)), SharedStr{});
+    }
+    intset = IntSet{};
+}
@@ -0,0 +1,602 @@
+#include "tier.hpp"
+#include "connection.hpp"
+#include "evict.hpp"
+#include "hashtable.hpp"
+#include "replication.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>     // std::min
+#include <array>         // std::array
+#include <cerrno>        // errno, EAGAIN, EINTR
+#include <chrono>        // std::chrono::steady_clock
+#include <cstddef>       // std::size_t
+#include <cstdint>       // std::uint32_t, std::uint64_t
+#include <cstring>       // std::memcpy, std::strerror
+#include <deque>         // std::deque
+#include <map>           // std::map
+#include <memory>        // std::make_shared, std::unique_ptr
+#include <mutex>         // std::mutex, std::lock_guard
+#include <string>        // std::string
+#include <string_view>   // std::string_view
+#include <thread>        // std::thread
+#include <unordered_map> // std::unordered_map
+#include <utility>       // std::exchange, std::move
+#include <variant>       // std::get_if
+#include <vector>        // std::vector
+
+#include <fcntl.h>       // open, O_CLOEXEC, O_CREAT, O_RDWR, O_TRUNC
+#include <sys/eventfd.h> // eventfd, eventfd_read, eventfd_write, EFD_*
+#include <sys/uio.h>     // iovec, pwritev
+#include <unistd.h>      // close, getpid, pread, unlink
+
+namespace {
+// Key length and value length
+constexpr std::size_t RECORD_HEADER = 2 * sizeof(std::uint32_t);
+// Sampling catches up on at most this many missed cycles
+constexpr std::uint64_t MAX_CYCLES = 100;
+
+struct Segment {
+    int fd = -1;
+    std::uint64_t size = 0; // Bytes reserved, written once pending is 0
+    std::uint64_t live = 0; // Bytes of the values a SpilledStr refers to
+    std::size_t pending = 0; // Jobs that use fd
+    bool compacted = false;
+};
+
+enum class JobType : std::uint8_t { SPILL, MOVE, LOAD, SCAN };
+
+// A record read back by a SCAN
+struct Record {
+    std::string key;
+    std::uint64_t pos = 0;
+    SharedStr value;
+};
+
+struct Job {
+    JobType type = JobType::SPILL;
+    int fd = -1;
+    std::uint64_t offset = 0; // Of the record in fd, SCAN reads size bytes from 0
+    std::uint64_t size = 0;
+    std::string key;
+    // SPILL and MOVE write it, LOAD reads it
+    SharedStr value;
+    std::uint64_t pos = 0;  // Of the value
+    std::uint64_t from = 0; // MOVE: the pos of the record being moved
+    std::vector<Record> records;
+    bool failed = false;
+    int error = 0; // errno of the failure, 0 for a short read
+};
+
+struct State {
+    std::string dir;
+    std::uint32_t idle_seconds = 0;
+    int event_fd = -1;
+    // Counts the queued jobs, an I/O thread takes one per read
+    int jobs_fd = -1;
+
+    // By id, the last one is appended to
+    std::map<std::uint32_t, Segment> segments;
+    std::uint32_t next_id = 0;
+    std::size_t writes = 0; // SPILL jobs in flight
+    bool scanning = false;
+    std::uint64_t last_cycle = 0;
+    // Keys left to sample, a full queue of writes leaves the rest for when
+    // they complete
+    std::size_t samples = 0;
+
+    // Connections waiting for a LOAD, by the pos of the value
+    std::unordered_map<std::uint64_t, std::vector<int>> loads;
+
+    std::mutex mutex;
+    std::deque<Job> jobs; // For the I/O threads
+    std::vector<Job> done; // Back to the loop thread
+    std::vector<Job> finished;
+
+    // INFO
+    std::uint64_t spilled_keys = 0;
+    std::uint64_t spilled_bytes = 0;
+    std::uint64_t spills = 0;
+    std::uint64_t loads_done = 0;
+    std::uint64_t compactions = 0;
+    std::uint64_t io_errors = 0;
+};
+
+// Never destroyed: map may release its records after any static of this file
+// is gone, and the detached I/O threads wait on the queue until the process ends
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects,cppcoreguidelines-owning-memory)
+State &state = *new State;
+
+std::uint64_t now_ms() {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+std::uint32_t segment_of(std::uint64_t pos) { return pos >> 32; }
+
+bool read_at(int fd, char *buf, std::size_t len, std::uint64_t offset) {
+    while (len > 0) {
+        const ssize_t n = pread(fd, buf, len, static_cast<off_t>(offset));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool write_record(const Job &job) {
+    const auto key_len = static_cast<std::uint32_t>(job.key.size());
+    const auto value_len = static_cast<std::uint32_t>(job.value->size());
+    std::array<char, RECORD_HEADER> header{};
+    std::memcpy(header.data(), &key_len, sizeof(key_len));
+    std::memcpy(&header[sizeof(key_len)], &value_len, sizeof(value_len));
+
+    std::array<iovec, 3> iov{{{header.data(), header.size()},
+                              {const_cast<char *>(job.key.data()), job.key.size()},
+                              {job.value->data(), job.value->size()}}};
+    std::size_t left = RECORD_HEADER + key_len + value_len;
+    std::uint64_t offset = job.offset;
+    std::size_t idx = 0;
+    while (left > 0) {
+        const ssize_t n = pwritev(job.fd, &iov[idx], static_cast<int>(iov.size() - idx),
+                                  static_cast<off_t>(offset));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        left -= n;
+        offset += n;
+        // Skip what was written, partial writes are rare
+        auto written = static_cast<std::size_t>(n);
+        while (idx < iov.size() && written >= iov[idx].iov_len) {
+            written -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < iov.size()) {
+            iov[idx].iov_base = static_cast<char *>(iov[idx].iov_base) + written;
+            iov[idx].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// A whole segment, with the pos of each value for segment id
+bool scan(Job &job) {
+    std::string buf(job.size, '\0');
+    if (!read_at(job.fd, buf.data(), buf.size(), 0)) {
+        return false;
+    }
+    const std::uint64_t base = std::uint64_t{segment_of(job.pos)} << 32;
+    std::size_t offset = 0;
+    while (offset + RECORD_HEADER <= buf.size()) {
+        std::uint32_t key_len = 0;
+        std::uint32_t value_len = 0;
+        std::memcpy(&key_len, &buf[offset], sizeof(key_len));
+        std::memcpy(&value_len, &buf[offset + sizeof(key_len)], sizeof(value_len));
+        const std::size_t key_pos = offset + RECORD_HEADER;
+        const std::size_t value_pos = key_pos + key_len;
+        if (value_pos + value_len > buf.size()) {
+            return false;
+        }
+        const std::string_view value = std::string_view(buf).substr(value_pos, value_len);
+        job.records.push_back({buf.substr(key_pos, key_len), base | value_pos,
+                               make_str(value)});
+        offset = value_pos + value_len;
+    }
+    return true;
+}
+
+void run(Job &job) {
+    errno = 0;
+    switch (job.type) {
+    case JobType::SPILL:
+    case JobType::MOVE:
+        job.failed = !write_record(job);
+        break;
+    case JobType::LOAD:
+        job.failed = !read_at(job.fd, job.value->data(), job.value->size(), job.offset);
+        break;
+    case JobType::SCAN:
+        job.failed = !scan(job);
+        break;
+    }
+    if (job.failed) {
+        job.error = errno;
+    }
+}
+
+void signal(int fd) {
+    if (eventfd_write(fd, 1) == -1) {
+        LOG_ERROR(fmt::format("eventfd write failed: {}", std::strerror(errno)));
+    }
+}
+
+void work() {
+    while (true) {
+        eventfd_t count = 0;
+        if (eventfd_read(state.jobs_fd, &count) == -1) {
+            continue; // EINTR
+        }
+
+        Job job;
+        {
+            const std::lock_guard<std::mutex> lock{state.mutex};
+            job = std::move(state.jobs.front());
+            state.jobs.pop_front();
+        }
+        run(job);
+        {
+            const std::lock_guard<std::mutex> lock{state.mutex};
+            state.done.push_back(std::move(job));
+        }
+        signal(state.event_fd);
+    }
+}
+
+void submit(Job job) {
+    state.segments[segment_of(job.pos)].pending++;
+    {
+        const std::lock_guard<std::mutex> lock{state.mutex};
+        state.jobs.push_back(std::move(job));
+    }
+    signal(state.jobs_fd);
+}
+
+bool new_segment() {
+    const std::uint32_t id = state.next_id;
+    const std::string path = fmt::format("{}/tier-{}-{}.dat", state.dir, getpid(), id);
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        LOG_ERROR(fmt::format("Cannot create {}: {}", path, std::strerror(errno)));
+        return false;
+    }
+    // Only the fd keeps the file, it goes away with the process
+    unlink(path.c_str());
+    state.segments[id].fd = fd;
+    state.next_id++;
+    return true;
+}
+
+// Queue a write of key and value to the last segment, from is the pos of the
+// record it replaces for a MOVE. Returns false if there is no room.
+bool append(JobType type, const std::string &key, const SharedStr &value,
+            std::uint64_t from) {
+    const std::uint64_t len = RECORD_HEADER + key.size() + value->size();
+    if (len > TIER_SEGMENT_SIZE) {
+        return false;
+    }
+    if (state.segments.rbegin()->second.size + len > TIER_SEGMENT_SIZE &&
+        !new_segment()) {
+        return false;
+    }
+
+    auto &[id, segment] = *state.segments.rbegin();
+    Job job;
+    job.type = type;
+    job.fd = segment.fd;
+    job.offset = segment.size;
+    job.key = key;
+    job.value = value;
+    job.pos = std::uint64_t{id} << 32 | (segment.size + RECORD_HEADER + key.size());
+    job.from = from;
+    segment.size += len;
+    submit(std::move(job));
+    return true;
+}
+
+const SpilledStr *spilled_of(HashNode *node) {
+    return node != nullptr ? std::get_if<SpilledStr>(&node->value) : nullptr;
+}
+
+// node now refers to the record at pos
+void adopt(HashNode *node, std::uint64_t pos, std::uint32_t len) {
+    state.segments[segment_of(pos)].live += len;
+    state.spilled_keys++;
+    state.spilled_bytes += len;
+    node->value = SpilledStr{pos, len};
+}
+
+void release(std::uint64_t pos, std::uint32_t len) {
+    state.segments[segment_of(pos)].live -= len;
+    state.spilled_keys--;
+    state.spilled_bytes -= len;
+}
+
+void on_spilled(Job &job) {
+    state.writes--;
+    if (job.failed) {
+        return;
+    }
+    // Written if the key still holds the same string and was not used meanwhile
+    HashNode *node = map.get(job.key);
+    const auto *str = node != nullptr ? std::get_if<SharedStr>(&node->value) : nullptr;
+    if (str == nullptr || *str != job.value || idle_seconds(node) < state.idle_seconds) {
+        return;
+    }
+    adopt(node, job.pos, static_cast<std::uint32_t>(job.value->size()));
+    state.spills++;
+}
+
+void on_moved(const Job &job) {
+    if (job.failed) {
+        return;
+    }
+    HashNode *node = map.get(job.key);
+    const SpilledStr *spilled = spilled_of(node);
+    if (spilled == nullptr || spilled->pos != job.from) {
+        return;
+    }
+    adopt(node, job.pos, spilled->len);
+}
+
+void on_loaded(Job &job, std::vector<int> &fds) {
+    const auto waiters = state.loads.find(job.pos);
+    fds.insert(fds.end(), waiters->second.begin(), waiters->second.end());
+    state.loads.erase(waiters);
+
+    HashNode *node = map.get(job.key);
+    const SpilledStr *spilled = spilled_of(node);
+    if (spilled == nullptr || spilled->pos != job.pos) {
+        return;
+    }
+    if (job.failed) {
+        // The value is lost, a key that stays spilled would block its clients
+        LOG_ERROR(fmt::format("Cannot read back the value of {}, deleting it", job.key));
+        map.remove(job.key);
+        Replication::feed({"DEL", job.key});
+        return;
+    }
+    node->value = std::move(job.value);
+    state.loads_done++;
+}
+
+void on_scanned(Job &job) {
+    state.scanning = false;
+    if (job.failed) {
+        return;
+    }
+    // Live records move to the last segment, the others are dropped
+    for (Record &record : job.records) {
+        HashNode *node = map.get(record.key);
+        const SpilledStr *spilled = spilled_of(node);
+        if (spilled != nullptr && spilled->pos == record.pos) {
+            append(JobType::MOVE, record.key, record.value, record.pos);
+        }
+    }
+    state.compactions++;
+}
+
+// Queue a read of the value of node if it is spilled, conn waits for it
+void load(std::unique_ptr<Connection> &conn, HashNode *node) {
+    const SpilledStr *spilled = spilled_of(node);
+    if (spilled == nullptr) {
+        return;
+    }
+
+    // Clients waiting for the same value share its read
+    auto [waiters, added] = state.loads.try_emplace(spilled->pos);
+    if (added) {
+        Job job;
+        job.type = JobType::LOAD;
+        job.fd = state.segments[segment_of(spilled->pos)].fd;
+        job.offset = spilled->pos & UINT32_MAX;
+        job.key = node->key;
+        job.value = std::make_shared<std::string>(spilled->len, '\0');
+        job.pos = spilled->pos;
+        submit(std::move(job));
+    }
+    waiters->second.push_back(conn->fd);
+    conn->io_pending++;
+}
+
+void spill() {
+    std::array<HashNode *, TIER_SAMPLES> nodes{};
+    while (state.samples > 0) {
+        const std::size_t n =
+            map.sample(nodes.data(), std::min(nodes.size(), state.samples));
+        state.samples -= std::min(nodes.size(), state.samples);
+        for (std::size_t i = 0; i < n; i++) {
+            if (state.writes >= TIER_MAX_WRITES) {
+                return;
+            }
+            // A string in the output of a client, or already on its way to the
+            // disk, is shared
+            const auto *str = std::get_if<SharedStr>(&nodes[i]->value);
+            if (str == nullptr || str->use_count() > 1 ||
+                (*str)->size() < TIER_MIN_VALUE || (*str)->size() > UINT32_MAX ||
+                idle_seconds(nodes[i]) < state.idle_seconds) {
+                continue;
+            }
+            if (!append(JobType::SPILL, nodes[i]->key, *str, 0)) {
+                return;
+            }
+            state.writes++;
+        }
+        if (n == 0) {
+            return;
+        }
+    }
+}
+
+// Scan the full segment with the least live bytes, if it is mostly dead, and
+// close the segments nothing refers to anymore
+void compact() {
+    Segment *best = nullptr;
+    std::uint32_t best_id = 0;
+    const std::uint32_t last = state.segments.rbegin()->first;
+    for (auto it = state.segments.begin(); it != state.segments.end();) {
+        auto &[id, segment] = *it;
+        if (id == last || segment.pending > 0) {
+            ++it;
+            continue;
+        }
+        if (segment.live == 0) {
+            close(segment.fd);
+            it = state.segments.erase(it);
+            continue;
+        }
+        if (!segment.compacted &&
+            static_cast<double>(segment.live) <
+                static_cast<double>(segment.size) * TIER_COMPACT_RATIO &&
+            (best == nullptr || segment.live < best->live)) {
+            best = &segment;
+            best_id = id;
+        }
+        ++it;
+    }
+
+    if (best == nullptr || state.scanning) {
+        return;
+    }
+    best->compacted = true;
+    state.scanning = true;
+    Job job;
+    job.type = JobType::SCAN;
+    job.fd = best->fd;
+    job.size = best->size;
+    job.pos = std::uint64_t{best_id} << 32;
+    submit(std::move(job));
+}
+} // namespace
+
+SpilledStr &SpilledStr::operator=(SpilledStr &&other) noexcept {
+    if (this != &other) {
+        if (len > 0) {
+            release(pos, len);
+        }
+        pos = other.pos;
+        len = std::exchange(other.len, 0);
+    }
+    return *this;
+}
+
+SpilledStr::~SpilledStr() {
+    if (len > 0) {
+        release(pos, len);
+    }
+}
+
+namespace Tier {
+bool open(const std::string &dir, std::uint32_t idle_seconds, std::size_t io_threads) {
+    state.dir = dir;
+    state.idle_seconds = idle_seconds;
+    if (!new_segment()) {
+        return false;
+    }
+    state.jobs_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    state.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state.jobs_fd == -1 || state.event_fd == -1) {
+        LOG_ERROR(fmt::format("eventfd failed: {}", std::strerror(errno)));
+        return false;
+    }
+    for (std::size_t i = 0; i < io_threads; i++) {
+        std::thread{work}.detach();
+    }
+    return true;
+}
+
+bool enabled() { return state.event_fd != -1; }
+
+int event_fd() { return state.event_fd; }
+
+bool load_keys(std::unique_ptr<Connection> &conn) {
+    const KeySpec spec = key_spec(conn->req->cmd);
+    if (!enabled() || spec.first == 0) {
+        return false;
+    }
+
+    const auto &args = conn->req->args;
+    const auto nargs = static_cast<int>(args.size());
+    const int last = spec.last < 0 ? nargs + spec.last : spec.last;
+    for (int i = spec.first; i <= last; i += spec.step) {
+        load(conn, map.get(args[i]));
+    }
+    return conn->io_pending > 0;
+}
+
+bool load_keys(std::unique_ptr<Connection> &conn, const std::vector<std::string> &keys) {
+    if (!enabled()) {
+        return false;
+    }
+    for (const auto &key : keys) {
+        load(conn, map.get(key));
+    }
+    return conn->io_pending > 0;
+}
+
+void complete(std::vector<int> &fds) {
+    fds.clear();
+    eventfd_t count = 0;
+    // Reset before taking the jobs, a job done meanwhile signals again
+    if (eventfd_read(state.event_fd, &count) == -1 && errno != EAGAIN) {
+        LOG_ERROR(fmt::format("eventfd read failed: {}", std::strerror(errno)));
+    }
+    {
+        const std::lock_guard<std::mutex> lock{state.mutex};
+        state.finished.swap(state.done);
+    }
+
+    for (Job &job : state.finished) {
+        state.segments[segment_of(job.pos)].pending--;
+        if (job.failed) {
+            state.io_errors++;
+            LOG_WARNING(fmt::format("Tier I/O failed: {}", std::strerror(job.error)));
+        }
+        switch (job.type) {
+        case JobType::SPILL:
+            on_spilled(job);
+            break;
+        case JobType::MOVE:
+            on_moved(job);
+            break;
+        case JobType::LOAD:
+            on_loaded(job, fds);
+            break;
+        case JobType::SCAN:
+            on_scanned(job);
+            break;
+        }
+    }
+    state.finished.clear();
+}
+
+void cycle() {
+    if (!enabled()) {
+        return;
+    }
+    const std::uint64_t now = now_ms();
+    const std::uint64_t cycles = (now - state.last_cycle) / TIER_CYCLE_MS;
+    if (cycles > 0) {
+        state.last_cycle = now;
+        state.samples = std::min(state.samples + TIER_SAMPLES * cycles,
+                                 TIER_SAMPLES * MAX_CYCLES);
+        compact();
+    }
+    if (state.writes < TIER_MAX_WRITES) {
+        spill();
+    }
+}
+
+std::string info() {
+    std::uint64_t file_bytes = 0;
+    for (const auto &[id, segment] : state.segments) {
+        file_bytes += segment.size;
+    }
+    return fmt::format("tier_enabled:{}\r\ntier_spilled_keys:{}\r\n"
+                       "tier_spilled_bytes:{}\r\ntier_file_bytes:{}\r\n"
+                       "tier_segments:{}\r\ntier_spills:{}\r\ntier_loads:{}\r\n"
+                       "tier_compactions:{}\r\ntier_io_errors:{}\r\n",
+                       enabled() ? 1 : 0, state.spilled_keys, state.spilled_bytes,
+                       file_bytes, state.segments.size(), state.spills,
+                       state.loads_done, state.compactions, state.io_errors);
+}
+} // namespace Tier
@@ -0,0 +1,46 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm> // std::max
+#include <cstddef>   // std::size_t
+#include <cstdint>   // std::uint64_t
+#include <vector>    // std::vector
+
+namespace {
+void expire_slot(std::vector<Timer> &slot, std::uint64_t now, std::vector<Timer> &due) {
+    std::size_t i = 0;
+    while (i < slot.size()) {
+        if (slot[i].when > now) {
+            i++;
+            continue;
+        }
+        due.push_back(slot[i]);
+        slot[i] = slot.back();
+        slot.pop_back();
+    }
+}
+} // namespace
+
+void TimerWheel::add(int fd, std::uint64_t when) {
+    // A second already expired won't be looked at again until the next turn
+    when = std::max(when, next);
+    slots[when % TIMER_WHEEL_SLOTS].push_back({fd, when});
+}
+
+void TimerWheel::expire(std::uint64_t now, std::vector<Timer> &due) {
+    if (next != 0 && now < next) {
+        return;
+    }
+
+    if (next == 0 || now - next >= TIMER_WHEEL_SLOTS) {
+        // A whole turn or more went by
+        for (auto &slot : slots) {
+            expire_slot(slot, now, due);
+        }
+    } else {
+        for (std::uint64_t second = next; second <= now; second++) {
+            expire_slot(slots[second % TIMER_WHEEL_SLOTS], now, due);
+        }
+    }
+
+    next = now + 1;
+}
@@ -0,0 +1,130 @@
+#include "trace.hpp"
+#include "connection.hpp"
+
+#include <fmt/format.h> // fmt::format_to
+
+#include <algorithm>   // std::min
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t, std::uint32_t, std::uint64_t
+#include <ctime>       // clock_gettime, timespec
+#include <iterator>    // std::back_inserter
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+namespace {
+struct Event {
+    std::uint64_t start = 0; // rdtsc ticks
+    std::uint32_t ticks = 0;
+    int fd = -1;
+    Phase phase = Phase::READ;
+    Cmd cmd = Cmd::NONE;
+};
+
+// Written and dumped by its own thread only, so it needs no locking
+struct Ring {
+    std::vector<Event> events; // Allocated by the first event
+    std::size_t next = 0;
+    std::size_t size = 0;
+};
+
+// rdtsc ticks are turned into time with two readings of both clocks
+struct Clock {
+    std::uint64_t ticks = 0;
+    std::int64_t ns = 0;
+};
+
+std::uint32_t sample_rate = 0;
+std::uint32_t countdown = 0;
+Clock base; // When tracing was first enabled, the trace starts there
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+thread_local Ring ring;
+
+Clock read_clock() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return {Trace::now(), ts.tv_sec * 1'000'000'000LL + ts.tv_nsec};
+}
+
+std::string_view to_string(Phase phase) {
+    switch (phase) {
+    case Phase::READ:
+        return "read";
+    case Phase::FRAME:
+        return "frame";
+    case Phase::PARSE:
+        return "parse";
+    case Phase::EXEC:
+        return "exec";
+    case Phase::WRITE:
+        return "write";
+    }
+}
+} // namespace
+
+namespace Trace {
+void set_rate(std::uint32_t rate) {
+    if (rate > 0 && base.ticks == 0) {
+        base = read_clock();
+    }
+    sample_rate = rate;
+    countdown = rate;
+}
+
+std::uint32_t rate() { return sample_rate; }
+
+bool sample() {
+    if (sample_rate == 0 || --countdown > 0) {
+        return false;
+    }
+    countdown = sample_rate;
+    return true;
+}
+
+void record(Phase phase, int fd, std::uint64_t start, Cmd cmd) {
+    const std::uint64_t ticks = std::min<std::uint64_t>(now() - start, UINT32_MAX);
+    if (ring.events.empty()) {
+        ring.events.resize(TRACE_RING_SIZE);
+    }
+    ring.events[ring.next] = {start, static_cast<std::uint32_t>(ticks), fd, phase, cmd};
+    ring.next = (ring.next + 1) % TRACE_RING_SIZE;
+    if (ring.size < TRACE_RING_SIZE) {
+        ring.size++;
+    }
+}
+
+std::string dump() {
+    const Clock end = read_clock();
+    const double ns_per_tick = end.ticks > base.ticks
+                                   ? static_cast<double>(end.ns - base.ns) /
+                                         static_cast<double>(end.ticks - base.ticks)
+                                   : 1.0;
+
+    std::string json = R"({"displayTimeUnit":"ns","traceEvents":[)";
+    auto out = std::back_inserter(json);
+    // Oldest first
+    const std::size_t first =
+        (ring.next + TRACE_RING_SIZE - ring.size) % TRACE_RING_SIZE;
+    for (std::size_t i = 0; i < ring.size; i++) {
+        const Event &event = ring.events[(first + i) % TRACE_RING_SIZE];
+        // Microseconds since tracing was first enabled
+        const double ts =
+            static_cast<double>(event.start - base.ticks) * ns_per_tick / 1000;
+        const double dur = event.ticks * ns_per_tick / 1000;
+        fmt::format_to(out,
+                       R"({}{{"name":"{}","cat":"request","ph":"X","pid":1,"tid":{},)"
+                       R"("ts":{:.3f},"dur":{:.3f})",
+                       i == 0 ? "" : ",", to_string(event.phase), event.fd, ts, dur);
+        if (event.cmd != Cmd::NONE) {
+            fmt::format_to(out, R"(,"args":{{"cmd":"{}"}})", to_string(event.cmd));
+        }
+        json.push_back('}');
+    }
+    json += "]}";
+
+    ring.next = 0;
+    ring.size = 0;
+    return json;
+}
+} // namespace Trace
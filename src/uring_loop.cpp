@@ -0,0 +1,827 @@
+#include "connection.hpp"
+#include "defrag.hpp"
+#include "event_loop.hpp"
+#include "latency.hpp"
+#include "pubsub.hpp"
+#include "replication.hpp"
+#include "tier.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm> // std::max
+#include <array>     // std::array
+#include <chrono>    // std::chrono::steady_clock
+#include <cerrno>    // errno, ENOBUFS, ECANCELED, EBUSY, EAGAIN, EINTR
+#include <cstddef>   // std::byte, std::size_t
+#include <cstdint>   // std::uint16_t, std::uint64_t
+#include <cstdlib>   // EXIT_FAILURE, std::abort
+#include <cstring>   // std::memcpy, std::memmove, std::memset, std::strerror
+#include <memory>    // std::unique_ptr, std::make_unique
+#include <vector>    // std::vector
+
+#include <linux/io_uring.h>   // io_uring_params, io_uring_sqe, io_uring_cqe
+#include <linux/time_types.h> // __kernel_timespec
+#include <poll.h>             // POLLIN
+#include <sys/mman.h>         // mmap, munmap
+#include <sys/socket.h>       // msghdr, shutdown, MSG_NOSIGNAL, SOCK_NONBLOCK
+#include <sys/syscall.h>      // __NR_io_uring_*
+#include <sys/uio.h>          // iovec
+#include <unistd.h>           // close, syscall
+
+namespace {
+constexpr unsigned URING_ENTRIES = 4096;
+// Provided receive buffers, BUF_RING_ENTRIES must be a power of 2
+constexpr unsigned BUF_RING_ENTRIES = 1024;
+constexpr std::size_t BUF_SIZE = 4096;
+constexpr std::uint16_t BUF_GROUP = 0;
+
+enum class Op : std::uint8_t { ACCEPT, RECV, SEND, TIMEOUT, TIER, CANCEL };
+
+std::uint64_t to_user_data(Op op, int fd) {
+    return static_cast<std::uint64_t>(op) << 32 | static_cast<std::uint32_t>(fd);
+}
+Op to_op(std::uint64_t user_data) { return static_cast<Op>(user_data >> 32); }
+int to_fd(std::uint64_t user_data) { return static_cast<int>(user_data & 0xFFFFFFFF); }
+
+int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                                    flags, nullptr, 0));
+}
+
+int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+// Arguments of the send in flight, they must stay put until it completes
+struct SendMsg {
+    msghdr hdr{};
+    std::array<iovec, WBUF_IOV_MAX> iov{};
+};
+
+// Per connection state only the io_uring backend needs
+struct UringConn {
+    bool recv_armed = false;
+    bool send_inflight = false;
+    bool closing = false;
+    bool close_after_send = false; // The reply to a protocol error goes out first
+    bool paused = false; // Stopped reading with too much input waiting, see sync_recv
+    bool ready = false;  // Has requests left and nothing to send, waits in ready
+    std::uint64_t timer = 0; // When the current idle timer fires, 0 if none
+    // Heap allocated, states may be resized while a send is in flight. Created
+    // with the first send, a client that never sends anything doesn't need it.
+    std::unique_ptr<SendMsg> send;
+};
+
+std::uint64_t now_seconds() {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::seconds>(now).count();
+}
+
+/*
+    io_uring backend. Clients are accepted with a multishot accept and read with
+    a multishot recv that picks buffers from a provided buffer ring, so a quiet
+    connection holds no receive buffer. Every SQE queued while handling the
+    completions of an iteration, sends included, goes out with the single
+    io_uring_enter that also waits for the next completions. If the SQ fills up
+    meanwhile it is submitted right away, the completions are first moved out
+    of the CQ ring when the kernel has no room for more.
+
+    A connection has at most one sendmsg in flight, pointing into wbuf and the
+    values it references, and the requests that arrive meanwhile stay in rbuf
+    until it completes. A turn handles at most request-budget requests, the rest
+    wait for the send to complete so the other connections get their turns in
+    between. A connection with nothing to send, like the link to the primary
+    whose replies are dropped, waits in the ready queue instead, which is run
+    before waiting for completions again. The fd is only closed once no
+    operation refers to the connection anymore.
+
+    Once RBUF_HIGH_WATER bytes wait in rbuf for a send, their turn or spilled
+    values, the multishot recv is cancelled. It is armed again when the connection
+    handles requests again, so a client that sends faster than it reads is held
+    back by TCP.
+
+    With a timeout, a timeout SQE completes every second to expire the idle
+    timers, the same way as the epoll backend does. A replica keeps it armed
+    too, to connect to its primary again.
+
+    The replicas get what the clients wrote once the completions of the
+    iteration were handled, except for those with a send in flight, which get
+    it after the send completes.
+
+    A poll on Tier::event_fd completes when spilled values were read back, the
+    connections that waited for them are handled again.
+*/
+class UringLoop : public EventLoop {
+  public:
+    explicit UringLoop(const Config &config) : config{config} {}
+    ~UringLoop() override;
+
+    bool init();
+    int run(const std::vector<Listener> &listeners) override;
+
+  private:
+    // Never fails, submits what was queued when the SQ is full
+    io_uring_sqe *get_sqe();
+    int submit_and_wait();
+    // Move the completions out of the CQ ring into completions
+    void reap();
+
+    void prep_accept(int listen_fd);
+    void prep_recv(int fd);
+    void prep_send(int fd);
+    void prep_timeout();
+    void prep_tier_poll();
+    void prep_cancel_recv(int fd);
+    void add_buffer(std::uint16_t bid);
+
+    bool on_accept(const io_uring_cqe &cqe);
+    void on_recv(const io_uring_cqe &cqe);
+    void on_send(const io_uring_cqe &cqe);
+    void on_timeout();
+    void on_tier();
+
+    void add_connection(int fd);
+    void sync_replication();
+    void wake_subscribers();
+    void handle(int fd);
+    void run_ready();
+    // Stop reading while the connection can't handle the input it has, and read
+    // again once it can
+    void sync_recv(int fd);
+    void add_timer(int fd, std::uint64_t when);
+    void close_conn(int fd);
+    void try_release(int fd);
+
+    const Config &config;
+    int ring_fd = -1;
+
+    // Submission and completion queues share a single mapping
+    void *rings = MAP_FAILED;
+    std::size_t rings_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sqes_len = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0; // Published to sq_tail on submit
+    unsigned to_submit = 0;
+
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+    // Reaped, handled in order by the loop
+    std::vector<io_uring_cqe> completions;
+
+    io_uring_buf_ring *buf_ring = nullptr;
+    std::size_t buf_ring_len = 0;
+    std::uint16_t buf_tail = 0;
+    std::vector<std::byte> buf_pool;
+
+    std::vector<std::unique_ptr<Connection>> connections; // index is fd
+    std::vector<UringConn> states;                        // index is fd
+    // Connections that used up their budget and the ones being run, by fd
+    std::vector<int> ready;
+    std::vector<int> running;
+    // Replication::replicas(), which closing a replica changes
+    std::vector<int> replicas;
+    std::vector<int> woken; // See PubSub::take_woken
+    std::vector<int> loaded; // See Tier::complete
+
+    TimerWheel timers;
+    std::vector<Timer> due;
+    __kernel_timespec tick{1, 0}; // Read by the kernel while the timeout is pending
+    bool tick_armed = false;
+    std::uint64_t now = 0;        // Seconds, updated once per iteration
+};
+
+UringLoop::~UringLoop() {
+    if (buf_ring != nullptr) {
+        munmap(buf_ring, buf_ring_len);
+    }
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_len);
+    }
+    if (rings != MAP_FAILED) {
+        munmap(rings, rings_len);
+    }
+    if (ring_fd != -1) {
+        close(ring_fd);
+    }
+}
+
+bool UringLoop::init() {
+    io_uring_params params{};
+    // Completions are only reaped from this thread, in io_uring_enter
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring_fd = io_uring_setup(URING_ENTRIES, &params);
+    if (ring_fd == -1) {
+        params = {};
+        ring_fd = io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring_fd == -1) {
+        LOG_WARNING(fmt::format("io_uring_setup failed: {}", std::strerror(errno)));
+        return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        LOG_WARNING("io_uring lacks IORING_FEAT_SINGLE_MMAP");
+        return false;
+    }
+
+    rings_len = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                         params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    rings = mmap(nullptr, rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        LOG_WARNING(fmt::format("mmap failed: {}", std::strerror(errno)));
+        return false;
+    }
+
+    sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes_map = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_map == MAP_FAILED) {
+        LOG_WARNING(fmt::format("mmap failed: {}", std::strerror(errno)));
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(sqes_map);
+
+    auto *base = static_cast<char *>(rings);
+    sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    sq_mask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+
+    cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+
+    // The buffer ring must be page aligned
+    buf_ring_len = BUF_RING_ENTRIES * sizeof(io_uring_buf);
+    void *ring_map = mmap(nullptr, buf_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_map == MAP_FAILED) {
+        LOG_WARNING(fmt::format("mmap failed: {}", std::strerror(errno)));
+        return false;
+    }
+    buf_ring = static_cast<io_uring_buf_ring *>(ring_map);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+    reg.ring_entries = BUF_RING_ENTRIES;
+    reg.bgid = BUF_GROUP;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        LOG_WARNING(fmt::format("io_uring_register failed: {}", std::strerror(errno)));
+        return false;
+    }
+
+    buf_pool.resize(BUF_RING_ENTRIES * BUF_SIZE);
+    for (unsigned bid = 0; bid < BUF_RING_ENTRIES; bid++) {
+        add_buffer(static_cast<std::uint16_t>(bid));
+    }
+
+    return true;
+}
+
+int UringLoop::run(const std::vector<Listener> &listeners) {
+    for (const auto &listener : listeners) {
+        prep_accept(listener.fd);
+    }
+    if (Tier::enabled()) {
+        prep_tier_poll();
+    }
+    now = now_seconds();
+    sync_replication();
+
+    while (true) {
+        if (submit_and_wait() == -1) {
+            LOG_ERROR(fmt::format("io_uring_enter failed: {}", std::strerror(errno)));
+            return EXIT_FAILURE;
+        }
+        now = now_seconds();
+        Latency::begin_iteration();
+
+        // Handling them may reap more, see get_sqe
+        reap();
+        for (std::size_t i = 0; i < completions.size(); i++) {
+            const io_uring_cqe cqe = completions[i];
+            switch (to_op(cqe.user_data)) {
+            case Op::ACCEPT:
+                if (!on_accept(cqe)) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case Op::RECV:
+                on_recv(cqe);
+                break;
+            case Op::SEND:
+                on_send(cqe);
+                break;
+            case Op::TIMEOUT:
+                on_timeout();
+                break;
+            case Op::TIER:
+                on_tier();
+                break;
+            case Op::CANCEL:
+                // The recv completes with -ECANCELED, if it was still armed
+                break;
+            }
+        }
+        completions.clear();
+
+        run_ready();
+        Tier::cycle();
+        Defrag::cycle();
+        sync_replication();
+        wake_subscribers();
+        Latency::end_iteration();
+    }
+}
+
+io_uring_sqe *UringLoop::get_sqe() {
+    // The queue is full, submit what we have so far without waiting until the
+    // kernel took some of it
+    while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        const int n = io_uring_enter(ring_fd, to_submit, 0, 0);
+        if (n > 0) {
+            to_submit -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 || errno == EBUSY || errno == EAGAIN) {
+            // The completions have no room left, move them out of the CQ ring
+            // for the loop to handle and let the kernel flush its overflow
+            reap();
+            io_uring_enter(ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+            reap();
+            continue;
+        }
+        LOG_ERROR(fmt::format("io_uring_enter failed with the SQ full: {}",
+                              std::strerror(errno)));
+        std::abort();
+    }
+
+    const unsigned idx = sq_local_tail & sq_mask;
+    sq_array[idx] = idx;
+    sq_local_tail++;
+    to_submit++;
+
+    io_uring_sqe *sqe = &sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void UringLoop::reap() {
+    unsigned head = *cq_head;
+    const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        completions.push_back(cqes[head & cq_mask]);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+int UringLoop::submit_and_wait() {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+    // Don't block while queued connections have work left
+    const unsigned min_complete = ready.empty() ? 1 : 0;
+    int n = 0;
+    do {
+        n = io_uring_enter(ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0) {
+        to_submit -= n;
+    }
+    return n == -1 ? -1 : 0;
+}
+
+void UringLoop::prep_accept(int listen_fd) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = to_user_data(Op::ACCEPT, listen_fd);
+}
+
+void UringLoop::prep_recv(int fd) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = to_user_data(Op::RECV, fd);
+    states[fd].recv_armed = true;
+}
+
+void UringLoop::prep_send(int fd) {
+    if (states[fd].send == nullptr) {
+        states[fd].send = std::make_unique<SendMsg>();
+    }
+    SendMsg &send = *states[fd].send;
+    send.hdr.msg_iov = send.iov.data();
+    send.hdr.msg_iovlen = wbuf_iov(connections[fd], send.iov.data(), send.iov.size());
+
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&send.hdr);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = to_user_data(Op::SEND, fd);
+    states[fd].send_inflight = true;
+}
+
+void UringLoop::prep_timeout() {
+    // Faster while defragmenting, see Defrag::cycle
+    tick = Defrag::running() ? __kernel_timespec{0, DEFRAG_CYCLE_MS * 1'000'000}
+                             : __kernel_timespec{1, 0};
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&tick);
+    sqe->len = 1;
+    sqe->user_data = to_user_data(Op::TIMEOUT, -1);
+    tick_armed = true;
+}
+
+void UringLoop::prep_tier_poll() {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = Tier::event_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = to_user_data(Op::TIER, Tier::event_fd());
+}
+
+void UringLoop::prep_cancel_recv(int fd) {
+    io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = to_user_data(Op::RECV, fd);
+    sqe->user_data = to_user_data(Op::CANCEL, fd);
+}
+
+void UringLoop::add_buffer(std::uint16_t bid) {
+    // The ring is indexed by hand, bufs sits at the wrong offset when the header
+    // is compiled as C++. Only set the fields we own, the tail overlays resv of
+    // the first entry.
+    io_uring_buf &buf =
+        reinterpret_cast<io_uring_buf *>(buf_ring)[buf_tail & (BUF_RING_ENTRIES - 1)];
+    buf.addr = reinterpret_cast<std::uint64_t>(&buf_pool[bid * BUF_SIZE]);
+    buf.len = BUF_SIZE;
+    buf.bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+bool UringLoop::on_accept(const io_uring_cqe &cqe) {
+    if (cqe.res == -EINVAL) {
+        LOG_ERROR("io_uring multishot accept is not supported by this kernel");
+        return false;
+    }
+
+    if (cqe.res < 0) {
+        LOG_ERROR(fmt::format("accept failed: {}", std::strerror(-cqe.res)));
+    } else {
+        const int fd = cqe.res;
+        add_connection(fd);
+        LOG_INFO(fmt::format("Accepted new connection: fd = {}", fd));
+    }
+
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+        prep_accept(to_fd(cqe.user_data));
+    }
+    return true;
+}
+
+void UringLoop::on_recv(const io_uring_cqe &cqe) {
+    const int fd = to_fd(cqe.user_data);
+    UringConn &state = states[fd];
+    auto &conn = connections[fd];
+
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+        state.recv_armed = false;
+    }
+
+    if ((cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+        const auto bid = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe.res > 0 && !state.closing) {
+            // Append to rbuf, dropping the requests handled so far. The kernel
+            // did the read, the copy out of its buffer is what is traced.
+            const auto n = static_cast<std::size_t>(cqe.res);
+            conn->traced = Trace::sample();
+            const TraceSpan span{*conn, Phase::READ};
+            acquire_rbuf(conn);
+            conn->last_active = now;
+            if (conn->rbuf_pos > 0) {
+                const std::size_t remain = conn->rbuf_size - conn->rbuf_pos;
+                std::memmove(conn->rbuf.data(), &conn->rbuf[conn->rbuf_pos], remain);
+                conn->rbuf_size = remain;
+                conn->rbuf_pos = 0;
+            }
+            if (conn->rbuf.size() - conn->rbuf_size < n) {
+                conn->rbuf.resize(conn->rbuf_size + n);
+            }
+            std::memcpy(&conn->rbuf[conn->rbuf_size], &buf_pool[bid * BUF_SIZE], n);
+            conn->rbuf_size += n;
+        }
+        add_buffer(bid);
+    }
+
+    if (state.closing) {
+        try_release(fd);
+        return;
+    }
+
+    if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+        // Ran out of provided buffers, they are back by now, or paused
+        if (!state.paused && !state.recv_armed) {
+            prep_recv(fd);
+        }
+        return;
+    }
+
+    if (cqe.res <= 0) {
+        if (cqe.res == 0) {
+            LOG_INFO(fmt::format("Connection closed: fd = {}", fd));
+        } else {
+            LOG_ERROR(fmt::format("recv failed: {}", std::strerror(-cqe.res)));
+        }
+        close_conn(fd);
+        return;
+    }
+
+    if (!state.recv_armed && !state.paused) {
+        prep_recv(fd);
+    }
+    handle(fd);
+    sync_recv(fd);
+}
+
+void UringLoop::on_send(const io_uring_cqe &cqe) {
+    const int fd = to_fd(cqe.user_data);
+    auto &conn = connections[fd];
+    states[fd].send_inflight = false;
+
+    if (states[fd].closing) {
+        try_release(fd);
+        return;
+    }
+
+    if (cqe.res < 0) {
+        LOG_ERROR(fmt::format("send failed: {}", std::strerror(-cqe.res)));
+        close_conn(fd);
+        return;
+    }
+
+    wbuf_consume(conn, cqe.res);
+    conn->last_active = now;
+    if (wbuf_pending(conn)) {
+        prep_send(fd);
+        return;
+    }
+    if (states[fd].close_after_send) {
+        close_conn(fd);
+        return;
+    }
+
+    // Response was fully sent
+    conn->state = ConnState::REQUEST;
+
+    // Handle the requests that arrived while sending
+    handle(fd);
+}
+
+void UringLoop::add_connection(int fd) {
+    if (connections.size() <= static_cast<std::size_t>(fd)) {
+        connections.resize(fd + 1);
+        states.resize(fd + 1);
+    }
+    connections[fd] = std::make_unique<Connection>(fd);
+    connections[fd]->last_active = now;
+    states[fd] = {};
+    if (config.timeout > 0) {
+        add_timer(fd, now + config.timeout);
+    }
+    prep_recv(fd);
+}
+
+void UringLoop::sync_replication() {
+    const int link_fd = Replication::connect_primary(now);
+    if (link_fd != -1) {
+        // The send and the recv wait for the connection to complete
+        add_connection(link_fd);
+        Replication::on_link(connections[link_fd]);
+        connections[link_fd]->state = ConnState::RESPONSE;
+        prep_send(link_fd);
+    }
+
+    replicas = Replication::replicas();
+    for (const int fd : replicas) {
+        // The send in flight points into wbuf, which catch_up may grow
+        if (states[fd].send_inflight || states[fd].closing) {
+            continue;
+        }
+        if (!Replication::catch_up(connections[fd])) {
+            close_conn(fd);
+            continue;
+        }
+        if (wbuf_pending(connections[fd])) {
+            connections[fd]->state = ConnState::RESPONSE;
+            prep_send(fd);
+        }
+    }
+
+    if (!tick_armed && (config.timeout > 0 || Replication::is_replica() ||
+                        Tier::enabled() || Defrag::enabled())) {
+        prep_timeout();
+    }
+}
+
+void UringLoop::wake_subscribers() {
+    PubSub::take_woken(woken);
+    for (const int fd : woken) {
+        // The ones with a send in flight get their messages once it completes
+        const UringConn &state = states[fd];
+        if (connections[fd] == nullptr || state.closing || state.send_inflight ||
+            !wbuf_pending(connections[fd])) {
+            continue;
+        }
+        connections[fd]->state = ConnState::RESPONSE;
+        prep_send(fd);
+    }
+}
+
+void UringLoop::handle(int fd) {
+    auto &conn = connections[fd];
+    if (states[fd].send_inflight) {
+        return;
+    }
+
+    if (states[fd].ready) {
+        // Gets its turn from run_ready
+        return;
+    }
+
+    auto budget = static_cast<std::size_t>(config.request_budget);
+    while (budget > 0 && try_one_request(conn)) {
+        budget--;
+    }
+
+    if (conn->state == ConnState::END) {
+        if (wbuf_pending(conn)) {
+            states[fd].close_after_send = true;
+            prep_send(fd);
+            return;
+        }
+        LOG_ERROR(fmt::format("Connection closed without respond: fd = {}", fd));
+        close_conn(fd);
+        return;
+    }
+
+    release_rbuf(conn);
+
+    if (over_output_limit(conn, config.output_limit, now)) {
+        LOG_WARNING(fmt::format("Client over the output buffer limit: fd = {}", fd));
+        close_conn(fd);
+        return;
+    }
+
+    if (wbuf_pending(conn)) {
+        conn->state = ConnState::RESPONSE;
+        prep_send(fd);
+    } else if (budget == 0 && conn->io_pending == 0) {
+        // No send completion will bring it back for the requests left
+        states[fd].ready = true;
+        ready.push_back(fd);
+    }
+    sync_recv(fd);
+}
+
+void UringLoop::run_ready() {
+    // One more turn for each connection queued so far, in order. The ones still
+    // not done queue up again behind the new ones.
+    running.swap(ready);
+    for (const int fd : running) {
+        // The fd may have been closed and reused meanwhile
+        if (connections[fd] != nullptr && states[fd].ready && !states[fd].closing) {
+            states[fd].ready = false;
+            handle(fd);
+        }
+    }
+    running.clear();
+}
+
+void UringLoop::sync_recv(int fd) {
+    UringConn &state = states[fd];
+    const auto &conn = connections[fd];
+    if (conn == nullptr || state.closing) {
+        return;
+    }
+    const bool blocked = state.send_inflight || state.ready || conn->io_pending > 0;
+    const bool backlog = blocked && conn->rbuf_size - conn->rbuf_pos >= RBUF_HIGH_WATER;
+    if (backlog == state.paused) {
+        return;
+    }
+    state.paused = backlog;
+    if (state.paused && state.recv_armed) {
+        prep_cancel_recv(fd);
+    } else if (!state.paused && !state.recv_armed) {
+        prep_recv(fd);
+    }
+}
+
+void UringLoop::on_timeout() {
+    tick_armed = false;
+    const LatencySpan latency{LatencyEvent::EXPIRE_CYCLE};
+    timers.expire(now, due);
+    for (const Timer &timer : due) {
+        // Skip the timers of closed connections
+        const UringConn &state = states[timer.fd];
+        if (connections[timer.fd] == nullptr || state.closing ||
+            state.timer != timer.when) {
+            continue;
+        }
+
+        const std::uint64_t deadline =
+            connections[timer.fd]->last_active + config.timeout;
+        if (deadline > now || !may_time_out(*connections[timer.fd])) {
+            add_timer(timer.fd, std::max(deadline, now + 1));
+            continue;
+        }
+
+        LOG_INFO(fmt::format("Closing idle client: fd = {}", timer.fd));
+        close_conn(timer.fd);
+    }
+    due.clear();
+}
+
+void UringLoop::on_tier() {
+    Tier::complete(loaded);
+    for (const int fd : loaded) {
+        // Closed since, or a new connection on the same fd
+        auto &conn = connections[fd];
+        if (conn == nullptr || states[fd].closing || conn->io_pending == 0 ||
+            --conn->io_pending > 0) {
+            continue;
+        }
+        handle(fd);
+    }
+    prep_tier_poll();
+}
+
+void UringLoop::add_timer(int fd, std::uint64_t when) {
+    states[fd].timer = when;
+    timers.add(fd, when);
+}
+
+void UringLoop::close_conn(int fd) {
+    Replication::on_close(*connections[fd], now);
+    if (connections[fd]->subscriptions > 0) {
+        PubSub::on_close(*connections[fd]);
+    }
+    states[fd].closing = true;
+    // Terminates the multishot recv, the fd is closed once it completes
+    shutdown(fd, SHUT_RDWR);
+    try_release(fd);
+}
+
+void UringLoop::try_release(int fd) {
+    const UringConn &state = states[fd];
+    if (!state.closing || state.recv_armed || state.send_inflight) {
+        return;
+    }
+    close(fd);
+    connections[fd].reset();
+    states[fd] = {};
+}
+} // namespace
+
+std::unique_ptr<EventLoop> make_uring_loop(const Config &config) {
+    auto loop = std::make_unique<UringLoop>(config);
+    if (!loop->init()) {
+        return nullptr;
+    }
+    return loop;
+}
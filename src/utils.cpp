@@ -3,11 +3,14 @@
 
 #include <fmt/ranges.h> // fmt::print
 
-#include <algorithm>   // std::transform
+#include <algorithm>   // std::transform, std::min, std::minmax
+#include <array>       // std::array
 #include <cerrno>      // errno
+#include <charconv>    // std::from_chars
 #include <cstddef>     // std::byte, std::size_t
-#include <cstdint>     // std::int32_t
+#include <cstdint>     // std::int32_t, std::uint8_t, std::uint16_t, std::uint64_t
 #include <cstring>     // std::strerror
+#include <optional>    // std::optional
 #include <string_view> // std::string_view
 #include <vector>      // std::vector
 
@@ -95,6 +98,33 @@ std::vector<std::byte> to_bytes(std::string_view sv) {
     return buf;
 }
 
+std::optional<std::int64_t> to_int64(std::string_view sv) {
+    if (sv.empty() || sv == "-0") {
+        return std::nullopt;
+    }
+
+    // Reject leading zeros
+    const std::size_t digits = sv[0] == '-' ? 1 : 0;
+    if (sv.size() > digits + 1 && sv[digits] == '0') {
+        return std::nullopt;
+    }
+
+    std::int64_t value = 0;
+    const auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), value);
+    if (ec != std::errc{} || ptr != sv.data() + sv.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::uint64_t fast_rand() {
+    static std::uint64_t state = 0x9E3779B97F4A7C15ULL;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
 std::vector<std::byte> make_request(const std::vector<std::string_view> &args) {
     std::size_t len = CMD_LEN_BYTES;
     for (const auto &arg : args) {
@@ -121,8 +151,135 @@ std::vector<std::byte> make_request(const std::vector<std::string_view> &args) {
     return buf;
 }
 
+namespace {
+// Match c against the class starting at pattern[p], which is '['. Moves p past
+// the closing ']', an unterminated class runs to the end of the pattern.
+bool match_class(std::string_view pattern, std::size_t &p, char c) {
+    p++;
+    const bool negate = p < pattern.size() && pattern[p] == '^';
+    if (negate) {
+        p++;
+    }
+
+    bool match = false;
+    while (p < pattern.size() && pattern[p] != ']') {
+        if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+            match = match || pattern[p + 1] == c;
+            p += 2;
+        } else if (p + 2 < pattern.size() && pattern[p + 1] == '-' &&
+                   pattern[p + 2] != ']') {
+            const auto [lo, hi] = std::minmax(pattern[p], pattern[p + 2]);
+            match = match || (c >= lo && c <= hi);
+            p += 3;
+        } else {
+            match = match || pattern[p] == c;
+            p++;
+        }
+    }
+    if (p < pattern.size()) {
+        p++;
+    }
+    return match != negate;
+}
+} // namespace
+
+bool glob_match(std::string_view pattern, std::string_view str) {
+    // On a mismatch, the last * takes one more character and matching resumes
+    // after it. Earlier stars never need to take more, so this is O(n * m) at
+    // worst instead of exponential.
+    constexpr std::size_t NO_STAR = std::string_view::npos;
+    std::size_t p = 0;
+    std::size_t s = 0;
+    std::size_t star_p = NO_STAR;
+    std::size_t star_s = 0;
+
+    while (s < str.size()) {
+        if (p < pattern.size()) {
+            const char c = pattern[p];
+            if (c == '*') {
+                star_p = ++p;
+                star_s = s;
+                continue;
+            }
+
+            std::size_t next = p + 1;
+            bool match = false;
+            if (c == '?') {
+                match = true;
+            } else if (c == '[') {
+                next = p;
+                match = match_class(pattern, next, str[s]);
+            } else if (c == '\\' && p + 1 < pattern.size()) {
+                match = pattern[p + 1] == str[s];
+                next = p + 2;
+            } else {
+                match = c == str[s];
+            }
+
+            if (match) {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+
+        if (star_p == NO_STAR) {
+            return false;
+        }
+        p = star_p;
+        s = ++star_s;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+std::string_view glob_prefix(std::string_view pattern) {
+    return pattern.substr(0, std::min(pattern.find_first_of("*?[\\"), pattern.size()));
+}
+
+namespace {
+constexpr std::array<std::uint16_t, 256> make_crc16_table() {
+    std::array<std::uint16_t, 256> table{};
+    for (std::size_t i = 0; i < table.size(); i++) {
+        auto crc = static_cast<std::uint16_t>(i << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) != 0 ? static_cast<std::uint16_t>((crc << 1) ^ 0x1021)
+                                      : static_cast<std::uint16_t>(crc << 1);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr std::array<std::uint16_t, 256> CRC16_TABLE = make_crc16_table();
+} // namespace
+
+std::uint16_t crc16(std::string_view data) {
+    std::uint16_t crc = 0;
+    for (const char c : data) {
+        const auto idx =
+            static_cast<std::uint8_t>((crc >> 8) ^ static_cast<std::uint8_t>(c));
+        crc = static_cast<std::uint16_t>((crc << 8) ^ CRC16_TABLE[idx]);
+    }
+    return crc;
+}
+
+std::uint16_t key_slot(std::string_view key) {
+    const std::size_t open = key.find('{');
+    if (open != std::string_view::npos) {
+        const std::size_t close = key.find('}', open + 1);
+        if (close != std::string_view::npos && close > open + 1) {
+            key = key.substr(open + 1, close - open - 1);
+        }
+    }
+    return crc16(key) & (CLUSTER_SLOTS - 1);
+}
+
 namespace Logger {
-Level level;
+Level level = Level::INFO;
 
 std::string_view to_string(Level level) {
     switch (level) {
@@ -140,6 +297,7 @@ std::string_view to_string(Level level) {
 }
 
 void set_level(Level level) { Logger::level = level; }
+bool enabled(Level level) { return level >= Logger::level; }
 
 void log_write(Level level, const std::string &msg, const Location &loc) {
     if (level < Logger::level) {
@@ -0,0 +1,186 @@
+#include "art.hpp"
+#include "connection.hpp"
+#include "cpu.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>   // std::sort
+#include <cstddef>     // std::size_t
+#include <memory>      // std::make_unique, std::make_shared
+#include <random>      // std::mt19937
+#include <set>         // std::set
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+namespace {
+// Short keys over a few letters share long prefixes and end inside each other
+std::string random_key(std::mt19937 &rng) {
+    std::string key(rng() % 8, '\0');
+    for (auto &c : key) {
+        c = static_cast<char>('a' + rng() % 4);
+    }
+    return key;
+}
+
+std::vector<std::string> with_prefix(const std::set<std::string> &keys,
+                                     std::string_view prefix, std::size_t limit) {
+    std::vector<std::string> out;
+    for (auto it = keys.lower_bound(std::string(prefix));
+         it != keys.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+        if (limit != 0 && out.size() == limit) {
+            break;
+        }
+        out.push_back(*it);
+    }
+    return out;
+}
+
+std::vector<std::string> range(const std::set<std::string> &keys,
+                               const std::string &start, const std::string &end,
+                               std::size_t limit) {
+    std::vector<std::string> out;
+    for (auto it = keys.lower_bound(start); it != keys.end() && *it <= end; ++it) {
+        if (limit != 0 && out.size() == limit) {
+            break;
+        }
+        out.push_back(*it);
+    }
+    return out;
+}
+
+void compare_random(std::mt19937 &rng) {
+    ArtTree tree;
+    std::set<std::string> keys;
+    for (int i = 0; i < 20000; i++) {
+        const std::string key = random_key(rng);
+        if (rng() % 3 == 0) {
+            ASSERT_EQ(tree.remove(key), keys.erase(key) == 1) << key;
+        } else {
+            ASSERT_EQ(tree.insert(key), keys.insert(key).second) << key;
+        }
+        ASSERT_EQ(tree.size(), keys.size());
+
+        if (i % 100 == 0) {
+            const std::string a = random_key(rng);
+            const std::string b = random_key(rng);
+            const std::size_t limit = rng() % 4 == 0 ? rng() % 10 : 0;
+            EXPECT_EQ(tree.contains(a), keys.count(a) == 1) << a;
+            EXPECT_EQ(tree.with_prefix(a, limit), with_prefix(keys, a, limit)) << a;
+            EXPECT_EQ(tree.range(a, b, limit), range(keys, a, b, limit)) << a << " " << b;
+        }
+    }
+}
+} // namespace
+
+TEST(ArtTree, InsertRemove) {
+    ArtTree tree;
+    EXPECT_TRUE(tree.insert("romane"));
+    EXPECT_TRUE(tree.insert("romanus"));
+    EXPECT_TRUE(tree.insert("roman"));
+    EXPECT_TRUE(tree.insert(""));
+    EXPECT_FALSE(tree.insert("roman"));
+    EXPECT_EQ(tree.size(), 4);
+
+    EXPECT_TRUE(tree.contains("roman"));
+    EXPECT_TRUE(tree.contains(""));
+    EXPECT_FALSE(tree.contains("rom"));
+    EXPECT_FALSE(tree.contains("romanes"));
+
+    EXPECT_TRUE(tree.remove("roman"));
+    EXPECT_FALSE(tree.remove("roman"));
+    EXPECT_FALSE(tree.contains("roman"));
+    EXPECT_TRUE(tree.contains("romanus"));
+    EXPECT_EQ(tree.with_prefix("", 0),
+              (std::vector<std::string>{"", "romane", "romanus"}));
+
+    tree.clear();
+    EXPECT_EQ(tree.size(), 0);
+    EXPECT_TRUE(tree.with_prefix("", 0).empty());
+}
+
+TEST(ArtTree, Prefix) {
+    ArtTree tree;
+    for (const auto *key : {"user:1", "user:10", "user:2", "users", "post:1", "use"}) {
+        tree.insert(key);
+    }
+    EXPECT_EQ(tree.with_prefix("user:", 0),
+              (std::vector<std::string>{"user:1", "user:10", "user:2"}));
+    EXPECT_EQ(tree.with_prefix("user", 2),
+              (std::vector<std::string>{"user:1", "user:10"}));
+    EXPECT_EQ(tree.with_prefix("use", 0),
+              (std::vector<std::string>{"use", "user:1", "user:10", "user:2", "users"}));
+    EXPECT_EQ(tree.with_prefix("user:10", 0), (std::vector<std::string>{"user:10"}));
+    EXPECT_TRUE(tree.with_prefix("user:3", 0).empty());
+    EXPECT_TRUE(tree.with_prefix("x", 0).empty());
+}
+
+TEST(ArtTree, Range) {
+    ArtTree tree;
+    for (const auto *key : {"a", "ab", "abc", "b", "ba", "c"}) {
+        tree.insert(key);
+    }
+    EXPECT_EQ(tree.range("ab", "b", 0), (std::vector<std::string>{"ab", "abc", "b"}));
+    EXPECT_EQ(tree.range("aa", "bz", 2), (std::vector<std::string>{"ab", "abc"}));
+    EXPECT_EQ(tree.range("", "\xff", 0).size(), 6);
+    EXPECT_TRUE(tree.range("c", "a", 0).empty());
+    EXPECT_TRUE(tree.range("bb", "bz", 0).empty());
+}
+
+// Every byte below one node, it grows to 256 children and shrinks back
+TEST(ArtTree, GrowShrink) {
+    ArtTree tree;
+    std::vector<std::string> keys;
+    for (int byte = 255; byte >= 0; byte--) {
+        keys.push_back(std::string("k") + static_cast<char>(byte));
+        ASSERT_TRUE(tree.insert(keys.back()));
+        ASSERT_TRUE(tree.contains(keys.back()));
+    }
+    std::sort(keys.begin(), keys.end());
+    EXPECT_EQ(tree.with_prefix("k", 0), keys);
+
+    while (!keys.empty()) {
+        ASSERT_TRUE(tree.remove(keys.back()));
+        keys.pop_back();
+        ASSERT_EQ(tree.with_prefix("k", 0), keys);
+    }
+    EXPECT_EQ(tree.size(), 0);
+}
+
+TEST(ArtTree, Random) {
+    std::mt19937 rng(42); // NOLINT(cert-msc32-c, cert-msc51-cpp)
+    compare_random(rng);
+}
+
+TEST(ArtTree, RandomScalar) {
+    Cpu::set_simd_enabled(false);
+    std::mt19937 rng(7); // NOLINT(cert-msc32-c, cert-msc51-cpp)
+    compare_random(rng);
+    Cpu::set_simd_enabled(true);
+}
+
+TEST(ArtTree, Commands) {
+    auto conn = std::make_unique<Connection>(0);
+    map.clear();
+    EXPECT_EQ(run(conn, {"SCANPREFIX", "user:"}),
+              "-ERR the ordered index is off, see the ordered-index option\r\n");
+
+    map.enable_index();
+    for (const auto *key : {"user:2", "user:1", "user:10", "post:1"}) {
+        map.set(key, std::make_shared<std::string>("v"));
+    }
+    map.remove("user:2");
+    EXPECT_EQ(run(conn, {"SCANPREFIX", "user:"}),
+              "*2\r\n$6\r\nuser:1\r\n$7\r\nuser:10\r\n");
+    EXPECT_EQ(run(conn, {"SCANPREFIX", "user:", "LIMIT", "1"}), "*1\r\n$6\r\nuser:1\r\n");
+    EXPECT_EQ(run(conn, {"KEYSRANGE", "p", "user:1"}),
+              "*2\r\n$6\r\npost:1\r\n$6\r\nuser:1\r\n");
+    EXPECT_EQ(run(conn, {"KEYSRANGE", "a", "b", "LIMIT"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run(conn, {"SCANPREFIX", "u", "LIMIT", "-1"}),
+              "-ERR value is not an integer or out of range\r\n");
+
+    map.clear();
+    EXPECT_EQ(run(conn, {"SCANPREFIX", ""}), "*0\r\n");
+}
@@ -0,0 +1,89 @@
+#include "bitops.hpp"
+#include "cpu.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>     // std::uint8_t
+#include <random>      // std::mt19937
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+namespace {
+const std::uint8_t *bits(const std::string &s) {
+    return reinterpret_cast<const std::uint8_t *>(s.data());
+}
+
+std::string random_bytes(std::mt19937 &rng, std::size_t n) {
+    std::string s(n, '\0');
+    for (auto &c : s) {
+        c = static_cast<char>(rng());
+    }
+    return s;
+}
+} // namespace
+
+TEST(BitOps, Popcount) {
+    std::mt19937 rng(1);
+    for (const std::size_t n : {0, 1, 7, 31, 32, 100, 4099}) {
+        const std::string s = random_bytes(rng, n);
+        std::uint64_t expected = 0;
+        for (const char c : s) {
+            expected += __builtin_popcount(static_cast<unsigned char>(c));
+        }
+
+        for (const bool simd : {true, false}) {
+            Cpu::set_simd_enabled(simd);
+            EXPECT_EQ(popcount(bits(s), s.size()), expected);
+        }
+    }
+    Cpu::set_simd_enabled(true);
+}
+
+TEST(BitOps, Bitpos) {
+    for (const bool simd : {true, false}) {
+        Cpu::set_simd_enabled(simd);
+
+        std::string s(100, '\0');
+        EXPECT_EQ(bitpos(bits(s), s.size(), true), -1);
+        EXPECT_EQ(bitpos(bits(s), s.size(), false), 0);
+
+        s[70] = '\x10';
+        EXPECT_EQ(bitpos(bits(s), s.size(), true), 70 * 8 + 3);
+
+        std::string ones(64, '\xff');
+        ones[40] = '\xfe';
+        EXPECT_EQ(bitpos(bits(ones), ones.size(), false), 40 * 8 + 7);
+    }
+    Cpu::set_simd_enabled(true);
+}
+
+TEST(BitOps, Bitop) {
+    std::mt19937 rng(2);
+    const std::string a = random_bytes(rng, 77);
+    const std::string b = random_bytes(rng, 40);
+    const std::vector<std::string_view> srcs{a, b};
+
+    for (const bool simd : {true, false}) {
+        Cpu::set_simd_enabled(simd);
+
+        std::string out(a.size(), '\0');
+        auto *dst = reinterpret_cast<std::uint8_t *>(out.data());
+
+        bitop(BitOp::AND, dst, out.size(), srcs);
+        for (std::size_t i = 0; i < out.size(); i++) {
+            EXPECT_EQ(out[i], i < b.size() ? static_cast<char>(a[i] & b[i]) : '\0');
+        }
+
+        bitop(BitOp::XOR, dst, out.size(), srcs);
+        for (std::size_t i = 0; i < out.size(); i++) {
+            EXPECT_EQ(out[i], i < b.size() ? static_cast<char>(a[i] ^ b[i]) : a[i]);
+        }
+
+        bitop(BitOp::NOT, dst, out.size(), {a});
+        for (std::size_t i = 0; i < out.size(); i++) {
+            EXPECT_EQ(out[i], static_cast<char>(~a[i]));
+        }
+    }
+    Cpu::set_simd_enabled(true);
+}
@@ -0,0 +1,85 @@
+#include "capture.hpp"
+#include "connection.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>     // std::uint32_t, std::uint64_t
+#include <cstdio>      // std::FILE, std::fopen, std::fread, std::fclose, std::remove
+#include <memory>      // std::make_unique
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+TEST(Capture, EncodeDecode) {
+    const std::string big(300, 'x');
+    std::string out;
+    Capture::encode(out, 5, 1, {"SET", "key", big});
+    Capture::encode(out, 1000000, 300, {"GET", ""});
+
+    std::string_view in = out;
+    CaptureRecord record;
+    ASSERT_TRUE(Capture::decode(in, record));
+    EXPECT_EQ(record.time_us, 5);
+    EXPECT_EQ(record.conn, 1);
+    EXPECT_EQ(record.args, (std::vector<std::string>{"SET", "key", big}));
+    ASSERT_TRUE(Capture::decode(in, record));
+    EXPECT_EQ(record.time_us, 1000005);
+    EXPECT_EQ(record.conn, 300);
+    EXPECT_EQ(record.args, (std::vector<std::string>{"GET", ""}));
+    EXPECT_TRUE(in.empty());
+
+    // A record cut short is left in place
+    std::string_view cut = std::string_view(out).substr(0, out.size() - 1);
+    ASSERT_TRUE(Capture::decode(cut, record));
+    const std::size_t left = cut.size();
+    EXPECT_FALSE(Capture::decode(cut, record));
+    EXPECT_EQ(cut.size(), left);
+}
+
+TEST(Capture, Record) {
+    const std::string path = ::testing::TempDir() + "capture_test.cap";
+    EXPECT_FALSE(Capture::start(path).has_value());
+    EXPECT_TRUE(Capture::enabled());
+    EXPECT_TRUE(Capture::start(path).has_value());
+
+    auto a = std::make_unique<Connection>(10);
+    auto b = std::make_unique<Connection>(11);
+    auto primary = std::make_unique<Connection>(12);
+    primary->link = Link::PRIMARY;
+    a->req->args = {"SET", "k", "v"};
+    Capture::record(*a);
+    primary->req->args = {"DEL", "k"};
+    Capture::record(*primary);
+    b->req->args = {"GET", "k"};
+    Capture::record(*b);
+    a->req->args = {"PING"};
+    Capture::record(*a);
+    Capture::stop();
+    EXPECT_FALSE(Capture::enabled());
+    EXPECT_NE(Capture::info().find("capture_records:3\r\n"), std::string::npos);
+
+    // std::ifstream would go through the read of sys.cpp
+    std::string data(4096, '\0');
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    ASSERT_NE(file, nullptr);
+    data.resize(std::fread(data.data(), 1, data.size(), file));
+    std::fclose(file);
+    std::string_view in = data;
+    ASSERT_EQ(in.substr(0, CAPTURE_MAGIC.size()), CAPTURE_MAGIC);
+    in.remove_prefix(CAPTURE_MAGIC.size());
+
+    CaptureRecord record;
+    std::vector<std::uint32_t> conns;
+    std::vector<std::string> cmds;
+    std::uint64_t last = 0;
+    while (Capture::decode(in, record)) {
+        EXPECT_GE(record.time_us, last);
+        last = record.time_us;
+        conns.push_back(record.conn);
+        cmds.push_back(record.args[0]);
+    }
+    EXPECT_TRUE(in.empty());
+    EXPECT_EQ(conns, (std::vector<std::uint32_t>{1, 2, 1}));
+    EXPECT_EQ(cmds, (std::vector<std::string>{"SET", "GET", "PING"}));
+    std::remove(path.c_str());
+}
@@ -0,0 +1,135 @@
+#include "cluster.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+#include <gtest/gtest.h>
+
+#include <memory>      // std::unique_ptr, std::make_unique
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+namespace {
+// Two nodes, the first half of the slots here and the rest on port 7001
+std::unique_ptr<Connection> two_nodes() {
+    map.clear();
+    Cluster::enable("127.0.0.1", 7000);
+    auto conn = std::make_unique<Connection>(0);
+    EXPECT_EQ(run(conn, {"CLUSTER", "SETRANGE", "0", "8191", "127.0.0.1", "7000"}),
+              "+OK\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "SETRANGE", "8192", "16383", "127.0.0.1", "7001"}),
+              "+OK\r\n");
+    return conn;
+}
+} // namespace
+
+// "foo" is in slot 12182, "bar" in slot 5061
+TEST(Cluster, Redirect) {
+    map.clear();
+    auto conn = std::make_unique<Connection>(0);
+    EXPECT_EQ(run(conn, {"CLUSTER", "SLOTS"}),
+              "-ERR This instance has cluster support disabled\r\n");
+
+    Cluster::enable("127.0.0.1", 7000);
+    EXPECT_EQ(run(conn, {"GET", "bar"}), "-CLUSTERDOWN Hash slot not served\r\n");
+    conn = two_nodes();
+
+    EXPECT_EQ(run(conn, {"CLUSTER", "KEYSLOT", "foo"}), ":12182\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "SLOTS"}),
+              "*2\r\n*4\r\n:0\r\n:8191\r\n$9\r\n127.0.0.1\r\n:7000\r\n"
+              "*4\r\n:8192\r\n:16383\r\n$9\r\n127.0.0.1\r\n:7001\r\n");
+    EXPECT_EQ(run(conn, {"SET", "bar", "1"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"GET", "foo"}), "-MOVED 12182 127.0.0.1:7001\r\n");
+    EXPECT_EQ(run(conn, {"MSET", "{bar}1", "a", "{bar}2", "b"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"MGET", "bar", "foo"}),
+              "-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+    // Commands without keys run anywhere
+    EXPECT_EQ(run(conn, {"PING"}), "+PONG\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "COUNTKEYSINSLOT", "5061"}), ":3\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "COUNTKEYSINSLOT", "16384"}),
+              "-ERR Invalid or out of range slot '16384'\r\n");
+
+    EXPECT_EQ(run(conn, {"CLUSTER", "SETSLOT", "5061", "NODE", "127.0.0.1", "7001"}),
+              "+OK\r\n");
+    EXPECT_EQ(run(conn, {"GET", "bar"}), "-MOVED 5061 127.0.0.1:7001\r\n");
+    EXPECT_NE(run(conn, {"INFO", "cluster"}).find("cluster_slots_served:8191\r\n"),
+              std::string::npos);
+
+    Cluster::disable();
+    EXPECT_EQ(run(conn, {"GET", "foo"}), "$-1\r\n");
+}
+
+TEST(Cluster, Migrate) {
+    auto conn = two_nodes();
+    EXPECT_EQ(run(conn, {"SET", "bar", "1"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"SET", "{bar}2", "2"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "DUMPKEYS", "5061", "1"}),
+              "-ERR hash slot 5061 is not migrating\r\n");
+    EXPECT_EQ(
+        run(conn, {"CLUSTER", "SETSLOT", "12182", "MIGRATING", "127.0.0.1", "7001"}),
+        "-ERR I'm not the owner of hash slot 12182\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "SETSLOT", "5061", "MIGRATING", "127.0.0.1", "7001"}),
+              "+OK\r\n");
+
+    // Keys not here are asked of the target
+    EXPECT_EQ(run(conn, {"GET", "{bar}1"}), "-ASK 5061 127.0.0.1:7001\r\n");
+    EXPECT_EQ(run(conn, {"MGET", "bar", "{bar}1"}),
+              "-TRYAGAIN Multiple keys request during rehashing of slot\r\n");
+
+    // One key at a time, in order
+    const std::vector<std::byte> asking = make_request({"ASKING"});
+    const std::vector<std::byte> del = make_request({"DEL", "bar"});
+    const std::vector<std::byte> restore = make_request({"RESTORE", "bar", "int", "1"});
+    EXPECT_EQ(run(conn, {"CLUSTER", "DUMPKEYS", "5061", "1"}),
+              fmt::format("*1\r\n*4\r\n$3\r\nbar\r\n"
+                          "${}\r\n{}\r\n${}\r\n{}\r\n${}\r\n{}\r\n",
+                          asking.size(), to_view(asking, asking.size()), del.size(),
+                          to_view(del, del.size()), restore.size(),
+                          to_view(restore, restore.size())));
+    EXPECT_EQ(run(conn, {"GET", "bar"}), "$1\r\n1\r\n");
+    EXPECT_EQ(run(conn, {"SET", "bar", "3"}),
+              "-TRYAGAIN Keys are moving to another node\r\n");
+    EXPECT_EQ(run(conn, {"SET", "{bar}2", "3"}), "+OK\r\n");
+
+    // Only the keys handed out are deleted
+    EXPECT_EQ(run(conn, {"CLUSTER", "DELKEYS", "bar", "{bar}2"}), ":1\r\n");
+    EXPECT_EQ(run(conn, {"GET", "bar"}), "-ASK 5061 127.0.0.1:7001\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "DUMPKEYS", "5061", "10"}).substr(0, 20),
+              "*1\r\n*4\r\n$6\r\n{bar}2\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "DUMPKEYS", "5061", "10"}), "*0\r\n");
+
+    // Giving up leaves the remaining key here
+    EXPECT_EQ(run(conn, {"CLUSTER", "SETSLOT", "5061", "STABLE"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"SET", "{bar}2", "4"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "DELKEYS", "{bar}2"}), ":0\r\n");
+    Cluster::disable();
+}
+
+TEST(Cluster, Import) {
+    auto conn = two_nodes();
+    EXPECT_EQ(run(conn, {"RESTORE", "foo", "str", "abc"}),
+              "-MOVED 12182 127.0.0.1:7001\r\n");
+    EXPECT_EQ(run(conn, {"RESTORE", "bar", "str", "abc"}),
+              "-ERR RESTORE is only sent by the primary or to a cluster node importing "
+              "the slot of the key\r\n");
+    EXPECT_EQ(
+        run(conn, {"CLUSTER", "SETSLOT", "12182", "IMPORTING", "127.0.0.1", "7001"}),
+        "+OK\r\n");
+
+    EXPECT_EQ(run(conn, {"RESTORE", "foo", "str", "abc"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"RESTORE", "foo", "hll", "-1", "x"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run(conn, {"GET", "foo"}), "-MOVED 12182 127.0.0.1:7001\r\n");
+    EXPECT_EQ(run(conn, {"ASKING"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"GET", "foo"}), "$3\r\nabc\r\n");
+    // ASKING only holds for the next request
+    EXPECT_EQ(run(conn, {"GET", "foo"}), "-MOVED 12182 127.0.0.1:7001\r\n");
+
+    EXPECT_EQ(run(conn, {"CLUSTER", "SETSLOT", "12182", "NODE", "127.0.0.1", "7000"}),
+              "+OK\r\n");
+    EXPECT_EQ(run(conn, {"GET", "foo"}), "$3\r\nabc\r\n");
+    EXPECT_EQ(run(conn, {"CLUSTER", "COUNTKEYSINSLOT", "12182"}), ":1\r\n");
+    Cluster::disable();
+}
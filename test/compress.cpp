@@ -0,0 +1,124 @@
+#include "compress.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+#include <gtest/gtest.h>
+
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <memory>      // std::make_unique
+#include <random>      // std::mt19937
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <variant>     // std::holds_alternative
+#include <vector>      // std::vector
+
+namespace {
+std::string round_trip(const std::string &in) {
+    std::string packed(in.size() + in.size() / 16 + 16, '\0');
+    const std::size_t n =
+        lzf_compress(in.data(), in.size(), packed.data(), packed.size());
+    EXPECT_GT(n, 0);
+    std::string out(in.size(), '\0');
+    EXPECT_TRUE(lzf_decompress(packed.data(), n, out.data(), out.size()));
+    return out;
+}
+
+// Text with a small vocabulary, like JSON or logs
+std::string text(std::mt19937 &rng, std::size_t n) {
+    const std::array<std::string_view, 6> words{"\"id\": ", "\"name\": \"", "user",
+                                                "\", ",  "true, ",     "1234"};
+    std::string s;
+    while (s.size() < n) {
+        s += words[rng() % words.size()];
+    }
+    s.resize(n);
+    return s;
+}
+
+bool is_packed(std::string_view key) {
+    return std::holds_alternative<PackedStr>(map.get(key)->value);
+}
+} // namespace
+
+TEST(Lzf, RoundTrip) {
+    std::mt19937 rng(1);
+    for (const std::size_t n : {1, 2, 3, 4, 31, 32, 33, 300, 9000, 100000}) {
+        const std::string runs(n, 'a');
+        EXPECT_EQ(round_trip(runs), runs);
+        const std::string words = text(rng, n);
+        EXPECT_EQ(round_trip(words), words);
+
+        std::string noise(n, '\0');
+        for (auto &c : noise) {
+            c = static_cast<char>(rng());
+        }
+        EXPECT_EQ(round_trip(noise), noise);
+    }
+}
+
+TEST(Lzf, Limits) {
+    std::mt19937 rng(2);
+    const std::string words = text(rng, 10000);
+    std::string packed(words.size(), '\0');
+    const std::size_t n =
+        lzf_compress(words.data(), words.size(), packed.data(), packed.size());
+    ASSERT_GT(n, 0);
+    EXPECT_LT(n, words.size() / 2);
+
+    // Does not fit
+    EXPECT_EQ(lzf_compress(words.data(), words.size(), packed.data(), n - 1), 0);
+
+    std::string out(words.size(), '\0');
+    EXPECT_FALSE(lzf_decompress(packed.data(), n - 1, out.data(), out.size()));
+    EXPECT_FALSE(lzf_decompress(packed.data(), n, out.data(), out.size() - 1));
+    // A back reference before the start
+    EXPECT_FALSE(lzf_decompress("\x20\x05", 2, out.data(), 3));
+}
+
+TEST(Compress, StringsAreStoredCompressed) {
+    map.clear();
+    Compress::set_min_size(256);
+    std::mt19937 rng(3);
+    const std::string large = text(rng, 4096);
+    const std::string small = text(rng, 100);
+    std::string noise(1000, '\0');
+    for (auto &c : noise) {
+        c = static_cast<char>(rng());
+    }
+
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_EQ(run(conn, {"SET", "large", large}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"MSET", "small", small, "noise", noise}), "+OK\r\n");
+    EXPECT_TRUE(is_packed("large"));
+    EXPECT_FALSE(is_packed("small"));
+    EXPECT_FALSE(is_packed("noise"));
+
+    EXPECT_EQ(run(conn, {"GET", "large"}), fmt::format("$4096\r\n{}\r\n", large));
+    EXPECT_EQ(run(conn, {"MGET", "small", "large"}),
+              fmt::format("*2\r\n$100\r\n{}\r\n$4096\r\n{}\r\n", small, large));
+    EXPECT_EQ(run(conn, {"GETBIT", "large", "6"}), ":0\r\n");
+    EXPECT_EQ(run(conn, {"INCR", "large"}),
+              "-ERR value is not an integer or out of range\r\n");
+
+    // The native protocol gets the same bytes
+    auto native = std::make_unique<Connection>(-1);
+    const std::string out = run(native, {"GET", "large"}, Proto::NATIVE);
+    EXPECT_EQ(out.size(), CMD_LEN_BYTES + 1 + CMD_LEN_BYTES + large.size());
+    EXPECT_EQ(out.substr(out.size() - large.size()), large);
+
+    // Writes leave a plain string
+    EXPECT_EQ(run(conn, {"SETBIT", "large", "0", "1"}), ":0\r\n");
+    EXPECT_FALSE(is_packed("large"));
+    EXPECT_EQ(run(conn, {"GETBIT", "large", "0"}), ":1\r\n");
+
+    const std::string info = Compress::info();
+    EXPECT_NE(info.find("compress_packs:1\r\n"), std::string::npos);
+    EXPECT_NE(info.find("compress_rejected:1\r\n"), std::string::npos);
+
+    Compress::set_min_size(0);
+    map.clear();
+}
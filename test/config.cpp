@@ -0,0 +1,131 @@
+#include "config.hpp"
+#include "evict.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string> // std::string
+#include <vector> // std::vector
+
+TEST(Config, SetOption) {
+    Config config;
+    EXPECT_FALSE(set_option(config, "port", "6380").has_value());
+    EXPECT_FALSE(set_option(config, "unixsocket", "/tmp/test.sock").has_value());
+    EXPECT_FALSE(set_option(config, "unixsocketperm", "770").has_value());
+    EXPECT_FALSE(set_option(config, "tcp-nodelay", "no").has_value());
+    EXPECT_FALSE(set_option(config, "rcvbuf", "256kb").has_value());
+    EXPECT_FALSE(set_option(config, "io-backend", "io_uring").has_value());
+    EXPECT_FALSE(set_option(config, "maxmemory-policy", "allkeys-lfu").has_value());
+    EXPECT_FALSE(set_option(config, "loglevel", "warning").has_value());
+    EXPECT_FALSE(set_option(config, "request-budget", "16").has_value());
+    EXPECT_FALSE(set_option(config, "timeout", "300").has_value());
+    EXPECT_FALSE(set_option(config, "client-output-buffer-limit", "32mb 8mb 60").has_value());
+    EXPECT_FALSE(set_option(config, "proto-max-bulk-len", "64mb").has_value());
+    EXPECT_FALSE(set_option(config, "trace-sample-rate", "100").has_value());
+    EXPECT_FALSE(set_option(config, "latency-monitor-threshold", "10").has_value());
+    EXPECT_FALSE(set_option(config, "watchdog-period", "200").has_value());
+    EXPECT_FALSE(set_option(config, "replicaof", "127.0.0.1 6379").has_value());
+    EXPECT_FALSE(set_option(config, "repl-backlog-size", "4mb").has_value());
+    EXPECT_FALSE(set_option(config, "tier-dir", "/var/tmp").has_value());
+    EXPECT_FALSE(set_option(config, "tier-idle-seconds", "600").has_value());
+    EXPECT_FALSE(set_option(config, "tier-io-threads", "4").has_value());
+    EXPECT_FALSE(set_option(config, "compress-min-size", "1kb").has_value());
+    EXPECT_FALSE(set_option(config, "activedefrag", "yes").has_value());
+    EXPECT_FALSE(set_option(config, "active-defrag-threshold", "20").has_value());
+    EXPECT_FALSE(set_option(config, "active-defrag-ignore-bytes", "10mb").has_value());
+    EXPECT_FALSE(set_option(config, "active-defrag-cpu", "5").has_value());
+    EXPECT_FALSE(set_option(config, "ordered-index", "yes").has_value());
+    EXPECT_FALSE(set_option(config, "capture-file", "/tmp/requests.cap").has_value());
+    EXPECT_FALSE(set_option(config, "cluster-enabled", "yes").has_value());
+    EXPECT_FALSE(set_option(config, "cluster-announce-host", "10.0.0.7").has_value());
+
+    EXPECT_EQ(config.port, 6380);
+    EXPECT_EQ(config.unixsocket, "/tmp/test.sock");
+    EXPECT_EQ(config.unixsocketperm, 0770);
+    EXPECT_FALSE(config.tcp_nodelay);
+    EXPECT_EQ(config.rcvbuf, 256 * 1024);
+    EXPECT_EQ(config.io_backend, LoopBackend::IO_URING);
+    EXPECT_EQ(config.maxmemory_policy, EvictPolicy::ALLKEYS_LFU);
+    EXPECT_EQ(config.loglevel, Logger::Level::WARNING);
+    EXPECT_EQ(config.request_budget, 16);
+    EXPECT_EQ(config.timeout, 300);
+    EXPECT_EQ(config.output_limit.hard, 32UL << 20);
+    EXPECT_EQ(config.output_limit.soft, 8UL << 20);
+    EXPECT_EQ(config.output_limit.soft_seconds, 60);
+    EXPECT_EQ(config.proto_max_bulk_len, 64UL << 20);
+    EXPECT_EQ(config.trace_sample_rate, 100);
+    EXPECT_EQ(config.latency_monitor_threshold, 10);
+    EXPECT_EQ(config.replicaof_host, "127.0.0.1");
+    EXPECT_EQ(config.replicaof_port, 6379);
+    EXPECT_EQ(config.repl_backlog_size, 4UL << 20);
+    EXPECT_EQ(config.watchdog_period, 200);
+    EXPECT_EQ(config.tier_dir, "/var/tmp");
+    EXPECT_EQ(config.tier_idle_seconds, 600);
+    EXPECT_EQ(config.tier_io_threads, 4);
+    EXPECT_EQ(config.compress_min_size, 1024);
+    EXPECT_TRUE(config.activedefrag);
+    EXPECT_EQ(config.active_defrag_threshold, 20);
+    EXPECT_EQ(config.active_defrag_ignore_bytes, 10UL << 20);
+    EXPECT_EQ(config.active_defrag_cpu, 5);
+    EXPECT_TRUE(config.ordered_index);
+    EXPECT_EQ(config.capture_file, "/tmp/requests.cap");
+    EXPECT_TRUE(config.cluster_enabled);
+    EXPECT_EQ(config.cluster_announce_host, "10.0.0.7");
+
+    EXPECT_TRUE(set_option(config, "port", "65536").has_value());
+    EXPECT_TRUE(set_option(config, "unixsocketperm", "778").has_value());
+    EXPECT_TRUE(set_option(config, "tcp-nodelay", "maybe").has_value());
+    EXPECT_TRUE(set_option(config, "events-per-wait", "0").has_value());
+    EXPECT_TRUE(set_option(config, "request-budget", "0").has_value());
+    EXPECT_TRUE(set_option(config, "client-output-buffer-limit", "32mb 8mb").has_value());
+    EXPECT_TRUE(set_option(config, "client-output-buffer-limit", "1 2 3 4").has_value());
+    EXPECT_TRUE(set_option(config, "proto-max-bulk-len", "0").has_value());
+    EXPECT_TRUE(set_option(config, "trace-sample-rate", "-1").has_value());
+    EXPECT_TRUE(set_option(config, "tier-io-threads", "0").has_value());
+    EXPECT_TRUE(set_option(config, "compress-min-size", "big").has_value());
+    EXPECT_TRUE(set_option(config, "active-defrag-cpu", "0").has_value());
+    EXPECT_TRUE(set_option(config, "ordered-index", "sorted").has_value());
+    EXPECT_TRUE(set_option(config, "cluster-enabled", "maybe").has_value());
+    EXPECT_TRUE(set_option(config, "cluster-announce-host", "").has_value());
+    EXPECT_TRUE(set_option(config, "replicaof", "127.0.0.1").has_value());
+    EXPECT_TRUE(set_option(config, "replicaof", "127.0.0.1 0").has_value());
+    EXPECT_TRUE(set_option(config, "no-such-option", "1").has_value());
+    EXPECT_EQ(config.port, 6380);
+}
+
+TEST(Config, ToMemory) {
+    EXPECT_EQ(to_memory("100"), 100);
+    EXPECT_EQ(to_memory("1k"), 1000);
+    EXPECT_EQ(to_memory("1kb"), 1024);
+    EXPECT_EQ(to_memory("2gb"), 2UL << 30);
+    EXPECT_FALSE(to_memory("kb").has_value());
+    EXPECT_FALSE(to_memory("-1").has_value());
+    EXPECT_FALSE(to_memory("1tb").has_value());
+}
+
+// File contents aren't tested, test/sys.cpp replaces read and write
+TEST(Config, Args) {
+    std::vector<std::string> strs = {
+        "server", "--port", "7001", "--maxmemory", "1mb", "--events-per-wait", "256",
+        "--io-uring"};
+    std::vector<char *> argv;
+    for (auto &str : strs) {
+        argv.push_back(str.data());
+    }
+
+    Config config;
+    const int argc = static_cast<int>(argv.size());
+    EXPECT_FALSE(parse_args(config, argc, argv.data()).has_value());
+    EXPECT_EQ(config.port, 7001);
+    EXPECT_EQ(config.maxmemory, 1UL << 20);
+    EXPECT_EQ(config.events_per_wait, 256);
+    EXPECT_EQ(config.io_backend, LoopBackend::IO_URING);
+
+    // A missing value, an unknown option and a missing config file
+    EXPECT_TRUE(parse_args(config, 2, argv.data()).has_value());
+    strs[1] = "--no-such-option";
+    argv[1] = strs[1].data();
+    EXPECT_TRUE(parse_args(config, 3, argv.data()).has_value());
+    strs[1] = "/nonexistent/kv.conf";
+    argv[1] = strs[1].data();
+    EXPECT_TRUE(parse_args(config, 2, argv.data()).has_value());
+}
@@ -0,0 +1,284 @@
+#include "alloc.hpp"
+#include "config.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+
+#include <gtest/gtest.h>
+
+#include <array>       // std::array
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::uint32_t
+#include <memory>      // std::make_unique
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <variant>     // std::get
+
+#include <sys/uio.h> // iovec
+
+// NOLINTNEXTLINE(fuchsia-statically-constructed-objects)
+HashTable map;
+
+namespace {
+void append_u32(std::string &buf, std::size_t value) {
+    const auto n = static_cast<std::uint32_t>(value);
+    buf.append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+std::string str_reply(std::string_view value) {
+    std::string reply;
+    append_u32(reply, 1 + 4 + value.size());
+    reply.push_back('$');
+    append_u32(reply, value.size());
+    reply.append(value);
+    return reply;
+}
+} // namespace
+
+TEST(Connection, LargeValuesAreReferenced) {
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string small(10, 's');
+    const std::string large(WBUF_REF_MIN * 4, 'l');
+
+    push_request(conn, {"SET", "small", small}, Proto::NATIVE);
+    push_request(conn, {"SET", "large", large}, Proto::NATIVE);
+    push_request(conn, {"GET", "large"}, Proto::NATIVE);
+    push_request(conn, {"GET", "small"}, Proto::NATIVE);
+    push_request(conn, {"GET", "large"}, Proto::NATIVE);
+    handle_requests(conn);
+
+    EXPECT_EQ(conn->wrefs.size(), 2);
+
+    const std::string expected = str_reply("OK") + str_reply("OK") + str_reply(large) +
+                                 str_reply(small) + str_reply(large);
+    EXPECT_EQ(drain(conn, 1000), expected);
+
+    EXPECT_EQ(conn->wbuf_size, 0);
+    EXPECT_TRUE(conn->wrefs.empty());
+}
+
+TEST(Connection, ReferencedValueOutlivesKey) {
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string first(WBUF_REF_MIN, 'a');
+    const std::string second(WBUF_REF_MIN, 'b');
+
+    push_request(conn, {"SET", "key", first}, Proto::NATIVE);
+    push_request(conn, {"GET", "key"}, Proto::NATIVE);
+    handle_requests(conn);
+
+    // Overwrite and delete the key before the reply is sent
+    push_request(conn, {"SET", "key", second}, Proto::NATIVE);
+    push_request(conn, {"DEL", "key"}, Proto::NATIVE);
+    handle_requests(conn);
+
+    const std::string out = drain(conn, 7);
+    EXPECT_NE(out.find(str_reply(first)), std::string::npos);
+    EXPECT_EQ(map.get("key"), nullptr);
+}
+
+TEST(Connection, WriteCopiesReferencedValue) {
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string value(WBUF_REF_MIN, '\0');
+
+    push_request(conn, {"SET", "bits", value}, Proto::NATIVE);
+    push_request(conn, {"GET", "bits"}, Proto::NATIVE);
+    push_request(conn, {"SETBIT", "bits", "0", "1"}, Proto::NATIVE);
+    handle_requests(conn);
+
+    const std::string out = drain(conn, 4096);
+    EXPECT_NE(out.find(str_reply(value)), std::string::npos);
+
+    const HashNode *node = map.get("bits");
+    ASSERT_NE(node, nullptr);
+    EXPECT_EQ((*std::get<SharedStr>(node->value))[0], '\x80');
+}
+
+TEST(Connection, MultiKeyCommands) {
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string large(WBUF_REF_MIN * 2, 'm');
+
+    push_request(conn, {"MSET", "m1", "one", "m2", large, "m3", "3"}, Proto::NATIVE);
+    push_request(conn, {"MGET", "m1", "missing", "m2", "m3"}, Proto::NATIVE);
+    push_request(conn, {"DEL", "m1", "m2", "missing"}, Proto::NATIVE);
+    push_request(conn, {"MSET", "m1"}, Proto::NATIVE);
+    handle_requests(conn);
+
+    std::string mget;
+    append_u32(mget, 1 + 4 + (1 + 4 + 3) + (1 + 4) + (1 + 4 + large.size()) + (1 + 4 + 1));
+    mget.push_back('*');
+    append_u32(mget, 4);
+    mget += str_reply("one").substr(4);
+    mget.push_back('_');
+    append_u32(mget, 0);
+    mget += str_reply(large).substr(4);
+    mget += str_reply("3").substr(4);
+
+    std::string del;
+    append_u32(del, 1 + 4 + 1);
+    del.push_back(':');
+    append_u32(del, 1);
+    del.push_back('\x02');
+
+    const std::string out = drain(conn, 100);
+    const std::string prefix = str_reply("OK") + mget + del;
+    EXPECT_EQ(out.substr(0, prefix.size()), prefix);
+    EXPECT_EQ(out[prefix.size() + 4], '-');
+
+    EXPECT_EQ(map.get("m1"), nullptr);
+    EXPECT_NE(map.get("m3"), nullptr);
+}
+
+TEST(Connection, IncrDecr) {
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_EQ(run(conn, {"INCR", "n"}), ":1\r\n");
+    EXPECT_EQ(run(conn, {"INCRBY", "n", "41"}), ":42\r\n");
+    EXPECT_EQ(run(conn, {"DECR", "n"}), ":41\r\n");
+    EXPECT_EQ(run(conn, {"DECRBY", "n", "-9"}), ":50\r\n");
+    EXPECT_EQ(run(conn, {"DECRBY", "fresh", "5"}), ":-5\r\n");
+
+    const std::string not_int = "-ERR value is not an integer or out of range\r\n";
+    EXPECT_EQ(run(conn, {"INCRBY", "n", "1.5"}), not_int);
+    EXPECT_EQ(run(conn, {"DECRBY", "n", "-9223372036854775808"}), not_int);
+    EXPECT_EQ(run(conn, {"SET", "s", "abc"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"INCR", "s"}), not_int);
+    EXPECT_EQ(run(conn, {"DECRBY", "s", "1"}), not_int);
+
+    // SETBIT leaves a string, "1" once these bits are set
+    for (const auto bit : {"2", "3", "7"}) {
+        EXPECT_EQ(run(conn, {"SETBIT", "bits", bit, "1"}), ":0\r\n");
+    }
+    EXPECT_EQ(run(conn, {"INCR", "bits"}), ":2\r\n");
+    EXPECT_EQ(run(conn, {"GET", "bits"}), "$1\r\n2\r\n");
+
+    // The value is left as it was
+    const std::string overflow = "-ERR increment or decrement would overflow\r\n";
+    EXPECT_EQ(run(conn, {"SET", "max", "9223372036854775807"}), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"INCR", "max"}), overflow);
+    EXPECT_EQ(run(conn, {"INCRBY", "max", "1"}), overflow);
+    EXPECT_EQ(run(conn, {"DECRBY", "n", "9223372036854775807"}),
+              ":-9223372036854775757\r\n");
+    EXPECT_EQ(run(conn, {"DECRBY", "n", "100"}), overflow);
+    EXPECT_EQ(run(conn, {"GET", "max"}), "$19\r\n9223372036854775807\r\n");
+
+    const std::string wrongtype =
+        "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+    EXPECT_EQ(run(conn, {"SADD", "set", "a"}), ":1\r\n");
+    EXPECT_EQ(run(conn, {"INCR", "set"}), wrongtype);
+    EXPECT_EQ(run(conn, {"DECR", "set"}), wrongtype);
+    EXPECT_EQ(run(conn, {"INCRBY", "set", "2"}), wrongtype);
+    EXPECT_EQ(run(conn, {"DECRBY", "set", "2"}), wrongtype);
+    map.clear();
+}
+
+TEST(Connection, WarmRequestsDoNotAllocate) {
+    // As the server runs by default
+    Logger::set_level(Config{}.loglevel);
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string long_key(64, 'k');
+    const std::string large(WBUF_REF_MIN, 'v');
+
+    const auto push_all = [&conn, &long_key, &large]() {
+        push_request(conn, {"SET", long_key, "value"}, Proto::NATIVE);
+        push_request(conn, {"SET", "large", large}, Proto::NATIVE);
+        push_request(conn, {"SET", "num", "42"}, Proto::NATIVE);
+        push_request(conn, {"GET", long_key}, Proto::NATIVE);
+        push_request(conn, {"GET", "large"}, Proto::NATIVE);
+        push_request(conn, {"GET", "num"}, Proto::NATIVE);
+        push_request(conn, {"GET", "missing"}, Proto::NATIVE);
+        push_request(conn, {"MGET", long_key, "large", "num", "missing"}, Proto::NATIVE);
+        push_request(conn, {"INCR", "ratelimit:user:12345"}, Proto::NATIVE);
+        push_request(conn, {"DEL", "missing"}, Proto::NATIVE);
+    };
+
+    // The first round grows the buffers and adds the keys
+    push_all();
+    handle_requests(conn);
+    drain(conn, IOBUF_LEN);
+
+    push_request(conn, {"SET", "victim", "value"}, Proto::NATIVE);
+    handle_requests(conn);
+    drain(conn, IOBUF_LEN);
+
+    push_all();
+    push_request(conn, {"DEL", "victim"}, Proto::NATIVE);
+    const std::size_t before = allocations();
+    handle_requests(conn);
+    std::array<iovec, WBUF_IOV_MAX> iov{};
+    std::size_t sent = 0;
+    while (wbuf_pending(conn)) {
+        const std::size_t niov = wbuf_iov(conn, iov.data(), iov.size());
+        for (std::size_t i = 0; i < niov; i++) {
+            sent += iov[i].iov_len;
+            wbuf_consume(conn, iov[i].iov_len);
+        }
+    }
+    const std::size_t after = allocations();
+
+    EXPECT_EQ(after - before, 0);
+    EXPECT_GT(sent, large.size());
+}
+
+TEST(Connection, BuffersAreTakenWhenNeeded) {
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_TRUE(conn->rbuf.empty());
+    EXPECT_TRUE(conn->wbuf.empty());
+
+    acquire_rbuf(conn);
+    EXPECT_EQ(conn->rbuf.size(), IOBUF_LEN);
+    push_request(conn, {"SET", "pooled", "1"}, Proto::NATIVE);
+    handle_requests(conn);
+    EXPECT_FALSE(conn->wbuf.empty());
+
+    // Everything was handled and sent, the connection holds no buffer
+    release_rbuf(conn);
+    drain(conn, IOBUF_LEN);
+    EXPECT_TRUE(conn->rbuf.empty());
+    EXPECT_TRUE(conn->wbuf.empty());
+
+    // Part of a request stays
+    acquire_rbuf(conn);
+    conn->rbuf_size = 2;
+    release_rbuf(conn);
+    EXPECT_EQ(conn->rbuf.size(), IOBUF_LEN);
+}
+
+TEST(Connection, OutputLimits) {
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string value(1000, 'o');
+    push_request(conn, {"SET", "limited", value}, Proto::NATIVE);
+    for (int i = 0; i < 10; i++) {
+        push_request(conn, {"GET", "limited"}, Proto::NATIVE);
+    }
+    handle_requests(conn);
+    ASSERT_GT(wbuf_pending_bytes(conn), 10 * value.size());
+
+    EXPECT_FALSE(over_output_limit(conn, {}, 100));
+    OutputLimit hard;
+    hard.hard = 5000;
+    EXPECT_TRUE(over_output_limit(conn, hard, 100));
+
+    OutputLimit soft;
+    soft.soft = 5000;
+    soft.soft_seconds = 10;
+    EXPECT_FALSE(over_output_limit(conn, soft, 100));
+    EXPECT_FALSE(over_output_limit(conn, soft, 109));
+    EXPECT_TRUE(over_output_limit(conn, soft, 110));
+
+    // Going below the soft limit restarts the clock
+    drain(conn, IOBUF_LEN);
+    EXPECT_FALSE(over_output_limit(conn, soft, 111));
+    EXPECT_EQ(conn->soft_limit_since, 0);
+}
+
+TEST(Connection, SubscribersDoNotTimeOut) {
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_TRUE(may_time_out(*conn));
+
+    run(conn, {"SUBSCRIBE", "quiet"});
+    EXPECT_FALSE(may_time_out(*conn));
+    run(conn, {"UNSUBSCRIBE"});
+    EXPECT_TRUE(may_time_out(*conn));
+
+    conn->link = Link::REPLICA;
+    EXPECT_FALSE(may_time_out(*conn));
+}
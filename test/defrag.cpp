@@ -0,0 +1,64 @@
+#include "alloc.hpp"
+#include "defrag.hpp"
+#include "hashtable.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstddef>     // std::size_t
+#include <memory>      // std::make_shared
+#include <string>      // std::string, std::to_string
+#include <string_view> // std::string_view
+#include <variant>     // std::get
+
+namespace {
+std::string key_of(std::size_t i) {
+    return "defrag-key-" + std::to_string(i) + "-padding";
+}
+
+std::string value_of(std::size_t i) { return std::string(100 + i % 50, 'a' + i % 26); }
+} // namespace
+
+TEST(Alloc, PageUsed) {
+    track_pages();
+    auto *block = new char[100]; // NOLINT(cppcoreguidelines-owning-memory)
+    const std::size_t before = page_used(block);
+    EXPECT_GE(before, 100);
+    delete[] block; // NOLINT(cppcoreguidelines-owning-memory)
+    EXPECT_LT(page_used(block), before);
+    EXPECT_GT(rss_memory(), 0);
+}
+
+TEST(Defrag, MovesOutOfSparsePages) {
+    map.clear();
+    Defrag::enable(0, 0, 100);
+    EXPECT_TRUE(Defrag::enabled());
+
+    // Delete most of the keys, the rest are left alone in their pages
+    constexpr std::size_t KEYS = 20000;
+    for (std::size_t i = 0; i < KEYS; i++) {
+        map.set(key_of(i), std::make_shared<std::string>(value_of(i)));
+    }
+    for (std::size_t i = 0; i < KEYS; i++) {
+        if (i % 10 != 0) {
+            map.remove(key_of(i));
+        }
+    }
+    // Referenced by a reply, it must stay
+    const SharedStr held = std::get<SharedStr>(map.get(key_of(0))->value);
+
+    Defrag::run_pass();
+    EXPECT_FALSE(Defrag::running());
+
+    for (std::size_t i = 0; i < KEYS; i += 10) {
+        const HashNode *node = map.get(key_of(i));
+        ASSERT_NE(node, nullptr);
+        EXPECT_EQ(*std::get<SharedStr>(node->value), value_of(i));
+    }
+    EXPECT_EQ(std::get<SharedStr>(map.get(key_of(0))->value), held);
+
+    const std::string info = Defrag::info();
+    EXPECT_NE(info.find("active_defrag_scanned:2000\r\n"), std::string::npos);
+    EXPECT_NE(info.find("active_defrag_passes:1\r\n"), std::string::npos);
+    EXPECT_EQ(info.find("active_defrag_hits:0\r\n"), std::string::npos);
+    map.clear();
+}
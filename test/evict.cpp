@@ -0,0 +1,173 @@
+#include "evict.hpp"
+#include "alloc.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstddef> // std::size_t
+#include <cstdint> // std::int64_t
+#include <memory>  // std::make_unique
+#include <string>  // std::string, std::to_string
+
+namespace {
+constexpr std::size_t NKEYS = 1000;
+
+class Evict : public ::testing::Test {
+  protected:
+    void TearDown() override { set_maxmemory(0, EvictPolicy::NOEVICTION); }
+
+    // Fill ht with NKEYS keys, the odd ones are the hot ones
+    void fill(HashTable &ht) {
+        for (std::size_t i = 0; i < NKEYS; i++) {
+            const std::string key = std::to_string(i);
+            touch_key(ht.set(key, make_str(std::string(100, 'x'))), true);
+        }
+    }
+
+    // Each call evicts for EVICT_BUDGET_US at most
+    static bool evict(HashTable &ht) {
+        while (maxmemory_used() > maxmemory()) {
+            if (!free_memory(ht)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Percentage of the evicted keys that are not hot
+    static std::size_t cold_evicted_pct(HashTable &ht) {
+        std::size_t cold = 0;
+        std::size_t evicted = 0;
+        for (std::size_t i = 0; i < NKEYS; i++) {
+            if (ht.get(std::to_string(i)) == nullptr) {
+                evicted++;
+                cold += i % 2 == 0 ? 1 : 0;
+            }
+        }
+        EXPECT_GT(evicted, 0);
+        return evicted == 0 ? 0 : cold * 100 / evicted;
+    }
+};
+} // namespace
+
+TEST_F(Evict, PolicyNames) {
+    for (const auto name : {"noeviction", "allkeys-lru", "allkeys-lfu", "allkeys-random",
+                            "volatile-lru", "volatile-lfu", "volatile-random",
+                            "volatile-ttl"}) {
+        const auto policy = to_evict_policy(name);
+        ASSERT_TRUE(policy.has_value());
+        EXPECT_EQ(to_string(*policy), name);
+    }
+    EXPECT_FALSE(to_evict_policy("allkeys").has_value());
+}
+
+TEST_F(Evict, UnderLimit) {
+    HashTable ht;
+    set_maxmemory(used_memory() + (1UL << 20), EvictPolicy::ALLKEYS_LRU);
+    fill(ht);
+    EXPECT_TRUE(free_memory(ht));
+    EXPECT_EQ(ht.size(), NKEYS);
+}
+
+TEST_F(Evict, NoEviction) {
+    HashTable ht;
+    set_maxmemory(used_memory() + 1, EvictPolicy::NOEVICTION);
+    fill(ht);
+    EXPECT_FALSE(free_memory(ht));
+    EXPECT_EQ(ht.size(), NKEYS);
+
+    // No key can expire, there is nothing volatile to evict
+    set_maxmemory(maxmemory(), EvictPolicy::VOLATILE_LRU);
+    EXPECT_FALSE(free_memory(ht));
+    EXPECT_EQ(ht.size(), NKEYS);
+}
+
+TEST_F(Evict, LRU) {
+    HashTable ht;
+    const std::size_t base = used_memory();
+    set_maxmemory(0, EvictPolicy::ALLKEYS_LRU);
+    fill(ht);
+
+    // Make the even keys idle for 100 seconds
+    for (std::size_t i = 0; i < NKEYS; i += 2) {
+        ht.get(std::to_string(i))->lru = (lru_clock() - 100) & LRU_CLOCK_MAX;
+    }
+
+    const std::size_t limit = base + (used_memory() - base) * 3 / 4;
+    set_maxmemory(limit, EvictPolicy::ALLKEYS_LRU);
+    EXPECT_TRUE(evict(ht));
+    EXPECT_LE(used_memory(), limit);
+    EXPECT_GE(cold_evicted_pct(ht), 90);
+}
+
+TEST_F(Evict, LFU) {
+    HashTable ht;
+    const std::size_t base = used_memory();
+    set_maxmemory(0, EvictPolicy::ALLKEYS_LFU);
+    fill(ht);
+
+    HashNode *node = ht.get("1");
+    EXPECT_EQ(lfu_counter(node), LFU_INIT_VAL);
+
+    for (std::size_t i = 1; i < NKEYS; i += 2) {
+        HashNode *hot = ht.get(std::to_string(i));
+        for (int j = 0; j < 100; j++) {
+            touch_key(hot, false);
+        }
+    }
+    // Logarithmic, 100 hits are far from saturating the counter
+    EXPECT_GT(lfu_counter(node), LFU_INIT_VAL);
+    EXPECT_LT(lfu_counter(node), 50);
+
+    const std::size_t limit = base + (used_memory() - base) * 3 / 4;
+    set_maxmemory(limit, EvictPolicy::ALLKEYS_LFU);
+    EXPECT_TRUE(evict(ht));
+    EXPECT_LE(used_memory(), limit);
+    EXPECT_GE(cold_evicted_pct(ht), 90);
+}
+
+TEST_F(Evict, Random) {
+    HashTable ht;
+    const std::size_t base = used_memory();
+    fill(ht);
+
+    const std::size_t limit = base + (used_memory() - base) / 2;
+    set_maxmemory(limit, EvictPolicy::ALLKEYS_RANDOM);
+    EXPECT_TRUE(evict(ht));
+    EXPECT_LE(used_memory(), limit);
+    EXPECT_LT(ht.size(), NKEYS);
+}
+
+TEST_F(Evict, OutputBuffersNotCounted) {
+    HashTable ht;
+    fill(ht);
+    auto conn = std::make_unique<Connection>(-1);
+    const std::size_t before = used_memory();
+    add_reply(conn, std::string(1UL << 20, 'x'));
+    EXPECT_GE(output_buffer_memory(), 1UL << 20);
+
+    // Over maxmemory only with the reply, which evicting would not free. The
+    // allocator rounds large buffers up a little.
+    set_maxmemory(before + (64UL << 10), EvictPolicy::ALLKEYS_LRU);
+    EXPECT_GT(used_memory(), maxmemory());
+    EXPECT_TRUE(free_memory(ht));
+    EXPECT_EQ(ht.size(), NKEYS);
+
+    wbuf_discard(conn);
+    EXPECT_EQ(output_buffer_memory(), 0);
+}
+
+TEST_F(Evict, Budget) {
+    HashTable ht;
+    for (std::size_t i = 0; i < 100 * NKEYS; i++) {
+        ht.set(std::to_string(i), std::int64_t{0});
+    }
+
+    // Evicting every key takes longer than the budget
+    set_maxmemory(1, EvictPolicy::ALLKEYS_RANDOM);
+    EXPECT_TRUE(free_memory(ht));
+    EXPECT_GT(ht.size(), 0);
+    EXPECT_FALSE(evict(ht));
+    EXPECT_TRUE(ht.is_empty());
+}
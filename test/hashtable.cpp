@@ -2,19 +2,23 @@
 
 #include <gtest/gtest.h>
 
-#include <string> // std::to_string
+#include <array>       // std::array
+#include <string>      // std::to_string
+#include <string_view> // std::string_view
+#include <variant>     // std::get
+#include <vector>      // std::vector
 
 TEST(HashTable, BasicOperations) {
     HashTable ht;
     EXPECT_EQ(ht.get("key"), nullptr);
 
-    ht.set("key", "value");
+    ht.set("key", make_str("value"));
     ASSERT_FALSE(ht.is_empty());
 
     auto node = ht.get("key");
     ASSERT_NE(node, nullptr);
     EXPECT_EQ(node->key, "key");
-    EXPECT_EQ(node->value, "value");
+    EXPECT_EQ(*std::get<SharedStr>(node->value), "value");
 
     ht.remove("key");
     ASSERT_TRUE(ht.is_empty());
@@ -26,7 +30,7 @@ TEST(HashTable, BasicOperations) {
 TEST(HashTable, Resize) {
     HashTable ht;
     for (int i = 0; i < 16; i++) {
-        ht.set(std::to_string(i), std::to_string(i));
+        ht.set(std::to_string(i), make_str(std::to_string(i)));
     }
 
     ht.force_rehash();
@@ -38,14 +42,14 @@ TEST(HashTable, Resize) {
         auto node = ht.get(std::to_string(i));
         ASSERT_NE(node, nullptr);
         EXPECT_EQ(node->key, std::to_string(i));
-        EXPECT_EQ(node->value, std::to_string(i));
+        EXPECT_EQ(*std::get<SharedStr>(node->value), std::to_string(i));
     }
 }
 
 TEST(HashTable, MoreResize) {
     HashTable ht;
     for (int i = 0; i < 128; i++) {
-        ht.set(std::to_string(i), std::to_string(i));
+        ht.set(std::to_string(i), make_str(std::to_string(i)));
     }
 
     ht.force_rehash();
@@ -57,6 +61,59 @@ TEST(HashTable, MoreResize) {
         auto node = ht.get(std::to_string(i));
         ASSERT_NE(node, nullptr);
         EXPECT_EQ(node->key, std::to_string(i));
-        EXPECT_EQ(node->value, std::to_string(i));
+        EXPECT_EQ(*std::get<SharedStr>(node->value), std::to_string(i));
     }
-}
\ No newline at end of file
+}
+
+TEST(HashTable, Sample) {
+    HashTable ht;
+    std::array<HashNode *, 5> out{};
+    EXPECT_EQ(ht.sample(out.data(), out.size()), 0);
+
+    for (int i = 0; i < 100; i++) {
+        ht.set(std::to_string(i), make_str(std::to_string(i)));
+    }
+
+    // Also while rehashing, nodes come from both tables
+    for (int round = 0; round < 2; round++) {
+        ASSERT_EQ(ht.sample(out.data(), out.size()), out.size());
+        for (const HashNode *node : out) {
+            EXPECT_EQ(ht.get(node->key), node);
+        }
+        ht.force_rehash();
+    }
+
+    std::vector<HashNode *> all(1000);
+    EXPECT_EQ(ht.sample(all.data(), all.size()), 100);
+}
+
+TEST(HashTable, GetMany) {
+    HashTable ht;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100; i++) {
+        ht.set(std::to_string(i), make_str(std::to_string(i)));
+        keys.push_back(std::to_string(i * 2));
+    }
+
+    // Still rehashing from the last expansion
+    EXPECT_NE(ht.state(1).size, 0);
+    const std::vector<std::string_view> views(keys.begin(), keys.end());
+    std::vector<HashNode *> nodes;
+    ht.get_many(views.data(), views.size(), 1, nodes);
+    ASSERT_EQ(nodes.size(), keys.size());
+    for (std::size_t i = 0; i < keys.size(); i++) {
+        EXPECT_EQ(nodes[i], ht.get(keys[i]));
+        EXPECT_EQ(nodes[i] != nullptr, i < 50);
+    }
+
+    // Every other key, as MSET passes them
+    ht.get_many(views.data() + 1, views.size() / 2, 2, nodes);
+    ASSERT_EQ(nodes.size(), keys.size() / 2);
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+        EXPECT_EQ(nodes[i], ht.get(keys[2 * i + 1]));
+    }
+
+    HashTable empty;
+    empty.get_many(views.data(), views.size(), 1, nodes);
+    EXPECT_EQ(nodes, std::vector<HashNode *>(keys.size(), nullptr));
+}
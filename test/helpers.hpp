@@ -0,0 +1,86 @@
+#pragma once
+
+#include "connection.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+
+#include <algorithm>   // std::max, std::min
+#include <array>       // std::array
+#include <cstddef>     // std::byte, std::size_t
+#include <cstring>     // std::memcpy
+#include <limits>      // std::numeric_limits
+#include <memory>      // std::unique_ptr
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+#include <sys/uio.h> // iovec
+
+// Drive connections without sockets: requests go straight into rbuf and the
+// replies are taken from wbuf as a write would.
+
+// The request in the protocol, RESP2 for RESP3 too
+inline std::string encode(const std::vector<std::string_view> &args,
+                          Proto proto = Proto::RESP2) {
+    if (proto == Proto::NATIVE) {
+        const std::vector<std::byte> req = make_request(args);
+        return {reinterpret_cast<const char *>(req.data()), req.size()};
+    }
+    std::string req = fmt::format("*{}\r\n", args.size());
+    for (const auto arg : args) {
+        req += fmt::format("${}\r\n{}\r\n", arg.size(), arg);
+    }
+    return req;
+}
+
+// Append bytes to rbuf as if they were read
+inline void push(std::unique_ptr<Connection> &conn, std::string_view bytes) {
+    acquire_rbuf(conn);
+    conn->rbuf.resize(std::max(conn->rbuf.size(), conn->rbuf_size + bytes.size()));
+    std::memcpy(&conn->rbuf[conn->rbuf_size], bytes.data(), bytes.size());
+    conn->rbuf_size += bytes.size();
+}
+
+inline void push_request(std::unique_ptr<Connection> &conn,
+                         const std::vector<std::string_view> &args,
+                         Proto proto = Proto::RESP2) {
+    push(conn, encode(args, proto));
+}
+
+inline void handle_requests(std::unique_ptr<Connection> &conn) {
+    while (try_one_request(conn)) {
+    }
+}
+
+// The pending output, written at most chunk bytes at a time
+inline std::string drain(std::unique_ptr<Connection> &conn,
+                         std::size_t chunk = std::numeric_limits<std::size_t>::max()) {
+    std::string out;
+    while (wbuf_pending(conn)) {
+        std::array<iovec, WBUF_IOV_MAX> iov{};
+        const std::size_t niov = wbuf_iov(conn, iov.data(), iov.size());
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < niov && n < chunk; i++) {
+            const std::size_t len = std::min(iov[i].iov_len, chunk - n);
+            out.append(static_cast<const char *>(iov[i].iov_base), len);
+            n += len;
+        }
+        wbuf_consume(conn, n);
+    }
+    return out;
+}
+
+// Handle the requests in bytes and return their replies
+inline std::string run_bytes(std::unique_ptr<Connection> &conn, std::string_view bytes) {
+    push(conn, bytes);
+    handle_requests(conn);
+    release_rbuf(conn);
+    return drain(conn);
+}
+
+inline std::string run(std::unique_ptr<Connection> &conn,
+                       const std::vector<std::string_view> &args,
+                       Proto proto = Proto::RESP2) {
+    return run_bytes(conn, encode(args, proto));
+}
@@ -0,0 +1,69 @@
+#include "hotkeys.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstddef> // std::size_t
+#include <cstdint> // std::uint32_t
+#include <memory>  // std::make_unique
+#include <random>  // std::mt19937
+#include <string>  // std::string, std::to_string
+#include <vector>  // std::vector
+
+TEST(HotKeys, FindsTheHottest) {
+    auto hot = std::make_unique<HotKeys>();
+    std::mt19937 rng(1);
+
+    // hot0 takes 1% of the traffic, hot1 2% and so on up to hot4, 15% in all. The
+    // rest goes to 100000 cold keys.
+    for (int round = 0; round < 200000; round++) {
+        const std::uint32_t r = rng() % 100;
+        if (r >= 15) {
+            hot->add("cold" + std::to_string(rng() % 100000));
+            continue;
+        }
+        std::uint32_t i = 0;
+        for (std::uint32_t end = 1; r >= end; end += i + 1) {
+            i++;
+        }
+        hot->add("hot" + std::to_string(i));
+    }
+
+    const std::vector<HotKey> top = hot->top(5);
+    ASSERT_EQ(top.size(), 5);
+    for (std::size_t i = 0; i < top.size(); i++) {
+        EXPECT_EQ(top[i].key, "hot" + std::to_string(4 - i));
+    }
+
+    // Never underestimated, and not far over with 16 KiB of counters
+    EXPECT_GE(hot->estimate("hot4"), 9000);
+    EXPECT_LT(hot->estimate("hot4"), 11000);
+    EXPECT_LT(hot->estimate("missing"), 1000);
+    EXPECT_EQ(hot->accesses(), 200000);
+}
+
+TEST(HotKeys, Decay) {
+    auto hot = std::make_unique<HotKeys>();
+    for (std::uint32_t i = 0; i < HOTKEYS_DECAY_PERIOD - 1; i++) {
+        hot->add("old");
+    }
+    EXPECT_EQ(hot->estimate("old"), HOTKEYS_DECAY_PERIOD - 1);
+
+    hot->add("new");
+    EXPECT_EQ(hot->estimate("old"), (HOTKEYS_DECAY_PERIOD - 1) / 2);
+    EXPECT_EQ(hot->top(1)[0].count, (HOTKEYS_DECAY_PERIOD - 1) / 2);
+}
+
+TEST(HotKeys, LongKeysAreTruncated) {
+    auto hot = std::make_unique<HotKeys>();
+    const std::string key(HOTKEYS_KEY_MAX * 2, 'k');
+    hot->add(key);
+    hot->add(key);
+
+    const std::vector<HotKey> top = hot->top(HOTKEYS_TOP);
+    ASSERT_EQ(top.size(), 1);
+    EXPECT_EQ(top[0].key, key.substr(0, HOTKEYS_KEY_MAX));
+    EXPECT_EQ(top[0].count, 2);
+
+    hot->clear();
+    EXPECT_TRUE(hot->top(HOTKEYS_TOP).empty());
+}
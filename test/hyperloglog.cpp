@@ -0,0 +1,82 @@
+#include "cpu.hpp"
+#include "hyperloglog.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cmath>  // std::abs
+#include <random> // std::mt19937
+#include <string> // std::to_string
+
+namespace {
+void expect_close(std::uint64_t estimate, std::uint64_t actual, double tolerance) {
+    const double error =
+        std::abs(static_cast<double>(estimate) - static_cast<double>(actual)) /
+        static_cast<double>(actual);
+    EXPECT_LT(error, tolerance) << "estimate " << estimate << ", actual " << actual;
+}
+} // namespace
+
+TEST(HyperLogLog, Sparse) {
+    HyperLogLog hll;
+    EXPECT_EQ(hll.count(), 0);
+
+    EXPECT_TRUE(hll.add("a"));
+    EXPECT_FALSE(hll.add("a"));
+    EXPECT_TRUE(hll.add("b"));
+    EXPECT_TRUE(hll.is_sparse());
+    EXPECT_EQ(hll.count(), 2);
+}
+
+TEST(HyperLogLog, Accuracy) {
+    HyperLogLog hll;
+    std::uint64_t n = 0;
+    for (const std::uint64_t target : {100, 1000, 10000, 100000, 1000000}) {
+        for (; n < target; n++) {
+            hll.add(std::to_string(n));
+        }
+        expect_close(hll.count(), n, 0.03);
+    }
+    EXPECT_FALSE(hll.is_sparse());
+    EXPECT_EQ(hll.bytes(), HLL_DENSE_BYTES);
+}
+
+TEST(HyperLogLog, PackRoundTrip) {
+    std::mt19937 rng(7);
+    HLLRegisters regs{};
+    for (auto &reg : regs) {
+        reg = rng() % 64;
+    }
+
+    for (const bool simd : {true, false}) {
+        Cpu::set_simd_enabled(simd);
+        HyperLogLog hll;
+        hll.assign(regs);
+
+        HLLRegisters out{};
+        hll.merge_into(out);
+        EXPECT_EQ(out, regs);
+    }
+    Cpu::set_simd_enabled(true);
+}
+
+TEST(HyperLogLog, MergeAndEstimate) {
+    HyperLogLog a;
+    HyperLogLog b;
+    for (int i = 0; i < 50000; i++) {
+        a.add(std::to_string(i));
+        b.add(std::to_string(i + 25000));
+    }
+
+    std::uint64_t estimates[2] = {};
+    for (const bool simd : {true, false}) {
+        Cpu::set_simd_enabled(simd);
+        HLLRegisters regs{};
+        a.merge_into(regs);
+        b.merge_into(regs);
+        estimates[simd ? 1 : 0] = HyperLogLog::estimate(regs);
+    }
+    Cpu::set_simd_enabled(true);
+
+    EXPECT_EQ(estimates[0], estimates[1]);
+    expect_close(estimates[0], 75000, 0.03);
+}
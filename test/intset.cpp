@@ -0,0 +1,105 @@
+#include "cpu.hpp"
+#include "intset.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm> // std::set_intersection
+#include <cstdint>   // std::int64_t
+#include <iterator>  // std::back_inserter
+#include <random>    // std::mt19937_64
+#include <vector>    // std::vector
+
+namespace {
+std::vector<std::int64_t> naive_intersect(const IntSet &a, const IntSet &b) {
+    const auto va = a.values();
+    const auto vb = b.values();
+    std::vector<std::int64_t> out;
+    std::set_intersection(va.begin(), va.end(), vb.begin(), vb.end(),
+                          std::back_inserter(out));
+    return out;
+}
+
+IntSet random_set(std::mt19937_64 &rng, std::size_t n, std::int64_t range) {
+    std::uniform_int_distribution<std::int64_t> dist(-range, range);
+    std::vector<std::int64_t> values(n);
+    for (auto &v : values) {
+        v = dist(rng);
+    }
+    IntSet set;
+    set.add(values);
+    return set;
+}
+} // namespace
+
+TEST(IntSet, BasicOperations) {
+    IntSet set;
+    EXPECT_TRUE(set.add(5));
+    EXPECT_TRUE(set.add(1));
+    EXPECT_TRUE(set.add(3));
+    EXPECT_FALSE(set.add(3));
+
+    EXPECT_EQ(set.size(), 3);
+    EXPECT_EQ(set.encoding(), IntSetEnc::INT16);
+    EXPECT_EQ(set.values(), (std::vector<std::int64_t>{1, 3, 5}));
+
+    EXPECT_TRUE(set.contains(3));
+    EXPECT_FALSE(set.contains(4));
+    EXPECT_FALSE(set.contains(1LL << 40));
+
+    EXPECT_TRUE(set.remove(3));
+    EXPECT_FALSE(set.remove(3));
+    EXPECT_EQ(set.values(), (std::vector<std::int64_t>{1, 5}));
+}
+
+TEST(IntSet, Upgrade) {
+    IntSet set;
+    set.add(1);
+    set.add(-2);
+
+    set.add(100000);
+    EXPECT_EQ(set.encoding(), IntSetEnc::INT32);
+    EXPECT_EQ(set.bytes(), 3 * sizeof(std::int32_t));
+
+    set.add(-(1LL << 40));
+    EXPECT_EQ(set.encoding(), IntSetEnc::INT64);
+    EXPECT_EQ(set.values(), (std::vector<std::int64_t>{-(1LL << 40), -2, 1, 100000}));
+}
+
+TEST(IntSet, BatchAdd) {
+    IntSet set;
+    set.add(std::vector<std::int64_t>{7, 3});
+    EXPECT_EQ(set.add(std::vector<std::int64_t>{9, 3, 1, 9, 70000}), 3);
+    EXPECT_EQ(set.encoding(), IntSetEnc::INT32);
+    EXPECT_EQ(set.values(), (std::vector<std::int64_t>{1, 3, 7, 9, 70000}));
+}
+
+TEST(IntSet, Intersect) {
+    std::mt19937_64 rng(42);
+    const std::int64_t ranges[] = {1000, 1LL << 20, 1LL << 40};
+
+    for (const bool simd : {true, false}) {
+        Cpu::set_simd_enabled(simd);
+        for (const auto range : ranges) {
+            for (const std::size_t n : {0, 3, 17, 1000, 5000}) {
+                const IntSet a = random_set(rng, n, range);
+                const IntSet b = random_set(rng, 2 * n + 1, range);
+
+                std::vector<std::int64_t> out;
+                IntSet::intersect(a, b, out);
+                EXPECT_EQ(out, naive_intersect(a, b));
+            }
+        }
+    }
+    Cpu::set_simd_enabled(true);
+}
+
+TEST(IntSet, IntersectMixedEncodings) {
+    IntSet a;
+    IntSet b;
+    a.add(std::vector<std::int64_t>{1, 2, 3, 4, 5});
+    b.add(std::vector<std::int64_t>{2, 4, 1LL << 40});
+
+    std::vector<std::int64_t> out;
+    IntSet::intersect(a, b, out);
+    EXPECT_EQ(out, (std::vector<std::int64_t>{2, 4}));
+}
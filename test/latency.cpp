@@ -0,0 +1,95 @@
+#include "latency.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>  // std::chrono::milliseconds
+#include <cstddef> // std::size_t
+#include <thread>  // std::this_thread
+#include <vector>  // std::vector
+
+namespace {
+void reset_all() {
+    for (std::size_t i = 0; i < LATENCY_EVENTS; i++) {
+        Latency::reset(static_cast<LatencyEvent>(i));
+    }
+}
+} // namespace
+
+TEST(Latency, Names) {
+    for (std::size_t i = 0; i < LATENCY_EVENTS; i++) {
+        const auto event = static_cast<LatencyEvent>(i);
+        EXPECT_EQ(to_latency_event(to_string(event)), event);
+    }
+    EXPECT_EQ(to_latency_event("expire-cycle"), LatencyEvent::EXPIRE_CYCLE);
+    EXPECT_FALSE(to_latency_event("fork").has_value());
+}
+
+TEST(Latency, Threshold) {
+    reset_all();
+    Latency::set_threshold(0);
+    Latency::add_sample(LatencyEvent::COMMAND, 1'000'000);
+    EXPECT_TRUE(Latency::latest().empty());
+
+    Latency::set_threshold(5);
+    Latency::add_sample(LatencyEvent::COMMAND, 4'999);
+    EXPECT_TRUE(Latency::latest().empty());
+    Latency::add_sample(LatencyEvent::COMMAND, 5'000);
+    ASSERT_EQ(Latency::history(LatencyEvent::COMMAND).size(), 1);
+    EXPECT_EQ(Latency::history(LatencyEvent::COMMAND)[0].ms, 5);
+
+    Latency::set_threshold(0);
+    reset_all();
+}
+
+TEST(Latency, HistoryAndLatest) {
+    reset_all();
+    Latency::set_threshold(1);
+    Latency::add_sample(LatencyEvent::FREE, 30'000);
+    Latency::add_sample(LatencyEvent::REHASH, 2'000);
+    Latency::add_sample(LatencyEvent::FREE, 10'000);
+
+    // Unless the second changed in between, both FREE samples are one, the worst
+    const std::vector<LatencySample> free = Latency::history(LatencyEvent::FREE);
+    ASSERT_FALSE(free.empty());
+    EXPECT_EQ(free.front().ms, 30);
+    EXPECT_GT(free.front().time, 0);
+
+    const std::vector<LatencyStats> latest = Latency::latest();
+    ASSERT_EQ(latest.size(), 2);
+    EXPECT_EQ(latest[0].event, LatencyEvent::REHASH);
+    EXPECT_EQ(latest[0].latest, 2);
+    EXPECT_EQ(latest[1].event, LatencyEvent::FREE);
+    EXPECT_EQ(latest[1].max, 30);
+
+    EXPECT_TRUE(Latency::reset(LatencyEvent::FREE));
+    EXPECT_FALSE(Latency::reset(LatencyEvent::FREE));
+    EXPECT_TRUE(Latency::history(LatencyEvent::FREE).empty());
+    EXPECT_EQ(Latency::latest().size(), 1);
+
+    Latency::set_threshold(0);
+    reset_all();
+}
+
+TEST(Latency, Span) {
+    reset_all();
+    {
+        const LatencySpan off{LatencyEvent::EVICTION};
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    EXPECT_TRUE(Latency::history(LatencyEvent::EVICTION).empty());
+
+    Latency::set_threshold(1);
+    {
+        const LatencySpan on{LatencyEvent::EVICTION};
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    {
+        const LatencySpan fast{LatencyEvent::COMMAND};
+    }
+    ASSERT_EQ(Latency::history(LatencyEvent::EVICTION).size(), 1);
+    EXPECT_GE(Latency::history(LatencyEvent::EVICTION)[0].ms, 2);
+    EXPECT_TRUE(Latency::history(LatencyEvent::COMMAND).empty());
+
+    Latency::set_threshold(0);
+    reset_all();
+}
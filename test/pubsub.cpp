@@ -0,0 +1,94 @@
+#include "connection.hpp"
+#include "helpers.hpp"
+#include "pubsub.hpp"
+#include "utils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <memory>      // std::unique_ptr, std::make_unique
+#include <string>      // std::string
+#include <vector>      // std::vector
+
+namespace {
+std::unique_ptr<Connection> resp_conn(int fd, Proto proto) {
+    auto conn = std::make_unique<Connection>(fd);
+    conn->proto = proto;
+    return conn;
+}
+} // namespace
+
+TEST(PubSub, MessagesAreShared) {
+    auto a = resp_conn(200, Proto::RESP2);
+    auto b = resp_conn(201, Proto::RESP2);
+    auto c = resp_conn(202, Proto::RESP3);
+    EXPECT_EQ(run(a, {"SUBSCRIBE", "news"}),
+              "*3\r\n$9\r\nsubscribe\r\n$4\r\nnews\r\n:1\r\n");
+    EXPECT_EQ(run(b, {"SUBSCRIBE", "news", "other"}),
+              "*3\r\n$9\r\nsubscribe\r\n$4\r\nnews\r\n:1\r\n"
+              "*3\r\n$9\r\nsubscribe\r\n$5\r\nother\r\n:2\r\n");
+    EXPECT_EQ(run(c, {"SUBSCRIBE", "news"}),
+              ">3\r\n$9\r\nsubscribe\r\n$4\r\nnews\r\n:1\r\n");
+    EXPECT_EQ(PubSub::num_channels(), 2);
+
+    std::vector<int> woken;
+    PubSub::take_woken(woken);
+    EXPECT_EQ(PubSub::publish("news", "hi"), 3);
+    PubSub::take_woken(woken);
+    EXPECT_EQ(woken, (std::vector<int>{200, 201, 202}));
+
+    // One encoding per protocol, referenced by every subscriber
+    ASSERT_EQ(a->wrefs.size(), 1);
+    ASSERT_EQ(b->wrefs.size(), 1);
+    EXPECT_EQ(a->wrefs[0].value.get(), b->wrefs[0].value.get());
+    EXPECT_EQ(a->wrefs[0].value.use_count(), 2);
+    EXPECT_EQ(drain(a), "*3\r\n$7\r\nmessage\r\n$4\r\nnews\r\n$2\r\nhi\r\n");
+    EXPECT_EQ(drain(c), ">3\r\n$7\r\nmessage\r\n$4\r\nnews\r\n$2\r\nhi\r\n");
+
+    // Only subscribers with nothing pending are woken
+    EXPECT_EQ(PubSub::publish("other", "x"), 1);
+    PubSub::take_woken(woken);
+    EXPECT_TRUE(woken.empty());
+    EXPECT_NE(drain(b).find("$5\r\nother\r\n$1\r\nx\r\n"), std::string::npos);
+
+    // RESP2 subscribers are limited to the pub/sub commands
+    EXPECT_EQ(run_bytes(a, encode({"GET", "k"}) + encode({"PING"})).substr(0, 17),
+              "-ERR Can't execut");
+    EXPECT_EQ(run(a, {"PING"}), "*2\r\n$4\r\npong\r\n$0\r\n\r\n");
+
+    run(b, {"UNSUBSCRIBE"});
+    EXPECT_EQ(b->subscriptions, 0);
+    PubSub::on_close(*a);
+    PubSub::on_close(*c);
+    EXPECT_EQ(PubSub::num_channels(), 0);
+    EXPECT_EQ(PubSub::publish("news", "hi"), 0);
+}
+
+TEST(PubSub, Patterns) {
+    auto a = resp_conn(203, Proto::RESP2);
+    auto b = resp_conn(204, Proto::NATIVE);
+    run(a, {"PSUBSCRIBE", "news.*", "*"});
+    PubSub::psubscribe(*b, "news.*");
+    PubSub::psubscribe(*b, "sport.[ab]?");
+    EXPECT_EQ(PubSub::num_patterns(), 3);
+
+    EXPECT_EQ(PubSub::publish("news.tech", "m"), 3);
+    EXPECT_EQ(PubSub::publish("sport.ax", "m"), 2);
+    EXPECT_EQ(PubSub::publish("sport.cx", "m"), 1);
+    EXPECT_EQ(PubSub::publish("new", "m"), 1);
+    const std::string out = drain(a);
+    EXPECT_NE(out.find("*4\r\n$8\r\npmessage\r\n$6\r\nnews.*\r\n$9\r\nnews.tech\r\n"),
+              std::string::npos);
+    EXPECT_NE(out.find("$1\r\n*\r\n$3\r\nnew\r\n"), std::string::npos);
+
+    run(a, {"PUNSUBSCRIBE"});
+    EXPECT_EQ(a->subscriptions, 0);
+    EXPECT_EQ(PubSub::publish("new", "m"), 0);
+    EXPECT_TRUE(PubSub::punsubscribe(*b, "news.*"));
+    EXPECT_FALSE(PubSub::punsubscribe(*b, "news.*"));
+    PubSub::on_close(*b);
+    EXPECT_EQ(PubSub::num_patterns(), 0);
+    EXPECT_EQ(PubSub::publish("sport.ax", "m"), 0);
+
+    std::vector<int> woken;
+    PubSub::take_woken(woken);
+}
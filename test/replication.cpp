@@ -0,0 +1,272 @@
+#include "compress.hpp"
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+#include "replication.hpp"
+#include "utils.hpp"
+
+#include <fmt/core.h> // fmt::format
+#include <gtest/gtest.h>
+
+#include <cstddef>     // std::size_t
+#include <cstdint>     // std::int64_t
+#include <memory>      // std::make_unique
+#include <random>      // std::mt19937
+#include <string>      // std::string, std::to_string
+#include <string_view> // std::string_view
+#include <utility>     // std::move
+#include <variant>     // std::get, std::holds_alternative
+#include <vector>      // std::vector
+
+#include <unistd.h> // close
+
+namespace {
+// A request as the replication stream carries it
+std::string stream(const std::vector<std::string_view> &args) {
+    return encode(args, Proto::NATIVE);
+}
+
+// A field of the replication section of INFO
+std::string info_field(std::string_view name) {
+    const std::string info = Replication::info();
+    const std::size_t start = info.find(std::string(name) + ":") + name.size() + 1;
+    return info.substr(start, info.find("\r\n", start) - start);
+}
+} // namespace
+
+TEST(Replication, FullResyncSendsSnapshot) {
+    map.clear();
+    map.set("str", make_str("value"));
+    map.set("num", std::int64_t{42});
+
+    auto replica = std::make_unique<Connection>(100);
+    push(replica, stream({"PSYNC", "?", "-1"}));
+    handle_requests(replica);
+    EXPECT_EQ(replica->link, Link::REPLICA);
+    ASSERT_EQ(Replication::replicas().size(), 1);
+
+    const std::string replid = info_field("master_replid");
+    const std::string offset = info_field("master_repl_offset");
+    EXPECT_EQ(drain(replica), stream({"FULLRESYNC", replid, offset}));
+    EXPECT_TRUE(Replication::sending_snapshot(*replica));
+
+    // The keyspace follows once the replica took the output
+    EXPECT_TRUE(Replication::catch_up(replica));
+    const std::string out = drain(replica);
+    const std::string str =
+        stream({"DEL", "str"}) + stream({"RESTORE", "str", "str", "value"});
+    EXPECT_NE(out.find(str), std::string::npos);
+    EXPECT_NE(out.find(stream({"DEL", "num"}) + stream({"RESTORE", "num", "int", "42"})),
+              std::string::npos);
+    const std::string end = stream({"CONTINUE", replid, offset});
+    EXPECT_EQ(out.rfind(end), out.size() - end.size());
+    EXPECT_FALSE(Replication::sending_snapshot(*replica));
+
+    // Writes reach the replica through the backlog, errors included
+    Replication::feed({"SET", "k", "v"});
+    EXPECT_TRUE(Replication::catch_up(replica));
+    EXPECT_EQ(drain(replica), stream({"SET", "k", "v"}));
+    EXPECT_TRUE(Replication::catch_up(replica));
+    EXPECT_FALSE(wbuf_pending(replica));
+
+    Replication::on_close(*replica, 0);
+    EXPECT_TRUE(Replication::replicas().empty());
+    map.clear();
+}
+
+TEST(Replication, SnapshotFollowsWrites) {
+    map.clear();
+    constexpr std::size_t NKEYS = 1000;
+    const std::string value(1000, 'v');
+    for (std::size_t i = 0; i < NKEYS; i++) {
+        map.set("key" + std::to_string(i), make_str(value));
+    }
+
+    auto replica = std::make_unique<Connection>(100);
+    push(replica, stream({"PSYNC", "?", "-1"}));
+    handle_requests(replica);
+    drain(replica);
+
+    // Only some of the keyspace waits for the replica at a time
+    EXPECT_TRUE(Replication::catch_up(replica));
+    EXPECT_GE(wbuf_pending_bytes(replica), REPL_SNAPSHOT_BUFFER);
+    EXPECT_LT(wbuf_pending_bytes(replica), REPL_SNAPSHOT_BUFFER + 2 * value.size());
+    std::string out = drain(replica);
+
+    // Writes come first, BITOP after the keys it reads as they are now
+    auto client = std::make_unique<Connection>(-1);
+    run(client, {"SET", "new", "1"});
+    run(client, {"BITOP", "OR", "dest", "key1", "new"});
+    EXPECT_TRUE(Replication::catch_up(replica));
+    const std::string writes = drain(replica);
+    const std::string set = stream({"SET", "new", "1"});
+    const std::string bitop = stream({"BITOP", "OR", "dest", "key1", "new"});
+    EXPECT_EQ(writes.find(set), 0U);
+    EXPECT_EQ(writes.find(stream({"DEL", "dest"}) + stream({"DEL", "key1"})), set.size());
+    const std::size_t restore_new =
+        writes.find(stream({"DEL", "new"}) + stream({"RESTORE", "new", "int", "1"}));
+    EXPECT_LT(restore_new, writes.find(bitop));
+    out += writes;
+
+    while (Replication::sending_snapshot(*replica)) {
+        EXPECT_TRUE(Replication::catch_up(replica));
+        out += drain(replica);
+    }
+    for (std::size_t i = 0; i < NKEYS; i++) {
+        const std::string key = "key" + std::to_string(i);
+        EXPECT_NE(out.find(stream({"RESTORE", key, "str", value})), std::string::npos);
+    }
+    const std::string end = stream(
+        {"CONTINUE", info_field("master_replid"), info_field("master_repl_offset")});
+    EXPECT_EQ(out.rfind(end), out.size() - end.size());
+
+    Replication::on_close(*replica, 0);
+    map.clear();
+}
+
+TEST(Replication, PartialResyncFromBacklog) {
+    map.clear();
+    auto first = std::make_unique<Connection>(100);
+    push(first, stream({"PSYNC", "?", "-1"}));
+    handle_requests(first);
+    Replication::on_close(*first, 0);
+
+    const std::string replid = info_field("master_replid");
+    const std::string offset = info_field("master_repl_offset");
+    Replication::feed({"DEL", "a"});
+    Replication::feed({"INCR", "b"});
+
+    // The replica that was at offset only misses what came after
+    auto replica = std::make_unique<Connection>(101);
+    push(replica, stream({"PSYNC", replid, offset}));
+    handle_requests(replica);
+    EXPECT_TRUE(Replication::catch_up(replica));
+    EXPECT_EQ(drain(replica), stream({"CONTINUE", replid}) + stream({"DEL", "a"}) +
+                                  stream({"INCR", "b"}));
+    Replication::on_close(*replica, 0);
+
+    // Another stream is a full resync
+    auto stranger = std::make_unique<Connection>(102);
+    push(stranger, stream({"PSYNC", "0123", offset}));
+    handle_requests(stranger);
+    const std::string fullresync =
+        stream({"FULLRESYNC", replid, info_field("master_repl_offset")});
+    EXPECT_EQ(drain(stranger).find(fullresync), 0U);
+    EXPECT_EQ(stranger->link, Link::REPLICA);
+    Replication::on_close(*stranger, 0);
+}
+
+TEST(Replication, ReplicaAppliesStream) {
+    map.clear();
+    Replication::replicate_from("127.0.0.1", 1);
+    EXPECT_TRUE(Replication::is_replica());
+
+    // Nothing listens on port 1, the link is never used for more than its fd
+    const int fd = Replication::connect_primary(0);
+    ASSERT_NE(fd, -1);
+    EXPECT_EQ(Replication::connect_primary(0), -1);
+    auto link = std::make_unique<Connection>(fd);
+    const std::string psync =
+        stream({"PSYNC", info_field("master_replid"), info_field("master_repl_offset")});
+    Replication::on_link(link);
+    EXPECT_EQ(link->link, Link::PRIMARY);
+    EXPECT_EQ(drain(link), psync);
+
+    push(link, stream({"FULLRESYNC", "abc", "100"}));
+    push(link, stream({"SET", "k", "0"}));
+    push(link, stream({"DEL", "big"}));
+    push(link, stream({"RESTORE", "big", "str", "part1"}));
+    push(link, stream({"RESTORE", "big", "str", "part2"}));
+    push(link, stream({"RESTORE", "set", "set", "x", "y"}));
+    push(link, stream({"SET", "k", "1"}));
+    handle_requests(link);
+    EXPECT_FALSE(wbuf_pending(link));
+    EXPECT_EQ(info_field("master_link_status"), "up");
+    EXPECT_EQ(info_field("master_sync_in_progress"), "1");
+    EXPECT_EQ(info_field("master_replid"), "abc");
+
+    // The snapshot and the stream are mixed, the offset comes at the end. From
+    // then on every request counts, RESTOREs of keys moved by Cluster too.
+    const std::string restore = stream({"RESTORE", "n", "int", "5"});
+    push(link, stream({"CONTINUE", "abc", "150"}));
+    push(link, restore);
+    handle_requests(link);
+    EXPECT_EQ(info_field("master_sync_in_progress"), "0");
+    EXPECT_EQ(info_field("master_repl_offset"), std::to_string(150 + restore.size()));
+    EXPECT_EQ(*std::get<SharedStr>(map.get("big")->value), "part1part2");
+    EXPECT_EQ(std::get<Set>(map.get("set")->value).size(), 2);
+    EXPECT_EQ(std::get<std::int64_t>(map.get("k")->value), 1);
+
+    // Clients only read
+    auto client = std::make_unique<Connection>(-1);
+    push(client, stream({"DEL", "k"}));
+    push(client, stream({"GET", "k"}));
+    handle_requests(client);
+    const std::string out = drain(client);
+    EXPECT_NE(out.find("READONLY"), std::string::npos);
+    EXPECT_NE(map.get("k"), nullptr);
+
+    Replication::on_close(*link, 0);
+    EXPECT_EQ(info_field("master_link_status"), "down");
+    close(fd);
+
+    // A snapshot cut short is not resumed
+    const int next_fd = Replication::connect_primary(REPL_RETRY_SECONDS);
+    ASSERT_NE(next_fd, -1);
+    auto next = std::make_unique<Connection>(next_fd);
+    Replication::on_link(next);
+    drain(next);
+    push(next, stream({"FULLRESYNC", "def", "200"}));
+    handle_requests(next);
+    Replication::on_close(*next, 0);
+    close(next_fd);
+    EXPECT_NE(info_field("master_replid"), "def");
+
+    Replication::replicate_from({}, 0);
+    EXPECT_FALSE(Replication::is_replica());
+    EXPECT_NE(info_field("master_replid"), "abc");
+    map.clear();
+}
+
+TEST(Replication, CompressedValuesStayCompressed) {
+    map.clear();
+    Compress::set_min_size(256);
+    std::mt19937 rng(5);
+    std::string json;
+    while (json.size() < 64 * 1024) {
+        json += fmt::format(R"({{"id":{},"score":{}}},)", rng() % 100000, rng() % 1000);
+    }
+    auto packed = Compress::pack(json);
+    ASSERT_TRUE(packed);
+    ASSERT_GT(packed->data.size(), REPL_CHUNK);
+    map.set("doc", std::move(*packed));
+    std::string dump;
+    Replication::dump_key(*map.get("doc"),
+                          [&dump](const auto &args) { dump += stream(args); });
+    map.clear();
+
+    Replication::replicate_from("127.0.0.1", 1);
+    const int fd = Replication::connect_primary(0);
+    ASSERT_NE(fd, -1);
+    auto link = std::make_unique<Connection>(fd);
+    Replication::on_link(link);
+    drain(link);
+    push(link, stream({"FULLRESYNC", "abc", "100"}));
+    push(link, stream({"DEL", "doc"}));
+    push(link, dump);
+    push(link, stream({"CONTINUE", "abc", "100"}));
+    handle_requests(link);
+    EXPECT_FALSE(wbuf_pending(link));
+
+    // The replica keeps the compressed bytes of the primary
+    const HashNode *node = map.get("doc");
+    ASSERT_NE(node, nullptr);
+    ASSERT_TRUE(std::holds_alternative<PackedStr>(node->value));
+    EXPECT_EQ(Compress::unpack(std::get<PackedStr>(node->value)), json);
+
+    Replication::on_close(*link, 0);
+    close(fd);
+    Replication::replicate_from({}, 0);
+    Compress::set_min_size(0);
+    map.clear();
+}
@@ -0,0 +1,161 @@
+#include "connection.hpp"
+#include "cpu.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+#include "resp.hpp"
+
+#include <fmt/core.h> // fmt::format
+#include <gtest/gtest.h>
+
+#include <cstddef>     // std::size_t
+#include <memory>      // std::make_unique
+#include <string>      // std::string, std::stoi
+#include <string_view> // std::string_view
+#include <utility>     // std::pair
+#include <vector>      // std::vector
+
+TEST(Resp, FindCrlf) {
+    for (const bool simd : {true, false}) {
+        Cpu::set_simd_enabled(simd);
+        for (const std::size_t at : {0, 1, 30, 31, 32, 33, 63, 100}) {
+            std::string s(at, 'x');
+            s += "\r\rx\n\r\nyy";
+            EXPECT_EQ(find_crlf(s.data(), s.size()), at + 4);
+        }
+        // A "\r" at the end may be followed by "\n" once more arrives
+        const std::string cr(40, '\r');
+        EXPECT_EQ(find_crlf(cr.data(), cr.size()), cr.size());
+    }
+    Cpu::set_simd_enabled(true);
+}
+
+TEST(Resp, Detect) {
+    const auto bytes = [](std::string_view s) {
+        return reinterpret_cast<const std::byte *>(s.data());
+    };
+    EXPECT_TRUE(is_resp(bytes("*3\r\n")));
+    EXPECT_FALSE(is_resp(bytes("PING\r\n")));
+    // A 42 byte native request also starts with '*'
+    EXPECT_FALSE(is_resp(bytes("*\0\0\0")));
+    EXPECT_FALSE(is_resp(bytes("*0\0\0")));
+}
+
+TEST(Resp, Commands) {
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_EQ(run_bytes(conn, "*3\r\n$3\r\nSET\r\n$4\r\nresp\r\n$5\r\nhello\r\n"),
+              "+OK\r\n");
+    EXPECT_EQ(conn->proto, Proto::RESP2);
+    EXPECT_EQ(run_bytes(conn, "*2\r\n$3\r\nGET\r\n$4\r\nresp\r\n"), "$5\r\nhello\r\n");
+    EXPECT_EQ(run_bytes(conn, "*2\r\n$3\r\nGET\r\n$7\r\nmissing\r\n"), "$-1\r\n");
+    EXPECT_EQ(run_bytes(conn, "*2\r\n$4\r\nINCR\r\n$7\r\ncounter\r\n"), ":1\r\n");
+    EXPECT_EQ(run_bytes(conn, "*1\r\n$4\r\nPING\r\n"), "+PONG\r\n");
+    // Line breaks can not be part of an error
+    EXPECT_EQ(run_bytes(conn, "*1\r\n$6\r\nNO\r\nPE\r\n"),
+              "-ERR unknown command 'NO  PE'\r\n");
+
+    const std::string large(WBUF_REF_MIN, 'l');
+    run_bytes(conn, "*3\r\n$3\r\nSET\r\n$5\r\nlarge\r\n$1024\r\n" + large + "\r\n");
+    EXPECT_EQ(run_bytes(conn,
+                        "*4\r\n$4\r\nMGET\r\n$4\r\nresp\r\n$1\r\nx\r\n$5\r\nlarge\r\n"),
+              "*3\r\n$5\r\nhello\r\n$-1\r\n$1024\r\n" + large + "\r\n");
+}
+
+TEST(Resp, Pipelined) {
+    auto conn = std::make_unique<Connection>(-1);
+    const std::string set = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+    const std::string get = "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n";
+    const std::string both = set + get;
+
+    // Split anywhere, the replies are the same
+    for (std::size_t i = 1; i < both.size(); i++) {
+        std::string out = run_bytes(conn, std::string_view{both}.substr(0, i));
+        out += run_bytes(conn, std::string_view{both}.substr(i));
+        EXPECT_EQ(out, "+OK\r\n$5\r\nvalue\r\n");
+        EXPECT_EQ(conn->state, ConnState::REQUEST);
+        conn->rbuf_pos = conn->rbuf_size = 0;
+    }
+}
+
+TEST(Resp, Hello) {
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_EQ(run_bytes(conn, "*2\r\n$5\r\nHELLO\r\n$1\r\n4\r\n"),
+              "-NOPROTO unsupported protocol version\r\n");
+
+    const std::string reply = run_bytes(conn, "*2\r\n$5\r\nHELLO\r\n$1\r\n3\r\n");
+    EXPECT_EQ(conn->proto, Proto::RESP3);
+    EXPECT_EQ(reply.substr(0, 4), "%6\r\n");
+    EXPECT_NE(reply.find("$5\r\nproto\r\n:3\r\n"), std::string::npos);
+
+    EXPECT_EQ(run_bytes(conn, "*2\r\n$3\r\nGET\r\n$7\r\nmissing\r\n"), "_\r\n");
+
+    run_bytes(conn, "*2\r\n$5\r\nHELLO\r\n$1\r\n2\r\n");
+    EXPECT_EQ(conn->proto, Proto::RESP2);
+}
+
+TEST(Resp, ProtocolErrors) {
+    set_proto_max_bulk_len(1000);
+    const std::vector<std::pair<std::string_view, std::string_view>> cases{
+        {"*1\r\n+PING\r\n", "expected '$', got '+'"},
+        {"*1\r\n$4\r\nPINGxx", "bulk string without CRLF"},
+        {"*1\r\n$-1\r\n", "invalid bulk length -1"},
+        {"*1x\r\n", "invalid length '1x'"},
+        {"*1\r\n$1001\r\n", "invalid bulk length 1001"},
+        {"*1\r\n$12345678901234567890123", "header line too long"},
+        {"*1048577\r\n", "invalid multibulk length 1048577"}};
+    for (const auto &[bad, msg] : cases) {
+        auto conn = std::make_unique<Connection>(-1);
+        EXPECT_EQ(run_bytes(conn, bad), fmt::format("-ERR Protocol error: {}\r\n", msg))
+            << bad;
+        EXPECT_EQ(conn->state, ConnState::END) << bad;
+    }
+    set_proto_max_bulk_len(PROTO_MAX_BULK_LEN);
+
+    // Empty requests are skipped
+    auto conn = std::make_unique<Connection>(-1);
+    EXPECT_EQ(run_bytes(conn, "*0\r\n*-1\r\n*1\r\n$4\r\nPING\r\n"), "+PONG\r\n");
+}
+
+TEST(Resp, LargeArguments) {
+    map.clear();
+    const std::string large(100'000, 'l');
+    const std::string req = encode({"SET", "large", large});
+
+    // rbuf grows for the rest of the argument once its length is known
+    auto conn = std::make_unique<Connection>(-1);
+    push(conn, std::string_view{req}.substr(0, 100));
+    handle_requests(conn);
+    EXPECT_GE(conn->rbuf.size(), req.size());
+    EXPECT_EQ(run_bytes(conn, std::string_view{req}.substr(100)), "+OK\r\n");
+    EXPECT_EQ(run(conn, {"GET", "large"}), fmt::format("$100000\r\n{}\r\n", large));
+
+    // And for the whole request in the native protocol
+    auto native = std::make_unique<Connection>(-1);
+    const std::string native_req = encode({"SET", "large", large}, Proto::NATIVE);
+    push(native, std::string_view{native_req}.substr(0, 100));
+    handle_requests(native);
+    EXPECT_GE(native->rbuf.size(), native_req.size());
+    push(native, std::string_view{native_req}.substr(100));
+    handle_requests(native);
+    EXPECT_EQ(native->rbuf_pos, native_req.size());
+    map.clear();
+}
+
+TEST(Resp, HotKeys) {
+    auto conn = std::make_unique<Connection>(-1);
+    for (int i = 0; i < 1000; i++) {
+        run_bytes(conn, "*3\r\n$4\r\nMSET\r\n$6\r\nhotkey\r\n$1\r\n1\r\n");
+        run_bytes(conn, "*2\r\n$3\r\nGET\r\n$6\r\nhotkey\r\n");
+    }
+
+    // One request in HOTKEYS_SAMPLE is counted, so the count is about 2000
+    const std::string prefix = "*2\r\n$6\r\nhotkey\r\n:";
+    const std::string reply = run_bytes(conn, "*2\r\n$7\r\nHOTKEYS\r\n$1\r\n1\r\n");
+    ASSERT_EQ(reply.substr(0, prefix.size()), prefix);
+    const int count = std::stoi(reply.substr(prefix.size()));
+    EXPECT_GT(count, 1500);
+    EXPECT_LT(count, 2500);
+
+    const std::string info = run_bytes(conn, "*2\r\n$4\r\nINFO\r\n$7\r\nhotkeys\r\n");
+    EXPECT_NE(info.find(fmt::format("hotkey0:key=hotkey,count={}\r\n", count)),
+              std::string::npos);
+}
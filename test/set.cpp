@@ -0,0 +1,56 @@
+#include "set.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm> // std::sort
+#include <string>    // std::string
+#include <vector>    // std::vector
+
+TEST(Set, IntSetEncoding) {
+    Set set;
+    EXPECT_TRUE(set.add("10"));
+    EXPECT_TRUE(set.add("-3"));
+    EXPECT_FALSE(set.add("10"));
+    EXPECT_TRUE(set.is_intset());
+
+    EXPECT_TRUE(set.contains("-3"));
+    EXPECT_FALSE(set.contains("abc"));
+    EXPECT_EQ(set.members(), (std::vector<std::string>{"-3", "10"}));
+}
+
+TEST(Set, ConvertToHashTable) {
+    Set set;
+    set.add(std::vector<std::string_view>{"1", "2", "3"});
+    EXPECT_TRUE(set.is_intset());
+
+    // Not canonical integers, must be kept as strings
+    EXPECT_TRUE(set.add("007"));
+    EXPECT_FALSE(set.is_intset());
+    EXPECT_EQ(set.size(), 4);
+    EXPECT_TRUE(set.contains("2"));
+    EXPECT_TRUE(set.contains("007"));
+    EXPECT_FALSE(set.contains("7"));
+
+    EXPECT_TRUE(set.remove("2"));
+    EXPECT_FALSE(set.remove("2"));
+
+    auto members = set.members();
+    std::sort(members.begin(), members.end());
+    EXPECT_EQ(members, (std::vector<std::string>{"007", "1", "3"}));
+}
+
+TEST(Set, Merge) {
+    Set a;
+    Set b;
+    a.add(std::vector<std::string_view>{"1", "2"});
+    b.add(std::vector<std::string_view>{"2", "3"});
+
+    a.merge(b);
+    EXPECT_TRUE(a.is_intset());
+    EXPECT_EQ(a.members(), (std::vector<std::string>{"1", "2", "3"}));
+
+    b.add("x");
+    a.merge(b);
+    EXPECT_FALSE(a.is_intset());
+    EXPECT_EQ(a.size(), 4);
+}
@@ -0,0 +1,106 @@
+#include "connection.hpp"
+#include "hashtable.hpp"
+#include "helpers.hpp"
+#include "tier.hpp"
+#include "utils.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>      // std::chrono::milliseconds
+#include <cstdint>     // std::int64_t
+#include <cstdlib>     // mkdtemp
+#include <memory>      // std::make_unique
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <thread>      // std::this_thread
+#include <variant>     // std::get, std::holds_alternative
+#include <vector>      // std::vector
+
+#include <poll.h> // poll, pollfd, POLLIN
+
+namespace {
+// Wait for the I/O threads like the event loop does
+std::vector<int> wait_io() {
+    pollfd pfd{Tier::event_fd(), POLLIN, 0};
+    EXPECT_EQ(poll(&pfd, 1, 5000), 1);
+    std::vector<int> fds;
+    Tier::complete(fds);
+    return fds;
+}
+
+bool is_spilled(std::string_view key) {
+    return std::holds_alternative<SpilledStr>(map.get(key)->value);
+}
+
+// Run cycles until key is spilled, sampling may miss it
+void spill(std::string_view key) {
+    for (int i = 0; i < 100 && !is_spilled(key); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(TIER_CYCLE_MS));
+        Tier::cycle();
+        pollfd pfd{Tier::event_fd(), POLLIN, 0};
+        if (poll(&pfd, 1, 100) == 1) {
+            std::vector<int> fds;
+            Tier::complete(fds);
+        }
+    }
+}
+} // namespace
+
+TEST(Tier, SpillsAndLoadsBack) {
+    map.clear();
+    std::string dir = "/tmp/tier-test-XXXXXX";
+    ASSERT_NE(mkdtemp(dir.data()), nullptr);
+    ASSERT_TRUE(Tier::open(dir, 0, 1));
+    EXPECT_TRUE(Tier::enabled());
+
+    const std::string value(TIER_MIN_VALUE * 2, 'v');
+    map.set("cold", make_str(value));
+    map.set("small", make_str("v"));
+    map.set("num", std::int64_t{42});
+    spill("cold");
+    ASSERT_TRUE(is_spilled("cold"));
+    EXPECT_FALSE(is_spilled("small"));
+    EXPECT_NE(Tier::info().find("tier_spilled_keys:1\r\n"), std::string::npos);
+
+    // The read is shared, both wait and both run once it is back
+    auto first = std::make_unique<Connection>(100);
+    auto second = std::make_unique<Connection>(101);
+    push_request(first, {"GET", "cold"}, Proto::NATIVE);
+    push_request(second, {"GET", "cold"}, Proto::NATIVE);
+    EXPECT_FALSE(try_one_request(first));
+    EXPECT_FALSE(try_one_request(second));
+    EXPECT_EQ(first->io_pending, 1);
+    EXPECT_EQ(first->rbuf_pos, 0);
+    EXPECT_FALSE(wbuf_pending(first));
+
+    const std::vector<int> fds = wait_io();
+    EXPECT_EQ(fds, (std::vector<int>{100, 101}));
+    EXPECT_FALSE(is_spilled("cold"));
+    first->io_pending = 0;
+    second->io_pending = 0;
+    EXPECT_TRUE(try_one_request(first));
+    EXPECT_TRUE(try_one_request(second));
+    EXPECT_NE(drain(first).find(value), std::string::npos);
+    EXPECT_NE(drain(second).find(value), std::string::npos);
+    EXPECT_NE(Tier::info().find("tier_spilled_keys:0\r\n"), std::string::npos);
+    EXPECT_NE(Tier::info().find("tier_loads:1\r\n"), std::string::npos);
+
+    // A replaced value leaves a dead record
+    spill("cold");
+    ASSERT_TRUE(is_spilled("cold"));
+    map.set("cold", make_str("new"));
+    EXPECT_NE(Tier::info().find("tier_spilled_bytes:0\r\n"), std::string::npos);
+
+    // Keys other than the arguments of a request, for the replication snapshot
+    map.set("cold", make_str(value));
+    spill("cold");
+    ASSERT_TRUE(is_spilled("cold"));
+    auto replica = std::make_unique<Connection>(102);
+    EXPECT_TRUE(Tier::load_keys(replica, {"cold", "small", "missing"}));
+    EXPECT_EQ(replica->io_pending, 1);
+    EXPECT_EQ(wait_io(), (std::vector<int>{102}));
+    EXPECT_EQ(*std::get<SharedStr>(map.get("cold")->value), value);
+    replica->io_pending = 0;
+    EXPECT_FALSE(Tier::load_keys(replica, {"cold"}));
+    map.clear();
+}
@@ -0,0 +1,56 @@
+#include "timer_wheel.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm> // std::sort
+#include <cstdint>   // std::uint64_t
+#include <vector>    // std::vector
+
+namespace {
+std::vector<int> expire_fds(TimerWheel &wheel, std::uint64_t now) {
+    std::vector<Timer> due;
+    wheel.expire(now, due);
+    std::vector<int> fds;
+    for (const Timer &timer : due) {
+        EXPECT_LE(timer.when, now);
+        fds.push_back(timer.fd);
+    }
+    std::sort(fds.begin(), fds.end());
+    return fds;
+}
+} // namespace
+
+TEST(TimerWheel, ExpiresInOrder) {
+    TimerWheel wheel;
+    wheel.add(1, 1000);
+    wheel.add(2, 1001);
+    wheel.add(3, 1005);
+    // A turn of the wheel later, in the same slot as fd 1
+    wheel.add(4, 1000 + TIMER_WHEEL_SLOTS);
+
+    EXPECT_EQ(expire_fds(wheel, 999), std::vector<int>{});
+    EXPECT_EQ(expire_fds(wheel, 1000), std::vector<int>{1});
+    EXPECT_EQ(expire_fds(wheel, 1000), std::vector<int>{});
+    EXPECT_EQ(expire_fds(wheel, 1004), std::vector<int>{2});
+    EXPECT_EQ(expire_fds(wheel, 1010), std::vector<int>{3});
+    EXPECT_EQ(expire_fds(wheel, 1000 + TIMER_WHEEL_SLOTS - 1), std::vector<int>{});
+    EXPECT_EQ(expire_fds(wheel, 1000 + TIMER_WHEEL_SLOTS), std::vector<int>{4});
+}
+
+TEST(TimerWheel, LateExpire) {
+    TimerWheel wheel;
+    EXPECT_EQ(expire_fds(wheel, 100), std::vector<int>{});
+    for (int fd = 0; fd < 200; fd++) {
+        wheel.add(fd, 100 + fd);
+    }
+
+    // Several turns went by at once
+    const std::vector<int> fds = expire_fds(wheel, 250);
+    EXPECT_EQ(fds.size(), 151);
+    EXPECT_EQ(fds.front(), 0);
+    EXPECT_EQ(fds.back(), 150);
+
+    // A timer already in the past fires with the next expire
+    wheel.add(500, 10);
+    EXPECT_EQ(expire_fds(wheel, 251), (std::vector<int>{151, 500}));
+}
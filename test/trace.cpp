@@ -0,0 +1,68 @@
+#include "connection.hpp"
+#include "trace.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstddef>     // std::size_t
+#include <cstring>     // std::memcpy
+#include <memory>      // std::make_unique
+#include <string>      // std::string
+#include <string_view> // std::string_view
+
+namespace {
+std::size_t count(const std::string &s, std::string_view what) {
+    std::size_t n = 0;
+    for (auto pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1)) {
+        n++;
+    }
+    return n;
+}
+} // namespace
+
+TEST(Trace, Sample) {
+    Trace::set_rate(0);
+    EXPECT_FALSE(Trace::sample());
+
+    Trace::set_rate(3);
+    int sampled = 0;
+    for (int i = 0; i < 30; i++) {
+        sampled += Trace::sample() ? 1 : 0;
+    }
+    EXPECT_EQ(sampled, 10);
+
+    Trace::set_rate(1);
+    EXPECT_TRUE(Trace::sample());
+    Trace::set_rate(0);
+}
+
+TEST(Trace, Dump) {
+    Trace::set_rate(1);
+    Trace::dump();
+
+    auto conn = std::make_unique<Connection>(-1);
+    conn->fd = 7;
+    {
+        const TraceSpan untraced{*conn, Phase::READ};
+    }
+    conn->traced = true;
+    const std::string request = "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n";
+    acquire_rbuf(conn);
+    std::memcpy(&conn->rbuf[0], request.data(), request.size());
+    conn->rbuf_size = request.size();
+    EXPECT_TRUE(try_one_request(conn));
+    release_rbuf(conn);
+    conn->fd = -1;
+
+    const std::string json = Trace::dump();
+    EXPECT_EQ(json.rfind(R"({"displayTimeUnit":"ns","traceEvents":[{"name":"parse")", 0),
+              0);
+    EXPECT_EQ(json.substr(json.size() - 2), "]}");
+    EXPECT_EQ(count(json, R"("ph":"X")"), 2);
+    EXPECT_EQ(count(json, R"("tid":7)"), 2);
+    EXPECT_EQ(count(json, R"("name":"exec")"), 1);
+    EXPECT_EQ(count(json, R"("args":{"cmd":"GET"})"), 1);
+
+    // Dumping empties the ring
+    EXPECT_EQ(Trace::dump(), R"({"displayTimeUnit":"ns","traceEvents":[]})");
+    Trace::set_rate(0);
+}
@@ -41,4 +41,57 @@ TEST(Utils, WriteAll) {
 
     auto ret = write_all(fd, buf, n);
     EXPECT_EQ(ret, 0);
-}
\ No newline at end of file
+}
+
+TEST(Utils, ToInt64) {
+    EXPECT_EQ(to_int64("0"), 0);
+    EXPECT_EQ(to_int64("-42"), -42);
+    EXPECT_EQ(to_int64("9223372036854775807"), INT64_MAX);
+    EXPECT_EQ(to_int64("-9223372036854775808"), INT64_MIN);
+
+    // Only the canonical form is an integer
+    EXPECT_FALSE(to_int64(""));
+    EXPECT_FALSE(to_int64("-"));
+    EXPECT_FALSE(to_int64("-0"));
+    EXPECT_FALSE(to_int64("007"));
+    EXPECT_FALSE(to_int64("+1"));
+    EXPECT_FALSE(to_int64(" 1"));
+    EXPECT_FALSE(to_int64("1a"));
+    EXPECT_FALSE(to_int64("9223372036854775808"));
+}
+
+TEST(Utils, GlobMatch) {
+    EXPECT_TRUE(glob_match("*", ""));
+    EXPECT_TRUE(glob_match("news.*", "news.tech"));
+    EXPECT_FALSE(glob_match("news.*", "new.tech"));
+    EXPECT_TRUE(glob_match("h?llo", "hello"));
+    EXPECT_FALSE(glob_match("h?llo", "hllo"));
+    EXPECT_TRUE(glob_match("h[ae]llo", "hallo"));
+    EXPECT_FALSE(glob_match("h[^e]llo", "hello"));
+    EXPECT_TRUE(glob_match("h[a-c]llo", "hbllo"));
+    EXPECT_TRUE(glob_match("a*b*c", "a-b-b-c"));
+    EXPECT_FALSE(glob_match("a*b*c", "a-b-b-"));
+    EXPECT_TRUE(glob_match("\\*x", "*x"));
+    EXPECT_FALSE(glob_match("\\*x", "ax"));
+    EXPECT_TRUE(glob_match("**a**", "bab"));
+
+    // Exponential for naive backtracking
+    const std::string str(10'000, 'a');
+    EXPECT_FALSE(glob_match("*a*a*a*a*a*a*a*a*b", str));
+
+    EXPECT_EQ(glob_prefix("news.*"), "news.");
+    EXPECT_EQ(glob_prefix("a[bc]"), "a");
+    EXPECT_EQ(glob_prefix("plain"), "plain");
+    EXPECT_EQ(glob_prefix("*"), "");
+}
+
+TEST(Utils, KeySlot) {
+    EXPECT_EQ(crc16("123456789"), 0x31c3);
+    EXPECT_EQ(key_slot("foo"), 12182);
+    EXPECT_EQ(key_slot("bar"), 5061);
+    EXPECT_EQ(key_slot("{user1000}.following"), key_slot("user1000"));
+    EXPECT_EQ(key_slot("{user1000}.followers"), key_slot("user1000"));
+    // An empty tag hashes the whole key
+    EXPECT_EQ(key_slot("foo{}{bar}"), crc16("foo{}{bar}") & (CLUSTER_SLOTS - 1));
+    EXPECT_EQ(key_slot("foo{{bar}}zap"), key_slot("{bar"));
+}